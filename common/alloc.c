@@ -139,6 +139,7 @@ If the function succeeds, the return value is a pointer to the allocated memory
 #include "heap.h"
 #include "callstack.h"
 #include "redblack.h"
+#include "ohashtable.h"
 #ifdef USE_DRSYMS
 # include "drsyms.h"
 # include "symcache.h"
@@ -231,6 +232,10 @@ static void
 alloc_wrap_Ki(void *wrapcxt, void OUT **user_data);
 #endif
 
+static dr_emit_flags_t
+alloc_event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
+                       bool for_trace, bool translating);
+
 static dr_emit_flags_t
 alloc_event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
                         bool for_trace, bool translating, OUT void **user_data);
@@ -313,6 +318,9 @@ typedef struct _cls_alloc_t {
 #endif
 } cls_alloc_t;
 
+static void
+malloc_dead_free_if_unlocked(void);
+
 static void
 alloc_context_init(void *drcontext, bool new_depth)
 {
@@ -331,6 +339,8 @@ alloc_context_exit(void *drcontext, bool thread_exit)
     if (thread_exit) {
         cls_alloc_t *data = (cls_alloc_t *) drmgr_get_cls_field(drcontext, cls_idx_alloc);
         thread_free(drcontext, data, sizeof(*data), HEAPSTAT_MISC);
+        if (alloc_ops.track_allocs)
+            malloc_dead_free_if_unlocked();
     }
     /* else, nothing to do: we leave the struct for re-use on next callback */
 }
@@ -685,6 +695,10 @@ struct _alloc_routine_entry_t {
      * call site method causes a lot of instrumentation when there's high fan-in)
      */
     bool intercept_post;
+    /* For routines with no post wrapper, we skip drwrap and insert our own
+     * entry clean call (see alloc_lean_entry())
+     */
+    bool lean_entry;
 };
 
 /* Set of malloc routines */
@@ -1204,6 +1218,7 @@ add_alloc_routine(app_pc pc, routine_type_t type, const char *name,
     e->name = name;
     e->set = set;
     e->intercept_post = routine_needs_post_wrap(type, set->type);
+    e->lean_entry = false;
     if (e->set != NULL) {
         e->set->refcnt++;
         e->set->func[e->type] = e;
@@ -2121,6 +2136,48 @@ redzone_size(alloc_routine_entry_t *routine)
             alloc_ops.redzone_size : 0);
 }
 
+/* Filter checked on every app instr in alloc_event_bb_insert() so that
+ * blocks with no lean routine entry never take alloc_routine_lock.  Bits
+ * are only ever set: a bit left over from a removed routine just costs a
+ * locked lookup.
+ */
+#define LEAN_ENTRY_FILTER_BITS 12
+static uint lean_entry_filter[(1 << LEAN_ENTRY_FILTER_BITS) / 32];
+
+static inline uint
+lean_entry_filter_index(app_pc pc)
+{
+    return ((uint)(ptr_uint_t)pc * 2654435761U) >> (32 - LEAN_ENTRY_FILTER_BITS);
+}
+
+static inline bool
+lean_entry_filter_test(app_pc pc)
+{
+    uint i = lean_entry_filter_index(pc);
+    return TEST(1U << (i % 32), lean_entry_filter[i / 32]);
+}
+
+static void
+lean_entry_filter_add(app_pc pc)
+{
+    uint i = lean_entry_filter_index(pc);
+    ATOMIC_OR32(lean_entry_filter[i / 32], 1U << (i % 32));
+}
+
+/* Our lean entry instrumentation is only inserted when a block is built, so
+ * any existing code for pc must be thrown out when it is added or removed.
+ */
+static void
+lean_entry_flush(app_pc pc)
+{
+    void *drcontext = dr_get_current_drcontext();
+    if (drcontext != NULL && dr_fragment_exists_at(drcontext, pc)) {
+        LOG(2, "flushing "PFX" for lean entry change\n", pc);
+        if (!dr_delay_flush_region(pc, 1, 0, NULL))
+            ASSERT(false, "failed to flush for lean entry");
+    }
+}
+
 /* XXX i#882: make this static once malloc replacement replaces operators */
 void
 /* XXX: if we split the wrapping from the routine identification we'll
@@ -2143,9 +2200,17 @@ malloc_wrap__intercept(app_pc pc, routine_type_t type, alloc_routine_entry_t *e)
             ASSERT(false, "failed to replace dbg-nop");
     } else {
 #endif
-        if (!drwrap_wrap_ex(pc, alloc_hook,
-                            e->intercept_post ? handle_alloc_post : NULL,
-                            (void *)e, DRWRAP_UNWIND_ON_EXCEPTION))
+        if (!e->intercept_post) {
+            /* These are mostly operator delete, which has high fan-in and
+             * only needs its arg and the outer-layer frame: we insert a
+             * direct clean call in alloc_event_bb_insert() rather than paying
+             * for drwrap's dispatch, wrap context, and unwind bookkeeping.
+             */
+            e->lean_entry = true;
+            lean_entry_filter_add(pc);
+            lean_entry_flush(pc);
+        } else if (!drwrap_wrap_ex(pc, alloc_hook, handle_alloc_post,
+                                   (void *)e, DRWRAP_UNWIND_ON_EXCEPTION))
             ASSERT(false, "failed to wrap alloc routine");
 #ifdef WINDOWS
     }
@@ -2163,8 +2228,10 @@ malloc_wrap__unintercept(app_pc pc, routine_type_t type, alloc_routine_entry_t *
             ASSERT(false, "failed to unreplace dbg-nop");
     } else {
 #endif
-        if (!drwrap_unwrap(pc, alloc_hook,
-                           e->intercept_post ? handle_alloc_post : NULL))
+        if (e->lean_entry) {
+            e->lean_entry = false;
+            lean_entry_flush(pc);
+        } else if (!drwrap_unwrap(pc, alloc_hook, handle_alloc_post))
             ASSERT(false, "failed to unwrap alloc routine");
 #ifdef WINDOWS
     }
@@ -2407,8 +2474,20 @@ get_padded_size(IF_WINDOWS_(reg_t auxarg) app_pc real_base, alloc_routine_entry_
 
 #ifdef USE_DRSYMS
 # define POST_CALL_SYMCACHE_NAME "__DrMemory_post_call"
+/* A negative (0) entry means the module has no alloc routines */
+# define NO_ALLOC_SYMCACHE_NAME "__DrMemory_alloc_routines"
 #endif
 
+/* For -lazy_alloc_search: modules whose alloc routine search is deferred
+ * until their first execution, keyed by bounds.  No code in a module can
+ * run before a block from it is built, so searching from the app2app event
+ * for that block is early enough to intercept every call.
+ * Protected by alloc_routine_lock.
+ */
+static rb_tree_t *mod_search_tree;
+/* Used for quick check w/o need for lock.  Written while holding alloc_routine_lock. */
+static uint mod_search_entries;
+
 #ifdef USE_DRSYMS
 /* We can't use post-call symcache entries at DR's module load event b/c
  * it's prior to rebasing.  Our solution is to wait for the first execution
@@ -2453,13 +2532,283 @@ event_post_call_entry_added(app_pc postcall)
  * insertions and deletions), so sticking with a hashtable!
  */
 #define ALLOC_TABLE_HASH_BITS 12
-static hashtable_t malloc_table;
 /* we could switch to a full-fledged known-owner lock, or a recursive lock.
  * xref i#129.
  */
 #define THREAD_ID_INVALID ((thread_id_t)0) /* invalid thread id on Linux+Windows */
+/* To reduce lock contention, with alloc_ops.shard_malloc_table the table is
+ * split by address into shards, each with its own lock.  Operations on one
+ * malloc lock only its shard.  Operations that need a global view
+ * (malloc_lock(), malloc_iterate()) lock every shard, in index order.
+ * A thread holding one shard lock must not acquire any other: operations
+ * that look at other addresses (invalid arg checks, i#1072) lock the whole
+ * table instead (see malloc_lock_and_lookup()).
+ * Without alloc_ops.shard_malloc_table there is a single shard and the
+ * behavior is that of a single table lock.
+ */
+#define MALLOC_TABLE_SHARD_BITS 4
+#define MALLOC_TABLE_SHARDS (1 << MALLOC_TABLE_SHARD_BITS)
+/* Each shard is an open-addressed, linearly-probed table of pointers to
+ * malloc_entry_t keyed by chunk start.  Writers hold the shard lock.
+ * Readers of a single entry (malloc_end(), malloc_size(),
+ * malloc_get_client_data(), etc.) do not: a slot is published by writing
+ * its entry before its key, and removed entries and replaced slot arrays
+ * are not freed until every reader that might still see them has left its
+ * read section (see epoch_read_enter()).  We do
+ * not use a drcontainers hashtable_t here as it frees its chain nodes and
+ * old bucket arrays internally, which rules out unlocked readers; nor an
+ * ohashtable_t, whose Robin Hood adds and removes move live entries under
+ * a reader's feet.  Removes here leave tombstones instead.
+ */
+struct _malloc_entry_t;
+typedef struct _malloc_slot_t {
+    /* NULL for empty, MALLOC_SLOT_REMOVED for a tombstone */
+    app_pc start;
+    struct _malloc_entry_t *e;
+} malloc_slot_t;
+#define MALLOC_SLOT_REMOVED ((app_pc)(ptr_uint_t)1)
+typedef struct _malloc_slots_t {
+    uint mask; /* capacity - 1 */
+    malloc_slot_t slot[1]; /* variable-length */
+} malloc_slots_t;
+#define MALLOC_SLOTS_SIZE(mask) \
+    (sizeof(malloc_slots_t) + (mask) * sizeof(malloc_slot_t))
+typedef struct _malloc_shard_t {
+    malloc_slots_t *volatile slots;
+    uint entries; /* live keys */
+    uint used; /* live keys plus tombstones */
+    void *lock;
+    /* owner of just this shard's lock */
+    thread_id_t owner;
+} malloc_shard_t;
+static malloc_shard_t malloc_shards[MALLOC_TABLE_SHARDS];
+static uint num_malloc_shards;
+/* owner of the whole table, i.e., of all the shard locks */
 static thread_id_t malloc_lock_owner = THREAD_ID_INVALID;
 
+static inline malloc_shard_t *
+malloc_shard(app_pc start)
+{
+    /* mallocs are at least 8-aligned; the multiplier spreads neighbors */
+    uint hash = (uint)(((ptr_uint_t)start >> 3) * 2654435761U);
+    return &malloc_shards[(hash >> 16) & (num_malloc_shards - 1)];
+}
+
+/* A side index so we can answer range queries ("which malloc contains this
+ * address", "which mallocs are in this range") without walking the whole
+ * table, at the cost of one atomic bit operation per malloc and free rather
+ * than the interval tree insert that the comment above rejects.  There is
+ * one bit per MALLOC_CHUNK_ALIGNMENT-sized granule, set when a table entry
+ * starts anywhere in it.  A set bit is only a hint: lookups confirm it in the
+ * table, and until we have seen a start that is not aligned
+ * (chunk_map_unaligned) only the granule's first address need be tried.
+ * Bitmaps cover CHUNK_MAP_UNIT_SIZE each and hang off a
+ * two-level directory that only ever grows, so lookups take no lock.
+ * Mallocs of LARGE_MALLOC_MIN_SIZE or more are in large_malloc_tree, so a
+ * search for the malloc containing an address need only look back that far.
+ * Only used when wrapping: alloc_replace.c has its own arena walks.
+ */
+#define CHUNK_MAP_UNIT_SHIFT 16
+#define CHUNK_MAP_UNIT_SIZE (1 << CHUNK_MAP_UNIT_SHIFT)
+#define CHUNK_MAP_UNIT_BITS (CHUNK_MAP_UNIT_SIZE / MALLOC_CHUNK_ALIGNMENT)
+#define CHUNK_MAP_UNIT_WORDS (CHUNK_MAP_UNIT_BITS / 32)
+#define CHUNK_MAP_L2_BITS 16
+#define CHUNK_MAP_L2_SIZE (1 << CHUNK_MAP_L2_BITS)
+#ifdef X64
+/* user-mode addresses fit in 48 bits */
+# define CHUNK_MAP_L1_SIZE (1 << (48 - CHUNK_MAP_UNIT_SHIFT - CHUNK_MAP_L2_BITS))
+#else
+# define CHUNK_MAP_L1_SIZE 1
+#endif
+static uint ***chunk_map;
+/* only held to add to the directory */
+static void *chunk_map_lock;
+/* set once we've indexed a start that is not MALLOC_CHUNK_ALIGNMENT-aligned */
+static volatile bool chunk_map_unaligned;
+
+static bool
+chunk_map_granule_used(ptr_uint_t granule, app_pc except);
+
+static inline uint *
+chunk_map_lookup(ptr_uint_t addr)
+{
+    ptr_uint_t unit = addr >> CHUNK_MAP_UNIT_SHIFT;
+    uint **l2;
+    if (unit >> CHUNK_MAP_L2_BITS >= CHUNK_MAP_L1_SIZE)
+        return NULL;
+    l2 = chunk_map[unit >> CHUNK_MAP_L2_BITS];
+    if (l2 == NULL)
+        return NULL;
+    return l2[unit & (CHUNK_MAP_L2_SIZE - 1)];
+}
+
+static uint *
+chunk_map_lookup_or_add(ptr_uint_t addr)
+{
+    ptr_uint_t unit = addr >> CHUNK_MAP_UNIT_SHIFT;
+    uint *bits = chunk_map_lookup(addr);
+    if (bits != NULL || unit >> CHUNK_MAP_L2_BITS >= CHUNK_MAP_L1_SIZE)
+        return bits;
+    dr_mutex_lock(chunk_map_lock);
+    /* Readers don't lock, so we fill in each level before publishing it
+     * (x86 does not reorder the stores).
+     */
+    if (chunk_map[unit >> CHUNK_MAP_L2_BITS] == NULL) {
+        chunk_map[unit >> CHUNK_MAP_L2_BITS] = (uint **)
+            nonheap_alloc(CHUNK_MAP_L2_SIZE * sizeof(uint *),
+                          DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    }
+    bits = chunk_map[unit >> CHUNK_MAP_L2_BITS][unit & (CHUNK_MAP_L2_SIZE - 1)];
+    if (bits == NULL) {
+        bits = (uint *) global_alloc(CHUNK_MAP_UNIT_WORDS * sizeof(uint), HEAPSTAT_MISC);
+        memset(bits, 0, CHUNK_MAP_UNIT_WORDS * sizeof(uint));
+        chunk_map[unit >> CHUNK_MAP_L2_BITS][unit & (CHUNK_MAP_L2_SIZE - 1)] = bits;
+    }
+    dr_mutex_unlock(chunk_map_lock);
+    return bits;
+}
+
+static inline uint
+chunk_map_index(ptr_uint_t addr)
+{
+    return (uint) ((addr & (CHUNK_MAP_UNIT_SIZE - 1)) / MALLOC_CHUNK_ALIGNMENT);
+}
+
+/* Caller should hold start's shard lock, to order vs a re-malloc there */
+static void
+chunk_map_set(app_pc start, bool set)
+{
+    uint *bits;
+    uint idx;
+    ptr_uint_t granule = ALIGN_BACKWARD(start, MALLOC_CHUNK_ALIGNMENT);
+    if (chunk_map == NULL)
+        return;
+    bits = set ? chunk_map_lookup_or_add((ptr_uint_t)start) :
+        chunk_map_lookup((ptr_uint_t)start);
+    if (bits == NULL)
+        return;
+    idx = chunk_map_index((ptr_uint_t)start);
+    if (set) {
+        if (granule != (ptr_uint_t)start && !chunk_map_unaligned) {
+            LOG(1, "malloc "PFX" is not aligned: probing whole granules\n", start);
+            /* the locked OR below orders this before the bit */
+            chunk_map_unaligned = true;
+        }
+        ATOMIC_OR32(bits[idx / 32], 1U << (idx % 32));
+    } else {
+        ATOMIC_AND32(bits[idx / 32], ~(1U << (idx % 32)));
+        /* Another malloc may start in the same granule.  We look for it after
+         * clearing, so that a racing add there either is seen here or sets
+         * the bit again after us.
+         */
+        if (chunk_map_unaligned && chunk_map_granule_used(granule, start))
+            ATOMIC_OR32(bits[idx / 32], 1U << (idx % 32));
+    }
+}
+
+/* How many addresses of a marked granule to try as malloc starts */
+static inline uint
+chunk_map_granule_span(void)
+{
+    return chunk_map_unaligned ? MALLOC_CHUNK_ALIGNMENT : 1;
+}
+
+/* Returns the lowest marked start in [from, to), or NULL */
+static app_pc
+chunk_map_next(app_pc from, app_pc to)
+{
+    ptr_uint_t cur = ALIGN_FORWARD(from, MALLOC_CHUNK_ALIGNMENT);
+    while (cur < (ptr_uint_t)to && cur != 0/*overflow*/) {
+        ptr_uint_t unit_end = ALIGN_BACKWARD(cur, CHUNK_MAP_UNIT_SIZE) +
+            CHUNK_MAP_UNIT_SIZE;
+        uint *bits = chunk_map_lookup(cur);
+        if (bits != NULL) {
+            uint idx = chunk_map_index(cur);
+            while (idx < CHUNK_MAP_UNIT_BITS) {
+                uint word = bits[idx / 32] >> (idx % 32);
+                if (word == 0) {
+                    idx = (idx & ~31) + 32;
+                    continue;
+                }
+                while (!TEST(1, word)) {
+                    word >>= 1;
+                    idx++;
+                }
+                cur = ALIGN_BACKWARD(cur, CHUNK_MAP_UNIT_SIZE) +
+                    idx * MALLOC_CHUNK_ALIGNMENT;
+                return (cur < (ptr_uint_t)to) ? (app_pc)cur : NULL;
+            }
+        }
+        cur = unit_end;
+    }
+    return NULL;
+}
+
+/* Returns the highest marked start in [from, to), or NULL */
+static app_pc
+chunk_map_prev(app_pc from, app_pc to)
+{
+    ptr_uint_t cur;
+    if (to <= from || (ptr_uint_t)to < MALLOC_CHUNK_ALIGNMENT)
+        return NULL;
+    cur = ALIGN_BACKWARD(to - 1, MALLOC_CHUNK_ALIGNMENT);
+    while (cur >= (ptr_uint_t)from) {
+        ptr_uint_t unit_start = ALIGN_BACKWARD(cur, CHUNK_MAP_UNIT_SIZE);
+        uint *bits = chunk_map_lookup(cur);
+        if (bits != NULL) {
+            int idx = (int) chunk_map_index(cur);
+            while (idx >= 0) {
+                uint word = bits[idx / 32] << (31 - idx % 32);
+                if (word == 0) {
+                    idx = (idx & ~31) - 1;
+                    continue;
+                }
+                while (!TEST(0x80000000, word)) {
+                    word <<= 1;
+                    idx--;
+                }
+                cur = unit_start + idx * MALLOC_CHUNK_ALIGNMENT;
+                return (cur >= (ptr_uint_t)from) ? (app_pc)cur : NULL;
+            }
+        }
+        if (unit_start == 0)
+            break;
+        cur = unit_start - MALLOC_CHUNK_ALIGNMENT;
+    }
+    return NULL;
+}
+
+static void
+chunk_map_init(void)
+{
+    chunk_map = (uint ***)
+        nonheap_alloc(CHUNK_MAP_L1_SIZE * sizeof(uint **),
+                      DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    chunk_map_lock = dr_mutex_create();
+}
+
+static void
+chunk_map_exit(void)
+{
+    uint i, j;
+    if (chunk_map == NULL)
+        return;
+    for (i = 0; i < CHUNK_MAP_L1_SIZE; i++) {
+        if (chunk_map[i] == NULL)
+            continue;
+        for (j = 0; j < CHUNK_MAP_L2_SIZE; j++) {
+            if (chunk_map[i][j] != NULL) {
+                global_free(chunk_map[i][j], CHUNK_MAP_UNIT_WORDS * sizeof(uint),
+                            HEAPSTAT_MISC);
+            }
+        }
+        nonheap_free(chunk_map[i], CHUNK_MAP_L2_SIZE * sizeof(uint *), HEAPSTAT_MISC);
+    }
+    nonheap_free(chunk_map, CHUNK_MAP_L1_SIZE * sizeof(uint **), HEAPSTAT_MISC);
+    chunk_map = NULL;
+    dr_mutex_destroy(chunk_map_lock);
+}
+
 /* PR 525807: to handle malloc-based stacks we need an interval tree
  * for large mallocs.  Putting all mallocs in a tree instead of a table
  * is too expensive (PR 535568).
@@ -2517,23 +2866,291 @@ malloc_entry_is_native(malloc_entry_t *e)
 #endif
 }
 
+/* Callbacks for mallocs in different shards would otherwise run in
+ * parallel, as would client_malloc_data_free() for retired entries, which
+ * malloc_dead_free() frees outside of any table lock.  So unless the client
+ * says its callbacks are thread-safe (alloc_ops.malloc_callbacks_synched)
+ * we serialize them here.  The lock is recursive in case a callback leads
+ * to another.  It is always acquired last: no table lock may be acquired
+ * while holding it.
+ */
+static void *client_malloc_cb_lock;
+
+static inline void
+client_malloc_cb_enter(void)
+{
+    if (client_malloc_cb_lock != NULL)
+        dr_recurlock_lock(client_malloc_cb_lock);
+}
+
+static inline void
+client_malloc_cb_exit(void)
+{
+    if (client_malloc_cb_lock != NULL)
+        dr_recurlock_unlock(client_malloc_cb_lock);
+}
+
 static void
 malloc_entry_free(void *v)
 {
     malloc_entry_t *e = (malloc_entry_t *) v;
-    if (!malloc_entry_is_native(e))
+    if (!malloc_entry_is_native(e)) {
+        client_malloc_cb_enter();
         client_malloc_data_free(e->data);
+        client_malloc_cb_exit();
+    }
     global_free(e, sizeof(*e), HEAPSTAT_HASHTABLE);
 }
 
-/* Mallocs are aligned to 8 so drop the bottom 3 bits */
-static uint
-malloc_hash(void *v)
+/***************************************************************************
+ * MALLOC TABLE
+ *
+ * See the comment above malloc_shard_t.
+ */
+
+/* Removed entries and replaced slot arrays are handed to
+ * epoch_defer_free().  Freeing an entry calls client_malloc_data_free(),
+ * which must neither run under a table lock nor from wherever the epoch
+ * code happens to reclaim, so an entry whose grace period has ended is only
+ * moved here, and freed at our next unlock.
+ */
+typedef struct _malloc_dead_t {
+    uint num;
+    uint capacity;
+    struct _malloc_entry_t **entries;
+} malloc_dead_t;
+static malloc_dead_t malloc_dead;
+static void *malloc_dead_lock; /* a leaf lock: protects malloc_dead */
+
+static void
+malloc_slots_free(void *item, void *data)
+{
+    malloc_slots_t *slots = (malloc_slots_t *) item;
+    global_free(slots, MALLOC_SLOTS_SIZE(slots->mask), HEAPSTAT_HASHTABLE);
+}
+
+static void
+malloc_entry_dead(void *item, void *data)
+{
+    dr_mutex_lock(malloc_dead_lock);
+    if (malloc_dead.num == malloc_dead.capacity) {
+        uint new_cap = (malloc_dead.capacity == 0) ? 16 : malloc_dead.capacity * 2;
+        struct _malloc_entry_t **entries = (struct _malloc_entry_t **)
+            global_alloc(new_cap * sizeof(*entries), HEAPSTAT_HASHTABLE);
+        if (malloc_dead.entries != NULL) {
+            memcpy(entries, malloc_dead.entries, malloc_dead.num * sizeof(*entries));
+            global_free(malloc_dead.entries, malloc_dead.capacity * sizeof(*entries),
+                        HEAPSTAT_HASHTABLE);
+        }
+        malloc_dead.entries = entries;
+        malloc_dead.capacity = new_cap;
+    }
+    malloc_dead.entries[malloc_dead.num++] = (struct _malloc_entry_t *) item;
+    dr_mutex_unlock(malloc_dead_lock);
+}
+
+/* Frees the entries in malloc_dead.  The caller must hold no table lock. */
+static void
+malloc_dead_free(void)
+{
+    malloc_dead_t dead;
+    uint i;
+    dr_mutex_lock(malloc_dead_lock);
+    dead = malloc_dead;
+    memset(&malloc_dead, 0, sizeof(malloc_dead));
+    dr_mutex_unlock(malloc_dead_lock);
+    for (i = 0; i < dead.num; i++)
+        malloc_entry_free(dead.entries[i]);
+    if (dead.entries != NULL) {
+        global_free(dead.entries, dead.capacity * sizeof(*dead.entries),
+                    HEAPSTAT_HASHTABLE);
+    }
+}
+
+/* Caller must hold the shard lock that e was removed under */
+static void
+malloc_retire_entry(struct _malloc_entry_t *e)
+{
+    epoch_defer_free((void *)e, malloc_entry_dead, NULL);
+}
+
+/* Mallocs are aligned to 8, which ohash_hash_ptr() assumes */
+static inline uint
+malloc_slot_hash(app_pc start, uint mask)
 {
-    uint hash = (uint)(ptr_uint_t) v;
     ASSERT(MALLOC_CHUNK_ALIGNMENT == 8, "update hash func please");
-    /* Many mallocs are larger than 8 and we get fewer collisions w/ >> 5 */
-    return (hash >> 5);
+    return ohash_hash_ptr((void *)start) & mask;
+}
+
+static malloc_slots_t *
+malloc_slots_create(uint mask)
+{
+    malloc_slots_t *slots = (malloc_slots_t *)
+        global_alloc(MALLOC_SLOTS_SIZE(mask), HEAPSTAT_HASHTABLE);
+    slots->mask = mask;
+    memset(slots->slot, 0, (mask + 1) * sizeof(malloc_slot_t));
+    return slots;
+}
+
+static void
+malloc_table_init(malloc_shard_t *shard, uint bits)
+{
+    memset(shard, 0, sizeof(*shard));
+    shard->slots = malloc_slots_create((1U << bits) - 1);
+    shard->lock = dr_mutex_create();
+    shard->owner = THREAD_ID_INVALID;
+}
+
+/* Frees the live entries.  No readers may remain. */
+static void
+malloc_table_delete(malloc_shard_t *shard)
+{
+    malloc_slots_t *slots = shard->slots;
+    uint i;
+    for (i = 0; i <= slots->mask; i++) {
+        if (slots->slot[i].start != NULL && slots->slot[i].start != MALLOC_SLOT_REMOVED)
+            malloc_entry_free(slots->slot[i].e);
+    }
+    global_free(slots, MALLOC_SLOTS_SIZE(slots->mask), HEAPSTAT_HASHTABLE);
+    dr_mutex_destroy(shard->lock);
+}
+
+/* Safe to call either holding the shard lock or inside a read section.
+ * The returned entry may have been removed concurrently, so an unlocked
+ * caller must check that its start still matches.
+ */
+static struct _malloc_entry_t *
+malloc_table_lookup(malloc_shard_t *shard, app_pc start)
+{
+    malloc_slots_t *slots = shard->slots;
+    uint mask = slots->mask;
+    uint i = malloc_slot_hash(start, mask);
+    while (true) {
+        volatile malloc_slot_t *slot = &slots->slot[i];
+        app_pc key = slot->start;
+        if (key == start)
+            return slot->e;
+        if (key == NULL)
+            return NULL;
+        i = (i + 1) & mask;
+    }
+}
+
+/* Returns whether a table entry other than except starts in the granule,
+ * or true if we can't tell.  The caller may hold one shard lock: we only
+ * read the others.
+ */
+static bool
+chunk_map_granule_used(ptr_uint_t granule, app_pc except)
+{
+    void *reader = epoch_read_enter();
+    bool used = false;
+    uint i;
+    if (reader == NULL)
+        return true; /* a stale bit only costs lookups */
+    for (i = 0; i < MALLOC_CHUNK_ALIGNMENT && !used; i++) {
+        app_pc pc = (app_pc)(granule + i);
+        struct _malloc_entry_t *e;
+        if (pc == except)
+            continue;
+        e = malloc_table_lookup(malloc_shard(pc), pc);
+        used = (e != NULL && e->start == pc);
+    }
+    epoch_read_exit(reader);
+    return used;
+}
+
+/* Caller must hold the shard lock.  Doubles the capacity as needed, which
+ * also drops tombstones, and publishes the new array.
+ */
+static void
+malloc_table_resize(malloc_shard_t *shard)
+{
+    malloc_slots_t *old = shard->slots;
+    malloc_slots_t *slots;
+    uint mask = old->mask;
+    uint i;
+    while ((shard->entries + 1) * 2 > mask + 1)
+        mask = (mask << 1) | 1;
+    slots = malloc_slots_create(mask);
+    for (i = 0; i <= old->mask; i++) {
+        app_pc key = old->slot[i].start;
+        if (key != NULL && key != MALLOC_SLOT_REMOVED) {
+            uint j = malloc_slot_hash(key, mask);
+            while (slots->slot[j].start != NULL)
+                j = (j + 1) & mask;
+            slots->slot[j] = old->slot[i];
+        }
+    }
+    LOG(2, "malloc table shard resized from %u to %u slots (%u entries)\n",
+        old->mask + 1, mask + 1, shard->entries);
+    shard->used = shard->entries;
+    /* the contents must be visible before the pointer */
+    MEMORY_STORE_BARRIER();
+    shard->slots = slots;
+    epoch_defer_free((void *)old, malloc_slots_free, NULL);
+}
+
+/* Caller must hold the shard lock.  Returns the entry that e replaced,
+ * which the caller must retire, or NULL.
+ */
+static struct _malloc_entry_t *
+malloc_table_add_replace(malloc_shard_t *shard, app_pc start,
+                         struct _malloc_entry_t *e)
+{
+    malloc_slots_t *slots;
+    volatile malloc_slot_t *slot, *tomb = NULL;
+    uint i;
+    if ((shard->used + 1) * 4 > (shard->slots->mask + 1) * 3)
+        malloc_table_resize(shard);
+    slots = shard->slots;
+    i = malloc_slot_hash(start, slots->mask);
+    while (true) {
+        slot = &slots->slot[i];
+        if (slot->start == start) {
+            struct _malloc_entry_t *old_e = slot->e;
+            slot->e = e;
+            return old_e;
+        }
+        if (slot->start == NULL)
+            break;
+        if (slot->start == MALLOC_SLOT_REMOVED && tomb == NULL)
+            tomb = slot;
+        i = (i + 1) & slots->mask;
+    }
+    if (tomb != NULL)
+        slot = tomb;
+    else
+        shard->used++;
+    shard->entries++;
+    /* a reader that matches the key must see the entry */
+    slot->e = e;
+    MEMORY_STORE_BARRIER();
+    slot->start = start;
+    return NULL;
+}
+
+/* Caller must hold the shard lock.  Returns whether start was present;
+ * if so its entry is retired.
+ */
+static bool
+malloc_table_remove(malloc_shard_t *shard, app_pc start)
+{
+    malloc_slots_t *slots = shard->slots;
+    uint i = malloc_slot_hash(start, slots->mask);
+    while (true) {
+        volatile malloc_slot_t *slot = &slots->slot[i];
+        if (slot->start == start) {
+            struct _malloc_entry_t *e = slot->e;
+            slot->start = MALLOC_SLOT_REMOVED;
+            shard->entries--;
+            malloc_retire_entry(e);
+            return true;
+        }
+        if (slot->start == NULL)
+            return false;
+        i = (i + 1) & slots->mask;
+    }
 }
 
 /* If track_allocs is false, only callbacks and callback returns are tracked.
@@ -2567,6 +3184,15 @@ alloc_init(alloc_options_t *ops, size_t ops_size)
                           HASH_INTPTR, false/*!str_dup*/, false/*!synch*/,
                           alloc_routine_entry_free, NULL, NULL);
         alloc_routine_lock = dr_mutex_create();
+        if (alloc_ops.track_heap && alloc_ops.lazy_routine_search) {
+            /* we must intercept before drwrap looks at the block */
+            drmgr_priority_t pri_app2app = {sizeof(pri_app2app),
+                                            "drmemory.alloc.app2app", NULL, NULL,
+                                            DRMGR_PRIORITY_APP2APP_ALLOC};
+            mod_search_tree = rb_tree_create(NULL);
+            if (!drmgr_register_bb_app2app_event(alloc_event_bb_app2app, &pri_app2app))
+                ASSERT(false, "drmgr registration failed");
+        }
         /* We want leaner wrapping and we are ok w/ no dups and no dynamic
          * wrap changes
          */
@@ -2591,20 +3217,20 @@ alloc_init(alloc_options_t *ops, size_t ops_size)
     }
 
     if (alloc_ops.track_allocs) {
-        hashtable_config_t hashconfig;
-        hashtable_init_ex(&malloc_table, ALLOC_TABLE_HASH_BITS, HASH_INTPTR,
-                          false/*!str_dup*/, false/*!synch*/, malloc_entry_free,
-                          malloc_hash, NULL);
-        /* hash lookup can be a bottleneck so it's worth taking some extra space
-         * to reduce the collision chains
-         */
-        hashconfig.size = sizeof(hashconfig);
-        hashconfig.resizable = true;
-        hashconfig.resize_threshold = 50; /* default is 75 */
-        hashtable_configure(&malloc_table, &hashconfig);
+        uint i;
+        num_malloc_shards = alloc_ops.shard_malloc_table ? MALLOC_TABLE_SHARDS : 1;
+        if (!alloc_ops.malloc_callbacks_synched)
+            client_malloc_cb_lock = dr_recurlock_create();
+        for (i = 0; i < num_malloc_shards; i++) {
+            malloc_table_init(&malloc_shards[i], ALLOC_TABLE_HASH_BITS -
+                              (num_malloc_shards > 1 ? MALLOC_TABLE_SHARD_BITS : 0));
+        }
+        malloc_dead_lock = dr_mutex_create();
 
         large_malloc_tree = rb_tree_create(NULL);
         large_malloc_lock = dr_mutex_create();
+        if (!alloc_ops.replace_malloc)
+            chunk_map_init();
 #ifdef USE_DRSYMS
         if (alloc_ops.cache_postcall)
             mod_pending_tree = rb_tree_create(NULL);
@@ -2633,7 +3259,7 @@ alloc_exit(void)
      * FIXME: provide a hashtable iterator instead of breaking abstraction
      * barrier here.
      */
-    uint i;
+    uint i, s;
     if (!alloc_ops.track_allocs)
         return;
 
@@ -2642,27 +3268,44 @@ alloc_exit(void)
 
     hashtable_delete_with_stats(&alloc_routine_table, "alloc routine table");
     dr_mutex_destroy(alloc_routine_lock);
+    if (mod_search_tree != NULL) {
+        LOG(1, "%u modules never searched for alloc routines\n", mod_search_entries);
+        rb_tree_destroy(mod_search_tree);
+    }
 
-    LOG(1, "final malloc table size: %u bits, %u entries\n",
-        malloc_table.table_bits, malloc_table.entries);
-    /* we can't hold malloc_table.lock b/c report_leak() acquires it
-     * for malloc_get_caller()
-     */
-    for (i = 0; i < HASHTABLE_SIZE(malloc_table.table_bits); i++) {
-        hash_entry_t *he;
-        for (he = malloc_table.table[i]; he != NULL; he = he->next) {
-            malloc_entry_t *e = (malloc_entry_t *) he->payload;
+    for (s = 0; s < num_malloc_shards; s++) {
+        malloc_slots_t *slots = malloc_shards[s].slots;
+        LOG(1, "final malloc table shard %u size: %u slots, %u entries\n",
+            s, slots->mask + 1, malloc_shards[s].entries);
+        /* we can't hold the table lock b/c report_leak() acquires it
+         * for malloc_get_caller()
+         */
+        for (i = 0; i <= slots->mask; i++) {
+            malloc_entry_t *e = slots->slot[i].e;
+            if (slots->slot[i].start == NULL || slots->slot[i].start == MALLOC_SLOT_REMOVED)
+                continue;
             if (MALLOC_VISIBLE(e->flags) && !malloc_entry_is_native(e)) {
-                client_exit_iter_chunk(e->start, e->end, TEST(MALLOC_PRE_US, e->flags),
+                client_exit_iter_chunk(e->start, e->end,
+                                       TEST(MALLOC_PRE_US, e->flags),
                                        e->flags, e->data);
             }
         }
     }
 
     if (alloc_ops.track_allocs) {
-        hashtable_delete(&malloc_table);
+        /* no readers remain */
+        epoch_reclaim_all();
+        malloc_dead_free();
+        for (s = 0; s < num_malloc_shards; s++)
+            malloc_table_delete(&malloc_shards[s]);
+        dr_mutex_destroy(malloc_dead_lock);
+        if (client_malloc_cb_lock != NULL) {
+            dr_recurlock_destroy(client_malloc_cb_lock);
+            client_malloc_cb_lock = NULL;
+        }
         rb_tree_destroy(large_malloc_tree);
         dr_mutex_destroy(large_malloc_lock);
+        chunk_map_exit();
 #ifdef USE_DRSYMS
         if (alloc_ops.cache_postcall) {
             dr_mutex_destroy(post_call_lock);
@@ -2855,8 +3498,36 @@ module_is_libc(const module_data_t *mod, bool *is_libc, bool *is_libcpp, bool *i
     }
 }
 
-void
-alloc_module_load(void *drcontext, const module_data_t *info, bool loaded)
+static bool
+module_is_main(const module_data_t *info)
+{
+    module_data_t *exe = dr_get_main_module();
+    bool res = false;
+    if (exe != NULL) {
+        res = (exe->start == info->start);
+        dr_free_module_data(exe);
+    }
+    return res;
+}
+
+#ifdef USE_DRSYMS
+/* Whether a prior run recorded that info has no alloc routines */
+static bool
+module_known_to_lack_routines(const module_data_t *info)
+{
+    size_t modoffs;
+    uint count;
+    return (op_use_symcache && symcache_module_is_cached(info) &&
+            symcache_lookup(info, NO_ALLOC_SYMCACHE_NAME, 0, &modoffs, &count) &&
+            modoffs == 0);
+}
+#endif
+
+/* Searches info for alloc routines and intercepts them.
+ * Caller must hold alloc_routine_lock.
+ */
+static void
+alloc_search_module(const module_data_t *info)
 {
     alloc_routine_set_t *set_libc = NULL;
     alloc_routine_set_t *set_cpp = NULL;
@@ -2864,23 +3535,16 @@ alloc_module_load(void *drcontext, const module_data_t *info, bool loaded)
 #ifdef WINDOWS
     /* i#607 part C: is msvcp*d.dll present, yet we do not have symbols? */
     bool dbgcpp = false, dbgcpp_nosyms = false;
+    bool no_dbg_routines = false;
 #endif
-    bool search_syms = true, search_libc_syms = true;
+    bool search_libc_syms = true;
     const char *modname = dr_module_preferred_name(info);
     bool is_libc, is_libcpp, is_debug;
+    ASSERT(dr_mutex_self_owns(alloc_routine_lock), "caller must hold lock");
     module_is_libc(info, &is_libc, &is_libcpp, &is_debug);
 
 #ifdef WINDOWS
-    alloc_find_syscalls(drcontext, info);
-#endif
-
-    if (modname != NULL &&
-        (strcmp(modname, "drmemorylib.dll") == 0 ||
-         strcmp(modname, "dynamorio.dll") == 0))
-        search_syms = false;
-
-#ifdef WINDOWS
-    if (alloc_ops.skip_msvc_importers && search_syms &&
+    if (alloc_ops.skip_msvc_importers &&
         module_imports_from_msvc(info) &&
         !is_libc && !is_libcpp) {
         /* i#963: assume there are no static libc routines if the module
@@ -2899,163 +3563,210 @@ alloc_module_load(void *drcontext, const module_data_t *info, bool loaded)
     }
 #endif
 
-    if (alloc_ops.track_heap && search_syms) {
 #ifdef WINDOWS
-        bool no_dbg_routines = false;
-#endif
-
-#ifdef WINDOWS
-        /* match msvcrtd.dll and msvcrNNd.dll */
-        if (is_libc && is_debug) {
-            if (!module_has_pdb(info)) {
-                if (alloc_ops.replace_malloc) {
-                    /* FIXME i#607 part A for replacing: we don't yet have the
-                     * nosyms fallback in place
-                     */
-                    NOTIFY_ERROR("FATAL ERROR: usage of Visual Studio Debug C DLL "
-                                 "(without its symbols) is not supported. "
-                                 "Please rebuild your application with either the Release "
-                                 "build (/MD or /MT) or static Debug library (/MTd). "
-                                 "With /MD, to avoid C++ Debug DLL, remove _DEBUG define."
-                                 NL);
-                    dr_abort();
-                } else {
-                    /* i#607 part A: we need pdb symbols for dbgcrt in order to intercept
-                     * all allocations.  If we don't have them we have a fallback but it
-                     * may have false negatives.
-                     * XXX i#143: add automated symbol retrieval
-                     */
-                    dbgcrt_nosyms = true;
-                }
-            }
-        } else if (is_libcpp && is_debug) {
-            dbgcpp = true;
-            if (!module_has_pdb(info)) {
-                /* i#607 part C: w/o symbols we have to disable
-                 * mismatch detection within msvcp*d.dll b/c we won't be able to
-                 * locate std::_DebugHeapDelete<*> for i#722.
+    /* match msvcrtd.dll and msvcrNNd.dll */
+    if (is_libc && is_debug) {
+        if (!module_has_pdb(info)) {
+            if (alloc_ops.replace_malloc) {
+                /* FIXME i#607 part A for replacing: we don't yet have the
+                 * nosyms fallback in place
                  */
-                dbgcpp_nosyms = true;
-                WARN("WARNING: no symbols for %s so disabling mismatch detection\n",
-                     modname);
+                NOTIFY_ERROR("FATAL ERROR: usage of Visual Studio Debug C DLL "
+                             "(without its symbols) is not supported. "
+                             "Please rebuild your application with either the Release "
+                             "build (/MD or /MT) or static Debug library (/MTd). "
+                             "With /MD, to avoid C++ Debug DLL, remove _DEBUG define."
+                             NL);
+                dr_abort();
+            } else {
+                /* i#607 part A: we need pdb symbols for dbgcrt in order to intercept
+                 * all allocations.  If we don't have them we have a fallback but it
+                 * may have false negatives.
+                 * XXX i#143: add automated symbol retrieval
+                 */
+                dbgcrt_nosyms = true;
             }
         }
+    } else if (is_libcpp && is_debug) {
+        dbgcpp = true;
+        if (!module_has_pdb(info)) {
+            /* i#607 part C: w/o symbols we have to disable
+             * mismatch detection within msvcp*d.dll b/c we won't be able to
+             * locate std::_DebugHeapDelete<*> for i#722.
+             */
+            dbgcpp_nosyms = true;
+            WARN("WARNING: no symbols for %s so disabling mismatch detection\n",
+                 modname);
+        }
+    }
 #endif
 
-        dr_mutex_lock(alloc_routine_lock);
 #ifdef WINDOWS
-        if (search_libc_syms &&
-            lookup_symbol_or_export(info, "_malloc_dbg", true) != NULL) {
-            if (modname == NULL ||
-                !text_matches_pattern(modname, "msvcrt.dll", true/*ignore case*/)) {
-                /* i#500: debug operator new calls either malloc, which calls
-                 * _nh_malloc_dbg, or calls _nh_malloc_dbg directly; yet debug
-                 * operator delete calls _free_dbg: so we're forced to disable all
-                 * redzones since the layers don't line up.  In general when using
-                 * debug version of msvcrt everything is debug, so we disable
-                 * redzones for all C and C++ allocators.  However, msvcrt.dll
-                 * contains _malloc_dbg (but not _nh_malloc_dbg), yet its operator
-                 * new is not debug and calls (regular) malloc.  Note that
-                 * _nh_malloc_dbg is not exported so we can't use that as a decider.
-                 */
-                use_redzone = false;
-                LOG(1, "NOT using redzones for any allocators in %s "PFX"\n",
-                    (modname == NULL) ? "<noname>" : modname, info->start);
-            } else {
-                LOG(1, "NOT using redzones for _dbg routines in %s "PFX"\n",
-                    (modname == NULL) ? "<noname>" : modname, info->start);
-            }
+    if (search_libc_syms &&
+        lookup_symbol_or_export(info, "_malloc_dbg", true) != NULL) {
+        if (modname == NULL ||
+            !text_matches_pattern(modname, "msvcrt.dll", true/*ignore case*/)) {
+            /* i#500: debug operator new calls either malloc, which calls
+             * _nh_malloc_dbg, or calls _nh_malloc_dbg directly; yet debug
+             * operator delete calls _free_dbg: so we're forced to disable all
+             * redzones since the layers don't line up.  In general when using
+             * debug version of msvcrt everything is debug, so we disable
+             * redzones for all C and C++ allocators.  However, msvcrt.dll
+             * contains _malloc_dbg (but not _nh_malloc_dbg), yet its operator
+             * new is not debug and calls (regular) malloc.  Note that
+             * _nh_malloc_dbg is not exported so we can't use that as a decider.
+             */
+            use_redzone = false;
+            LOG(1, "NOT using redzones for any allocators in %s "PFX"\n",
+                (modname == NULL) ? "<noname>" : modname, info->start);
         } else {
-            /* optimization: assume no other dbg routines if no _malloc_dbg */
-            no_dbg_routines = true;
+            LOG(1, "NOT using redzones for _dbg routines in %s "PFX"\n",
+                (modname == NULL) ? "<noname>" : modname, info->start);
         }
-#endif
-        if (search_libc_syms) {
-            set_libc = find_alloc_routines(info, possible_libc_routines,
-                                           POSSIBLE_LIBC_ROUTINE_NUM, use_redzone,
-                                           true/*mismatch*/, false/*!expect all*/,
-                                           HEAPSET_LIBC, NULL, is_libc, is_libcpp);
-            /* XXX i#1059: if there are multiple msvcr* dll's, we use the order
-             * chosen by get_libc_base().  Really we should support arbitrary
-             * numbers and find the specific sets used.
-             */
-            if (info->start == get_libc_base(NULL)) {
-                if (set_dyn_libc != NULL)
-                    WARN("WARNING: two libcs found");
-                set_dyn_libc = set_libc;
-            }
+    } else {
+        /* optimization: assume no other dbg routines if no _malloc_dbg */
+        no_dbg_routines = true;
+    }
+#endif
+    if (search_libc_syms) {
+        set_libc = find_alloc_routines(info, possible_libc_routines,
+                                       POSSIBLE_LIBC_ROUTINE_NUM, use_redzone,
+                                       true/*mismatch*/, false/*!expect all*/,
+                                       HEAPSET_LIBC, NULL, is_libc, is_libcpp);
+        /* XXX i#1059: if there are multiple msvcr* dll's, we use the order
+         * chosen by get_libc_base().  Really we should support arbitrary
+         * numbers and find the specific sets used.
+         */
+        if (info->start == get_libc_base(NULL)) {
+            if (set_dyn_libc != NULL)
+                WARN("WARNING: two libcs found");
+            set_dyn_libc = set_libc;
         }
+    }
 #ifdef WINDOWS
-        /* i#26: msvcrtdbg adds its own redzone that contains a debugging
-         * data structure.  The problem is that operator delete() assumes
-         * this data struct is placed immediately prior to the ptr
-         * returned by malloc.  We aren't intercepting new or delete
-         * as full layers so we simply skip our redzone for msvcrtdbg: after all there's
-         * already a redzone there.
+    /* i#26: msvcrtdbg adds its own redzone that contains a debugging
+     * data structure.  The problem is that operator delete() assumes
+     * this data struct is placed immediately prior to the ptr
+     * returned by malloc.  We aren't intercepting new or delete
+     * as full layers so we simply skip our redzone for msvcrtdbg: after all there's
+     * already a redzone there.
+     */
+    /* We watch debug operator delete b/c it reads malloc's headers (i#26)
+     * but we now watch it in general so we don't need to special-case
+     * it here.
+     */
+    if (search_libc_syms && !no_dbg_routines) {
+        alloc_routine_set_t *set_dbgcrt =
+            find_alloc_routines(info, possible_crtdbg_routines,
+                                POSSIBLE_CRTDBG_ROUTINE_NUM, false/*no redzone*/,
+                                true/*mismatch*/, false/*!expect all*/,
+                                HEAPSET_LIBC_DBG, set_libc, is_libc, is_libcpp);
+        /* XXX i#967: not sure this is right: some malloc calls,
+         * or operator new, might use shared libc?
          */
-        /* We watch debug operator delete b/c it reads malloc's headers (i#26)
-         * but we now watch it in general so we don't need to special-case
-         * it here.
+        if (set_libc == NULL)
+            set_libc = set_dbgcrt;
+    }
+#endif
+    if (alloc_ops.intercept_operators) {
+        alloc_routine_set_t *corresponding_libc = set_libc;
+#ifdef WINDOWS
+        /* we assume we only hit i#26 where op delete reads heap
+         * headers when _malloc_dbg is present in same lib, for
+         * static debug msvcp.  for dynamic we check by name.
          */
-        if (search_libc_syms && !no_dbg_routines) {
-            alloc_routine_set_t *set_dbgcrt =
-                find_alloc_routines(info, possible_crtdbg_routines,
-                                    POSSIBLE_CRTDBG_ROUTINE_NUM, false/*no redzone*/,
-                                    true/*mismatch*/, false/*!expect all*/,
-                                    HEAPSET_LIBC_DBG, set_libc, is_libc, is_libcpp);
-            /* XXX i#967: not sure this is right: some malloc calls,
-             * or operator new, might use shared libc?
-             */
-            if (set_libc == NULL)
-                set_libc = set_dbgcrt;
-        }
+        bool is_dbg = (!no_dbg_routines || dbgcpp);
 #endif
-        if (alloc_ops.intercept_operators) {
-            alloc_routine_set_t *corresponding_libc = set_libc;
+        /* Assume that a C++ library w/o a local libc calls into the
+         * shared libc.
+         * XXX i#967: this may not be the right thing: to be sure we'd
+         * have to disasm the library's operator new to find the malloc
+         * set it calls into.
+         */
+        if (corresponding_libc == NULL)
+            corresponding_libc = set_dyn_libc;
 #ifdef WINDOWS
-            /* we assume we only hit i#26 where op delete reads heap
-             * headers when _malloc_dbg is present in same lib, for
-             * static debug msvcp.  for dynamic we check by name.
-             */
-            bool is_dbg = (!no_dbg_routines || dbgcpp);
+        /* Even if the module imports from msvcp*.dll it can still have
+         * template instantiations in it of std::_DebugHeapDelete.
+         * Plus, we need to intercept the local operator stubs in order
+         * to properly do heap mismatch checks.
+         */
 #endif
-            /* Assume that a C++ library w/o a local libc calls into the
-             * shared libc.
-             * XXX i#967: this may not be the right thing: to be sure we'd
-             * have to disasm the library's operator new to find the malloc
-             * set it calls into.
-             */
-            if (corresponding_libc == NULL)
-                corresponding_libc = set_dyn_libc;
+        set_cpp = find_alloc_routines(info, possible_cpp_routines,
+                                      POSSIBLE_CPP_ROUTINE_NUM, use_redzone,
+                                      IF_WINDOWS_ELSE(!dbgcpp_nosyms, true),
+                                      false/*!expect all*/,
+                                      IF_WINDOWS(is_dbg ? HEAPSET_CPP_DBG :)
+                                      HEAPSET_CPP, corresponding_libc,
+                                      is_libc, is_libcpp);
+    }
+    if (set_cpp != NULL) {
+        /* for static, use corresponding libc for size.
+         * for dynamic, use dynamic libc.
+         */
+        alloc_routine_set_t *cpp_libc =
+            (set_libc == NULL) ? set_dyn_libc : set_libc;
+        if (cpp_libc != NULL) {
+            set_cpp->func[HEAP_ROUTINE_SIZE_USABLE] =
+                cpp_libc->func[HEAP_ROUTINE_SIZE_USABLE];
+            set_cpp->func[HEAP_ROUTINE_SIZE_REQUESTED] =
+                cpp_libc->func[HEAP_ROUTINE_SIZE_REQUESTED];
+        } else
+            WARN("WARNING: no libc found for cpp\n");
+    }
+#ifdef USE_DRSYMS
+    /* Record a full search that came up empty so the next run can skip
+     * this module entirely.  A partial search proves nothing.
+     */
+    if (set_libc == NULL && set_cpp == NULL && search_libc_syms &&
+        alloc_ops.intercept_operators && op_use_symcache)
+        symcache_add(info, NO_ALLOC_SYMCACHE_NAME, 0);
+#endif
+}
+
+void
+alloc_module_load(void *drcontext, const module_data_t *info, bool loaded)
+{
+    bool search_syms = true;
+    const char *modname = dr_module_preferred_name(info);
+    bool is_libc, is_libcpp, is_debug;
+    module_is_libc(info, &is_libc, &is_libcpp, &is_debug);
+
 #ifdef WINDOWS
-            /* Even if the module imports from msvcp*.dll it can still have
-             * template instantiations in it of std::_DebugHeapDelete.
-             * Plus, we need to intercept the local operator stubs in order
-             * to properly do heap mismatch checks.
-             */
+    alloc_find_syscalls(drcontext, info);
+#endif
+
+    if (modname != NULL &&
+        (strcmp(modname, "drmemorylib.dll") == 0 ||
+         strcmp(modname, "dynamorio.dll") == 0))
+        search_syms = false;
+
+#ifdef USE_DRSYMS
+    if (search_syms && module_known_to_lack_routines(info)) {
+        LOG(1, "symcache says module %s has no alloc routines\n",
+            modname == NULL ? "" : modname);
+        STATS_INC(symbol_search_cache_hits);
+        search_syms = false;
+    }
 #endif
-            set_cpp = find_alloc_routines(info, possible_cpp_routines,
-                                          POSSIBLE_CPP_ROUTINE_NUM, use_redzone,
-                                          IF_WINDOWS_ELSE(!dbgcpp_nosyms, true),
-                                          false/*!expect all*/,
-                                          IF_WINDOWS(is_dbg ? HEAPSET_CPP_DBG :)
-                                          HEAPSET_CPP, corresponding_libc,
-                                          is_libc, is_libcpp);
-        }
-        if (set_cpp != NULL) {
-            /* for static, use corresponding libc for size.
-             * for dynamic, use dynamic libc.
-             */
-            alloc_routine_set_t *cpp_libc =
-                (set_libc == NULL) ? set_dyn_libc : set_libc;
-            if (cpp_libc != NULL) {
-                set_cpp->func[HEAP_ROUTINE_SIZE_USABLE] =
-                    cpp_libc->func[HEAP_ROUTINE_SIZE_USABLE];
-                set_cpp->func[HEAP_ROUTINE_SIZE_REQUESTED] =
-                    cpp_libc->func[HEAP_ROUTINE_SIZE_REQUESTED];
-            } else
-                WARN("WARNING: no libc found for cpp\n");
-        }
+
+    if (alloc_ops.track_heap && search_syms) {
+        dr_mutex_lock(alloc_routine_lock);
+        /* Defer the search to the module's first execution, except for
+         * libc, whose set other modules' operators are tied to and which
+         * we use for the initial heap walk, and the executable, which is
+         * the likeliest to call into its own static allocator right away.
+         */
+        if (alloc_ops.lazy_routine_search && !is_libc && !is_libcpp &&
+            !module_is_main(info)) {
+            IF_DEBUG(rb_node_t *existing =)
+                rb_insert(mod_search_tree, info->start, info->end - info->start, NULL);
+            ASSERT(existing == NULL, "new module overlaps w/ existing");
+            mod_search_entries++;
+            LOG(2, "deferring alloc routine search in %s "PFX"\n",
+                modname == NULL ? "" : modname, info->start);
+        } else
+            alloc_search_module(info);
         dr_mutex_unlock(alloc_routine_lock);
     }
 
@@ -3080,6 +3791,33 @@ alloc_module_load(void *drcontext, const module_data_t *info, bool loaded)
 #endif
 }
 
+static void
+alloc_check_pending_search(app_pc pc)
+{
+    rb_node_t *node;
+    if (mod_search_entries == 0)
+        return;
+    dr_mutex_lock(alloc_routine_lock);
+    node = rb_in_node(mod_search_tree, pc);
+    if (node != NULL) {
+        /* other threads executing in this module wait on the lock until
+         * we're done, so none can reach a routine before it's intercepted
+         */
+        module_data_t *info = dr_lookup_module(pc);
+        ASSERT(info != NULL, "module can't disappear");
+        if (info != NULL) {
+            LOG(2, "first execution in %s "PFX": searching for alloc routines\n",
+                dr_module_preferred_name(info) == NULL ? "" :
+                dr_module_preferred_name(info), info->start);
+            alloc_search_module(info);
+            dr_free_module_data(info);
+        }
+        rb_delete(mod_search_tree, node);
+        mod_search_entries--;
+    }
+    dr_mutex_unlock(alloc_routine_lock);
+}
+
 #ifdef USE_DRSYMS
 static void
 alloc_check_pending_module(app_pc pc)
@@ -3125,6 +3863,14 @@ alloc_module_unload(void *drcontext, const module_data_t *info)
          *   final alloc routine table size: 7 bits, 44 entries
          */
         dr_mutex_lock(alloc_routine_lock);
+        if (mod_search_tree != NULL) {
+            /* never executed, so never searched */
+            rb_node_t *node = rb_find(mod_search_tree, info->start);
+            if (node != NULL) {
+                rb_delete(mod_search_tree, node);
+                mod_search_entries--;
+            }
+        }
         for (i = 0; i < HASHTABLE_SIZE(alloc_routine_table.table_bits); i++) {
             hash_entry_t *he, *nxt;
             for (he = alloc_routine_table.table[i]; he != NULL; he = nxt) {
@@ -3304,6 +4050,18 @@ malloc_iterate(malloc_iter_cb_t cb, void *iter_data)
     malloc_interface.malloc_iterate(cb, iter_data);
 }
 
+void
+malloc_iterate_range(app_pc start, app_pc end, malloc_iter_cb_t cb, void *iter_data)
+{
+    malloc_interface.malloc_iterate_range(start, end, cb, iter_data);
+}
+
+bool
+malloc_iterate_range_is_indexed(void)
+{
+    return !alloc_ops.replace_malloc;
+}
+
 /***************************************************************************
  * Per-malloc API for wrapping
  */
@@ -3312,32 +4070,109 @@ malloc_iterate(malloc_iter_cb_t cb, void *iter_data)
  * own or from within malloc_iterate(), so we need self-recursion support
  * of one level.  We do not need general recursion support.
  */
-static bool
-malloc_lock_held_by_self(void)
+static thread_id_t
+malloc_lock_self_id(void)
 {
-    /* reading this variable should be atomic */
     void *drcontext = dr_get_current_drcontext();
     if (drcontext == NULL) {
         ASSERT(false, "should always have dcontext w/ PR 536058");
+        return THREAD_ID_INVALID;
+    }
+    return dr_get_thread_id(drcontext);
+}
+
+/* Returns whether we hold the whole table */
+static bool
+malloc_lock_held_by_self(void)
+{
+    /* reading these variables should be atomic */
+    thread_id_t self = malloc_lock_self_id();
+    if (self == THREAD_ID_INVALID)
         return false;
+    return (self == malloc_lock_owner ||
+            /* with one shard, its lock is the whole table's */
+            (num_malloc_shards == 1 && self == malloc_shards[0].owner));
+}
+
+/* Asserts that we hold no single shard lock, as acquiring another lock
+ * could then deadlock
+ */
+static void
+malloc_assert_no_shard_held(thread_id_t self)
+{
+    DODEBUG({
+        uint i;
+        for (i = 0; i < num_malloc_shards; i++) {
+            ASSERT(self == THREAD_ID_INVALID || malloc_shards[i].owner != self,
+                   "must lock the whole table to use more than one shard");
+        }
+    });
+}
+
+/* Frees the entries in malloc_dead if the calling thread holds no table lock */
+static void
+malloc_dead_free_if_unlocked(void)
+{
+    thread_id_t self;
+    uint i;
+    if (malloc_dead.num == 0)
+        return; /* racy but a later unlock will get it */
+    self = malloc_lock_self_id();
+    if (self == THREAD_ID_INVALID || self == malloc_lock_owner)
+        return;
+    for (i = 0; i < num_malloc_shards; i++) {
+        if (malloc_shards[i].owner == self)
+            return;
     }
-    return (dr_get_thread_id(drcontext) == malloc_lock_owner);
+    malloc_dead_free();
 }
 
 static void
 malloc_lock_internal(void)
 {
-    void *drcontext = dr_get_current_drcontext();
-    hashtable_lock(&malloc_table);
-    if (drcontext != NULL) /* paranoid even w/ PR 536058 */
-        malloc_lock_owner = dr_get_thread_id(drcontext);
+    uint i;
+    malloc_assert_no_shard_held(malloc_lock_self_id());
+    /* a fixed order avoids deadlock among whole-table lockers */
+    for (i = 0; i < num_malloc_shards; i++)
+        dr_mutex_lock(malloc_shards[i].lock);
+    malloc_lock_owner = malloc_lock_self_id();
 }
 
 static void
 malloc_unlock_internal(void)
 {
+    uint i;
     malloc_lock_owner = THREAD_ID_INVALID;
-    hashtable_unlock(&malloc_table);
+    for (i = num_malloc_shards; i > 0; i--)
+        dr_mutex_unlock(malloc_shards[i - 1].lock);
+    malloc_dead_free_if_unlocked();
+}
+
+/* Locks just the shard holding start, unless we already hold it.  Returns
+ * the shard if we locked it, for passing to malloc_shard_unlock_if_locked_by_me().
+ */
+static malloc_shard_t *
+malloc_shard_lock_if_not_held_by_me(app_pc start)
+{
+    malloc_shard_t *shard = malloc_shard(start);
+    thread_id_t self = malloc_lock_self_id();
+    if (self != THREAD_ID_INVALID &&
+        (self == malloc_lock_owner || self == shard->owner))
+        return NULL;
+    malloc_assert_no_shard_held(self);
+    dr_mutex_lock(shard->lock);
+    shard->owner = self;
+    return shard;
+}
+
+static void
+malloc_shard_unlock_if_locked_by_me(malloc_shard_t *shard)
+{
+    if (shard != NULL) {
+        shard->owner = THREAD_ID_INVALID;
+        dr_mutex_unlock(shard->lock);
+        malloc_dead_free_if_unlocked();
+    }
 }
 
 static bool
@@ -3382,7 +4217,7 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
 {
     malloc_entry_t *e = (malloc_entry_t *) global_alloc(sizeof(*e), HEAPSTAT_HASHTABLE);
     malloc_entry_t *old_e;
-    bool locked_by_me;
+    malloc_shard_t *locked;
     ASSERT((alloc_ops.redzone_size > 0 && TEST(MALLOC_PRE_US, flags)) ||
            alloc_ops.record_allocs, 
            "internal inconsistency on when doing detailed malloc tracking");
@@ -3399,7 +4234,8 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
     LOG(3, "%s: type=%x\n", __FUNCTION__, alloc_type);
     e->flags |= (client_flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
     /* grab lock around client call and hashtable operations */
-    locked_by_me = malloc_lock_if_not_held_by_me();
+    locked = malloc_shard_lock_if_not_held_by_me(start);
+    client_malloc_cb_enter();
 
     if (!malloc_entry_is_native(e)) { /* don't show internal allocs to client */
         e->data = client_add_malloc_pre(e->start, e->end, e->end + e->usable_extra,
@@ -3412,7 +4248,12 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
      * when the free succeeds, so a race can hit a conflict.
      * Update: we no longer do this but leaving code for now
      */
-    old_e = hashtable_add_replace(&malloc_table, (void *) start, (void *)e);
+    old_e = malloc_table_add_replace(malloc_shard(start), start, e);
+    if (old_e != NULL) {
+        ASSERT(!TEST(MALLOC_VALID, old_e->flags), "internal error in malloc tracking");
+        malloc_retire_entry(old_e);
+    }
+    chunk_map_set(start, true);
 
     if (!malloc_entry_is_native(e) && end - start >= LARGE_MALLOC_MIN_SIZE) {
         malloc_large_add(e->start, e->end - e->start);
@@ -3422,21 +4263,20 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
         /* PR 567117: client event with entry in hashtable */
         client_add_malloc_post(e->start, e->end, e->end + e->usable_extra, e->data);
     }
+    client_malloc_cb_exit();
 
 #ifdef STATISTICS
     if (!malloc_entry_is_native(e))
         STATS_INC(num_mallocs);
     if (num_mallocs % 10000 == 0) {
-        hashtable_cluster_stats(&malloc_table, "malloc table");
+        malloc_shard_t *shard = malloc_shard(start);
+        LOG(1, "malloc table shard: %u entries, %u used, %u slots\n",
+            shard->entries, shard->used, shard->slots->mask + 1);
         LOG(1, "malloc table stats after %u malloc calls\n", num_mallocs);
     }
 #endif
 
-    malloc_unlock_if_locked_by_me(locked_by_me);
-    if (old_e != NULL) {
-        ASSERT(!TEST(MALLOC_VALID, old_e->flags), "internal error in malloc tracking");
-        malloc_entry_free(old_e);
-    }
+    malloc_shard_unlock_if_locked_by_me(locked);
     LOG(2, "MALLOC "PFX"-"PFX"\n", start, end);
     DOLOG(3, {
         print_callstack_to_file(dr_get_current_drcontext(), mc, post_call,
@@ -3456,16 +4296,87 @@ malloc_wrap__add(app_pc start, app_pc end, app_pc real_end,
 static malloc_entry_t *
 malloc_lookup(app_pc start)
 {
-    return hashtable_lookup(&malloc_table, (void *) start);
+    return malloc_table_lookup(malloc_shard(start), start);
+}
+
+/* Copies out the entry for start, if any, without taking the shard lock.
+ * The copy is a snapshot: the malloc may be freed right after.
+ */
+static bool
+malloc_lookup_copy(app_pc start, malloc_entry_t *copy OUT)
+{
+    malloc_entry_t *e;
+    bool found = false;
+    void *reader = epoch_read_enter();
+    malloc_shard_t *locked = NULL;
+    if (reader == NULL)
+        locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
+    /* a slot we raced with a remove or re-add can hold a retired entry */
+    if (e != NULL && e->start == start) {
+        *copy = *e;
+        found = true;
+    }
+    if (reader != NULL)
+        epoch_read_exit(reader);
+    else
+        malloc_shard_unlock_if_locked_by_me(locked);
+    return found;
+}
+
+/* Locks the shard holding start and returns its entry.  If there is no
+ * entry, the caller goes on to look at other addresses to check and report
+ * the invalid arg, and an i#1072 entry's removal touches its inner entry:
+ * for those we lock the whole table instead.  The OUT values are to be
+ * passed to malloc_unlock_after_lookup().
+ */
+static malloc_entry_t *
+malloc_lock_all_and_lookup(app_pc start, malloc_shard_t **locked_shard IN OUT,
+                           bool *locked_all IN OUT)
+{
+    if (*locked_shard != NULL) {
+        /* We can't nest another shard inside ours without risking deadlock
+         * with a whole-table locker, so we drop ours first.
+         */
+        malloc_shard_unlock_if_locked_by_me(*locked_shard);
+        *locked_shard = NULL;
+        *locked_all = malloc_lock_if_not_held_by_me();
+    }
+    /* the entry may have changed while unlocked */
+    return malloc_lookup(start);
+}
+
+static malloc_entry_t *
+malloc_lock_and_lookup(app_pc start, malloc_shard_t **locked_shard OUT,
+                       bool *locked_all OUT)
+{
+    malloc_entry_t *e;
+    *locked_all = false;
+    *locked_shard = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
+    if (*locked_shard != NULL && num_malloc_shards > 1 &&
+        (e == NULL || TEST(MALLOC_CONTAINS_LIBC_ALLOC, e->flags)))
+        e = malloc_lock_all_and_lookup(start, locked_shard, locked_all);
+    return e;
+}
+
+static void
+malloc_unlock_after_lookup(malloc_shard_t *locked_shard, bool locked_all)
+{
+    malloc_shard_unlock_if_locked_by_me(locked_shard);
+    malloc_unlock_if_locked_by_me(locked_all);
 }
 
-/* Note that this also frees the entry.  Caller should be holding lock. */
+/* Note that this also frees the entry.  Caller should be holding lock
+ * (the whole table's if an i#1072 outer entry: see malloc_lock_and_lookup()).
+ */
 static void
 malloc_entry_remove(malloc_entry_t *e)
 {
     app_pc start, end, real_end;
     bool native = malloc_entry_is_native(e);
     ASSERT(e != NULL, "invalid arg");
+    client_malloc_cb_enter();
     if (!native) {
         /* cache values for post-event */
         start = e->start;
@@ -3483,11 +4394,17 @@ malloc_entry_remove(malloc_entry_t *e)
      * a nop.
      */
     if (TEST(MALLOC_CONTAINS_LIBC_ALLOC, e->flags)) {
-        ASSERT(e->start + DBGCRT_PRE_REDZONE_SIZE < e->end, "invalid internal alloc");
-        hashtable_remove(&malloc_table, e->start + DBGCRT_PRE_REDZONE_SIZE);
+        app_pc inner = e->start + DBGCRT_PRE_REDZONE_SIZE;
+        ASSERT(inner < e->end, "invalid internal alloc");
+        ASSERT(malloc_shard(inner) == malloc_shard(e->start) ||
+               malloc_lock_held_by_self(), "must hold both shards");
+        if (malloc_table_remove(malloc_shard(inner), inner))
+            chunk_map_set(inner, false);
     }
 #endif
-    if (hashtable_remove(&malloc_table, e->start)) {
+    /* clear first, as the remove retires e */
+    chunk_map_set(e->start, false);
+    if (malloc_table_remove(malloc_shard(e->start), e->start)) {
 #ifdef STATISTICS
         if (!native)
             STATS_INC(num_frees);
@@ -3497,18 +4414,19 @@ malloc_entry_remove(malloc_entry_t *e)
         /* PR 567117: client event with entry removed from hashtable */
         client_remove_malloc_post(start, end, real_end);
     }
+    client_malloc_cb_exit();
 }
 
 #ifdef WINDOWS
 static void
 malloc_remove(app_pc start)
 {
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = malloc_lookup(start);
+    malloc_shard_t *locked_shard;
+    bool locked_all;
+    malloc_entry_t *e = malloc_lock_and_lookup(start, &locked_shard, &locked_all);
     if (e != NULL)
         malloc_entry_remove(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_unlock_after_lookup(locked_shard, locked_all);
 }
 #endif
 
@@ -3536,6 +4454,7 @@ malloc_entry_set_valid(malloc_entry_t *e, bool valid)
          * other add/remove calls, so that any hashtable iteration will
          * NOT find the changes yet (PR 560824)
          */
+        client_malloc_cb_enter();
         if (valid) {
             e->data = client_add_malloc_pre(e->start, e->end, e->end + e->usable_extra,
                                             e->data, NULL, NULL);
@@ -3564,6 +4483,7 @@ malloc_entry_set_valid(malloc_entry_t *e, bool valid)
             /* PR 567117: client event with entry removed from hashtable */
             client_remove_malloc_post(start, end, real_end);
         }
+        client_malloc_cb_exit();
     } /* ok to be NULL: a race where re-used in malloc and then freed already */
 }
 
@@ -3571,11 +4491,11 @@ static void
 malloc_set_valid(app_pc start, bool valid)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL)
         malloc_entry_set_valid(e, valid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
 }
 
 static bool
@@ -3617,26 +4537,20 @@ static uint
 malloc_alloc_type(byte *start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
     uint res = 0;
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = malloc_alloc_entry_type(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return res;
 }
 
 static bool
 malloc_wrap__is_pre_us_ex(app_pc start, bool ok_if_invalid)
 {
-    bool res = false;
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
-    if (e != NULL)
-        res = malloc_entry_is_pre_us(e, ok_if_invalid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
-    return res;
+    malloc_entry_t e;
+    return (malloc_lookup_copy(start, &e) && malloc_entry_is_pre_us(&e, ok_if_invalid));
 }
 
 static bool
@@ -3649,11 +4563,11 @@ static void
 malloc_set_pre_us(app_pc start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL)
         e->flags |= MALLOC_PRE_US;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
 }
 
 /* Returns true if the malloc is ignored by us */
@@ -3681,10 +4595,10 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 #ifdef WINDOWS
     bool res = false;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     res = malloc_entry_is_native_ex(e, start, pt, consider_being_freed);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return res;
 #else
     /* optimization: currently nothing in the table */
@@ -3699,7 +4613,7 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 static bool
 malloc_entry_exists_racy_nolock(app_pc start)
 {
-    malloc_entry_t *e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_entry_t *e = malloc_lookup(start);
     return (e != NULL && MALLOC_VISIBLE(e->flags));
 }
 #endif
@@ -3707,28 +4621,20 @@ malloc_entry_exists_racy_nolock(app_pc start)
 static app_pc
 malloc_wrap__end(app_pc start)
 {
-    app_pc end = NULL;
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
-    if (e != NULL && MALLOC_VISIBLE(e->flags))
-        end = e->end;
-    malloc_unlock_if_locked_by_me(locked_by_me);
-    return end;
+    malloc_entry_t e;
+    if (malloc_lookup_copy(start, &e) && MALLOC_VISIBLE(e.flags))
+        return e.end;
+    return NULL;
 }
 
 /* Returns -1 on failure */
 static ssize_t
 malloc_wrap__size(app_pc start)
 {
-    ssize_t sz = -1;
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
-    if (e != NULL && MALLOC_VISIBLE(e->flags))
-        sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
-    return sz;
+    malloc_entry_t e;
+    if (malloc_lookup_copy(start, &e) && MALLOC_VISIBLE(e.flags))
+        return (e.end - start);
+    return -1;
 }
 
 /* Returns -1 on failure.  Only looks at invalid malloc regions. */
@@ -3737,25 +4643,21 @@ malloc_wrap__size_invalid_only(app_pc start)
 {
     ssize_t sz = -1;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL && !TEST(MALLOC_VALID, e->flags))
         sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return sz;
 }
 
 static void *
 malloc_wrap__get_client_data(app_pc start)
 {
-    void *res = NULL;
-    malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
-    if (e != NULL)
-        res = e->data;
-    malloc_unlock_if_locked_by_me(locked_by_me);
-    return res;
+    malloc_entry_t e;
+    if (malloc_lookup_copy(start, &e))
+        return e.data;
+    return NULL;
 }
 
 static uint
@@ -3763,11 +4665,11 @@ malloc_wrap__get_client_flags(app_pc start)
 {
     uint res = 0;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = (e->flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return res;
 }
 
@@ -3776,13 +4678,13 @@ malloc_wrap__set_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags |= (client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return found;
 }
 
@@ -3791,30 +4693,36 @@ malloc_wrap__clear_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_shard_t *locked = malloc_shard_lock_if_not_held_by_me(start);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags &= ~(client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_shard_unlock_if_locked_by_me(locked);
     return found;
 }
 
 static void
 malloc_iterate_internal(bool include_native, malloc_iter_cb_t cb, void *iter_data)
 {
-    uint i;
+    uint i, s;
     /* we do support being called while malloc lock is held but caller should
      * be careful that table is in a consistent state (staleness does this)
      */
     bool locked_by_me = malloc_lock_if_not_held_by_me();
-    for (i = 0; i < HASHTABLE_SIZE(malloc_table.table_bits); i++) {
-        hash_entry_t *he, *nxt;
-        for (he = malloc_table.table[i]; he != NULL; he = nxt) {
-            malloc_entry_t *e = (malloc_entry_t *) he->payload;
+    /* a malloc_add() from cb can resize a shard: the read section keeps the
+     * array we are walking alive
+     */
+    void *reader = epoch_read_enter();
+    for (s = 0; s < num_malloc_shards; s++) {
+        malloc_slots_t *slots = malloc_shards[s].slots;
+        for (i = 0; i <= slots->mask; i++) {
             /* support malloc_remove() while iterating */
-            nxt = he->next;
+            malloc_entry_t *e = slots->slot[i].e;
+            if (slots->slot[i].start == NULL ||
+                slots->slot[i].start == MALLOC_SLOT_REMOVED)
+                continue;
             if (MALLOC_VISIBLE(e->flags) &&
                 (include_native || !malloc_entry_is_native(e))) {
                 if (!cb(e->start, e->end, e->end + e->usable_extra,
@@ -3828,6 +4736,8 @@ malloc_iterate_internal(bool include_native, malloc_iter_cb_t cb, void *iter_dat
         }
     }
  malloc_iterate_done:
+    if (reader != NULL)
+        epoch_read_exit(reader);
     malloc_unlock_if_locked_by_me(locked_by_me);
 }
 
@@ -3837,6 +4747,81 @@ malloc_wrap__iterate(malloc_iter_cb_t cb, void *iter_data)
     malloc_iterate_internal(false, cb, iter_data);
 }
 
+/* Fills in the fields of the malloc starting at start and returns true if
+ * there is a visible one there.  We copy them out so that callers can invoke
+ * iteration callbacks without holding the lock.
+ */
+static bool
+malloc_range_lookup(app_pc start, app_pc *end OUT, app_pc *real_end OUT,
+                    uint *flags OUT, void **data OUT)
+{
+    malloc_entry_t e;
+    if (!malloc_lookup_copy(start, &e) || !MALLOC_VISIBLE(e.flags) ||
+        malloc_entry_is_native(&e))
+        return false;
+    *end = e.end;
+    *real_end = e.end + e.usable_extra;
+    *flags = e.flags;
+    *data = e.data;
+    return true;
+}
+
+static void
+malloc_wrap__iterate_range(app_pc start, app_pc end, malloc_iter_cb_t cb,
+                           void *iter_data)
+{
+    app_pc granule, pc = NULL, limit, e_end, real_end;
+    uint flags, span, i;
+    void *data;
+    size_t large_size;
+    if (chunk_map == NULL || start >= end)
+        return;
+    span = chunk_map_granule_span();
+    /* First, a malloc starting below start that contains it.  Mallocs don't
+     * overlap, so only the nearest visible one below can.
+     */
+    limit = (start > (app_pc)LARGE_MALLOC_MIN_SIZE) ? (app_pc)
+        ALIGN_BACKWARD(start - LARGE_MALLOC_MIN_SIZE + 1, MALLOC_CHUNK_ALIGNMENT) : NULL;
+    for (granule = chunk_map_prev(limit, start); granule != NULL;
+         granule = chunk_map_prev(limit, granule)) {
+        for (i = span; i-- > 0; ) {
+            if (granule + i < start &&
+                malloc_range_lookup(granule + i, &e_end, &real_end, &flags, &data)) {
+                pc = granule + i;
+                break;
+            }
+        }
+        if (pc != NULL)
+            break;
+    }
+    if (pc == NULL) {
+        /* a larger malloc could reach from farther away */
+        if (!malloc_large_lookup(start, &pc, &large_size) || pc >= start ||
+            !malloc_range_lookup(pc, &e_end, &real_end, &flags, &data))
+            pc = NULL;
+    }
+    if (pc != NULL && e_end > start) {
+        if (!cb(pc, e_end, real_end, TEST(MALLOC_PRE_US, flags),
+                flags & MALLOC_POSSIBLE_CLIENT_FLAGS, data, iter_data))
+            return;
+    }
+    /* Then, every malloc starting in [start, end), in address order */
+    for (granule = chunk_map_next((app_pc)ALIGN_BACKWARD(start, MALLOC_CHUNK_ALIGNMENT),
+                                  end);
+         granule != NULL;
+         granule = chunk_map_next(granule + MALLOC_CHUNK_ALIGNMENT, end)) {
+        for (i = 0; i < span; i++) {
+            pc = granule + i;
+            if (pc < start || pc >= end)
+                continue;
+            if (malloc_range_lookup(pc, &e_end, &real_end, &flags, &data) &&
+                !cb(pc, e_end, real_end, TEST(MALLOC_PRE_US, flags),
+                    flags & MALLOC_POSSIBLE_CLIENT_FLAGS, data, iter_data))
+                return;
+        }
+    }
+}
+
 static void *
 malloc_wrap__set_init(heapset_type_t type, app_pc pc, void *libc_data)
 {
@@ -3887,6 +4872,7 @@ malloc_wrap_init(void)
     malloc_interface.malloc_set_client_flag = malloc_wrap__set_client_flag;
     malloc_interface.malloc_clear_client_flag = malloc_wrap__clear_client_flag;
     malloc_interface.malloc_iterate = malloc_wrap__iterate;
+    malloc_interface.malloc_iterate_range = malloc_wrap__iterate_range;
     malloc_interface.malloc_intercept = malloc_wrap__intercept;
     malloc_interface.malloc_unintercept = malloc_wrap__unintercept;
     malloc_interface.malloc_set_init = malloc_wrap__set_init;
@@ -4459,17 +5445,27 @@ handle_post_alloc_syscall(void *drcontext, int sysnum, dr_mcontext_t *mc)
 }
 
 static inline app_pc
-get_retaddr_at_entry(dr_mcontext_t *mc)
+get_retaddr_at_entry(reg_t xsp)
 {
     app_pc retaddr = NULL;
     if (alloc_ops.conservative) {
-        if (!safe_read((void *)mc->xsp, sizeof(retaddr), &retaddr))
+        if (!safe_read((void *)xsp, sizeof(retaddr), &retaddr))
             ASSERT(false, "error reading retaddr at func entry");
     } else
-        retaddr = *(app_pc*)(mc->xsp);
+        retaddr = *(app_pc*)xsp;
     return retaddr;
 }
 
+static inline void
+record_outer_layer(cls_alloc_t *pt, reg_t xsp, reg_t xbp, app_pc retaddr)
+{
+    pt->outer_xsp = xsp;
+    pt->outer_xbp = xbp;
+    pt->outer_retaddr = retaddr;
+    LOG(3, "\t@ level=%d recorded xsp="PFX" xbp="PFX" ra="PFX"\n",
+        pt->in_heap_routine, pt->outer_xsp, pt->outer_xbp, pt->outer_retaddr);
+}
+
 static inline void
 record_mc_for_client(cls_alloc_t *pt, void *wrapcxt)
 {
@@ -4481,11 +5477,7 @@ record_mc_for_client(cls_alloc_t *pt, void *wrapcxt)
      * pass operators through and don't handle until malloc/free!
      */
     dr_mcontext_t *mc = drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR);
-    pt->outer_xsp = mc->xsp;
-    pt->outer_xbp = mc->xbp;
-    pt->outer_retaddr = drwrap_get_retaddr(wrapcxt);
-    LOG(3, "\t@ level=%d recorded xsp="PFX" xbp="PFX" ra="PFX"\n",
-        pt->in_heap_routine, pt->outer_xsp, pt->outer_xbp, pt->outer_retaddr);
+    record_outer_layer(pt, mc->xsp, mc->xbp, drwrap_get_retaddr(wrapcxt));
 }
 
 /* Returns the top frame pc to pass to the client and temporarily sets
@@ -4775,27 +5767,30 @@ record_allocator(void *drcontext, cls_alloc_t *pt, alloc_routine_entry_t *routin
 /* i#123: report mismatch in free/delete/delete[]
  * Caller must hold malloc lock
  * Also records the outer layer for reporting any error (i#913)
+ * mc may be NULL, in which case it is only fetched if we report.
  */
 static bool
-handle_free_check_mismatch(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
-                           alloc_routine_entry_t *routine, malloc_entry_t *entry)
+handle_free_check_mismatch(void *drcontext, cls_alloc_t *pt,
+                           alloc_routine_entry_t *routine, malloc_entry_t *entry,
+                           app_pc base, app_pc retaddr, dr_mcontext_t *mc)
 {
-    /* XXX: safe_read */
-#ifdef WINDOWS
+#if defined(WINDOWS) && defined(X64)
     routine_type_t type = routine->type;
 #endif
-    app_pc base = (app_pc) drwrap_get_arg(wrapcxt, ARGNUM_FREE_PTR(type));
     /* We pass in entry to avoid an extra hashtable lookup */
     uint alloc_type = (entry == NULL) ? malloc_alloc_type(base) :
         malloc_alloc_entry_type(entry);
     uint free_type = malloc_allocator_type(routine);
+    dr_mcontext_t mc_local;
     LOG(3, "alloc/free match test: alloc %x vs free %x %s\n",
         alloc_type, free_type, routine->name);
 
     /* A convenient place to record outermost layer (even if not handled: we want
-     * operator delete) on free
+     * operator delete) on free.  alloc_lean_entry() passes a NULL mc and has
+     * already recorded it.
      */
-    record_mc_for_client(pt, wrapcxt);
+    if (mc != NULL)
+        record_outer_layer(pt, mc->xsp, mc->xbp, retaddr);
 
 #if defined(WINDOWS) && defined(X64)
     /* no mismatch check for RtlFreeStringRoutine */
@@ -4838,8 +5833,15 @@ handle_free_check_mismatch(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
             LOG(2, "ignoring operator mismatch b/c delete==delete[]\n");
             return true;
         }
-        client_mismatched_heap(drwrap_get_retaddr(wrapcxt),
-                               base, drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR),
+        if (mc == NULL) {
+            /* only a report needs the full context */
+            mc_local.size = sizeof(mc_local);
+            mc_local.flags = DR_MC_GPR;
+            dr_get_mcontext(drcontext, &mc_local);
+            mc_local.pc = routine->pc;
+            mc = &mc_local;
+        }
+        client_mismatched_heap(retaddr, base, mc,
                                malloc_alloc_type_name(alloc_type),
                                translate_routine_name(routine->name),
                                malloc_get_client_data(base));
@@ -4866,6 +5868,8 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     bool size_in_zone = (redzone_size(routine) > 0 && alloc_ops.size_in_redzone);
     size_t size = 0;
     malloc_entry_t *entry;
+    malloc_shard_t *locked_shard;
+    bool locked_all;
 
     base = (app_pc)arg;
     real_base = base;
@@ -4898,8 +5902,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     /* We must have synchronized access to avoid races and ensure we report
      * an error on the 2nd free to the same base
      */
-    malloc_lock();
-    entry = malloc_lookup(base);
+    entry = malloc_lock_and_lookup(base, &locked_shard, &locked_all);
     if (entry != NULL &&
         (malloc_entry_is_native_ex(entry, base, pt, false)
 #ifdef WINDOWS
@@ -4911,7 +5914,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
          )) {
         malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_unlock_after_lookup(locked_shard, locked_all);
         return;
     }
     if (pt->in_heap_routine == 1/*alread incremented, so outer*/) {
@@ -4923,7 +5926,9 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
             pt->ignore_next_mismatch = false;
         else
 #endif
-            handle_free_check_mismatch(drcontext, pt, wrapcxt, routine, entry);
+            handle_free_check_mismatch(drcontext, pt, routine, entry, base,
+                                       drwrap_get_retaddr(wrapcxt),
+                                       drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR));
     }
 #ifdef WINDOWS
     else if (pt->ignore_next_mismatch)
@@ -4942,11 +5947,15 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         if (pt->in_realloc) {
             /* when realloc calls free we've already invalidated the heap */
             ASSERT(pt->in_heap_routine > 1, "realloc calling free inconsistent");
-        } else if (!check_valid_heap_block(true/*invalid*/, base, pt, wrapcxt,
-                                           translate_routine_name(routine->name),
-                                           true/*is free()*/)) {
-            pt->expect_lib_to_fail = true;
-        } /* else, probably LFH free which we should ignore */
+        } else {
+            /* the report looks at neighbors in other shards */
+            malloc_lock_all_and_lookup(base, &locked_shard, &locked_all);
+            if (!check_valid_heap_block(true/*invalid*/, base, pt, wrapcxt,
+                                        translate_routine_name(routine->name),
+                                        true/*is free()*/)) {
+                pt->expect_lib_to_fail = true;
+            } /* else, probably LFH free which we should ignore */
+        }
     } else {
         app_pc change_base;
         size_t real_size;
@@ -5036,7 +6045,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 
         malloc_entry_remove(entry);
     }
-    malloc_unlock();
+    malloc_unlock_after_lookup(locked_shard, locked_all);
 
     set_handling_heap_layer(pt, base, size);
 #ifdef WINDOWS
@@ -5481,6 +6490,8 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     size_t size = (size_t) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_SIZE(type));
     app_pc base = (app_pc) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_PTR(type));
     malloc_entry_t *entry;
+    malloc_shard_t *locked_shard;
+    bool locked_all;
     if (base == NULL) {
         /* realloc(NULL, size) == malloc(size) (PR 416535) */
         /* call_site for call;jmp will be jmp, so retaddr better even if post-call */
@@ -5497,11 +6508,10 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         LOG(2, "realloc-pre "PFX" new size %d\n", base, pt->realloc_replace_size);
         return;
     }
-    malloc_lock();
-    entry = malloc_lookup(base);
+    entry = malloc_lock_and_lookup(base, &locked_shard, &locked_all);
     if (entry != NULL && malloc_entry_is_native_ex(entry, base, pt, true)) {
         malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_unlock_after_lookup(locked_shard, locked_all);
         return;
     }
 #ifdef WINDOWS
@@ -5511,7 +6521,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
     if (check_recursive_same_sequence(drcontext, &pt, routine, pt->alloc_size,
                                       size - redzone_size(routine)*2)) {
-        malloc_unlock();
+        malloc_unlock_after_lookup(locked_shard, locked_all);
         return;
     }
     set_handling_heap_layer(pt, base, size);
@@ -5523,7 +6533,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     if (!check_valid_heap_block(entry == NULL, pt->alloc_base, pt, wrapcxt,
                                 routine->name, is_free_routine(type))) {
         pt->expect_lib_to_fail = true;
-        malloc_unlock();
+        malloc_unlock_after_lookup(locked_shard, locked_all);
         return;
     }
     if (redzone_size(routine) > 0) {
@@ -5593,7 +6603,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         pt->alloc_base, pt->realloc_old_size, pt->alloc_size);
     if (alloc_ops.record_allocs && !invalidated)
         malloc_entry_set_valid(entry, false);
-    malloc_unlock();
+    malloc_unlock_after_lookup(locked_shard, locked_all);
 }
 
 static void
@@ -6121,6 +7131,81 @@ alloc_hook(void *wrapcxt, INOUT void **user_data)
     handle_alloc_pre_ex(drcontext, pt, wrapcxt, retaddr, pc, routine);
 }
 
+/* Entry hook for routines with no post wrapper (!intercept_post), called
+ * from a clean call inserted by alloc_event_bb_insert() that passes in the
+ * app's xsp, xbp, and (on x64) first-arg register so that the common case
+ * never copies out the whole mcontext.  This is the no-post subset of
+ * handle_alloc_pre_ex(): these routines never "enter" the heap, so all we
+ * do is check for mismatches and record the outer layer.
+ * only used if alloc_ops.track_heap
+ */
+static void
+alloc_lean_entry(app_pc pc, alloc_routine_entry_t *routine, reg_t xsp, reg_t xbp
+                 _IF_X64(reg_t xarg))
+{
+    void *drcontext = dr_get_current_drcontext();
+    cls_alloc_t *pt = (cls_alloc_t *) drmgr_get_cls_field(drcontext, cls_idx_alloc);
+    alloc_routine_entry_t routine_local;
+    app_pc retaddr, arg0;
+    if (alloc_ops.conservative) {
+        /* see handle_alloc_pre_ex() */
+        if (!get_alloc_entry(pc, &routine_local)) {
+            ASSERT(false, "fatal: can't find alloc entry");
+            return;
+        }
+        routine = &routine_local;
+    }
+    ASSERT(routine != NULL && !routine->intercept_post, "invalid lean entry");
+    retaddr = get_retaddr_at_entry(xsp);
+    LOG(2, "entering lean alloc routine "PFX" %s type=%d rec=%d\n",
+        pc, routine->name, routine->type, pt->in_heap_routine);
+
+    if (is_delete_routine(routine->type)) {
+        if (pt->in_heap_routine == 0) {
+            /* we only use lean entry for cdecl-style routines */
+#ifdef X64
+            arg0 = (app_pc) xarg;
+#else
+            arg0 = NULL;
+            if (!safe_read((void *)(xsp + sizeof(void*)), sizeof(arg0), &arg0))
+                LOG(1, "WARNING: unable to read arg at routine entry "PFX"\n", xsp);
+#endif
+            /* see handle_alloc_pre_ex() */
+            record_outer_layer(pt, xsp, xbp, retaddr);
+            handle_free_check_mismatch(drcontext, pt, routine, NULL, arg0, retaddr,
+                                       NULL);
+#ifdef WINDOWS
+            pt->ignore_next_mismatch = false; /* just in case */
+#endif
+            pt->allocator = 0; /* in case missed alloc post */
+        }
+    }
+#ifdef WINDOWS
+    else if (routine->type == HEAP_ROUTINE_DebugHeapDelete) {
+        /* see handle_alloc_pre_ex() */
+        pt->ignore_next_mismatch = true;
+    }
+#endif
+}
+
+static bool
+is_lean_entry_routine(app_pc pc, OUT alloc_routine_entry_t **routine)
+{
+    alloc_routine_entry_t *e;
+    bool res = false;
+    if (!lean_entry_filter_test(pc))
+        return false;
+    dr_mutex_lock(alloc_routine_lock);
+    e = hashtable_lookup(&alloc_routine_table, (void *)pc);
+    if (e != NULL && e->lean_entry) {
+        res = true;
+        if (routine != NULL)
+            *routine = e;
+    }
+    dr_mutex_unlock(alloc_routine_lock);
+    return res;
+}
+
 #ifdef WINDOWS
 static void
 alloc_wrap_exception(void *wrapcxt, void OUT **user_data)
@@ -6226,7 +7311,11 @@ handle_alloc_pre_ex(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
                 /* N.B.: should be called even if not reporting mismatches as it also
                  * records the outer layer (i#913)
                  */
-                handle_free_check_mismatch(drcontext, pt, wrapcxt, routine, NULL);
+                handle_free_check_mismatch(drcontext, pt, routine, NULL,
+                                           (app_pc) drwrap_get_arg
+                                           (wrapcxt, ARGNUM_FREE_PTR(type)),
+                                           call_site,
+                                           drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR));
 #ifdef WINDOWS
                 pt->ignore_next_mismatch = false; /* just in case */
 #endif
@@ -6457,7 +7546,7 @@ bool
 alloc_entering_alloc_routine(app_pc pc)
 {
     return (drwrap_is_wrapped(pc, alloc_hook, handle_alloc_post) ||
-            drwrap_is_wrapped(pc, alloc_hook, NULL));
+            is_lean_entry_routine(pc, NULL));
 }
 
 bool
@@ -6473,6 +7562,16 @@ alloc_exiting_alloc_routine(app_pc pc)
     return drwrap_is_post_wrap(pc);
 }
 
+static dr_emit_flags_t
+alloc_event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
+                       bool for_trace, bool translating)
+{
+    /* a trace or a re-translation implies an earlier block from here */
+    if (!for_trace && !translating)
+        alloc_check_pending_search(dr_fragment_app_pc(tag));
+    return DR_EMIT_DEFAULT;
+}
+
 static dr_emit_flags_t
 alloc_event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
                         bool for_trace, bool translating, OUT void **user_data)
@@ -6495,8 +7594,31 @@ alloc_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *inst
                       bool for_trace, bool translating, void *user_data)
 {
     app_pc pc = instr_get_app_pc(inst);
+    alloc_routine_entry_t *routine;
     if (pc == NULL)
         return DR_EMIT_DEFAULT;
+    /* We check every instr, not just the block start, so that we do not
+     * depend on elision being off: an elided call leaves the routine entry
+     * mid-block with its retaddr already pushed.
+     */
+    if (alloc_ops.track_heap && instr_ok_to_mangle(inst) &&
+        is_lean_entry_routine(pc, &routine)) {
+        /* At a routine entry the arithmetic flags are dead, none of these
+         * routines takes floating-point args, and our C code preserves the
+         * callee-saved xmm registers, so as with DRWRAP_FAST_CLEANCALLS we
+         * skip saving flags and xmm state.  On x64 the first arg is passed
+         * in too; on x86 alloc_lean_entry() reads it from the stack.
+         */
+        dr_insert_clean_call_ex(drcontext, bb, inst, (void *)alloc_lean_entry,
+                                DR_CLEANCALL_NOSAVE_FLAGS | DR_CLEANCALL_NOSAVE_XMM,
+                                IF_X64_ELSE(5, 4),
+                                OPND_CREATE_INTPTR((ptr_int_t)pc),
+                                OPND_CREATE_INTPTR((ptr_int_t)routine),
+                                opnd_create_reg(DR_REG_XSP),
+                                opnd_create_reg(DR_REG_XBP)
+                                _IF_X64(opnd_create_reg(IF_WINDOWS_ELSE
+                                                        (DR_REG_XCX, DR_REG_XDI))));
+    }
 #ifdef WINDOWS
     if (instr_get_opcode(inst) == OP_int &&
         opnd_get_immed_int(instr_get_src(inst, 0)) == CBRET_INTERRUPT_NUM) {
@@ -33,6 +33,8 @@
 
 /* priority of the analysis + insert routines */
 #define DRMGR_PRIORITY_INSERT_ALLOC  2020
+/* priority of the app2app routine: must precede drwrap's */
+#define DRMGR_PRIORITY_APP2APP_ALLOC -600
 
 /* All mallocs we've seen align to 8.  If this is changed, update malloc_hash(). */
 #define MALLOC_CHUNK_ALIGNMENT 8
@@ -73,12 +75,28 @@ typedef struct _alloc_options_t {
     /* replace instead of wrap existing? */
     bool replace_malloc;
     /* only used with -replace_malloc: */
-    bool external_headers; /* headers in hashtable instead of inside redzone */
+    bool external_headers; /* headers in side tables instead of inside redzone */
     uint delay_frees;
     uint delay_frees_maxsz;
+    /* chunks at least this big end at a guard page (0 disables) */
+    size_t guard_page_min;
 
     bool skip_msvc_importers;
 
+    /* Wrap mode only: split the malloc table into separately locked shards. */
+    bool shard_malloc_table;
+    /* Whether the client's client_{add,remove}_malloc_* and
+     * client_malloc_data_free() callbacks do their own synchronization.
+     * If not, we serialize them with a lock of their own, as table locks
+     * alone do not.
+     */
+    bool malloc_callbacks_synched;
+
+    /* Defer searching a module for alloc routines until its first execution.
+     * libc and the executable are still searched at load time.
+     */
+    bool lazy_routine_search;
+
     /* Add new options here */
 } alloc_options_t;
 
@@ -122,6 +140,9 @@ extern uint wrap_post;
 extern uint num_mallocs;
 extern uint num_large_mallocs;
 extern uint num_frees;
+extern uint num_zeroed_fresh;
+extern uint num_realloc_grown_in_place;
+extern uint num_guard_chunks;
 #endif
 
 /* caller should call drmgr_init() and drwrap_init() */
@@ -199,6 +220,22 @@ malloc_clear_client_flag(app_pc start, uint client_flag);
 void
 malloc_iterate(malloc_iter_cb_t cb, void *iter_data);
 
+/* Calls cb on each live malloc that overlaps [start, end), i.e., whose
+ * [start, end) does.  Unlike malloc_iterate(), this does not walk every
+ * malloc, and cb is not called with the malloc lock held, so the entries can
+ * change underneath it.  Should not be called from a per-malloc client
+ * callback.  When wrapping, mallocs are visited in address order.
+ */
+void
+malloc_iterate_range(app_pc start, app_pc end, malloc_iter_cb_t cb, void *iter_data);
+
+/* Returns whether malloc_iterate_range() is cheap enough for a lookup per
+ * pointer.  It is not when replacing, where each call walks the chunks of
+ * every arena it overlaps up to the range.
+ */
+bool
+malloc_iterate_range_is_indexed(void);
+
 typedef size_t (*alloc_size_func_t)(void *);
 
 #ifdef LINUX
@@ -242,6 +279,18 @@ alloc_replace_overlaps_delayed_free(byte *start, byte *end,
                                     byte **free_end OUT,
                                     void **client_data OUT);
 
+/* Returns whether addr is in the guard page of a live guard chunk or in a
+ * freed guard chunk that has not yet been unmapped (alloc_ops.guard_page_min)
+ */
+bool
+alloc_replace_in_guard_page(byte *addr);
+
+/* Like alloc_replace_in_guard_page(), but also makes addr's page accessible,
+ * so that a faulting access to it can be re-executed.
+ */
+bool
+alloc_replace_unprotect_guard_page(byte *addr);
+
 /***************************************************************************
  * CLIENT CALLBACKS
  */
@@ -306,6 +306,8 @@ typedef struct _malloc_interface_t {
     bool (*malloc_set_client_flag)(app_pc start, uint client_flag);
     bool (*malloc_clear_client_flag)(app_pc start, uint client_flag);
     void (*malloc_iterate)(malloc_iter_cb_t cb, void *iter_data);
+    void (*malloc_iterate_range)(app_pc start, app_pc end, malloc_iter_cb_t cb,
+                                 void *iter_data);
     void (*malloc_intercept)(app_pc pc, routine_type_t type, alloc_routine_entry_t *e);
     void (*malloc_unintercept)(app_pc pc, routine_type_t type, alloc_routine_entry_t *e);
     /* For storing data per malloc routine set.  The pc is one routine from the set.
@@ -338,7 +340,7 @@ alloc_routine_set_get_user_data(alloc_routine_entry_t *e);
  * for large mallocs.  Putting all mallocs in a tree instead of a table
  * is too expensive (PR 535568).
  */
-#define LARGE_MALLOC_MIN_SIZE 12*1024
+#define LARGE_MALLOC_MIN_SIZE (12*1024)
 
 void
 malloc_large_add(byte *start, size_t size);
@@ -51,7 +51,8 @@
  *
  * Design:
  * + for !alloc_ops.external_headers, header sits inside redzone;
- *   for alloc_ops.external_headers, header is in a hashtable
+ *   for alloc_ops.external_headers, header is a record in a per-arena
+ *   dense array (or, for mmapped chunks, a hashtable) outside of app memory
  * + redzones are shared among adjacent allocs and are centered to
  *   reduce the likelihood of corruption from over/underflow:
  *
@@ -68,8 +69,8 @@
  *   (though worse alloc re-use), and searches start at the front and
  *   take the first fit.
  *   we can add fancier algorithms in the future.
- * + for alloc_ops.external_headers, free list entries use headers that
- *   are co-located with the chunk headers
+ * + for alloc_ops.external_headers, free list entries are the chunk
+ *   records themselves
  * + for !alloc_ops.external_headers, free list entry headers begin where
  *   regular headers begin, in the middle of the redzone.
  */
@@ -82,6 +83,7 @@
 #include "alloc.h"
 #include "alloc_private.h"
 #include "heap.h"
+#include "redblack.h"
 #include <string.h> /* memcpy */
 
 #ifdef LINUX
@@ -101,7 +103,9 @@
 #define ARENA_INITIAL_COMMIT  CHUNK_MIN_MMAP
 #define ARENA_INITIAL_SIZE  4*1024*1024
 
-/* we only support allocation sizes under 4GB */
+/* Arena chunks are always under 4GB.  On X64, mmapped and pre-us chunks can
+ * be larger: see the size accessors below.
+ */
 typedef uint heapsz_t;
 
 /* each free list bucket contains freed chunks of at least its bucket size
@@ -121,6 +125,7 @@ enum {
     /* MALLOC_RESERVED_6 could be used to indicate presence of prev
      * free chunk for coalescing (i#948)
      */
+    CHUNK_GUARD       = MALLOC_RESERVED_7, /* mmap chunk ending at a guard page */
 };
 
 #define HEADER_MAGIC 0x5244 /* "DR" */
@@ -147,30 +152,77 @@ typedef struct _chunk_header_t {
      */
     ushort magic;
 #ifdef X64
-    /* compiler will add anyawy: just making explicit.  we need the header
-     * size to be aligned to 8 so we can't pack.  for alloc_ops.external_headers
-     * we eat this overhead to provide runtime flexibility w/ the same
-     * data struct as we don't need it there.
+    /* The top bits of request_size and alloc_size, for chunks of 4GB or more.
+     * These fill what would otherwise be padding (the header size must be
+     * aligned to 8), so the header does not grow.  16 bits give us 48-bit
+     * sizes, which covers the user address space.
      */
-    uint pad;
+    ushort request_size_hi;
+    ushort alloc_size_hi;
 #endif
 } chunk_header_t;
 
 #define HEADER_SIZE sizeof(chunk_header_t)
 
+#ifdef X64
+# define CHUNK_MAX_SIZE (((size_t)1 << 48) - 1)
+#else
+# define CHUNK_MAX_SIZE UINT_MAX
+#endif
+
+/* Code that can see mmapped or pre-us chunks must use these accessors.
+ * Code that only deals with arena chunks can use the heapsz_t fields directly.
+ */
+static inline size_t
+chunk_request_size(chunk_header_t *head)
+{
+#ifdef X64
+    return ((size_t)head->request_size_hi << 32) | head->request_size;
+#else
+    return head->request_size;
+#endif
+}
+
+static inline size_t
+chunk_alloc_size(chunk_header_t *head)
+{
+#ifdef X64
+    return ((size_t)head->alloc_size_hi << 32) | head->alloc_size;
+#else
+    return head->alloc_size;
+#endif
+}
+
+static inline void
+chunk_set_request_size(chunk_header_t *head, size_t size)
+{
+    ASSERT(size <= CHUNK_MAX_SIZE, "chunk size overflow");
+    head->request_size = (heapsz_t) size;
+#ifdef X64
+    head->request_size_hi = (ushort) (size >> 32);
+#endif
+}
+
+static inline void
+chunk_set_alloc_size(chunk_header_t *head, size_t size)
+{
+    ASSERT(size <= CHUNK_MAX_SIZE, "chunk size overflow");
+    head->alloc_size = (heapsz_t) size;
+#ifdef X64
+    head->alloc_size_hi = (ushort) (size >> 32);
+#endif
+}
+
 /* if redzone is too small, header sticks beyond it */
 static heapsz_t header_beyond_redzone;
 /* we place header in the middle */
 static heapsz_t redzone_beyond_header;
 
 /* free list header for both regular and var-size chunk.  each chunk
- * is at least 8 bytes so we can fit both the next pointer and the
- * only-used-for-alloc_ops.external_headers chunk pointer, simplifying
+ * is at least 8 bytes so we can fit the next pointer, simplifying
  * the code by having one header type.
- *
- * FIXME: for x64 chunk ptr doesn't fit: so either need a separate
- * struct used for hashtable only that has the chunk ptr, or need
- * to set CHUNK_MIN_SIZE to 16 for x64
+ * For alloc_ops.external_headers this is also the chunk record itself,
+ * which lives outside of app memory and so has room for the chunk pointer.
  */
 typedef struct _free_header_t {
     chunk_header_t head;
@@ -186,10 +238,37 @@ typedef struct _free_lists_t {
     free_header_t *last[NUM_FREE_LISTS];
 } free_lists_t;
 
+#ifdef STATISTICS
+uint num_zeroed_fresh;
+uint num_realloc_grown_in_place;
+uint num_guard_chunks;
+#endif
+
 /* counters for delayed frees.  protected by malloc lock. */
 static uint delayed_chunks;
 static size_t delayed_bytes;
 
+/* Freed guard chunks (alloc_ops.guard_page_min) are kept mapped but
+ * inaccessible in this FIFO, so that use-after-free faults.  These can come
+ * from any arena, so the FIFO has its own lock and its own -delay_frees and
+ * -delay_frees_maxsz budget, apart from delayed_chunks and delayed_bytes.
+ * The tree indexes the same entries by address for the fault handler.
+ * guard_free_lock also covers removing a live guard chunk's heap region
+ * on free, so that guard_page_lookup() never acts on a chunk being freed.
+ */
+typedef struct _guard_free_t {
+    byte *map;
+    size_t map_size;
+    struct _guard_free_t *next;
+} guard_free_t;
+
+static guard_free_t *guard_free_front;
+static guard_free_t *guard_free_last;
+static rb_tree_t *guard_free_tree;
+static uint guard_free_chunks;
+static size_t guard_free_bytes;
+static void *guard_free_lock;
+
 #ifdef LINUX
 /* we assume we're the sole users of the brk (after pre-us allocs) */
 static byte *pre_us_brk;
@@ -207,6 +286,35 @@ typedef struct _arena_header_t {
     free_lists_t *free_list;
     void *lock;
     uint flags;
+    /* Memory in [max(zero_start, next_chunk), commit_end) has never been handed
+     * out since the OS committed it and is thus known to be zero.  This only
+     * differs from start_chunk for the initial brk arena, whose first page can
+     * contain stale data from the pre-us heap.
+     */
+    byte *zero_start;
+    /* For alloc_ops.external_headers: chunk records are bump-allocated in
+     * fixed-size segments and never freed back (free chunks keep theirs on
+     * the free lists, and records of chunks absorbed by a neighbor are
+     * recycled through free_record), so they never move.  chunk_index has one
+     * entry per chunk_granule_shift-sized granule starting at start_chunk,
+     * holding the 1-based number of the record of the chunk that starts in
+     * that granule, or 0.  The minimum chunk stride is at least one granule
+     * so there is never more than one.  The index and the segment table
+     * grow by copying, with the old copies kept until the arena is freed
+     * for readers that do not hold the arena lock.  Writers publish each
+     * new array before its size, and a record before its index entry, so
+     * that such readers see consistent values.
+     */
+    uint *volatile chunk_index;
+    volatile size_t index_size;
+    free_header_t **volatile record_segs;
+    size_t record_segs_size;
+    uint num_records;
+    /* 1-based number of a recycled record, or 0.  A recycled record's
+     * alloc_size holds the number of the next one.
+     */
+    uint free_record;
+    struct _retired_array_t *retired;
 #ifdef WINDOWS
     uint magic;
     /* we need to iterate arenas belonging to one (non-default) Heap */
@@ -242,12 +350,49 @@ static arena_header_t *cur_arena;
 #define PRE_US_TABLE_HASH_BITS 8
 static hashtable_t pre_us_table;
 
-/* XXX i#879: for pattern mode we don't want co-located headers and
- * instead want a hashtable of live allocs (free are in free lists
- * and/or rbtree).
- * Cleaner to have own table here and not try to use the alloc.c malloc-wrap table
- * though we do want the same hash tuning.
+/* For alloc_ops.external_headers, records for mmapped chunks, which are not
+ * inside any arena, live in this table keyed by chunk start.  Contains
+ * free_header_t entries so that ptr_from_header() works the same for them.
+ * Synchronized as the chunks can belong to any arena.
+ */
+#define MMAP_HEADER_TABLE_HASH_BITS 8
+static hashtable_t mmap_header_table;
+
+/* For alloc_ops.external_headers: log2 of the arena chunk index granule */
+static uint chunk_granule_shift;
+
+/* For alloc_ops.external_headers: records per arena record segment */
+#define RECORD_SEG_SHIFT 10
+#define RECORD_SEG_COUNT (1 << RECORD_SEG_SHIFT)
+
+/* For alloc_ops.external_headers: maps each ARENA_MAP_UNIT_SIZE unit of the
+ * address space to the arena covering it, so that header_from_ptr() can find
+ * the arena of any pointer without a lock.  A unit touched by more than one
+ * arena holds ARENA_MAP_SHARED and is answered from the heap region tree.
+ * Updated under arena_map_lock; the second-level tables are never freed
+ * before exit, so readers need no lock.
  */
+#define ARENA_MAP_UNIT_SHIFT 16
+#define ARENA_MAP_UNIT_SIZE (1 << ARENA_MAP_UNIT_SHIFT)
+/* each second-level table covers 4GB */
+#define ARENA_MAP_L2_BITS 16
+#define ARENA_MAP_L2_SIZE (1 << ARENA_MAP_L2_BITS)
+#ifdef X64
+/* user-mode addresses fit in 48 bits */
+# define ARENA_MAP_L1_SIZE (1 << (48 - ARENA_MAP_UNIT_SHIFT - ARENA_MAP_L2_BITS))
+#else
+# define ARENA_MAP_L1_SIZE 1
+#endif
+#define ARENA_MAP_SHARED ((arena_header_t *)(ptr_uint_t)1)
+static arena_header_t **volatile *arena_map;
+static void *arena_map_lock;
+
+/* A replaced copy of an arena's chunk index or record segment table */
+typedef struct _retired_array_t {
+    void *array;
+    size_t size;
+    struct _retired_array_t *next;
+} retired_array_t;
 
 /***************************************************************************
  * utility routines
@@ -412,26 +557,48 @@ os_large_free(byte *map, size_t map_size)
 #endif
 }
 
+/* Makes [map, map + map_size) inaccessible, or readable and writable */
+static bool
+os_large_protect(byte *map, size_t map_size, bool accessible)
+{
+    ASSERT(ALIGNED(map, PAGE_SIZE), "invalid mmap base");
+    ASSERT(ALIGNED(map_size, PAGE_SIZE), "invalid mmap size");
+#ifdef LINUX
+    {
+        int success = (int) raw_syscall(SYS_mprotect, 3, (ptr_int_t)map, map_size,
+                                        accessible ? PROT_READ|PROT_WRITE : PROT_NONE);
+        LOG(3, "%s "PFX" size="PIFX" => %d\n",  __FUNCTION__, map, map_size, success);
+        return (success == 0);
+    }
+#else
+    LOG(3, "%s "PFX" size="PIFX"\n", __FUNCTION__, map, map_size);
+    return dr_memory_protect(map, map_size, accessible ?
+                             DR_MEMPROT_READ|DR_MEMPROT_WRITE : DR_MEMPROT_NONE);
+#endif
+}
+
 static void
 notify_client_alloc(bool call_handle, void *drcontext, byte *ptr,
                     chunk_header_t *head, dr_mcontext_t *mc,
                     bool zeroed, bool realloc, app_pc caller)
 {
-    head->user_data = client_add_malloc_pre(ptr, ptr + head->request_size,
-                                            ptr + head->alloc_size,
+    size_t request_size = chunk_request_size(head);
+    size_t alloc_size = chunk_alloc_size(head);
+    head->user_data = client_add_malloc_pre(ptr, ptr + request_size,
+                                            ptr + alloc_size,
                                             head->user_data, mc, caller);
-    client_add_malloc_post(ptr, ptr + head->request_size,
-                           ptr + head->alloc_size, head->user_data);
+    client_add_malloc_post(ptr, ptr + request_size,
+                           ptr + alloc_size, head->user_data);
     if (call_handle) {
         ASSERT(drcontext != NULL, "invalid arg");
-        client_handle_malloc(drcontext, ptr, head->request_size,
+        client_handle_malloc(drcontext, ptr, request_size,
                              /* XXX: pattern wants us to subtract redzone
                               * size for real_base but that would result in it clobbering
                               * our header: so we're just incompatible w/ pattern mode
                               * (checked up front in alloc_ops.c).
                               * xref i#879 on an allocator for pattern mode.
                               */
-                             ptr, head->alloc_size, zeroed, realloc, mc);
+                             ptr, alloc_size, zeroed, realloc, mc);
     }
 }
 
@@ -439,13 +606,225 @@ notify_client_alloc(bool call_handle, void *drcontext, byte *ptr,
  * core allocation routines
  */
 
+static inline uint
+arena_chunk_granule(arena_header_t *arena, byte *ptr)
+{
+    return (uint) ((ptr - arena->start_chunk) >> chunk_granule_shift);
+}
+
+/* For alloc_ops.external_headers: returns the record of the chunk starting
+ * at ptr in arena, or NULL if there is none.  Caller must ensure ptr is in
+ * [arena->start_chunk, arena->next_chunk).
+ */
+static inline chunk_header_t *
+arena_chunk_record(arena_header_t *arena, byte *ptr)
+{
+    uint granule = arena_chunk_granule(arena, ptr);
+    uint num;
+    free_header_t *rec;
+    /* The volatile fields are read in the reverse of the order in which
+     * arena_chunk_record_new() publishes them.  Loads are not reordered
+     * with other loads on x86, so a larger index_size means the grown
+     * chunk_index is visible, and a non-zero entry means its record is.
+     */
+    if (granule >= arena->index_size / sizeof(*arena->chunk_index))
+        return NULL;
+    num = ((volatile uint *)arena->chunk_index)[granule];
+    if (num == 0)
+        return NULL;
+    num--;
+    rec = &arena->record_segs[num >> RECORD_SEG_SHIFT][num & (RECORD_SEG_COUNT - 1)];
+    return (((volatile free_header_t *)rec)->chunk == ptr) ? &rec->head : NULL;
+}
+
+/* Returns a copy of array grown to new_size bytes, with the new tail zeroed,
+ * and retires the old array.  Caller must hold the arena lock.
+ */
+static void *
+arena_array_grow(arena_header_t *arena, void *array, size_t old_size,
+                 size_t new_size)
+{
+    byte *grown = nonheap_alloc(new_size, DR_MEMPROT_READ | DR_MEMPROT_WRITE,
+                                HEAPSTAT_MISC);
+    if (array != NULL) {
+        retired_array_t *old = (retired_array_t *)
+            global_alloc(sizeof(*old), HEAPSTAT_MISC);
+        memcpy(grown, array, old_size);
+        old->array = array;
+        old->size = old_size;
+        old->next = arena->retired;
+        arena->retired = old;
+    }
+    return grown;
+}
+
+/* For alloc_ops.external_headers: creates a record for a new chunk at ptr,
+ * which must be arena->next_chunk.  Caller must hold the arena lock.
+ */
+static chunk_header_t *
+arena_chunk_record_new(arena_header_t *arena, byte *ptr)
+{
+    uint granule = arena_chunk_granule(arena, ptr);
+    uint num;
+    uint seg;
+    free_header_t *rec;
+    if (granule >= arena->index_size / sizeof(*arena->chunk_index)) {
+        /* cover the whole committed arena, to grow rarely */
+        size_t new_size = ALIGN_FORWARD
+            ((arena_chunk_granule(arena, arena->commit_end) + 1) *
+             sizeof(*arena->chunk_index), PAGE_SIZE);
+        if (new_size < arena->index_size * 2)
+            new_size = arena->index_size * 2;
+        arena->chunk_index = (uint *)
+            arena_array_grow(arena, arena->chunk_index, arena->index_size, new_size);
+        MEMORY_STORE_BARRIER(); /* publish the array before its size */
+        arena->index_size = new_size;
+    }
+    if (arena->free_record != 0) {
+        num = arena->free_record - 1;
+        rec = &arena->record_segs[num >> RECORD_SEG_SHIFT][num & (RECORD_SEG_COUNT - 1)];
+        arena->free_record = (uint) rec->head.alloc_size;
+        rec->chunk = ptr;
+        MEMORY_STORE_BARRIER(); /* publish the record before its index entry */
+        arena->chunk_index[granule] = num + 1;
+        return &rec->head;
+    }
+    num = arena->num_records;
+    seg = num >> RECORD_SEG_SHIFT;
+    if ((num & (RECORD_SEG_COUNT - 1)) == 0) {
+        if (seg >= arena->record_segs_size / sizeof(*arena->record_segs)) {
+            size_t new_size = (arena->record_segs_size == 0) ? PAGE_SIZE :
+                arena->record_segs_size * 2;
+            arena->record_segs = (free_header_t **)
+                arena_array_grow(arena, arena->record_segs, arena->record_segs_size,
+                                 new_size);
+            arena->record_segs_size = new_size;
+        }
+        /* DR memory, so that the leak scan does not see the records */
+        arena->record_segs[seg] = (free_header_t *)
+            nonheap_alloc(RECORD_SEG_COUNT * sizeof(free_header_t),
+                          DR_MEMPROT_READ | DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    }
+    rec = &arena->record_segs[seg][num & (RECORD_SEG_COUNT - 1)];
+    rec->chunk = ptr;
+    arena->num_records++;
+    MEMORY_STORE_BARRIER(); /* publish the record before its index entry */
+    arena->chunk_index[granule] = arena->num_records;
+    return &rec->head;
+}
+
+/* For alloc_ops.external_headers: removes the record of the chunk at ptr,
+ * which is no longer a chunk start, and recycles it.  Caller must hold the
+ * arena lock.
+ */
+static void
+arena_chunk_record_remove(arena_header_t *arena, byte *ptr)
+{
+    uint granule = arena_chunk_granule(arena, ptr);
+    uint num = arena->chunk_index[granule];
+    free_header_t *rec;
+    ASSERT(num != 0, "chunk has no record");
+    arena->chunk_index[granule] = 0;
+    num--;
+    rec = &arena->record_segs[num >> RECORD_SEG_SHIFT][num & (RECORD_SEG_COUNT - 1)];
+    /* a racing reader holding the old number must not match this record */
+    rec->chunk = NULL;
+    rec->head.alloc_size = arena->free_record;
+    arena->free_record = num + 1;
+}
+
+/* Caller must hold arena_map_lock */
+static void
+arena_map_set(byte *unit_start, arena_header_t *arena, bool add)
+{
+    ptr_uint_t unit = (ptr_uint_t)unit_start >> ARENA_MAP_UNIT_SHIFT;
+    arena_header_t **l2;
+    if (unit >> ARENA_MAP_L2_BITS >= ARENA_MAP_L1_SIZE)
+        return;
+    l2 = arena_map[unit >> ARENA_MAP_L2_BITS];
+    if (l2 == NULL) {
+        if (!add)
+            return;
+        /* zeroed by the allocator, so ready to publish */
+        l2 = (arena_header_t **)
+            nonheap_alloc(ARENA_MAP_L2_SIZE * sizeof(*l2),
+                          DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+        arena_map[unit >> ARENA_MAP_L2_BITS] = l2;
+    }
+    unit &= ARENA_MAP_L2_SIZE - 1;
+    if (add)
+        l2[unit] = (l2[unit] == NULL || l2[unit] == arena) ? arena : ARENA_MAP_SHARED;
+    else if (l2[unit] == arena)
+        l2[unit] = NULL;
+    /* else leave ARENA_MAP_SHARED in place: the tree still answers it */
+}
+
+/* For alloc_ops.external_headers: records that arena covers, or with !add no
+ * longer covers, [start, end)
+ */
+static void
+arena_map_update(arena_header_t *arena, byte *start, byte *end, bool add)
+{
+    byte *unit, *last;
+    /* Windows libc-default Heaps can be destroyed after our exit */
+    if (arena_map == NULL || end <= start)
+        return;
+    last = (byte *) ALIGN_BACKWARD(end - 1, ARENA_MAP_UNIT_SIZE);
+    dr_mutex_lock(arena_map_lock);
+    for (unit = (byte *) ALIGN_BACKWARD(start, ARENA_MAP_UNIT_SIZE); ;
+         unit += ARENA_MAP_UNIT_SIZE) {
+        arena_map_set(unit, arena, add);
+        if (unit == last)
+            break;
+    }
+    dr_mutex_unlock(arena_map_lock);
+}
+
+static inline arena_header_t *
+arena_map_lookup(byte *ptr)
+{
+    ptr_uint_t unit = (ptr_uint_t)ptr >> ARENA_MAP_UNIT_SHIFT;
+    arena_header_t **l2;
+    if (arena_map == NULL || unit >> ARENA_MAP_L2_BITS >= ARENA_MAP_L1_SIZE)
+        return NULL;
+    l2 = arena_map[unit >> ARENA_MAP_L2_BITS];
+    if (l2 == NULL)
+        return NULL;
+    return ((arena_header_t *volatile *)l2)[unit & (ARENA_MAP_L2_SIZE - 1)];
+}
+
+/* For alloc_ops.external_headers: returns the arena containing ptr, or NULL */
+static inline arena_header_t *
+arena_for_ptr(byte *ptr)
+{
+    arena_header_t *arena;
+    /* the common case needs no lookup */
+    if (ptr >= cur_arena->start_chunk && ptr < cur_arena->next_chunk)
+        return cur_arena;
+    arena = arena_map_lookup(ptr);
+    if (arena == ARENA_MAP_SHARED) {
+        /* rare: a unit where one arena ends and another begins */
+        byte *start;
+        uint flags;
+        if (!heap_region_bounds(ptr, &start, NULL, &flags) ||
+            !TEST(HEAP_ARENA, flags) || TEST(HEAP_PRE_US, flags))
+            return NULL;
+        arena = (arena_header_t *) start;
+    }
+    if (arena != NULL && ptr >= arena->start_chunk && ptr < arena->next_chunk)
+        return arena;
+    return NULL;
+}
+
 static inline chunk_header_t *
 header_from_ptr(void *ptr)
 {
     if (alloc_ops.external_headers) {
-        /* XXX i#879: hashtable lookup */
-        ASSERT(false, "NYI");
-        return NULL;
+        arena_header_t *arena = arena_for_ptr((byte *)ptr);
+        if (arena != NULL)
+            return arena_chunk_record(arena, (byte *)ptr);
+        else
+            return hashtable_lookup(&mmap_header_table, ptr);
     } else {
         if ((ptr_uint_t)ptr < HEADER_SIZE)
             return NULL;
@@ -455,17 +834,50 @@ header_from_ptr(void *ptr)
     }
 }
 
-static inline byte *
-ptr_from_header(chunk_header_t *head)
+/* Like header_from_ptr() but for walking arena, where the caller knows
+ * that ptr is the start of a chunk in arena
+ */
+static inline chunk_header_t *
+arena_chunk_header(arena_header_t *arena, byte *ptr)
 {
     if (alloc_ops.external_headers) {
-        /* XXX i#879: hashtable lookup */
-        ASSERT(false, "NYI");
-        return NULL;
+        chunk_header_t *head = arena_chunk_record(arena, ptr);
+        ASSERT(head != NULL, "arena walk found no chunk record");
+        return head;
     } else
+        return header_from_ptr(ptr);
+}
+
+static inline byte *
+ptr_from_header(chunk_header_t *head)
+{
+    if (alloc_ops.external_headers)
+        return ((free_header_t *)head)->chunk;
+    else
         return (byte *)head + redzone_beyond_header + HEADER_SIZE;
 }
 
+/* The heap region of an mmapped chunk starts at the same distance before
+ * the chunk whether or not it has a guard page, so that alloc_iter_own_arena()
+ * can find the chunk from the region start.
+ */
+static inline byte *
+mmap_chunk_region_start(byte *ptr)
+{
+    return ptr - alloc_ops.redzone_size - header_beyond_redzone;
+}
+
+/* Returns the bounds of the mapping that holds the mmapped chunk at ptr */
+static inline void
+mmap_chunk_bounds(byte *ptr, chunk_header_t *head, byte **map OUT, size_t *map_size OUT)
+{
+    byte *end = ptr + chunk_alloc_size(head) +
+        (TEST(CHUNK_GUARD, head->flags) ? PAGE_SIZE : alloc_ops.redzone_size);
+    ASSERT(TEST(CHUNK_MMAP, head->flags), "not an mmapped chunk");
+    *map = (byte *) ALIGN_BACKWARD(mmap_chunk_region_start(ptr), PAGE_SIZE);
+    *map_size = end - *map;
+}
+
 /* Pass in result of header_from_ptr() as 2nd arg, but don't de-reference it!
  * Returns true for both live mallocs and chunks in delay free lists
  */
@@ -485,7 +897,9 @@ is_valid_chunk(void *ptr, chunk_header_t *head)
      * + could have client_ callout that checks shadow memory
      */
     if (alloc_ops.external_headers) {
-        /* XXX i#879: need to look in delay free rbtree too */
+        /* Records are only found for actual chunk starts, including
+         * chunks on the delayed free lists
+         */
         return head != NULL;
     } else {
         /* Unlike a regular malloc library, we cannot afford to crash on
@@ -539,13 +953,8 @@ ptr_is_in_arena(byte *ptr, arena_header_t *arena)
 static bool
 is_live_alloc(void *ptr, arena_header_t *arena, chunk_header_t *head)
 {
-    bool live = false;
-    if (alloc_ops.external_headers) {
-        live = (head != NULL);
-    } else {
-        live = (is_valid_chunk(ptr, head) &&
-                !TEST(CHUNK_FREED, head->flags));
-    }
+    bool live = (is_valid_chunk(ptr, head) &&
+                 !TEST(CHUNK_FREED, head->flags));
     return (live &&
             /* large allocs are their own arenas */
             (TEST(CHUNK_MMAP, head->flags) || ptr_is_in_arena(ptr, arena)));
@@ -589,6 +998,23 @@ arena_init(arena_header_t *arena, arena_header_t *parent)
         ALIGN_FORWARD(header_size, CHUNK_ALIGNMENT) +
         alloc_ops.redzone_size + header_beyond_redzone;
     arena->next_chunk = arena->start_chunk;
+    arena->zero_start = arena->start_chunk;
+#ifdef LINUX
+    if ((byte *)arena == pre_us_brk) {
+        arena->zero_start = (byte *)
+            ALIGN_FORWARD(arena->start_chunk, PAGE_SIZE);
+    }
+#endif
+    /* external header records are created on demand */
+    arena->chunk_index = NULL;
+    arena->index_size = 0;
+    arena->record_segs = NULL;
+    arena->record_segs_size = 0;
+    arena->num_records = 0;
+    arena->free_record = 0;
+    arena->retired = NULL;
+    arena_map_update(arena, (byte *)arena, arena->reserve_end > arena->commit_end ?
+                     arena->reserve_end : arena->commit_end, true);
 #ifdef WINDOWS
     arena->magic = HEADER_MAGIC;
     arena->next_arena = NULL;
@@ -607,29 +1033,46 @@ arena_free(arena_header_t *arena)
 {
     if (TEST(ARENA_MAIN, arena->flags))
         dr_recurlock_destroy(arena->lock);
+    arena_map_update(arena, (byte *)arena, arena->reserve_end > arena->commit_end ?
+                     arena->reserve_end : arena->commit_end, false);
+    if (arena->chunk_index != NULL) {
+        uint seg;
+        nonheap_free(arena->chunk_index, arena->index_size, HEAPSTAT_MISC);
+        for (seg = 0; seg * RECORD_SEG_COUNT < arena->num_records; seg++) {
+            nonheap_free(arena->record_segs[seg],
+                         RECORD_SEG_COUNT * sizeof(free_header_t), HEAPSTAT_MISC);
+        }
+        nonheap_free(arena->record_segs, arena->record_segs_size, HEAPSTAT_MISC);
+        while (arena->retired != NULL) {
+            retired_array_t *old = arena->retired;
+            arena->retired = old->next;
+            nonheap_free(old->array, old->size, HEAPSTAT_MISC);
+            global_free(old, sizeof(*old), HEAPSTAT_MISC);
+        }
+    }
 #ifdef LINUX
     if (arena->reserve_end != cur_brk)
 #endif
         os_large_free((byte *)arena, arena->reserve_end - (byte *)arena);
 }
 
-/* either extends arena in-place and returns it, or allocates a new arena
- * and returns that.  returns NULL on failure to do either.
+/* extends arena's committed memory in-place by at least add_size.
+ * returns whether successful.
  */
-static arena_header_t *
-arena_extend(arena_header_t *arena, heapsz_t add_size)
+static bool
+arena_extend_in_place(arena_header_t *arena, heapsz_t add_size)
 {
     heapsz_t aligned_add = (heapsz_t) ALIGN_FORWARD(add_size, PAGE_SIZE);
-    arena_header_t *new_arena;
 #ifdef LINUX
     if (arena->commit_end == cur_brk) {
         byte *new_brk = set_brk(cur_brk + aligned_add);
         if (new_brk >= cur_brk + add_size) {
             LOG(2, "\tincreased brk from "PFX" to "PFX"\n", cur_brk, new_brk);
+            arena_map_update(arena, cur_brk, new_brk, true);
             cur_brk = new_brk;
             arena->commit_end = new_brk;
             heap_region_adjust((byte *)arena, new_brk);
-            return arena;
+            return true;
         } else
             LOG(1, "brk cannot expand: switching to mmap\n");
     } else
@@ -641,13 +1084,26 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
         size_t new_size = cur_size + aligned_add;
         if (os_large_alloc_extend((byte *)arena, cur_size, new_size
                                   _IF_WINDOWS(arena_page_prot(arena->flags)))) {
+            arena_map_update(arena, arena->commit_end, (byte *)arena + new_size, true);
             arena->commit_end = (byte *)arena + new_size;
 #ifdef LINUX /* windows already added whole reservation */
             heap_region_adjust((byte *)arena, (byte *)arena + new_size);
 #endif
-            return arena;
+            return true;
         }
     }
+    return false;
+}
+
+/* either extends arena in-place and returns it, or allocates a new arena
+ * and returns that.  returns NULL on failure to do either.
+ */
+static arena_header_t *
+arena_extend(arena_header_t *arena, heapsz_t add_size)
+{
+    arena_header_t *new_arena;
+    if (arena_extend_in_place(arena, add_size))
+        return arena;
 #ifdef WINDOWS
     if (!TEST(HEAP_GROWABLE, arena->flags))
         return NULL;
@@ -671,6 +1127,25 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
     return new_arena;
 }
 
+/* our buckets guarantee that all allocs in that bucket have at least that size */
+static inline uint
+free_list_bucket(heapsz_t alloc_size)
+{
+    uint bucket;
+    for (bucket = NUM_FREE_LISTS - 1; alloc_size < free_list_sizes[bucket]; bucket--)
+        ; /* nothing */
+    ASSERT(alloc_size >= free_list_sizes[bucket], "bucket invariant violated");
+    return bucket;
+}
+
+/* we don't use a free list entry until we hit the max delay */
+static inline bool
+free_list_reuse_ok(void)
+{
+    return (delayed_chunks >= alloc_ops.delay_frees ||
+            delayed_bytes >= alloc_ops.delay_frees_maxsz);
+}
+
 static chunk_header_t *
 search_free_list_bucket(arena_header_t *arena, heapsz_t aligned_size, uint bucket)
 {
@@ -701,6 +1176,35 @@ search_free_list_bucket(arena_header_t *arena, heapsz_t aligned_size, uint bucke
     return head;
 }
 
+/* removes a specific freed chunk from its free list.
+ * returns false if it is not on the list.
+ */
+static bool
+free_list_remove(arena_header_t *arena, free_header_t *target)
+{
+    free_header_t *cur, *prev;
+    uint bucket = free_list_bucket(target->head.alloc_size);
+#ifdef LINUX
+    ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
+#endif
+    for (cur = arena->free_list->front[bucket], prev = NULL;
+         cur != NULL && cur != target;
+         prev = cur, cur = cur->next)
+        ; /* nothing */
+    if (cur == NULL)
+        return false;
+    if (prev == NULL)
+        arena->free_list->front[bucket] = cur->next;
+    else
+        prev->next = cur->next;
+    if (cur == arena->free_list->last[bucket])
+        arena->free_list->last[bucket] = prev;
+    LOG(3, "arena "PFX" bucket %d free front="PFX" last="PFX"\n",
+        arena, bucket, arena->free_list->front[bucket],
+        arena->free_list->last[bucket]);
+    return true;
+}
+
 static chunk_header_t *
 find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t aligned_size)
 {
@@ -712,8 +1216,7 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
 #endif
 
     /* don't use free list unless we hit max delay */
-    if (delayed_chunks < alloc_ops.delay_frees &&
-        delayed_bytes < alloc_ops.delay_frees_maxsz)
+    if (!free_list_reuse_ok())
         return NULL;
 
     /* b/c we're delaying, we're not able to re-use a just-freed chunk.
@@ -785,19 +1288,18 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
                      bool realloc, void *drcontext, dr_mcontext_t *mc, app_pc caller,
                      uint alloc_type)
 {
-    heapsz_t aligned_size;
+    size_t aligned_size;
     byte *res = NULL;
     chunk_header_t *head = NULL;
+    /* whether the chunk is fresh from the OS and thus already zero */
+    bool known_zero = false;
+    bool guard;
     ASSERT((alloc_type & ~(MALLOC_ALLOCATOR_FLAGS)) == 0, "invalid type flags");
 
-    if (request_size > UINT_MAX ||
-        /* catch overflow in chunk or mmap alignment: no need to support really
-         * large sizes within a page of UINT_MAX (i#944)
-         */
-        ALIGN_FORWARD(request_size, PAGE_SIZE) < request_size) {
-        /* rather than have larger headers for 64-bit we just don't support
-         * enormous allocations
+    if (/* catch overflow in chunk or mmap alignment: no need to support really
+         * large sizes within a couple of pages of the max (i#944)
          */
+        request_size > CHUNK_MAX_SIZE - 2*PAGE_SIZE) {
         client_handle_alloc_failure(request_size, zeroed, realloc, caller, mc);
         return NULL;
     }
@@ -806,6 +1308,7 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     ASSERT(aligned_size >= request_size, "overflow should have been caught");
     if (aligned_size < CHUNK_MIN_SIZE)
         aligned_size = CHUNK_MIN_SIZE;
+    guard = (alloc_ops.guard_page_min > 0 && request_size >= alloc_ops.guard_page_min);
 
     /* XXX i#948: use per-thread free lists to avoid lock in common case */
     if (synch)
@@ -814,35 +1317,60 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     /* for large requests we do direct mmap with own redzones.
      * we use the large malloc table to track them for iteration.
      * XXX: for simplicity, not delay-freeing these for now
+     *
+     * Guard chunks also get their own mapping, with the chunk placed so that
+     * its end abuts an inaccessible page: overflows then fault, no matter how
+     * far they go.  The trailing redzone is replaced by the guard page.
      */
-    if (aligned_size + HEADER_SIZE >= CHUNK_MIN_MMAP) {
+    if (guard || aligned_size + HEADER_SIZE >= CHUNK_MIN_MMAP) {
         size_t map_size = (size_t)
-            ALIGN_FORWARD(aligned_size + alloc_ops.redzone_size*2 +
-                          header_beyond_redzone, PAGE_SIZE);
+            ALIGN_FORWARD(aligned_size + alloc_ops.redzone_size*(guard ? 1 : 2) +
+                          header_beyond_redzone, PAGE_SIZE) + (guard ? PAGE_SIZE : 0);
         byte *map = os_large_alloc(map_size _IF_WINDOWS(map_size)
                                    _IF_WINDOWS(arena_page_prot(arena->flags)));
+        byte *ptr;
         ASSERT(map_size >= aligned_size, "overflow should have been caught");
-        LOG(2, "\tlarge alloc %d => mmap @"PFX"\n", request_size, map);
+        LOG(2, "\tlarge alloc "PIFX" => mmap @"PFX"%s\n", request_size, map,
+            guard ? " w/ guard page" : "");
         if (map == NULL) {
             client_handle_alloc_failure(request_size, zeroed, realloc, caller, mc);
             goto replace_alloc_common_done;
         }
-        ASSERT(!alloc_ops.external_headers, "NYI");
-        head = (chunk_header_t *) (map + alloc_ops.redzone_size +
-                                   header_beyond_redzone - redzone_beyond_header -
-                                   HEADER_SIZE);
-        head->flags |= CHUNK_MMAP;
+        if (guard) {
+            ptr = map + map_size - PAGE_SIZE - aligned_size;
+            if (!os_large_protect(map + map_size - PAGE_SIZE, PAGE_SIZE, false)) {
+                os_large_free(map, map_size);
+                client_handle_alloc_failure(request_size, zeroed, realloc, caller, mc);
+                goto replace_alloc_common_done;
+            }
+            STATS_INC(num_guard_chunks);
+        } else
+            ptr = map + alloc_ops.redzone_size + header_beyond_redzone;
+        if (alloc_ops.external_headers) {
+            free_header_t *rec = (free_header_t *)
+                global_alloc(sizeof(*rec), HEAPSTAT_HASHTABLE);
+            memset(rec, 0, sizeof(*rec));
+            rec->chunk = ptr;
+            head = &rec->head;
+            hashtable_add(&mmap_header_table, (void *)ptr, (void *)rec);
+        } else
+            head = header_from_ptr(ptr);
+        head->flags |= CHUNK_MMAP | (guard ? CHUNK_GUARD : 0);
         head->magic = HEADER_MAGIC;
-        head->alloc_size = map_size - alloc_ops.redzone_size*2 - header_beyond_redzone;
-        heap_region_add(map, map + map_size, HEAP_MMAP, mc);
+        chunk_set_alloc_size(head, map + map_size - (guard ? PAGE_SIZE :
+                                                     alloc_ops.redzone_size) - ptr);
+        heap_region_add(mmap_chunk_region_start(ptr), map + map_size, HEAP_MMAP, mc);
+        known_zero = true;
     } else {
         /* look for free list entry */
-        head = find_free_list_entry(arena, request_size, aligned_size);
+        head = find_free_list_entry(arena, (heapsz_t)request_size,
+                                    (heapsz_t)aligned_size);
     }
 
     /* if no free list entry, get new memory */
     if (head == NULL) {
-        heapsz_t add_size = aligned_size + alloc_ops.redzone_size + header_beyond_redzone;
+        heapsz_t add_size = (heapsz_t)aligned_size + alloc_ops.redzone_size +
+            header_beyond_redzone;
         if (arena->next_chunk + add_size > arena->commit_end) {
             arena = arena_extend(arena, add_size);
             if (arena == NULL) {
@@ -851,33 +1379,45 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
             }
         }
         /* remember that arena->next_chunk always has a redzone preceding it */
-        head = (chunk_header_t *)
-            (arena->next_chunk - redzone_beyond_header - HEADER_SIZE);
+        if (alloc_ops.external_headers)
+            head = arena_chunk_record_new(arena, arena->next_chunk);
+        else {
+            head = (chunk_header_t *)
+                (arena->next_chunk - redzone_beyond_header - HEADER_SIZE);
+        }
         LOG(2, "\tcarving out new chunk @"PFX" => head="PFX", res="PFX"\n",
             arena->next_chunk - alloc_ops.redzone_size, head, ptr_from_header(head));
-        head->alloc_size = aligned_size;
+        chunk_set_alloc_size(head, aligned_size);
         head->magic = HEADER_MAGIC;
         head->user_data = NULL; /* b/c we pass the old to client */
         head->flags = 0;
+        known_zero = (arena->next_chunk >= arena->zero_start);
         arena->next_chunk += add_size;
     }
 
     /* head->alloc_size, head->magic, and head->flags (except type) are already set */
     ASSERT(head->magic == HEADER_MAGIC, "corrupted header");
-    head->request_size = request_size;
+    chunk_set_request_size(head, request_size);
     head->flags |= alloc_type;
     res = ptr_from_header(head);
-    LOG(2, "\treplace_alloc_common flags="PIFX" request=%d, alloc=%d => "PFX"\n",
-        head->flags, head->request_size, head->alloc_size, res);
-    if (zeroed)
-        memset(res, 0, request_size);
+    LOG(2, "\treplace_alloc_common flags="PIFX" request="PIFX", alloc="PIFX" => "PFX"\n",
+        head->flags, request_size, chunk_alloc_size(head), res);
+    if (zeroed) {
+        /* Skip the memset for virgin memory: for large callocs this avoids
+         * touching (and thus committing) every page.
+         */
+        if (known_zero)
+            STATS_INC(num_zeroed_fresh);
+        else
+            memset(res, 0, request_size);
+    }
 
-    ASSERT(head->alloc_size >= request_size, "chunk too small");
+    ASSERT(chunk_alloc_size(head) >= request_size, "chunk too small");
 
     notify_client_alloc(true/*handle*/, drcontext, (byte *)res, head, mc,
                         zeroed, realloc, caller);
 
-    if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
+    if (request_size >= LARGE_MALLOC_MIN_SIZE)
         malloc_large_add(res, request_size);
     else
         STATS_INC(num_mallocs);
@@ -907,6 +1447,58 @@ check_type_match(void *ptr, chunk_header_t *head, uint free_type,
     }
 }
 
+/* Unmaps the oldest freed guard chunks while the FIFO is over its budget,
+ * always keeping the latest.  Caller must hold guard_free_lock.
+ */
+static void
+guard_free_trim(void)
+{
+    guard_free_t *gf;
+    while (guard_free_front != NULL && guard_free_front != guard_free_last &&
+           (guard_free_chunks > alloc_ops.delay_frees ||
+            guard_free_bytes > alloc_ops.delay_frees_maxsz)) {
+        gf = guard_free_front;
+        guard_free_front = gf->next;
+        rb_delete(guard_free_tree, rb_find(guard_free_tree, gf->map));
+        ASSERT(guard_free_chunks > 0, "guard delay counter off");
+        guard_free_chunks--;
+        ASSERT(guard_free_bytes >= gf->map_size, "guard delay bytes counter off");
+        guard_free_bytes -= gf->map_size;
+        LOG(2, "\tguard alloc @"PFX" leaving delay => munmap\n", gf->map);
+        if (!os_large_free(gf->map, gf->map_size))
+            ASSERT(false, "munmap failed");
+        global_free(gf, sizeof(*gf), HEAPSTAT_MISC);
+    }
+}
+
+/* Keeps the mapping of a freed guard chunk around but inaccessible, until
+ * the delayed-free limits push it out, so that use-after-free faults.
+ * Caller must hold guard_free_lock.
+ */
+static void
+guard_chunk_delay_free(byte *map, size_t map_size)
+{
+    guard_free_t *gf;
+    if (alloc_ops.delay_frees == 0 || !os_large_protect(map, map_size, false)) {
+        if (!os_large_free(map, map_size))
+            ASSERT(false, "munmap failed");
+        return;
+    }
+    gf = (guard_free_t *) global_alloc(sizeof(*gf), HEAPSTAT_MISC);
+    gf->map = map;
+    gf->map_size = map_size;
+    gf->next = NULL;
+    if (guard_free_last == NULL)
+        guard_free_front = gf;
+    else
+        guard_free_last->next = gf;
+    guard_free_last = gf;
+    rb_insert(guard_free_tree, map, map_size, (void *)gf);
+    guard_free_chunks++;
+    guard_free_bytes += map_size;
+    guard_free_trim();
+}
+
 /* Up to caller to verify that ptr is inside arena */
 static bool
 replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontext,
@@ -915,6 +1507,7 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
     chunk_header_t *head = header_from_ptr(ptr);
     free_header_t *cur;
     uint bucket;
+    size_t request_size, alloc_size;
 
     if (!is_live_alloc(ptr, arena, head)) { /* including NULL */
         /* w/o early inject, or w/ delayed instru, there are allocs in place
@@ -964,16 +1557,14 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
         app_heap_lock(drcontext, arena->lock);
 
     check_type_match(ptr, head, free_type, mc, caller);
+    request_size = chunk_request_size(head);
+    alloc_size = chunk_alloc_size(head);
 
     if (!TEST(CHUNK_MMAP, head->flags))
         head->flags |= CHUNK_FREED;
     if (!TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags)) {
         cur = (free_header_t *) head;
-        /* our buckets guarantee that all allocs in that bucket have at least that size */
-        for (bucket = NUM_FREE_LISTS - 1; head->alloc_size < free_list_sizes[bucket];
-             bucket--)
-            ; /* nothing */
-        ASSERT(head->alloc_size >= free_list_sizes[bucket], "bucket invariant violated");
+        bucket = free_list_bucket(head->alloc_size);
         LOG(2, "\treplace_free_common "PFX" == request=%d, alloc=%d\n",
             ptr, head->request_size, head->alloc_size);
 
@@ -1003,35 +1594,48 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
      * would we ever want to keep the alloc callstack for freed entries,
      * or we always want to replace w/ free callstack?
      */
-    client_remove_malloc_pre((byte *)ptr, (byte *)ptr + head->request_size,
-                             (byte *)ptr + head->alloc_size, head->user_data);
+    client_remove_malloc_pre((byte *)ptr, (byte *)ptr + request_size,
+                             (byte *)ptr + alloc_size, head->user_data);
     if (TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags)) {
         if (head->user_data != NULL)
             client_malloc_data_free(head->user_data);
         head->user_data = NULL;
     } else
         head->user_data = client_malloc_data_to_free_list(head->user_data, mc, caller);
-    client_remove_malloc_post((byte *)ptr, (byte *)ptr + head->request_size,
-                             (byte *)ptr + head->alloc_size);
+    client_remove_malloc_post((byte *)ptr, (byte *)ptr + request_size,
+                             (byte *)ptr + alloc_size);
 
     /* we ignore the return value */
-    client_handle_free((byte *)ptr, head->request_size,
+    client_handle_free((byte *)ptr, request_size,
                        /* XXX: real_base is regular base for us => no pattern */
-                       (byte *)ptr, head->alloc_size,
+                       (byte *)ptr, alloc_size,
                        mc, caller, head->user_data _IF_WINDOWS(NULL));
 
-    if (head->request_size >= LARGE_MALLOC_MIN_SIZE && !TEST(CHUNK_PRE_US, head->flags))
+    if (request_size >= LARGE_MALLOC_MIN_SIZE && !TEST(CHUNK_PRE_US, head->flags))
         malloc_large_remove(ptr);
 
     if (TEST(CHUNK_MMAP, head->flags)) {
         /* see comments in alloc routine about not delaying the free */
-        byte *map = (byte *)ptr - alloc_ops.redzone_size - header_beyond_redzone;
-        size_t map_size = head->alloc_size + alloc_ops.redzone_size*2 +
-            header_beyond_redzone;
-        LOG(2, "\tlarge alloc %d freed => munmap @"PFX"\n", head->request_size, map);
-        heap_region_remove(map, map + map_size, mc);
-        if (!os_large_free(map, map_size))
-            ASSERT(false, "munmap failed");
+        byte *map;
+        size_t map_size;
+        mmap_chunk_bounds((byte *)ptr, head, &map, &map_size);
+        if (TEST(CHUNK_GUARD, head->flags)) {
+            LOG(2, "\tguard alloc "PIFX" freed => protect @"PFX"\n", request_size, map);
+            /* guard_page_lookup() sees the chunk either live or delayed */
+            dr_mutex_lock(guard_free_lock);
+            heap_region_remove(mmap_chunk_region_start((byte *)ptr), map + map_size, mc);
+            guard_chunk_delay_free(map, map_size);
+            dr_mutex_unlock(guard_free_lock);
+        } else {
+            heap_region_remove(mmap_chunk_region_start((byte *)ptr), map + map_size, mc);
+            LOG(2, "\tlarge alloc "PIFX" freed => munmap @"PFX"\n", request_size, map);
+            if (!os_large_free(map, map_size))
+                ASSERT(false, "munmap failed");
+        }
+        if (alloc_ops.external_headers) {
+            hashtable_remove(&mmap_header_table, ptr);
+            global_free(head, sizeof(free_header_t), HEAPSTAT_HASHTABLE);
+        }
     }
 
     STATS_INC(num_frees);
@@ -1041,12 +1645,103 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
     return true;
 }
 
+/* Tries to grow the arena chunk at ptr to hold size bytes without moving it:
+ * either by advancing the arena frontier when it is the final chunk, or by
+ * absorbing the following chunk when that one is free and is the next entry
+ * its free list would hand out.  On success, updates head->alloc_size and sets
+ * *fresh_start to the start of the portion of the chunk that is known to be
+ * zero (or to the chunk end if none is).
+ */
+static bool
+realloc_grow_in_place(arena_header_t *arena, byte *ptr, chunk_header_t *head,
+                      size_t size, bool synch, void *drcontext,
+                      byte **fresh_start OUT)
+{
+    heapsz_t aligned_size;
+    heapsz_t chunk_gap = alloc_ops.redzone_size + header_beyond_redzone;
+    byte *next_ptr = ptr + head->alloc_size + chunk_gap;
+    void *lock = arena->lock;
+    bool grown = false;
+    ASSERT(!TESTANY(CHUNK_MMAP | CHUNK_PRE_US | CHUNK_FREED, head->flags),
+           "only live arena chunks can grow");
+    /* arena chunks must stay under 4GB: larger sizes get a new mmapped chunk */
+    if (size > UINT_MAX - CHUNK_ALIGNMENT)
+        return false;
+    aligned_size = (heapsz_t) ALIGN_FORWARD(size, CHUNK_ALIGNMENT);
+    ASSERT(aligned_size > head->alloc_size, "should only be called to grow");
+
+    if (synch)
+        app_heap_lock(drcontext, lock);
+#ifdef WINDOWS
+    /* find which of the Heap's arenas holds the chunk */
+    while (arena != NULL && (ptr < arena->start_chunk || ptr >= arena->commit_end))
+        arena = arena->next_arena;
+    if (arena == NULL)
+        goto realloc_grow_in_place_done;
+#endif
+
+    if (next_ptr == arena->next_chunk) {
+        /* Final chunk in the arena: extend into the frontier */
+        heapsz_t delta = aligned_size - head->alloc_size;
+        if (arena->next_chunk + delta > arena->commit_end &&
+            !arena_extend_in_place(arena, (heapsz_t)
+                                   (arena->next_chunk + delta - arena->commit_end)))
+            goto realloc_grow_in_place_done;
+        /* the trailing redzone up to next_chunk may hold app overflow */
+        *fresh_start = (arena->next_chunk >= arena->zero_start) ?
+            arena->next_chunk : ptr + aligned_size;
+        LOG(2, "\trealloc "PFX" growing at frontier by %d\n", ptr, delta);
+        arena->next_chunk += delta;
+        head->alloc_size = aligned_size;
+        grown = true;
+    } else if (next_ptr < arena->next_chunk && free_list_reuse_ok()) {
+        /* Absorb a free neighbor, along with the redzone in between.  We only
+         * take the oldest entry in its bucket, which the next allocation
+         * from that bucket would take anyway, so that a recently freed
+         * neighbor keeps its full use-after-free delay.
+         */
+        chunk_header_t *next_head = arena_chunk_header(arena, next_ptr);
+        /* the app may have clobbered the neighbor's header */
+        if (next_head->magic == HEADER_MAGIC &&
+            TEST(CHUNK_FREED, next_head->flags) &&
+            head->alloc_size + chunk_gap + next_head->alloc_size >= aligned_size &&
+            arena->free_list->front[free_list_bucket(next_head->alloc_size)] ==
+            (free_header_t *) next_head &&
+            free_list_remove(arena, (free_header_t *) next_head)) {
+            LOG(2, "\trealloc "PFX" absorbing free neighbor "PFX" size=%d\n",
+                ptr, next_ptr, next_head->alloc_size);
+            ASSERT(delayed_chunks > 0, "delay counter off");
+            delayed_chunks--;
+            ASSERT(delayed_bytes >= next_head->alloc_size, "delay bytes counter off");
+            delayed_bytes -= next_head->alloc_size;
+            if (next_head->user_data != NULL)
+                client_malloc_data_free(next_head->user_data);
+            head->alloc_size += chunk_gap + next_head->alloc_size;
+            /* the header is now inside our chunk and must not look valid */
+            next_head->magic = 0;
+            if (alloc_ops.external_headers)
+                arena_chunk_record_remove(arena, next_ptr);
+            *fresh_start = ptr + head->alloc_size;
+            grown = true;
+        }
+    }
+    if (grown)
+        STATS_INC(num_realloc_grown_in_place);
+
+ realloc_grow_in_place_done:
+    if (synch)
+        app_heap_unlock(drcontext, lock);
+    return grown;
+}
+
 static byte *
 replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
                        bool lock, bool zeroed, bool in_place_only, bool allow_null,
                        void *drcontext, dr_mcontext_t *mc, app_pc caller)
 {
     byte *res = NULL;
+    byte *fresh_start;
+    size_t old_size;
     chunk_header_t *head = header_from_ptr(ptr);
     if (ptr == NULL) {
         if (allow_null) {
@@ -1080,28 +1775,42 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
     }
     /* if we reach here, this is a regular realloc */
     ASSERT(head != NULL, "should return before here");
-    if (head->alloc_size >= size && !TEST(CHUNK_PRE_US, head->flags)) {
+    old_size = chunk_request_size(head);
+    fresh_start = ptr + chunk_alloc_size(head);
+    if (!TEST(CHUNK_PRE_US, head->flags) &&
+        (TEST(CHUNK_GUARD, head->flags) ?
+         /* a guard chunk must keep its end at the guard page */
+         ALIGN_FORWARD(size, CHUNK_ALIGNMENT) == chunk_alloc_size(head) :
+         (chunk_alloc_size(head) >= size ||
+          /* grow in place to avoid a copy: the client only needs to update the
+           * delta, as for a shrink
+           */
+          (!TEST(CHUNK_MMAP, head->flags) &&
+           realloc_grow_in_place(arena, ptr, head, size, lock, drcontext,
+                                 &fresh_start))))) {
         /* XXX: if shrinking a lot, should free and re-malloc to save space */
-        client_handle_realloc(drcontext, (byte *)ptr, head->request_size,
+        client_handle_realloc(drcontext, (byte *)ptr, old_size,
                               (byte *)ptr, size,
                               /* XXX: real_base is regular base for us => no pattern */
                               (byte *)ptr, mc);
-        if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
+        if (old_size >= LARGE_MALLOC_MIN_SIZE)
             malloc_large_remove(ptr);
-        if (head->request_size < size && zeroed)
-            memset(ptr + head->request_size, 0, size - head->request_size);
-        head->request_size = size;
-        if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
-            malloc_large_add(ptr, head->request_size);
+        if (old_size < size && zeroed) {
+            /* no need to clear what came fresh from the OS */
+            byte *zero_end = (ptr + size < fresh_start) ? ptr + size : fresh_start;
+            memset(ptr + old_size, 0, zero_end - (ptr + old_size));
+        }
+        chunk_set_request_size(head, size);
+        if (size >= LARGE_MALLOC_MIN_SIZE)
+            malloc_large_add(ptr, size);
         res = ptr;
     } else if (!in_place_only) {
         /* XXX: use mremap for mmapped alloc! */
-        /* XXX: if final chunk in arena, extend in-place */
         res = (void *) replace_alloc_common(arena, size, lock, zeroed,
                                             true/*realloc*/, drcontext, mc, caller,
                                             MALLOC_ALLOCATOR_MALLOC);
         if (res != NULL) {
-            memcpy(res, ptr, head->request_size);
+            memcpy(res, ptr, old_size);
             replace_free_common(arena, ptr, lock, drcontext, mc, caller,
                                 MALLOC_ALLOCATOR_MALLOC);
         }
@@ -1127,7 +1836,7 @@ replace_size_common(arena_header_t *arena, byte *ptr,
             return (size_t)-1;
         }
     }
-    return head->request_size; /* we do not allow using padding */
+    return chunk_request_size(head); /* we do not allow using padding */
 }
 
 /***************************************************************************
@@ -1138,8 +1847,19 @@ typedef struct _alloc_iter_data_t {
     bool only_live;
     malloc_iter_cb_t cb;
     void *data;
+    /* only chunks overlapping [range_start, range_end) are visited */
+    byte *range_start;
+    byte *range_end;
 } alloc_iter_data_t;
 
+static inline bool
+alloc_iter_in_range(alloc_iter_data_t *data, byte *start, byte *end)
+{
+    /* a zero-sized chunk counts if it starts in the range */
+    return (start < data->range_end &&
+            (end > data->range_start || start >= data->range_start));
+}
+
 static bool
 alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
                      _IF_WINDOWS(HANDLE heap), void *iter_data)
@@ -1149,15 +1869,22 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
     byte *cur;
     arena_header_t *arena = (arena_header_t *) iter_arena_start;
 
+    if (!alloc_iter_in_range(data, iter_arena_start, iter_arena_end))
+        return true;
+
     /* We use the HEAP_MMAP flag to find our mmapped chunks.  We can't easily
      * use the large malloc tree b/c it has pre_us allocs too (i#1051).
      */
     if (TEST(HEAP_MMAP, flags)) {
-        byte *start = iter_arena_start;
+        /* see mmap_chunk_region_start() */
+        byte *start = iter_arena_start + alloc_ops.redzone_size + header_beyond_redzone;
         chunk_header_t *head = header_from_ptr(start);
         ASSERT(TEST(CHUNK_MMAP, head->flags), "mmap chunk inconsistent");
-        LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, start, start + head->request_size);
-        if (!data->cb(start, start + head->request_size, start + head->alloc_size,
+        LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, start,
+            start + chunk_request_size(head));
+        if (alloc_iter_in_range(data, start, start + chunk_request_size(head)) &&
+            !data->cb(start, start + chunk_request_size(head),
+                      start + chunk_alloc_size(head),
                       false/*!pre_us*/, head->flags & MALLOC_POSSIBLE_CLIENT_FLAGS,
                       head->user_data, data->data))
             return false;
@@ -1168,11 +1895,13 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
 
     LOG(2, "%s: "PFX"-"PFX"\n", __FUNCTION__, iter_arena_start, iter_arena_end);
     cur = arena->start_chunk;
-    while (cur < arena->next_chunk) {
-        head = header_from_ptr(cur);
+    while (cur < arena->next_chunk && cur < data->range_end) {
+        head = arena_chunk_header(arena, cur);
         LOG(3, "\tchunk %s "PFX"-"PFX"\n", TEST(CHUNK_FREED, head->flags) ? "freed" : "",
             ptr_from_header(head), ptr_from_header(head) + head->alloc_size);
-        if (!data->only_live || !TEST(CHUNK_FREED, head->flags)) {
+        if ((!data->only_live || !TEST(CHUNK_FREED, head->flags)) &&
+            alloc_iter_in_range(data, ptr_from_header(head),
+                                ptr_from_header(head) + head->request_size)) {
             byte *start = ptr_from_header(head);
             if (!data->cb(start, start + head->request_size, start + head->alloc_size,
                           false/*!pre_us*/, head->flags & MALLOC_POSSIBLE_CLIENT_FLAGS,
@@ -1186,7 +1915,8 @@ alloc_iter_own_arena(byte *iter_arena_start, byte *iter_arena_end, uint flags
 
 
 static void
-alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
+alloc_iterate_range(malloc_iter_cb_t cb, void *iter_data, bool only_live,
+                    byte *range_start, byte *range_end)
 {
     /* Strategy:
      * + can iterate arenas via heap rbtree
@@ -1195,13 +1925,11 @@ alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
      *     pre-us, so we store a new flag in heap regions: HEAP_MMAP (i#1051)
      * + ignore pre-us arenas and instead iterate pre_us_table
      */
-    alloc_iter_data_t data = {only_live, cb, iter_data};
+    alloc_iter_data_t data = {only_live, cb, iter_data, range_start, range_end};
     uint i;
 
     LOG(2, "%s\n", __FUNCTION__);
 
-    ASSERT(!alloc_ops.external_headers, "NYI: walk malloc table");
-
     LOG(3, "%s: iterating heap regions\n", __FUNCTION__);
     heap_region_iterate(alloc_iter_own_arena, &data);
 
@@ -1213,10 +1941,12 @@ alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
         for (he = pre_us_table.table[i]; he != NULL; he = he->next) {
             chunk_header_t *head = (chunk_header_t *) he->payload;
             byte *start = he->key;
-            if (!only_live || !TEST(CHUNK_FREED, head->flags)) {
-                LOG(3, "\tpre-us "PFX"-"PFX"-"PFX"\n",
-                    start, start + head->request_size, start + head->alloc_size);
-                if (!cb(start, start + head->request_size, start + head->alloc_size,
+            if ((!only_live || !TEST(CHUNK_FREED, head->flags)) &&
+                alloc_iter_in_range(&data, start, start + chunk_request_size(head))) {
+                LOG(3, "\tpre-us "PFX"-"PFX"-"PFX"\n", start,
+                    start + chunk_request_size(head), start + chunk_alloc_size(head));
+                if (!cb(start, start + chunk_request_size(head),
+                        start + chunk_alloc_size(head),
                         true/*pre_us*/, head->flags & MALLOC_POSSIBLE_CLIENT_FLAGS,
                         head->user_data, iter_data))
                     break;
@@ -1225,6 +1955,12 @@ alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
     }
 }
 
+static void
+alloc_iterate(malloc_iter_cb_t cb, void *iter_data, bool only_live)
+{
+    alloc_iterate_range(cb, iter_data, only_live, NULL, (byte *)POINTER_MAX);
+}
+
 bool
 alloc_replace_overlaps_delayed_free(byte *start, byte *end,
                                     byte **free_start OUT,
@@ -1254,19 +1990,20 @@ alloc_replace_overlaps_delayed_free(byte *start, byte *end,
     if (malloc_large_lookup(start, &found_arena_start, &size)) {
         found_head = header_from_ptr(found_arena_start);
         found_start = found_arena_start;
-        ASSERT(found_arena_start + size == found_start + found_head->request_size,
+        ASSERT(found_arena_start + size == found_start + chunk_request_size(found_head),
                "inconsistent");
     } else if (heap_region_bounds(start, &found_arena_start, &found_arena_end, &flags)) {
         if (TEST(HEAP_PRE_US, flags)) {
             /* walk pre-us table */
             uint i;
             for (i = 0; i < HASHTABLE_SIZE(pre_us_table.table_bits); i++) {
-                /* see notes in alloc_iterate() about no lock */
+                /* see notes in alloc_iterate_range() about no lock */
                 hash_entry_t *he;
                 for (he = pre_us_table.table[i]; he != NULL; he = he->next) {
                     chunk_header_t *head = (chunk_header_t *) he->payload;
                     byte *chunk_start = he->key;
-                    if (start < chunk_start + head->request_size && end >= chunk_start) {
+                    if (start < chunk_start + chunk_request_size(head) &&
+                        end >= chunk_start) {
                         found_head = head;
                         found_start = chunk_start;
                     }
@@ -1281,7 +2018,7 @@ alloc_replace_overlaps_delayed_free(byte *start, byte *end,
             byte *cur = arena->start_chunk;
             while (cur < arena->next_chunk) {
                 byte *chunk_start;
-                chunk_header_t *head = header_from_ptr(cur);
+                chunk_header_t *head = arena_chunk_header(arena, cur);
                 chunk_start = ptr_from_header(head);
                 if (start < chunk_start + head->request_size && end >= chunk_start) {
                     found_head = head;
@@ -1290,14 +2027,16 @@ alloc_replace_overlaps_delayed_free(byte *start, byte *end,
                 }
                 cur += head->alloc_size + alloc_ops.redzone_size + header_beyond_redzone;
             }
-        } else
-            ASSERT(false, "large lookup should have found it");
+        } else {
+            /* the redzone or guard page of an mmapped chunk */
+            ASSERT(TEST(HEAP_MMAP, flags), "large lookup should have found it");
+        }
     }
     if (found_head != NULL && TEST(CHUNK_FREED, found_head->flags)) {
         if (free_start != NULL)
             *free_start = found_start;
         if (free_end != NULL)
-            *free_end = found_start + found_head->request_size;
+            *free_end = found_start + chunk_request_size(found_head);
         if (client_data != NULL)
             *client_data = found_head->user_data;
         return true;
@@ -1305,6 +2044,52 @@ alloc_replace_overlaps_delayed_free(byte *start, byte *end,
         return false;
 }
 
+/* If addr is in the guard page of a live guard chunk or in a freed guard
+ * chunk still in the delay FIFO, returns true, first making addr's page
+ * accessible if unprotect is set.  Both cases are checked under
+ * guard_free_lock, which a guard chunk's free holds from removing its heap
+ * region through delaying it, so the mapping cannot be freed, unmapped or
+ * reused underneath us.
+ */
+static bool
+guard_page_lookup(byte *addr, bool unprotect)
+{
+    byte *start, *end;
+    uint flags;
+    bool res = false;
+    if (alloc_ops.guard_page_min == 0)
+        return false;
+    dr_mutex_lock(guard_free_lock);
+    if (heap_region_bounds(addr, &start, &end, &flags)) {
+        chunk_header_t *head;
+        if (TEST(HEAP_MMAP, flags) && addr >= end - PAGE_SIZE) {
+            /* see mmap_chunk_region_start() */
+            head = header_from_ptr(start + alloc_ops.redzone_size +
+                                   header_beyond_redzone);
+            res = TEST(CHUNK_GUARD, head->flags);
+        }
+    } else
+        res = (rb_in_node(guard_free_tree, addr) != NULL);
+    if (res && unprotect) {
+        res = os_large_protect((byte *)ALIGN_BACKWARD(addr, PAGE_SIZE), PAGE_SIZE,
+                               true);
+    }
+    dr_mutex_unlock(guard_free_lock);
+    return res;
+}
+
+bool
+alloc_replace_in_guard_page(byte *addr)
+{
+    return guard_page_lookup(addr, false);
+}
+
+bool
+alloc_replace_unprotect_guard_page(byte *addr)
+{
+    return guard_page_lookup(addr, true);
+}
+
 /***************************************************************************
  * app-facing interface
  */
@@ -1592,7 +2377,7 @@ destroy_Rtl_heap(arena_header_t *arena, dr_mcontext_t *mc, bool free_chunks)
         if (free_chunks) {
             byte *cur = a->start_chunk;
             while (cur < a->next_chunk) {
-                head = header_from_ptr(cur);
+                head = arena_chunk_header(a, cur);
                 if (!TEST(CHUNK_FREED, head->flags)) {
                     /* XXX: like mmaps for large allocs, we assume the OS
                      * re-using the memory won't be immediate, so we go w/
@@ -2232,10 +3017,10 @@ malloc_replace__add(app_pc start, app_pc end, app_pc real_end,
 {
     IF_DEBUG(bool new_entry;)
     chunk_header_t *head = global_alloc(sizeof(*head), HEAPSTAT_HASHTABLE);
-    head->request_size = (end - start);
-    if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
-        malloc_large_add(start, head->request_size);
-    head->alloc_size = (real_end - start);
+    chunk_set_request_size(head, end - start);
+    if (end - start >= LARGE_MALLOC_MIN_SIZE)
+        malloc_large_add(start, end - start);
+    chunk_set_alloc_size(head, real_end - start);
     head->flags = CHUNK_PRE_US;
     head->magic = HEADER_MAGIC;
     head->user_data = NULL;
@@ -2271,7 +3056,7 @@ malloc_replace__end(app_pc start)
     if (head == NULL || TEST(CHUNK_FREED, head->flags))
         return NULL;
     else
-        return start + head->request_size;
+        return start + chunk_request_size(head);
 }
 
 /* Returns -1 on failure */
@@ -2282,7 +3067,7 @@ malloc_replace__size(app_pc start)
     ssize_t res = -1;
     head = header_from_ptr_include_pre_us(start);
     if (head != NULL && !TEST(CHUNK_FREED, head->flags))
-        res = head->request_size;
+        res = chunk_request_size(head);
     return res;
 }
 
@@ -2293,7 +3078,7 @@ malloc_replace__size_invalid_only(app_pc start)
     if (head == NULL || !TEST(CHUNK_FREED, head->flags))
         return -1;
     else
-        return head->request_size;
+        return chunk_request_size(head);
 }
 
 static void *
@@ -2345,6 +3130,14 @@ malloc_replace__iterate(bool (*cb)(app_pc start, app_pc end, app_pc real_end,
     alloc_iterate(cb, iter_data, true/*live only*/);
 }
 
+static void
+malloc_replace__iterate_range(app_pc start, app_pc end, malloc_iter_cb_t cb,
+                              void *iter_data)
+{
+    /* XXX: we still walk each overlapping arena from its start */
+    alloc_iterate_range(cb, iter_data, true/*live only*/, start, end);
+}
+
 static void
 malloc_replace__lock(void)
 {
@@ -2364,8 +3157,8 @@ malloc_replace__unlock(void)
 void
 alloc_replace_init(void)
 {
-    ASSERT(sizeof(free_header_t) <=
-           (alloc_ops.external_headers ? 0 : sizeof(chunk_header_t)) + CHUNK_MIN_SIZE,
+    ASSERT(alloc_ops.external_headers ||
+           sizeof(free_header_t) <= sizeof(chunk_header_t) + CHUNK_MIN_SIZE,
            "min size too small");
     /* we could pad but it's simpler to have struct already have right size */
     ASSERT(ALIGNED(sizeof(chunk_header_t), CHUNK_ALIGNMENT), "alignment off");
@@ -2377,7 +3170,24 @@ alloc_replace_init(void)
 
     ASSERT(ALIGNED(alloc_ops.redzone_size, CHUNK_ALIGNMENT), "redzone alignment off");
 
-    if (alloc_ops.redzone_size < HEADER_SIZE) {
+    if (alloc_ops.external_headers) {
+        /* the records live outside of app memory */
+        uint min_stride = CHUNK_MIN_SIZE + alloc_ops.redzone_size;
+        header_beyond_redzone = 0;
+        redzone_beyond_header = 0;
+        /* largest power of 2 that fits in the minimum stride between chunks */
+        for (chunk_granule_shift = 0; (2U << chunk_granule_shift) <= min_stride;
+             chunk_granule_shift++)
+            ; /* nothing */
+        ASSERT((1U << chunk_granule_shift) >= CHUNK_ALIGNMENT, "granule too small");
+        hashtable_init_ex(&mmap_header_table, MMAP_HEADER_TABLE_HASH_BITS,
+                          HASH_INTPTR, false/*!strdup*/, true/*synch*/,
+                          NULL, NULL, NULL);
+        arena_map_lock = dr_mutex_create();
+        arena_map = (arena_header_t **volatile *)
+            nonheap_alloc(ARENA_MAP_L1_SIZE * sizeof(*arena_map),
+                          DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    } else if (alloc_ops.redzone_size < HEADER_SIZE) {
         header_beyond_redzone = HEADER_SIZE - alloc_ops.redzone_size;
         redzone_beyond_header = 0;
     } else {
@@ -2387,6 +3197,8 @@ alloc_replace_init(void)
     }
 
     hashtable_init(&pre_us_table, PRE_US_TABLE_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
+    guard_free_lock = dr_mutex_create();
+    guard_free_tree = rb_tree_create(NULL);
 
 #ifdef LINUX
     /* we waste pre-brk space of pre-us allocator, and we assume we're
@@ -2427,6 +3239,7 @@ alloc_replace_init(void)
     malloc_interface.malloc_set_client_flag = malloc_replace__set_client_flag;
     malloc_interface.malloc_clear_client_flag = malloc_replace__clear_client_flag;
     malloc_interface.malloc_iterate = malloc_replace__iterate;
+    malloc_interface.malloc_iterate_range = malloc_replace__iterate_range;
     malloc_interface.malloc_intercept = malloc_replace__intercept;
     malloc_interface.malloc_unintercept = malloc_replace__unintercept;
     malloc_interface.malloc_set_init = malloc_replace__set_init;
@@ -2480,5 +3293,35 @@ alloc_replace_exit(void)
     }
     hashtable_delete_with_stats(&pre_us_table, "pre_us");
 
+    if (alloc_ops.external_headers) {
+        /* mmapped chunks are left in place, as is done without external headers */
+        for (i = 0; i < HASHTABLE_SIZE(mmap_header_table.table_bits); i++) {
+            hash_entry_t *he;
+            for (he = mmap_header_table.table[i]; he != NULL; he = he->next)
+                global_free(he->payload, sizeof(free_header_t), HEAPSTAT_HASHTABLE);
+        }
+        hashtable_delete_with_stats(&mmap_header_table, "mmap_headers");
+    }
+
+    while (guard_free_front != NULL) {
+        guard_free_t *gf = guard_free_front;
+        guard_free_front = gf->next;
+        os_large_free(gf->map, gf->map_size);
+        global_free(gf, sizeof(*gf), HEAPSTAT_MISC);
+    }
+    rb_tree_destroy(guard_free_tree);
+    dr_mutex_destroy(guard_free_lock);
+
     heap_region_iterate(free_arena_at_exit, NULL);
+
+    if (alloc_ops.external_headers) {
+        arena_header_t **volatile *map = arena_map;
+        arena_map = NULL;
+        dr_mutex_destroy(arena_map_lock);
+        for (i = 0; i < ARENA_MAP_L1_SIZE; i++) {
+            if (map[i] != NULL)
+                nonheap_free(map[i], ARENA_MAP_L2_SIZE * sizeof(*map[i]), HEAPSTAT_MISC);
+        }
+        nonheap_free((void *)map, ARENA_MAP_L1_SIZE * sizeof(*map), HEAPSTAT_MISC);
+    }
 }
@@ -29,6 +29,10 @@
 #include "callstack.h"
 #include "utils.h"
 #include "redblack.h"
+#include "ohashtable.h"
+#ifdef LINUX
+# include "unwind.h"
+#endif
 #ifdef USE_DRSYMS
 # include "drsyms.h"
 #endif
@@ -45,6 +49,9 @@ static uint op_stack_swap_threshold;
 static uint op_fp_flags; /* set of FP_ flags */
 static uint op_print_flags; /* set of PRINT_ flags */
 static size_t op_fp_scan_sz;
+static bool op_shadow_call_stack;
+static bool op_cfi_unwind;
+static bool op_frame_trie;
 /* optional: only needed if packed_callstack_record is passed a pc<64K */
 static const char * (*op_get_syscall_name)(drsys_sysnum_t);
 static bool (*op_is_dword_defined)(byte *);
@@ -73,13 +80,47 @@ uint symbol_names_truncated;
 uint cstack_is_retaddr;
 uint cstack_is_retaddr_backdecode;
 uint cstack_is_retaddr_unreadable;
+uint cstack_is_retaddr_cached;
+uint cstack_shadow_stack_hits;
+uint cstack_shadow_stack_misses;
+uint cstack_cfi_frames;
+uint cstack_cfi_fallbacks;
+# ifdef WINDOWS
+uint cstack_stack_bounds_queries;
+# endif
 #endif
 
+/* A module region, as found by module lookups */
+typedef struct _module_range_t {
+    app_pc start;
+    app_pc end;
+    struct _modname_info_t *name_info;
+} module_range_t;
+
 typedef struct _tls_callstack_t {
     char *errbuf; /* buffer for atomic writes to global logfile */
     size_t errbufsz;
     byte *page_buf; /* buffer for app stack safe read */
     app_pc stack_lowest_frame; /* optimization for recording callstacks */
+#ifdef WINDOWS
+    /* The TEB's bounds for the stack the thread is on, within which walks
+     * read the stack directly rather than via safe_read().  Empty if the
+     * thread is on some other stack.
+     */
+    app_pc stack_lo;
+    app_pc stack_hi;
+#endif
+    /* for -callstack_shadow_stack */
+    byte *shadow_alloc; /* unaligned allocation holding shadow_base */
+    byte *shadow_base;
+    byte *shadow_tls; /* our raw TLS slots, for access from other threads */
+    /* packed_callstack_record_scratch() */
+    byte *scratch_pcs;
+    /* in module_range_lookup(), which a nested lookup must not disturb */
+    bool module_looking_up;
+    /* last range found, valid while module_last_gen is current */
+    module_range_t module_last;
+    uint module_last_gen;
 } tls_callstack_t;
 
 static int tls_idx_callstack = -1;
@@ -165,6 +206,33 @@ static const modname_info_t MODNAME_INFO_SYSCALL;
 
 #define MAX_MODOFFS_STORED (0x00ffffff)
 
+/* With -callstack_frame_trie, kept callstacks share their frames: each frame
+ * is a node whose parent is the frame that called it, so callstacks with a
+ * common outer sequence of frames (e.g., from main or a thread entry on
+ * down) store it only once.  A callstack points at the node for its top
+ * frame.  Nodes are interned in frame_trie_table and counted, under its
+ * lock, by their children and the callstacks pointing at them, so that
+ * the trie only holds the frames of live callstacks.
+ */
+typedef struct _frame_node_t {
+    struct _frame_node_t *parent;
+    /* packed_callstack_hash() of the callstack ending here */
+    uint cstack_hash;
+    uint refcount;
+    bool is_packed:1;
+    /* a syscall node is followed by its syscall_loc_t */
+    bool is_syscall:1;
+    union {
+        packed_frame_t packed;
+        full_frame_t full;
+    } frame;
+} frame_node_t;
+
+#define FRAME_TRIE_TABLE_HASH_BITS 12
+static ohashtable_t frame_trie_table;
+/* callstacks can outlive callstack_exit(): they then leave the trie alone */
+static bool frame_trie_exited;
+
 struct _packed_callstack_t {
     /* share callstacks to save space (PR 465174) */
     uint refcount;
@@ -176,20 +244,62 @@ struct _packed_callstack_t {
     bool first_is_retaddr:1;
     /* whether first frame is a syscall (invariant: later frames never are) */
     bool first_is_syscall:1;
+    /* whether frames hold only addresses, with module info looked up on use
+     * until packed_callstack_resolve() fills it in (i#75)
+     */
+    bool is_raw:1;
+    /* whether frames.leaf points into the frame trie */
+    bool is_trie:1;
+    /* module_unload_count+1 when resolved from raw, so a resolved callstack
+     * never compares equal to one recorded after its module went away
+     */
+    uint resolve_gen;
     union {
         packed_frame_t *packed;
         full_frame_t *full;
+        frame_node_t *leaf;
     } frames;
 };
 
-/* multiplexing between packed and full frames */
+/* Frame n of a trie callstack is n parents up from its leaf.  Code that
+ * visits every frame should follow the parents itself rather than walk
+ * from the leaf for each one.
+ */
+static inline frame_node_t *
+frame_node_at(frame_node_t *leaf, uint n)
+{
+    while (n-- > 0)
+        leaf = leaf->parent;
+    return leaf;
+}
+
+/* multiplexing between packed and full frames.
+ * frame_loc_t is the first field of both frame types.
+ */
 #define PCS_FRAME_LOC(pcs, n) \
-    ((pcs)->is_packed ? (pcs)->frames.packed[n].loc : (pcs)->frames.full[n].loc)
+    ((pcs)->is_trie ? frame_node_at((pcs)->frames.leaf, n)->frame.packed.loc : \
+     ((pcs)->is_packed ? (pcs)->frames.packed[n].loc : (pcs)->frames.full[n].loc))
+/* For a trie callstack, this is only good for a NULL check */
 #define PCS_FRAMES(pcs) \
-    ((pcs)->is_packed ? (void*)((pcs)->frames.packed) : (void*)((pcs)->frames.full))
+    ((pcs)->is_trie ? (void*)((pcs)->frames.leaf) : \
+     ((pcs)->is_packed ? (void*)((pcs)->frames.packed) : (void*)((pcs)->frames.full)))
 #define PCS_FRAME_SZ(pcs) \
     ((pcs)->is_packed ? sizeof(*(pcs)->frames.packed) : sizeof(*(pcs)->frames.full))
 
+/* Like PCS_FRAME_LOC, but for a trie callstack node is frame n's node if the
+ * caller is walking the parents alongside (else NULL)
+ */
+static inline frame_loc_t *
+pcs_frame_loc(packed_callstack_t *pcs, uint n, frame_node_t *node)
+{
+    if (pcs->is_trie) {
+        if (node == NULL)
+            node = frame_node_at(pcs->frames.leaf, n);
+        return &node->frame.packed.loc;
+    }
+    return (pcs->is_packed ? &pcs->frames.packed[n].loc : &pcs->frames.full[n].loc);
+}
+
 /* Hashtable that stores name info.  We never remove entries. */
 #define MODNAME_TABLE_HASH_BITS 8
 static hashtable_t modname_table;
@@ -209,6 +319,9 @@ static uint modname_array_end = 1;
  */
 static uint modname_unique_id = 1;
 
+/* Bumped after each module unload.  Protected by modtree_lock. */
+static uint module_unload_count;
+
 /* PR 473640: our own module region tree */
 static rb_tree_t *module_tree;
 static void *modtree_lock;
@@ -217,13 +330,32 @@ static void *modtree_lock;
  */
 static app_pc modtree_min_start;
 static app_pc modtree_max_end;
-/* cached values for module_lookup */
-static app_pc modtree_last_start;
-static size_t modtree_last_size;
-static modname_info_t *modtree_last_name_info;
-/* cached values for is_in_module() */
-static app_pc modtree_last_hit;
-static app_pc modtree_last_miss;
+
+/* Lookups do not touch module_tree, which would need modtree_lock.  Each
+ * load and unload instead publishes a new immutable sorted copy of it, which
+ * lookups binary-search w/o a lock.  A replaced copy is freed once no thread
+ * can still be reading it: see epoch_read_enter().
+ */
+typedef struct _module_array_t {
+    uint gen;
+    uint num;
+    module_range_t range[1]; /* variable-length */
+} module_array_t;
+
+#define MODULE_ARRAY_SIZE(num) \
+    (sizeof(module_array_t) + ((num) == 0 ? 0 : (num) - 1) * sizeof(module_range_t))
+
+static module_array_t *volatile module_array;
+/* Generation of the last array published.  Protected by modtree_lock. */
+static uint module_array_gen;
+
+#ifdef LINUX
+/* -callstack_cfi_unwind: unwind_module_t per module, keyed by its bounds.
+ * Walks hold the read lock throughout so no module's data is freed under them.
+ */
+static rb_tree_t *unwind_tree;
+static void *unwind_lock;
+#endif
 
 /****************************************************************************
  * Symbolized callstacks for comparing to suppressions.
@@ -265,9 +397,44 @@ module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **na
 static void
 modname_info_free(void *p);
 
+static void
+module_array_publish(void);
+
+static void
+module_array_free(module_array_t *array);
+
 static void
 warn_no_symbols(modname_info_t *name_info);
 
+static size_t
+packed_callstack_scratch_size(void);
+
+static uint
+frame_node_hash(void *key);
+
+static bool
+frame_node_cmp(void *key1, void *key2);
+
+static void
+frame_node_free(void *p);
+
+static void
+shadow_stack_init(void);
+
+static void
+shadow_stack_exit(void);
+
+static void
+shadow_stack_thread_init(void *drcontext, tls_callstack_t *pt);
+
+static void
+shadow_stack_thread_exit(void *drcontext, tls_callstack_t *pt);
+
+#ifdef LINUX
+static void
+unwind_tree_free(void *p);
+#endif
+
 /***************************************************************************/
 
 size_t
@@ -285,7 +452,8 @@ max_callstack_size(void)
 
 void
 callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
-               uint fp_flags, size_t fp_scan_sz, uint print_flags,
+               uint fp_flags, size_t fp_scan_sz, bool shadow_call_stack,
+               bool cfi_unwind, bool frame_trie, uint print_flags,
                const char *(*get_syscall_name)(drsys_sysnum_t),
                bool (*is_dword_defined)(byte *),
                bool (*ignore_xbp)(void *, dr_mcontext_t *),
@@ -303,6 +471,9 @@ callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
     op_stack_swap_threshold = stack_swap_threshold;
     op_fp_flags = fp_flags;
     op_fp_scan_sz = fp_scan_sz;
+    op_shadow_call_stack = shadow_call_stack;
+    op_cfi_unwind = IF_LINUX_ELSE(cfi_unwind, false);
+    op_frame_trie = frame_trie;
     op_print_flags = print_flags;
     op_get_syscall_name = get_syscall_name;
     op_is_dword_defined = is_dword_defined;
@@ -320,6 +491,22 @@ callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
     modname_table_initialized = true;
     modtree_lock = dr_mutex_create();
     module_tree = rb_tree_create(NULL);
+    dr_mutex_lock(modtree_lock);
+    module_array_publish();
+    dr_mutex_unlock(modtree_lock);
+    if (op_shadow_call_stack)
+        shadow_stack_init();
+#ifdef LINUX
+    if (op_cfi_unwind) {
+        unwind_tree = rb_tree_create(unwind_tree_free);
+        unwind_lock = dr_rwlock_create();
+    }
+#endif
+    if (op_frame_trie) {
+        ohashtable_init(&frame_trie_table, FRAME_TRIE_TABLE_HASH_BITS,
+                        frame_node_hash, frame_node_cmp, frame_node_free,
+                        true/*synch*/);
+    }
 
 #ifdef USE_DRSYMS
     IF_WINDOWS(ASSERT(using_private_peb(), "private peb not preserved"));
@@ -330,13 +517,32 @@ callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
 void
 callstack_exit(void)
 {
+    /* retired callstacks still reference the frame trie */
+    epoch_reclaim_all();
     hashtable_delete(&modname_table);
 
     dr_mutex_lock(modtree_lock);
     rb_tree_destroy(module_tree);
+    module_array_free(module_array);
+    module_array = NULL;
     dr_mutex_unlock(modtree_lock);
     dr_mutex_destroy(modtree_lock);
 
+    if (op_shadow_call_stack)
+        shadow_stack_exit();
+#ifdef LINUX
+    if (op_cfi_unwind) {
+        dr_rwlock_write_lock(unwind_lock);
+        rb_tree_destroy(unwind_tree);
+        dr_rwlock_write_unlock(unwind_lock);
+        dr_rwlock_destroy(unwind_lock);
+    }
+#endif
+    if (op_frame_trie) {
+        ohashtable_delete_with_stats(&frame_trie_table, "frame trie");
+        frame_trie_exited = true;
+    }
+
 #ifdef USE_DRSYMS
     IF_WINDOWS(ASSERT(using_private_peb(), "private peb not preserved"));
 #endif
@@ -358,12 +564,26 @@ callstack_thread_init(void *drcontext)
     pt->errbuf = (char *) thread_alloc(drcontext, pt->errbufsz, HEAPSTAT_CALLSTACK);
     /* We take the space hit to avoid serializing all mallocs just for callstacks */
     pt->page_buf = (byte *) thread_alloc(drcontext, PAGE_SIZE, HEAPSTAT_CALLSTACK);
+    pt->scratch_pcs = (byte *)
+        thread_alloc(drcontext, packed_callstack_scratch_size(), HEAPSTAT_CALLSTACK);
 #ifdef WINDOWS
     if (get_TEB() != NULL) {
         pt->stack_lowest_frame = get_TEB()->StackBase;
-    } else
-#endif
+        /* the committed part: StackLimit drops as the guard page moves */
+        pt->stack_lo = get_TEB()->StackLimit;
+        pt->stack_hi = get_TEB()->StackBase;
+    } else {
         pt->stack_lowest_frame = NULL;
+        pt->stack_lo = NULL;
+        pt->stack_hi = NULL;
+    }
+#else
+    pt->stack_lowest_frame = NULL;
+#endif
+    if (op_shadow_call_stack)
+        shadow_stack_thread_init(drcontext, pt);
+    pt->module_looking_up = false;
+    pt->module_last_gen = 0;
 }
 
 void
@@ -373,6 +593,10 @@ callstack_thread_exit(void *drcontext)
         drmgr_get_tls_field(drcontext, tls_idx_callstack);
     thread_free(drcontext, (void *) pt->errbuf, pt->errbufsz, HEAPSTAT_CALLSTACK);
     thread_free(drcontext, (void *) pt->page_buf, PAGE_SIZE, HEAPSTAT_CALLSTACK);
+    thread_free(drcontext, (void *) pt->scratch_pcs, packed_callstack_scratch_size(),
+                HEAPSTAT_CALLSTACK);
+    if (op_shadow_call_stack)
+        shadow_stack_thread_exit(drcontext, pt);
     drmgr_set_tls_field(drcontext, tls_idx_callstack, NULL);
     thread_free(drcontext, pt, sizeof(*pt), HEAPSTAT_MISC);
 }
@@ -711,6 +935,57 @@ print_frame(symbolized_frame_t *frame IN,
     BUFPRINT(buf, bufsz, *sofar, len, NL);
 }
 
+/* Fills in frame pcs_idx of pcs for pc, which is in the module at mod_start */
+static void
+set_module_frame(packed_callstack_t *pcs, uint pcs_idx, app_pc pc, app_pc mod_start,
+                 modname_info_t *name_info)
+{
+    size_t sz = (pc - mod_start);
+    if (pcs->is_packed) {
+        pcs->frames.packed[pcs_idx].loc.addr = pc;
+        if (name_info == NULL) { /* handling missing module in release build */
+            /* We already asserted above */
+            if (sz > MAX_MODOFFS_STORED) /* We lose data here */
+                pcs->frames.packed[pcs_idx].modoffs = MAX_MODOFFS_STORED;
+            else
+                pcs->frames.packed[pcs_idx].modoffs = sz;
+            pcs->frames.packed[pcs_idx].modname_idx = MAX_MODNAMES_STORED;
+        } else {
+            int idx = name_info->index;
+            while (sz > MAX_MODOFFS_STORED) {
+                sz -= MAX_MODOFFS_STORED;
+                if (idx + 1 == MAX_MODNAMES_STORED)
+                    break;
+                idx++;
+                ASSERT(idx < modname_array_end, "large-modname entries truncated");
+                ASSERT(strcmp(modname_array[idx-1]->name,
+                              modname_array[idx]->name) == 0,
+                       "not enough large-modname entries");
+            }
+            pcs->frames.packed[pcs_idx].modoffs = sz;
+            pcs->frames.packed[pcs_idx].modname_idx = idx;
+        }
+    } else {
+        pcs->frames.full[pcs_idx].loc.addr = pc;
+        pcs->frames.full[pcs_idx].modoffs = sz;
+        pcs->frames.full[pcs_idx].modname = name_info;
+    }
+}
+
+static void
+set_non_module_frame(packed_callstack_t *pcs, uint pcs_idx, app_pc pc)
+{
+    if (pcs->is_packed) {
+        pcs->frames.packed[pcs_idx].loc.addr = pc;
+        pcs->frames.packed[pcs_idx].modoffs = MAX_MODOFFS_STORED;
+        pcs->frames.packed[pcs_idx].modname_idx = MAX_MODNAMES_STORED;
+    } else {
+        pcs->frames.full[pcs_idx].loc.addr = pc;
+        pcs->frames.full[pcs_idx].modoffs = 0;
+        pcs->frames.full[pcs_idx].modname = NULL;
+    }
+}
+
 /* Fills in frame xor pcs.
  * Returns whether a new frame was added (won't be if skip_non_module and pc
  * is not in a module)
@@ -731,42 +1006,29 @@ address_to_frame(symbolized_frame_t *frame OUT, packed_callstack_t *pcs OUT,
         pc_to_loc(&frame->loc, pc);
     }
 
+    if (pcs != NULL && pcs->is_raw) {
+        /* is_in_module() takes no lock */
+        if (skip_non_module && !is_in_module(pc))
+            return false;
+        if (pcs->is_packed) {
+            pcs->frames.packed[pcs->num_frames].loc.addr = pc;
+            pcs->frames.packed[pcs->num_frames].modoffs = 0;
+            pcs->frames.packed[pcs->num_frames].modname_idx = 0;
+        } else {
+            pcs->frames.full[pcs->num_frames].loc.addr = pc;
+            pcs->frames.full[pcs->num_frames].modoffs = 0;
+            pcs->frames.full[pcs->num_frames].modname = NULL;
+        }
+        pcs->num_frames++;
+        return true;
+    }
+
     if (module_lookup(pc, &mod_start, NULL, &name_info)) {
         ASSERT(pc >= mod_start, "internal pc-not-in-module error");
         ASSERT(name_info != NULL, "module should have info");
         ASSERT(mod_in == NULL || mod_in->start == mod_start, "module mismatch");
         if (pcs != NULL) {
-            size_t sz = (pc - mod_start);
-            uint pcs_idx = pcs->num_frames;
-            if (pcs->is_packed) {
-                pcs->frames.packed[pcs_idx].loc.addr = pc;
-                if (name_info == NULL) { /* handling missing module in release build */
-                    /* We already asserted above */
-                    if (sz > MAX_MODOFFS_STORED) /* We lose data here */
-                        pcs->frames.packed[pcs_idx].modoffs = MAX_MODOFFS_STORED;
-                    else
-                        pcs->frames.packed[pcs_idx].modoffs = sz;
-                    pcs->frames.packed[pcs_idx].modname_idx = MAX_MODNAMES_STORED;
-                } else {
-                    int idx = name_info->index;
-                    while (sz > MAX_MODOFFS_STORED) {
-                        sz -= MAX_MODOFFS_STORED;
-                        if (idx + 1 == MAX_MODNAMES_STORED)
-                            break;
-                        idx++;
-                        ASSERT(idx < modname_array_end, "large-modname entries truncated");
-                        ASSERT(strcmp(modname_array[idx-1]->name,
-                                      modname_array[idx]->name) == 0,
-                               "not enough large-modname entries");
-                    }
-                    pcs->frames.packed[pcs_idx].modoffs = sz;
-                    pcs->frames.packed[pcs_idx].modname_idx = idx;
-                }
-            } else {
-                pcs->frames.full[pcs_idx].loc.addr = pc;
-                pcs->frames.full[pcs_idx].modoffs = sz;
-                pcs->frames.full[pcs_idx].modname = name_info;
-            }
+            set_module_frame(pcs, pcs->num_frames, pc, mod_start, name_info);
             pcs->num_frames++;
         } else {
             const char *modname = (name_info->name == NULL) ?
@@ -787,15 +1049,7 @@ address_to_frame(symbolized_frame_t *frame OUT, packed_callstack_t *pcs OUT,
         return true;
     } else if (!skip_non_module) {
         if (pcs != NULL) {
-            if (pcs->is_packed) {
-                pcs->frames.packed[pcs->num_frames].loc.addr = pc;
-                pcs->frames.packed[pcs->num_frames].modoffs = MAX_MODOFFS_STORED;
-                pcs->frames.packed[pcs->num_frames].modname_idx = MAX_MODNAMES_STORED;
-            } else {
-                pcs->frames.full[pcs->num_frames].loc.addr = pc;
-                pcs->frames.full[pcs->num_frames].modoffs = 0;
-                pcs->frames.full[pcs->num_frames].modname = NULL;
-            }
+            set_non_module_frame(pcs, pcs->num_frames, pc);
             pcs->num_frames++;
         } else {
             ASSERT(!frame->is_module, "frame not initialized");
@@ -838,6 +1092,33 @@ print_address(char *buf, size_t bufsz, size_t *sofar,
 #define OP_CALL_DIR 0xe8
 #define OP_CALL_IND 0xff
 
+/* Scans test the same return sites over and over, so we remember recent
+ * back-decode verdicts in a direct-mapped cache.  Each slot holds the last
+ * pc found to be a retaddr and the last found not to be, and each is read
+ * and written as a single aligned pointer w/o a lock: a racing write just
+ * replaces one valid verdict w/ another.  Module unload clears the cache,
+ * as new code can then be mapped at the same addresses.  A verdict computed
+ * across the unload can survive the clear, which at worst leads to a less
+ * accurate callstack.
+ */
+#define RETADDR_CACHE_BITS 12
+#define RETADDR_CACHE_SIZE (1U << RETADDR_CACHE_BITS)
+
+typedef struct _retaddr_cache_slot_t {
+    app_pc retaddr;
+    app_pc not_retaddr;
+} retaddr_cache_slot_t;
+
+static retaddr_cache_slot_t retaddr_cache[RETADDR_CACHE_SIZE];
+
+static inline retaddr_cache_slot_t *
+retaddr_cache_slot(byte *pc)
+{
+    /* return sites differ in their low bits, so we keep them */
+    return &retaddr_cache[((uint)(ptr_uint_t)pc * 0x9e3779b1U) >>
+                          (32 - RETADDR_CACHE_BITS)];
+}
+
 static bool
 is_retaddr(byte *pc)
 {
@@ -855,11 +1136,13 @@ is_retaddr(byte *pc)
     if (!is_in_module(pc))
         return false;
     if (!TEST(FP_SEARCH_DO_NOT_DISASM, op_fp_flags)) {
-        /* The is_in_module() check is more expensive than our 3 derefs here.
-         * We do not bother to cache frequent/recent values.
-         */
         /* more efficient to read 3 dwords than safe_read 6 into a buffer */
-        bool match;
+        retaddr_cache_slot_t *slot = retaddr_cache_slot(pc);
+        bool match, readable = true;
+        if (slot->retaddr == pc || slot->not_retaddr == pc) {
+            STATS_INC(cstack_is_retaddr_cached);
+            return (slot->retaddr == pc);
+        }
         STATS_INC(cstack_is_retaddr_backdecode);
         DR_TRY_EXCEPT(dr_get_current_drcontext(), {
             match = (*(pc - 5) == OP_CALL_DIR ||
@@ -879,12 +1162,18 @@ is_retaddr(byte *pc)
                       ((*(pc - 5) >> 3) == 0x12 || *(pc - 5) == 0x15)));
         }, { /* EXCEPT */
             match = false;
-            /* If we end up with a lot of these we could either cache
-             * frequent/recent or switch to +rx instead of whole module
+            /* Not cached, as the code may be mapped in later.  If we still
+             * end up w/ a lot of these we could switch to +rx instead of
+             * whole module.
              */
+            readable = false;
             LOG(3, "is_retaddr: can't read "PFX"\n", pc);
             STATS_INC(cstack_is_retaddr_unreadable);
         });
+        if (match)
+            slot->retaddr = pc;
+        else if (readable)
+            slot->not_retaddr = pc;
 #ifdef USE_DRSYMS
         DOLOG(5, {
             char buf[128];
@@ -901,6 +1190,82 @@ is_retaddr(byte *pc)
         return true;
 }
 
+#ifdef WINDOWS
+/* Sets pt's stack bounds to the TEB's if sp is on the thread's own stack.
+ * Any other stack, such as one the app swapped to by hand, could be freed
+ * by another thread at any time, so it is only read via safe_read().
+ */
+static void
+stack_bounds_refresh(tls_callstack_t *pt, app_pc sp)
+{
+    TEB *teb = get_TEB();
+    STATS_INC(cstack_stack_bounds_queries);
+    pt->stack_lo = NULL;
+    pt->stack_hi = NULL;
+    if (teb != NULL && sp >= (app_pc)teb->StackLimit && sp < (app_pc)teb->StackBase &&
+        /* with definedness info, only trust the bounds if the shadow state
+         * agrees that the app has written to its stack at sp
+         */
+        (op_is_dword_defined == NULL || !ALIGNED(sp, sizeof(uint)) ||
+         op_is_dword_defined(sp))) {
+        pt->stack_lo = teb->StackLimit;
+        pt->stack_hi = teb->StackBase;
+    }
+    LOG(4, "stack bounds for sp="PFX": "PFX"-"PFX"\n", sp, pt->stack_lo, pt->stack_hi);
+}
+
+/* Called at the start of each walk.  Bounds that do not hold the walk's sp
+ * are from before a stack swap that stack_swap() was not told about.
+ */
+static inline void
+stack_bounds_validate(tls_callstack_t *pt, app_pc sp)
+{
+    if (sp < pt->stack_lo || sp >= pt->stack_hi)
+        stack_bounds_refresh(pt, sp);
+}
+
+void
+callstack_stack_swap(void *drcontext, app_pc new_sp)
+{
+    tls_callstack_t *pt = (tls_callstack_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    if (pt != NULL)
+        stack_bounds_refresh(pt, new_sp);
+}
+#endif
+
+/* Reads from the stack, directly if within pt's bounds.  On Linux
+ * safe_read() costs no system call, so we always use it there.
+ */
+static inline bool
+stack_read(tls_callstack_t *pt, app_pc addr, size_t size, void *buf OUT)
+{
+#ifdef WINDOWS
+    if (pt != NULL && addr >= pt->stack_lo && addr + size <= pt->stack_hi &&
+        addr + size > addr) {
+        memcpy(buf, addr, size);
+        return true;
+    }
+#endif
+    return safe_read(addr, size, buf);
+}
+
+/* Returns the contents of the stack page at page: the page itself if within
+ * pt's bounds, else a copy in pt->page_buf, or NULL if unreadable.
+ */
+static inline byte *
+stack_read_page(tls_callstack_t *pt, app_pc page)
+{
+#ifdef WINDOWS
+    if (page >= pt->stack_lo && page + PAGE_SIZE <= pt->stack_hi &&
+        page + PAGE_SIZE > page)
+        return page;
+#endif
+    if (safe_read(page, PAGE_SIZE, pt->page_buf))
+        return pt->page_buf;
+    return NULL;
+}
+
 static app_pc
 find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OUT*/)
 {
@@ -931,13 +1296,12 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
         return NULL;
     }
     /* PR 454536: dr_memory_is_readable() is racy so we use a safe_read().
-     * On Windows safe_read() costs 1 system call: perhaps DR should
-     * use try/except there like on Linux?
-     * Should we also store the stack bounds and then we know when
-     * to stop instead of incurring a fault on every callstack?
+     * On Windows safe_read() costs 1 system call, so within the thread's
+     * known stack bounds we read the stack directly instead.
      * XXX: should support partial safe read for invalid page next to stack 
      */
-    if (safe_read((app_pc)ALIGN_BACKWARD(fp, PAGE_SIZE), PAGE_SIZE, page_buf)) {
+    page_buf = stack_read_page(pt, (app_pc)ALIGN_BACKWARD(fp, PAGE_SIZE));
+    if (page_buf != NULL) {
         app_pc buf_pg = (app_pc) ALIGN_BACKWARD(fp, PAGE_SIZE);
         app_pc tos = fp;
         app_pc sp;
@@ -969,7 +1333,8 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
             /* Retrieve next page if slot1 will touch it */
             if ((app_pc)ALIGN_BACKWARD(sp + ret_offs, PAGE_SIZE) != buf_pg) {
                 buf_pg = (app_pc) ALIGN_BACKWARD(sp + ret_offs, PAGE_SIZE);
-                if (!safe_read(buf_pg, PAGE_SIZE, page_buf)) {
+                page_buf = stack_read_page(pt, buf_pg);
+                if (page_buf == NULL) {
                     LOG(4, "find_next_fp: returning NULL b/c couldn't read next page\n");
                     break;
                 }
@@ -1025,7 +1390,7 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
                 if (buf_pg == (app_pc)ALIGN_BACKWARD(parent_ret_ptr, PAGE_SIZE)) {
                     parent_ret = *((app_pc*)&page_buf[parent_ret_ptr - buf_pg]);
                 } else {
-                    if (!safe_read(parent_ret_ptr, sizeof(parent_ret), &parent_ret))
+                    if (!stack_read(pt, parent_ret_ptr, sizeof(parent_ret), &parent_ret))
                         parent_ret = NULL;
                 }
                 if (parent_ret != NULL && is_retaddr(parent_ret)) {
@@ -1039,77 +1404,500 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
     return NULL;
 }
 
-void
-print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc, 
-                bool print_fps, packed_callstack_t *pcs, int num_frames_printed,
-                bool for_log)
+/***************************************************************************
+ * Shadow call stack (-callstack_shadow_stack).
+ *
+ * Every app call pushes a {retaddr, xsp} frame onto a per-thread ring and
+ * every ret pops one, so recording a callstack reads the top frames rather
+ * than walking frame pointers and scanning the stack.  The inserted code
+ * must not touch the app's flags: the ring is 64K and 64K-aligned so that
+ * a 16-bit lea moves the top pointer with wraparound and leaves the ring's
+ * base bits alone.
+ *
+ * The pops are blind, so longjmp, exception unwinding, stack switches, and
+ * calls that never return leave dead frames behind, and deep recursion
+ * overwrites the oldest ones.  Rather than resynchronizing at each of those
+ * points, we check every frame when recording: a live frame lies above
+ * the current xsp and above the frame newer than it, and its return address
+ * is still in the stack slot the call pushed it to.  Anything else is
+ * skipped, and if we cannot get back to a frame we trust we fall back to
+ * the regular walk.
+ */
+
+typedef struct _shadow_frame_t {
+    app_pc retaddr;
+    /* xsp prior to the call's push: the retaddr lives just below it */
+    app_pc sp;
+} shadow_frame_t;
+
+#define SHADOW_STACK_SIZE (64*1024)
+#define SHADOW_STACK_FRAMES (SHADOW_STACK_SIZE / sizeof(shadow_frame_t))
+/* How many frames to consider per frame recorded before giving up */
+#define SHADOW_STACK_SCAN_FACTOR 4
+/* Our instrumentation of a call is at most this many instrs long */
+#define SHADOW_STACK_MAX_SEQUENCE 8
+
+enum {
+    SHADOW_TLS_TOP,   /* next free shadow_frame_t */
+    SHADOW_TLS_SPILL, /* app xax while we're using it */
+    SHADOW_TLS_COUNT,
+};
+
+static reg_id_t shadow_tls_seg;
+static uint shadow_tls_offs;
+
+static opnd_t
+opnd_create_shadow_tls_slot(uint slot)
 {
-    void *drcontext = dr_get_current_drcontext();
-    tls_callstack_t *pt = (tls_callstack_t *)
-        ((drcontext == NULL) ? NULL : drmgr_get_tls_field(drcontext, tls_idx_callstack));
-    int num = num_frames_printed;   /* PR 475453 - wrong call stack depths */
-    ssize_t len = 0;
-    ptr_uint_t *pc = (mc == NULL ? NULL : (ptr_uint_t *) mc->xbp);
-    size_t prev_sofar = 0;
-    struct {
-        app_pc next_fp;
-        app_pc retaddr;
-    } appdata;
-    app_pc custom_retaddr = NULL;
-    app_pc lowest_frame = NULL;
-    bool first_iter = true;
-    bool have_appdata = false;
-    bool scanned = false;
-    bool last_frame = false;
+    return opnd_create_far_base_disp_ex
+        /* must use 0 scale to match what DR decodes for opnd_same */
+        (shadow_tls_seg, REG_NULL, REG_NULL, 0,
+         shadow_tls_offs + slot*sizeof(ptr_uint_t), OPSZ_PTR,
+         /* we do NOT want an addr16 prefix */
+         false, true, false);
+}
 
-    ASSERT(num == 0 || num == 1, "only 1 frame can already be printed");
-    ASSERT((buf != NULL && sofar != NULL && pcs == NULL) ||
-           (buf == NULL && sofar == NULL && pcs != NULL),
-           "print_callstack: can't pass buf and pcs");
+static inline ptr_uint_t *
+shadow_tls_slot(tls_callstack_t *pt, uint slot)
+{
+    return (ptr_uint_t *) (pt->shadow_tls + slot*sizeof(ptr_uint_t));
+}
 
-#ifdef DEBUG
-    if (mc != NULL && op_callstack_dump_stack > 0)
-        dump_app_stack(drcontext, pt, mc, op_callstack_dump_stack,
-                       (pcs == NULL ? NULL : PCS_FRAME_LOC(pcs, 0).addr));
+/* Inserts a load of the top pointer into xax, which is spilled first */
+static void
+shadow_stack_insert_prologue(void *drcontext, instrlist_t *bb, instr_t *inst)
+{
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext, opnd_create_shadow_tls_slot(SHADOW_TLS_SPILL),
+                            opnd_create_reg(DR_REG_XAX)));
+    PRE(bb, inst,
+        INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(DR_REG_XAX),
+                            opnd_create_shadow_tls_slot(SHADOW_TLS_TOP)));
+}
+
+/* Moves the top pointer in xax by delta, stores it, and restores xax */
+static void
+shadow_stack_insert_epilogue(void *drcontext, instrlist_t *bb, instr_t *inst,
+                             int delta)
+{
+    /* the 16-bit destination wraps within the ring without touching eflags */
+    PRE(bb, inst,
+        INSTR_CREATE_lea(drcontext, opnd_create_reg(DR_REG_AX),
+                         OPND_CREATE_MEM_lea(DR_REG_XAX, DR_REG_NULL, 0, delta)));
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext, opnd_create_shadow_tls_slot(SHADOW_TLS_TOP),
+                            opnd_create_reg(DR_REG_XAX)));
+    PRE(bb, inst,
+        INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(DR_REG_XAX),
+                            opnd_create_shadow_tls_slot(SHADOW_TLS_SPILL)));
+}
+
+static void
+shadow_stack_insert_push(void *drcontext, instrlist_t *bb, instr_t *inst)
+{
+    ptr_uint_t retaddr = (ptr_uint_t)
+        (instr_get_app_pc(inst) + instr_length(drcontext, inst));
+    shadow_stack_insert_prologue(drcontext, bb, inst);
+#ifdef X64
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM32(DR_REG_XAX, 0),
+                            OPND_CREATE_INT32((int)retaddr)));
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM32(DR_REG_XAX, 4),
+                            OPND_CREATE_INT32((int)(retaddr >> 32))));
+#else
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEMPTR(DR_REG_XAX, 0),
+                            OPND_CREATE_INT32((int)retaddr)));
 #endif
+    PRE(bb, inst,
+        INSTR_CREATE_mov_st(drcontext,
+                            OPND_CREATE_MEMPTR(DR_REG_XAX, offsetof(shadow_frame_t, sp)),
+                            opnd_create_reg(DR_REG_XSP)));
+    shadow_stack_insert_epilogue(drcontext, bb, inst, sizeof(shadow_frame_t));
+}
 
-    if (mc != NULL) {
-        LOG(4, "initial fp="PFX" vs sp="PFX" def=%d\n",
-               mc->xbp, mc->xsp,
-               (op_is_dword_defined == NULL) ? 0 : op_is_dword_defined((byte*)mc->xbp));
-    }
-    if (mc != NULL && mc->xsp != 0 &&
-        (!ALIGNED(mc->xbp, sizeof(void*)) ||
-         mc->xbp < mc->xsp || 
-         mc->xbp - mc->xsp > op_stack_swap_threshold ||
-         (op_ignore_xbp != NULL &&
-          op_ignore_xbp(drcontext, mc)) ||
-         /* avoid stale fp,ra pair (i#640) */
-         (op_is_dword_defined != NULL &&
-          (!op_is_dword_defined((byte*)mc->xbp) ||
-           !op_is_dword_defined((byte*)mc->xbp + sizeof(void*)))) ||
-         (mc->xbp != 0 &&
-          (!safe_read((byte *)mc->xbp, sizeof(appdata), &appdata) ||
-           /* check the very first retaddr since ebp might point at
-            * a misleading stack slot
-            */
-           (!TEST(FP_DO_NOT_CHECK_FIRST_RETADDR, op_fp_flags) &&
-            !is_retaddr(appdata.retaddr)))))) {
-        /* We may start out in the middle of a frameless function that is
-         * using ebp for other purposes.  Heuristic: scan stack for fp + retaddr.
-         */
-        LOG(4, "find_next_fp b/c starting w/ non-fp ebp "PFX" (def=%d %d)\n", mc->xbp,
-            op_is_dword_defined == NULL ? 0 : op_is_dword_defined((byte*)mc->xbp),
-            op_is_dword_defined == NULL ? 0 : op_is_dword_defined((byte*)mc->xbp +
-                                                                  sizeof(void*)));
-        pc = (ptr_uint_t *) find_next_fp(pt, (app_pc)mc->xsp, true/*top frame*/,
-                                         &custom_retaddr);
-        scanned = true;
+static void
+shadow_stack_insert_pop(void *drcontext, instrlist_t *bb, instr_t *inst)
+{
+    shadow_stack_insert_prologue(drcontext, bb, inst);
+    shadow_stack_insert_epilogue(drcontext, bb, inst, -(int)sizeof(shadow_frame_t));
+}
+
+static dr_emit_flags_t
+shadow_stack_event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *inst,
+                             bool for_trace, bool translating, void *user_data)
+{
+    int opc;
+    if (!instr_ok_to_mangle(inst))
+        return DR_EMIT_DEFAULT;
+    opc = instr_get_opcode(inst);
+    if (opc == OP_call || opc == OP_call_ind)
+        shadow_stack_insert_push(drcontext, bb, inst);
+    else if (opc == OP_ret)
+        shadow_stack_insert_pop(drcontext, bb, inst);
+    return DR_EMIT_DEFAULT;
+}
+
+/* Returns whether inst is our spill (if spill) or restore (if !spill) of xax */
+static bool
+instr_is_shadow_stack_spill(instr_t *inst, bool spill)
+{
+    if (spill) {
+        return (instr_get_opcode(inst) == OP_mov_st &&
+                opnd_same(instr_get_dst(inst, 0),
+                          opnd_create_shadow_tls_slot(SHADOW_TLS_SPILL)) &&
+                opnd_same(instr_get_src(inst, 0), opnd_create_reg(DR_REG_XAX)));
+    } else {
+        return (instr_get_opcode(inst) == OP_mov_ld &&
+                opnd_same(instr_get_dst(inst, 0), opnd_create_reg(DR_REG_XAX)) &&
+                opnd_same(instr_get_src(inst, 0),
+                          opnd_create_shadow_tls_slot(SHADOW_TLS_SPILL)));
     }
-    while (pc != NULL) {
-        if (!have_appdata &&
-            !safe_read((byte *)pc, sizeof(appdata), &appdata)) {
-            LOG(4, "truncating callstack: can't read "PFX"\n", pc);
+}
+
+/* If we're translating from within a push or pop, xax holds the top pointer.
+ * We find out by looking ahead for our restore of xax: if we reach a spill
+ * first we're not inside a sequence.
+ */
+static bool
+shadow_stack_event_restore_state(void *drcontext, bool restore_memory,
+                                 dr_restore_state_info_t *info)
+{
+    tls_callstack_t *pt = (tls_callstack_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    instr_t inst;
+    byte *pc;
+    uint i;
+    bool xax_spilled = false;
+    if (pt == NULL || !info->raw_mcontext_valid)
+        return true;
+    pc = info->raw_mcontext->pc;
+    instr_init(drcontext, &inst);
+    for (i = 0; i < SHADOW_STACK_MAX_SEQUENCE && pc != NULL; i++) {
+        instr_reset(drcontext, &inst);
+        pc = decode(drcontext, pc, &inst);
+        if (pc == NULL || instr_is_shadow_stack_spill(&inst, true/*spill*/))
+            break;
+        if (instr_is_shadow_stack_spill(&inst, false/*restore*/)) {
+            xax_spilled = true;
+            break;
+        }
+    }
+    instr_free(drcontext, &inst);
+    if (xax_spilled) {
+        LOG(2, "restoring xax from shadow call stack spill slot\n");
+        info->mcontext->xax = (reg_t) *shadow_tls_slot(pt, SHADOW_TLS_SPILL);
+    }
+    return true;
+}
+
+#ifdef LINUX
+/* The handler's ret to the restorer pops a frame that no call pushed, which
+ * would lose the interrupted frame, so we push a placeholder that will
+ * never pass validation.  We're registered after the tools' signal events,
+ * which drmgr stops calling at the first that does not deliver, so we
+ * only see signals that are headed for the app.
+ */
+static dr_signal_action_t
+shadow_stack_event_signal(void *drcontext, dr_siginfo_t *info)
+{
+    tls_callstack_t *pt = (tls_callstack_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    byte *top;
+    shadow_frame_t *frame;
+    if (pt == NULL || pt->shadow_tls == NULL)
+        return DR_SIGNAL_DELIVER;
+    top = (byte *) *shadow_tls_slot(pt, SHADOW_TLS_TOP);
+    frame = (shadow_frame_t *) top;
+    frame->retaddr = info->mcontext->pc;
+    frame->sp = (app_pc) info->mcontext->xsp;
+    *shadow_tls_slot(pt, SHADOW_TLS_TOP) = (ptr_uint_t)
+        (pt->shadow_base + ((top + sizeof(*frame) - pt->shadow_base) &
+                            (SHADOW_STACK_SIZE - 1)));
+    return DR_SIGNAL_DELIVER;
+}
+#endif
+
+static void
+shadow_stack_init(void)
+{
+    drmgr_priority_t pri_insert = {sizeof(pri_insert), "drmemory.callstack.insert",
+                                   NULL, NULL,
+                                   DRMGR_PRIORITY_INSERT_CALLSTACK};
+    IF_DEBUG(bool ok =)
+        dr_raw_tls_calloc(&shadow_tls_seg, &shadow_tls_offs, SHADOW_TLS_COUNT, 0);
+    ASSERT(ok, "fatal error: unable to reserve tls slots");
+    if (!drmgr_register_bb_instrumentation_event(NULL, shadow_stack_event_bb_insert,
+                                                 &pri_insert))
+        ASSERT(false, "drmgr registration failed");
+    drmgr_register_restore_state_ex_event(shadow_stack_event_restore_state);
+#ifdef LINUX
+    drmgr_register_signal_event(shadow_stack_event_signal);
+#endif
+}
+
+static void
+shadow_stack_exit(void)
+{
+    IF_DEBUG(bool ok =)
+        dr_raw_tls_cfree(shadow_tls_offs, SHADOW_TLS_COUNT);
+    ASSERT(ok, "WARNING: unable to free tls slots");
+}
+
+static void
+shadow_stack_thread_init(void *drcontext, tls_callstack_t *pt)
+{
+    /* we need the ring 64K-aligned, so we allocate twice as much */
+    pt->shadow_alloc = (byte *)
+        nonheap_alloc(2*SHADOW_STACK_SIZE, DR_MEMPROT_READ|DR_MEMPROT_WRITE,
+                      HEAPSTAT_CALLSTACK);
+    pt->shadow_base = (byte *) ALIGN_FORWARD(pt->shadow_alloc, SHADOW_STACK_SIZE);
+    /* a NULL retaddr marks a slot no call has reached: the base of the stack */
+    memset(pt->shadow_base, 0, SHADOW_STACK_SIZE);
+#ifdef LINUX
+    pt->shadow_tls = (byte *) dr_get_dr_segment_base(shadow_tls_seg) + shadow_tls_offs;
+#else
+    pt->shadow_tls = (byte *) get_TEB() + shadow_tls_offs;
+#endif
+    *shadow_tls_slot(pt, SHADOW_TLS_TOP) = (ptr_uint_t) pt->shadow_base;
+}
+
+static void
+shadow_stack_thread_exit(void *drcontext, tls_callstack_t *pt)
+{
+    nonheap_free(pt->shadow_alloc, 2*SHADOW_STACK_SIZE, HEAPSTAT_CALLSTACK);
+    pt->shadow_tls = NULL;
+}
+
+/* Appends frames from the shadow call stack to pcs.  Returns false, leaving
+ * pcs as it was, if the shadow stack cannot account for the callstack.
+ */
+static bool
+shadow_stack_record(packed_callstack_t *pcs, dr_mcontext_t *mc)
+{
+    void *drcontext = dr_get_current_drcontext();
+    tls_callstack_t *pt = (tls_callstack_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    uint num_frames_printed = pcs->num_frames;
+    app_pc prev_sp = (app_pc) mc->xsp;
+    app_pc slot, slot_addr;
+    /* the app stack page last read, for checking all its frames w/ one read */
+    app_pc cur_pg = NULL;
+    byte *page_buf = NULL;
+    byte *top;
+    uint i, max_scan;
+    if (pt == NULL || pt->shadow_tls == NULL)
+        return false;
+    top = (byte *) *shadow_tls_slot(pt, SHADOW_TLS_TOP);
+    max_scan = SHADOW_STACK_SCAN_FACTOR * op_max_frames;
+    if (max_scan > SHADOW_STACK_FRAMES)
+        max_scan = SHADOW_STACK_FRAMES;
+    for (i = 0; i < max_scan; i++) {
+        shadow_frame_t *frame;
+        top = pt->shadow_base + ((top - sizeof(*frame) - pt->shadow_base) &
+                                 (SHADOW_STACK_SIZE - 1));
+        frame = (shadow_frame_t *) top;
+        if (frame->retaddr == NULL) {
+            LOG(4, "shadow stack: reached base\n");
+            STATS_INC(cstack_shadow_stack_hits);
+            return true;
+        }
+        LOG(4, "shadow stack: retaddr="PFX" sp="PFX"\n", frame->retaddr, frame->sp);
+        /* Already returned from, or older than a frame we already took */
+        if (frame->sp <= prev_sp)
+            continue;
+        /* Like the walk, we stop at a stack switch */
+        if ((ptr_uint_t)(frame->sp - prev_sp) >= op_stack_swap_threshold) {
+            LOG(4, "shadow stack: stopping at stack switch\n");
+            STATS_INC(cstack_shadow_stack_hits);
+            return true;
+        }
+        /* A reused slot means the frame is gone */
+        slot_addr = frame->sp - sizeof(app_pc);
+        if ((app_pc)ALIGN_BACKWARD(slot_addr, PAGE_SIZE) !=
+            (app_pc)ALIGN_BACKWARD(slot_addr + sizeof(slot) - 1, PAGE_SIZE)) {
+            if (!safe_read(slot_addr, sizeof(slot), &slot))
+                continue;
+        } else {
+            if ((app_pc)ALIGN_BACKWARD(slot_addr, PAGE_SIZE) != cur_pg) {
+                cur_pg = (app_pc) ALIGN_BACKWARD(slot_addr, PAGE_SIZE);
+                page_buf = stack_read_page(pt, cur_pg);
+            }
+            if (page_buf == NULL)
+                continue;
+            slot = *(app_pc *)&page_buf[slot_addr - cur_pg];
+        }
+        if (slot != frame->retaddr)
+            continue;
+        prev_sp = frame->sp;
+        if (num_frames_printed == 1 && pcs->num_frames == 1 &&
+            PCS_FRAME_LOC(pcs, 0).addr == frame->retaddr) {
+            /* caller already added this frame */
+            continue;
+        }
+        if (address_to_frame(NULL, pcs, frame->retaddr, NULL,
+                             !TEST(FP_SHOW_NON_MODULE_FRAMES, op_fp_flags),
+                             true, pcs->num_frames) &&
+            pcs->num_frames >= op_max_frames) {
+            STATS_INC(cstack_shadow_stack_hits);
+            return true;
+        }
+    }
+    LOG(3, "shadow stack: no base after %d frames: walking instead\n", max_scan);
+    STATS_INC(cstack_shadow_stack_misses);
+    pcs->num_frames = num_frames_printed;
+    return false;
+}
+
+#ifdef LINUX
+/***************************************************************************
+ * DWARF CFI unwinding (-callstack_cfi_unwind): see unwind.h.
+ *
+ * The walk from frame pointers has to scan the stack and guess at return
+ * addresses whenever it meets a function built without them, which is the
+ * default for x64 gcc.  .eh_frame instead says exactly where each frame's
+ * return address and caller's frame pointer are, so we use it for as many
+ * frames as we can and hand the rest to the regular walk.
+ */
+
+static void
+unwind_tree_free(void *p)
+{
+    unwind_module_free((unwind_module_t *) p);
+}
+
+/* Appends frames found from CFI to pcs, whose only frame must be the pc
+ * that mc is at.  Where the CFI runs out, finishes w/ the regular walk.
+ * Returns false, leaving pcs as it was, if not even the first frame's
+ * caller could be found from CFI.
+ */
+static bool
+cfi_unwind_record(packed_callstack_t *pcs, dr_mcontext_t *mc)
+{
+    unwind_state_t state;
+    bool is_retaddr = false;
+    bool done = false;
+    uint unwound = 0;
+    if (pcs->num_frames != 1 || pcs->first_is_syscall)
+        return false;
+    state.pc = PCS_FRAME_LOC(pcs, 0).addr;
+    state.sp = mc->xsp;
+    state.fp = mc->xbp;
+    dr_rwlock_read_lock(unwind_lock);
+    while (pcs->num_frames < op_max_frames) {
+        rb_node_t *node = rb_in_node(unwind_tree, state.pc);
+        void *mod;
+        if (node == NULL)
+            break;
+        rb_node_fields(node, NULL, NULL, &mod);
+        if (!unwind_step((unwind_module_t *) mod, &state, is_retaddr))
+            break;
+        unwound++;
+        is_retaddr = true;
+        if (state.pc == NULL) {
+            LOG(4, "cfi unwind: reached outermost frame\n");
+            done = true;
+            break;
+        }
+        LOG(4, "cfi unwind: retaddr="PFX" sp="PFX" fp="PFX"\n",
+            state.pc, state.sp, state.fp);
+        address_to_frame(NULL, pcs, state.pc, NULL,
+                         !TEST(FP_SHOW_NON_MODULE_FRAMES, op_fp_flags),
+                         true, pcs->num_frames);
+    }
+    dr_rwlock_read_unlock(unwind_lock);
+    if (unwound == 0)
+        return false;
+    STATS_ADD(cstack_cfi_frames, unwound);
+    if (!done && pcs->num_frames < op_max_frames) {
+        /* walk from the frame we could not unwind, which is already in pcs */
+        dr_mcontext_t mc_caller = *mc;
+        mc_caller.xsp = state.sp;
+        mc_caller.xbp = state.fp;
+        LOG(4, "cfi unwind: no CFI for "PFX": walking instead\n", state.pc);
+        STATS_INC(cstack_cfi_fallbacks);
+        print_callstack(NULL, 0, NULL, &mc_caller, false, pcs, 1, false);
+    }
+    return true;
+}
+#endif /* LINUX */
+
+void
+print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc, 
+                bool print_fps, packed_callstack_t *pcs, int num_frames_printed,
+                bool for_log)
+{
+    void *drcontext = dr_get_current_drcontext();
+    tls_callstack_t *pt = (tls_callstack_t *)
+        ((drcontext == NULL) ? NULL : drmgr_get_tls_field(drcontext, tls_idx_callstack));
+    int num = num_frames_printed;   /* PR 475453 - wrong call stack depths */
+    ssize_t len = 0;
+    ptr_uint_t *pc = (mc == NULL ? NULL : (ptr_uint_t *) mc->xbp);
+    size_t prev_sofar = 0;
+    struct {
+        app_pc next_fp;
+        app_pc retaddr;
+    } appdata;
+    app_pc custom_retaddr = NULL;
+    app_pc lowest_frame = NULL;
+    bool first_iter = true;
+    bool have_appdata = false;
+    bool scanned = false;
+    bool last_frame = false;
+
+    ASSERT(num == 0 || num == 1, "only 1 frame can already be printed");
+    ASSERT((buf != NULL && sofar != NULL && pcs == NULL) ||
+           (buf == NULL && sofar == NULL && pcs != NULL),
+           "print_callstack: can't pass buf and pcs");
+
+#ifdef DEBUG
+    if (mc != NULL && op_callstack_dump_stack > 0)
+        dump_app_stack(drcontext, pt, mc, op_callstack_dump_stack,
+                       (pcs == NULL ? NULL : PCS_FRAME_LOC(pcs, 0).addr));
+#endif
+
+#ifdef WINDOWS
+    if (mc != NULL && pt != NULL && mc->xsp != 0)
+        stack_bounds_validate(pt, (app_pc)mc->xsp);
+#endif
+    if (mc != NULL) {
+        LOG(4, "initial fp="PFX" vs sp="PFX" def=%d\n",
+               mc->xbp, mc->xsp,
+               (op_is_dword_defined == NULL) ? 0 : op_is_dword_defined((byte*)mc->xbp));
+    }
+    if (mc != NULL && mc->xsp != 0 &&
+        (!ALIGNED(mc->xbp, sizeof(void*)) ||
+         mc->xbp < mc->xsp || 
+         mc->xbp - mc->xsp > op_stack_swap_threshold ||
+         (op_ignore_xbp != NULL &&
+          op_ignore_xbp(drcontext, mc)) ||
+         /* avoid stale fp,ra pair (i#640) */
+         (op_is_dword_defined != NULL &&
+          (!op_is_dword_defined((byte*)mc->xbp) ||
+           !op_is_dword_defined((byte*)mc->xbp + sizeof(void*)))) ||
+         (mc->xbp != 0 &&
+          (!stack_read(pt, (byte *)mc->xbp, sizeof(appdata), &appdata) ||
+           /* check the very first retaddr since ebp might point at
+            * a misleading stack slot
+            */
+           (!TEST(FP_DO_NOT_CHECK_FIRST_RETADDR, op_fp_flags) &&
+            !is_retaddr(appdata.retaddr)))))) {
+        /* We may start out in the middle of a frameless function that is
+         * using ebp for other purposes.  Heuristic: scan stack for fp + retaddr.
+         */
+        LOG(4, "find_next_fp b/c starting w/ non-fp ebp "PFX" (def=%d %d)\n", mc->xbp,
+            op_is_dword_defined == NULL ? 0 : op_is_dword_defined((byte*)mc->xbp),
+            op_is_dword_defined == NULL ? 0 : op_is_dword_defined((byte*)mc->xbp +
+                                                                  sizeof(void*)));
+        pc = (ptr_uint_t *) find_next_fp(pt, (app_pc)mc->xsp, true/*top frame*/,
+                                         &custom_retaddr);
+        scanned = true;
+    }
+    while (pc != NULL) {
+        if (!have_appdata &&
+            !stack_read(pt, (byte *)pc, sizeof(appdata), &appdata)) {
+            LOG(4, "truncating callstack: can't read "PFX"\n", pc);
             break;
         }
         LOG(4, "print_callstack: pc="PFX" => FP="PFX", RA="PFX"\n",
@@ -1219,7 +2007,7 @@ print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
                  op_stack_swap_threshold);
             app_pc next_fp = appdata.next_fp;
             if (!out_of_range &&
-                !safe_read((byte *)next_fp, sizeof(appdata), &appdata)) {
+                !stack_read(pt, (byte *)next_fp, sizeof(appdata), &appdata)) {
                 LOG(4, "truncating callstack: can't read "PFX"\n", pc);
                 break;
             }
@@ -1338,21 +2126,46 @@ void
 packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
                         app_loc_t *loc)
 {
-    packed_callstack_t *pcs = (packed_callstack_t *)
-        global_alloc(sizeof(*pcs), HEAPSTAT_CALLSTACK);
-    size_t sz_out;
+    packed_callstack_record_ex(pcs_out, mc, loc, false/*resolve now*/);
+}
+
+/* A heap callstack is a single allocation: the header, then the syscall loc
+ * if any, then the frames.  Both the header and syscall_loc_t are
+ * pointer-size multiples, so the frames stay aligned.
+ */
+static size_t
+packed_callstack_alloc_size(bool is_packed, bool first_is_syscall, uint num_frames)
+{
+    return sizeof(packed_callstack_t) +
+        (first_is_syscall ? sizeof(syscall_loc_t) : 0) +
+        (is_packed ? sizeof(packed_frame_t) : sizeof(full_frame_t)) * num_frames;
+}
+
+/* Scratch space for one callstack of op_max_frames frames of either kind */
+static size_t
+packed_callstack_scratch_size(void)
+{
+    return packed_callstack_alloc_size(false, true, op_max_frames);
+}
+
+/* Records into scratch, which must have packed_callstack_scratch_size() bytes */
+static void
+packed_callstack_record_scratch_ex(byte *scratch, dr_mcontext_t *mc, app_loc_t *loc,
+                                   bool raw)
+{
+    packed_callstack_t *pcs = (packed_callstack_t *) scratch;
+    syscall_loc_t *sysloc = (syscall_loc_t *) (pcs + 1);
     int num_frames_printed = 0;
-    ASSERT(pcs_out != NULL, "invalid args");
     memset(pcs, 0, sizeof(*pcs));
+    /* never freed: see packed_callstack_record_scratch() */
     pcs->refcount = 1;
+    pcs->is_raw = raw;
     if (modname_array_end < MAX_MODNAMES_STORED) {
         pcs->is_packed = true;
-        pcs->frames.packed = (packed_frame_t *)
-            global_alloc(sizeof(*pcs->frames.packed) * op_max_frames, HEAPSTAT_CALLSTACK);
+        pcs->frames.packed = (packed_frame_t *) (sysloc + 1);
     } else {
         pcs->is_packed = false;
-        pcs->frames.full = (full_frame_t *)
-            global_alloc(sizeof(*pcs->frames.full) * op_max_frames, HEAPSTAT_CALLSTACK);
+        pcs->frames.full = (full_frame_t *) (sysloc + 1);
     }
     if (loc != NULL) {
         if (loc->type == APP_LOC_SYSCALL) {
@@ -1362,16 +2175,13 @@ packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
              * and compare it by just using its address.
              */
             pcs->first_is_syscall = true;
+            *sysloc = loc->u.syscall;
             if (pcs->is_packed) {
                 pcs->frames.packed[0].modname_idx = 0;
-                pcs->frames.packed[0].loc.sysloc = (syscall_loc_t *)
-                    global_alloc(sizeof(syscall_loc_t), HEAPSTAT_CALLSTACK);
-                *pcs->frames.packed[0].loc.sysloc = loc->u.syscall;
+                pcs->frames.packed[0].loc.sysloc = sysloc;
             } else {
                 pcs->frames.full[0].modname = (modname_info_t *) &MODNAME_INFO_SYSCALL;
-                pcs->frames.full[0].loc.sysloc = (syscall_loc_t *)
-                    global_alloc(sizeof(syscall_loc_t), HEAPSTAT_CALLSTACK);
-                *pcs->frames.full[0].loc.sysloc = loc->u.syscall;
+                pcs->frames.full[0].loc.sysloc = sysloc;
             }
             pcs->num_frames++;
         } else {
@@ -1381,33 +2191,280 @@ packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
         }
         num_frames_printed = 1;
     }
+    if (mc != NULL && op_shadow_call_stack && shadow_stack_record(pcs, mc))
+        return;
+#ifdef LINUX
+    if (mc != NULL && op_cfi_unwind && cfi_unwind_record(pcs, mc))
+        return;
+#endif
     print_callstack(NULL, 0, NULL, mc, false, pcs, num_frames_printed, false);
-    if (pcs->is_packed) {
-        packed_frame_t *frames_out;
-        sz_out = sizeof(*pcs->frames.packed) * pcs->num_frames;
-        if (sz_out == 0)
-            frames_out = NULL;
-        else {
-            frames_out = (packed_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
-            memcpy(frames_out, pcs->frames.packed, sz_out);
+}
+
+packed_callstack_t *
+packed_callstack_record_scratch(dr_mcontext_t *mc, app_loc_t *loc, bool raw)
+{
+    void *drcontext = dr_get_current_drcontext();
+    tls_callstack_t *pt = (drcontext == NULL) ? NULL : (tls_callstack_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    if (pt == NULL)
+        return NULL;
+    packed_callstack_record_scratch_ex(pt->scratch_pcs, mc, loc, raw);
+    return (packed_callstack_t *) pt->scratch_pcs;
+}
+
+static size_t
+packed_callstack_size(packed_callstack_t *pcs)
+{
+    if (pcs->is_trie)
+        return sizeof(*pcs);
+    return packed_callstack_alloc_size(pcs->is_packed, pcs->first_is_syscall,
+                                       pcs->num_frames);
+}
+
+static void
+packed_callstack_copy_header(packed_callstack_t *dst, packed_callstack_t *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    dst->refcount = 1;
+    dst->num_frames = src->num_frames;
+    dst->is_packed = src->is_packed;
+    dst->first_is_retaddr = src->first_is_retaddr;
+    dst->first_is_syscall = src->first_is_syscall;
+    dst->is_raw = src->is_raw;
+    dst->resolve_gen = src->resolve_gen;
+}
+
+static size_t
+frame_node_size(bool is_syscall)
+{
+    return sizeof(frame_node_t) + (is_syscall ? sizeof(syscall_loc_t) : 0);
+}
+
+static uint
+frame_node_hash(void *key)
+{
+    frame_node_t *node = (frame_node_t *) key;
+    ptr_uint_t val = node->is_syscall ?
+        (ptr_uint_t) node->frame.packed.loc.sysloc->sysnum.number :
+        (ptr_uint_t) node->frame.packed.loc.addr;
+    return ohash_hash_ptr(node->parent) ^ ((uint)val * 0x9e3779b1U);
+}
+
+static bool
+frame_node_cmp(void *key1, void *key2)
+{
+    frame_node_t *node1 = (frame_node_t *) key1;
+    frame_node_t *node2 = (frame_node_t *) key2;
+    if (node1->parent != node2->parent || node1->is_packed != node2->is_packed ||
+        node1->is_syscall != node2->is_syscall)
+        return false;
+    if (node1->is_syscall) {
+        return (memcmp(node1->frame.packed.loc.sysloc, node2->frame.packed.loc.sysloc,
+                       sizeof(syscall_loc_t)) == 0);
+    }
+    return (memcmp(&node1->frame, &node2->frame, node1->is_packed ?
+                   sizeof(packed_frame_t) : sizeof(full_frame_t)) == 0);
+}
+
+static void
+frame_node_free(void *p)
+{
+    frame_node_t *node = (frame_node_t *) p;
+    global_free(node, frame_node_size(node->is_syscall), HEAPSTAT_CALLSTACK);
+}
+
+/* Drops a callstack's reference to its leaf, freeing each node up the
+ * chain that is left with no children and no callstacks.
+ */
+static void
+frame_trie_release(frame_node_t *leaf)
+{
+    frame_node_t *node = leaf;
+    if (frame_trie_exited)
+        return;
+    ohashtable_lock(&frame_trie_table);
+    while (node != NULL) {
+        frame_node_t *parent = node->parent;
+        ASSERT(node->refcount > 0, "frame node refcount underflow");
+        if (--node->refcount > 0)
+            break;
+        /* frees node */
+        ohashtable_remove(&frame_trie_table, node);
+        node = parent;
+    }
+    ohashtable_unlock(&frame_trie_table);
+}
+
+static void
+frame_trie_add_ref(frame_node_t *leaf)
+{
+    ohashtable_lock(&frame_trie_table);
+    leaf->refcount++;
+    ohashtable_unlock(&frame_trie_table);
+}
+
+/* Returns the trie node for the top frame of pcs, which must be resolved
+ * and have at least one frame, adding whatever nodes are missing.  The
+ * caller gets a reference to it.
+ */
+static frame_node_t *
+frame_trie_intern(packed_callstack_t *pcs)
+{
+    frame_node_t *parent = NULL;
+    frame_node_t probe;
+    int i;
+    ASSERT(!pcs->is_raw && !pcs->is_trie && pcs->num_frames > 0, "invalid args");
+    /* hold the lock across each lookup and add */
+    ohashtable_lock(&frame_trie_table);
+    for (i = pcs->num_frames - 1; i >= 0; i--) {
+        frame_node_t *node;
+        memset(&probe, 0, sizeof(probe));
+        probe.parent = parent;
+        probe.is_packed = pcs->is_packed;
+        probe.is_syscall = (i == 0 && pcs->first_is_syscall);
+        if (pcs->is_packed)
+            probe.frame.packed = pcs->frames.packed[i];
+        else
+            probe.frame.full = pcs->frames.full[i];
+        probe.cstack_hash = (parent == NULL) ? 0 : parent->cstack_hash;
+        if (!probe.is_syscall)
+            probe.cstack_hash ^= (ptr_uint_t) probe.frame.packed.loc.addr;
+        node = (frame_node_t *) ohashtable_lookup(&frame_trie_table, &probe);
+        if (node == NULL) {
+            node = (frame_node_t *)
+                global_alloc(frame_node_size(probe.is_syscall), HEAPSTAT_CALLSTACK);
+            *node = probe;
+            if (node->is_syscall) {
+                syscall_loc_t *sysloc = (syscall_loc_t *) (node + 1);
+                *sysloc = *probe.frame.packed.loc.sysloc;
+                node->frame.packed.loc.sysloc = sysloc;
+            }
+            ohashtable_add_replace(&frame_trie_table, node, node);
+            /* the new child's reference */
+            if (parent != NULL)
+                parent->refcount++;
         }
-        global_free(pcs->frames.packed, sizeof(*pcs->frames.packed) * op_max_frames,
-                    HEAPSTAT_CALLSTACK);
-        pcs->frames.packed = frames_out;
+        parent = node;
+    }
+    /* the caller's reference */
+    parent->refcount++;
+    ohashtable_unlock(&frame_trie_table);
+    return parent;
+}
+
+/* Copies src into a single new allocation, keeping it raw if it is.
+ * With -callstack_frame_trie, resolved callstacks are put in the trie.
+ */
+static packed_callstack_t *
+packed_callstack_copy(packed_callstack_t *src)
+{
+    size_t sz;
+    packed_callstack_t *dst;
+    syscall_loc_t *sysloc;
+    void *frames;
+    if (src->is_trie || (op_frame_trie && !src->is_raw && src->num_frames > 0)) {
+        dst = (packed_callstack_t *) global_alloc(sizeof(*dst), HEAPSTAT_CALLSTACK);
+        packed_callstack_copy_header(dst, src);
+        dst->is_trie = true;
+        if (src->is_trie) {
+            dst->frames.leaf = src->frames.leaf;
+            frame_trie_add_ref(dst->frames.leaf);
+        } else
+            dst->frames.leaf = frame_trie_intern(src);
+        return dst;
+    }
+    sz = packed_callstack_alloc_size(src->is_packed, src->first_is_syscall,
+                                     src->num_frames);
+    dst = (packed_callstack_t *) global_alloc(sz, HEAPSTAT_CALLSTACK);
+    sysloc = (syscall_loc_t *) (dst + 1);
+    frames = src->first_is_syscall ? (void *) (sysloc + 1) : (void *) sysloc;
+    packed_callstack_copy_header(dst, src);
+    if (dst->num_frames == 0)
+        frames = NULL;
+    if (dst->is_packed) {
+        dst->frames.packed = (packed_frame_t *) frames;
+        memcpy(dst->frames.packed, src->frames.packed,
+               sizeof(*dst->frames.packed) * src->num_frames);
     } else {
-        full_frame_t *frames_out;
-        sz_out = sizeof(*pcs->frames.full) * pcs->num_frames;
-        if (sz_out == 0)
-            frames_out = NULL;
-        else {
-            frames_out = (full_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
-            memcpy(frames_out, pcs->frames.full, sz_out);
-        }
-        global_free(pcs->frames.full, sizeof(*pcs->frames.full) * op_max_frames,
-                    HEAPSTAT_CALLSTACK);
-        pcs->frames.full = frames_out;
+        dst->frames.full = (full_frame_t *) frames;
+        memcpy(dst->frames.full, src->frames.full,
+               sizeof(*dst->frames.full) * src->num_frames);
+    }
+    if (dst->first_is_syscall) {
+        *sysloc = *PCS_FRAME_LOC(src, 0).sysloc;
+        if (dst->is_packed)
+            dst->frames.packed[0].loc.sysloc = sysloc;
+        else
+            dst->frames.full[0].loc.sysloc = sysloc;
+    }
+    return dst;
+}
+
+packed_callstack_t *
+packed_callstack_from_scratch(packed_callstack_t *scratch)
+{
+    ASSERT(scratch != NULL, "invalid args");
+    return packed_callstack_copy(scratch);
+}
+
+void
+packed_callstack_record_ex(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
+                           app_loc_t *loc, bool raw)
+{
+    packed_callstack_t *scratch;
+    ASSERT(pcs_out != NULL, "invalid args");
+    scratch = packed_callstack_record_scratch(mc, loc, raw);
+    if (scratch != NULL)
+        *pcs_out = packed_callstack_copy(scratch);
+    else {
+        /* no per-thread scratch yet (or anymore) */
+        size_t sz = packed_callstack_scratch_size();
+        byte *buf = (byte *) global_alloc(sz, HEAPSTAT_CALLSTACK);
+        packed_callstack_record_scratch_ex(buf, mc, loc, raw);
+        *pcs_out = packed_callstack_copy((packed_callstack_t *) buf);
+        global_free(buf, sz, HEAPSTAT_CALLSTACK);
+    }
+}
+
+/* Fills in the module info of a raw callstack's frames, in place.  Concurrent
+ * readers see either the raw frames, which they look up themselves, or the
+ * finished ones, as is_raw is cleared last.
+ */
+static void
+packed_callstack_resolve_frames(packed_callstack_t *pcs)
+{
+    uint i;
+    ASSERT(pcs->is_raw, "already resolved");
+    for (i = (pcs->first_is_syscall ? 1 : 0); i < pcs->num_frames; i++) {
+        app_pc pc = PCS_FRAME_LOC(pcs, i).addr;
+        app_pc mod_start;
+        modname_info_t *name_info;
+        if (module_lookup(pc, &mod_start, NULL, &name_info))
+            set_module_frame(pcs, i, pc, mod_start, name_info);
+        else
+            set_non_module_frame(pcs, i, pc);
+    }
+    pcs->is_raw = false;
+}
+
+bool
+packed_callstack_resolve(packed_callstack_t *pcs, app_pc start, app_pc end)
+{
+    uint i;
+    if (!pcs->is_raw)
+        return false;
+    for (i = (pcs->first_is_syscall ? 1 : 0); i < pcs->num_frames; i++) {
+        app_pc pc = PCS_FRAME_LOC(pcs, i).addr;
+        if (pc >= start && pc < end)
+            break;
     }
-    *pcs_out = pcs;
+    if (i == pcs->num_frames)
+        return false;
+    dr_mutex_lock(modtree_lock);
+    pcs->resolve_gen = module_unload_count + 1;
+    dr_mutex_unlock(modtree_lock);
+    packed_callstack_resolve_frames(pcs);
+    return true;
 }
 
 void
@@ -1416,38 +2473,57 @@ packed_callstack_first_frame_retaddr(packed_callstack_t *pcs)
     pcs->first_is_retaddr = true;
 }
 
-/* Returns false if a syscall.  If returns true, also fills in the OUT params. */
+/* Returns false if a syscall.  If returns true, also fills in the OUT params.
+ * node is as for pcs_frame_loc().
+ */
 static bool
-packed_callstack_frame_modinfo(packed_callstack_t *pcs, uint frame,
+packed_callstack_frame_modinfo(packed_callstack_t *pcs, uint frame, frame_node_t *node,
                                modname_info_t **name_info OUT, size_t *modoffs OUT)
 {
     modname_info_t *info = NULL;
     size_t offs = 0;
     ASSERT(pcs != NULL, "invalid arg");
     ASSERT(frame < pcs->num_frames, "invalid arg");
+    if (pcs->is_raw && (frame > 0 || !pcs->first_is_syscall)) {
+        /* the module can't have been unloaded, else we'd have been resolved */
+        app_pc pc = pcs_frame_loc(pcs, frame, node)->addr;
+        app_pc mod_start;
+        if (module_lookup(pc, &mod_start, NULL, &info))
+            offs = pc - mod_start;
+        if (name_info != NULL)
+            *name_info = info;
+        if (modoffs != NULL)
+            *modoffs = offs;
+        return true;
+    }
+    if (pcs->is_trie && node == NULL)
+        node = frame_node_at(pcs->frames.leaf, frame);
     /* modname_idx==0 or modname==NULL is the code for a system call */
     if (!pcs->is_packed) {
-        info = pcs->frames.full[frame].modname;
+        full_frame_t *full = pcs->is_trie ? &node->frame.full : &pcs->frames.full[frame];
+        info = full->modname;
         if (info == &MODNAME_INFO_SYSCALL) {
             ASSERT(frame == 0, "syscall should only be top frame");
             ASSERT(pcs->first_is_syscall, "flag not set");
             return false;
         }
-        offs = pcs->frames.full[frame].modoffs;
+        offs = full->modoffs;
     } else {
-        if (pcs->frames.packed[frame].modname_idx == 0) {
+        packed_frame_t *packed = pcs->is_trie ?
+            &node->frame.packed : &pcs->frames.packed[frame];
+        if (packed->modname_idx == 0) {
             ASSERT(frame == 0, "syscall should only be top frame");
             ASSERT(pcs->first_is_syscall, "flag not set");
             return false;
         }
-        if (pcs->frames.packed[frame].modoffs < MAX_MODOFFS_STORED) {
+        if (packed->modoffs < MAX_MODOFFS_STORED) {
             /* If module is larger than 16M, we need to adjust offset.
              * The hashtable holds the first index.
              */
             int start_idx;
-            int idx = pcs->frames.packed[frame].modname_idx;
+            int idx = packed->modname_idx;
             ASSERT(idx < MAX_MODNAMES_STORED, "invalid modname idx");
-            offs = pcs->frames.packed[frame].modoffs;
+            offs = packed->modoffs;
             info = modname_array[idx];
             start_idx = info->index;
             ASSERT(start_idx != 0, "module in array must be in table");
@@ -1462,20 +2538,23 @@ packed_callstack_frame_modinfo(packed_callstack_t *pcs, uint frame,
     return true;
 }
 
+/* node is as for pcs_frame_loc() */
 static void
 packed_frame_to_symbolized(packed_callstack_t *pcs IN, symbolized_frame_t *frame OUT,
-                           uint idx)
+                           uint idx, frame_node_t *node)
 {
     modname_info_t *info = NULL;
     size_t offs;
     init_symbolized_frame(frame, idx);
-    if (!packed_callstack_frame_modinfo(pcs, idx, &info, &offs)) {
+    if (pcs->is_trie && node == NULL)
+        node = frame_node_at(pcs->frames.leaf, idx);
+    if (!packed_callstack_frame_modinfo(pcs, idx, node, &info, &offs)) {
         size_t sofar = 0;
         ssize_t len;
         const char *name = "<unknown>";
         frame->loc.type = APP_LOC_SYSCALL;
 
-        frame->loc.u.syscall = *(PCS_FRAME_LOC(pcs, idx).sysloc);
+        frame->loc.u.syscall = *(pcs_frame_loc(pcs, idx, node)->sysloc);
 
         /* we print the string now so we can compare to suppressions.
          * we use func since modname is too short in windows.
@@ -1499,7 +2578,7 @@ packed_frame_to_symbolized(packed_callstack_t *pcs IN, symbolized_frame_t *frame
         }
         NULL_TERMINATE_BUFFER(frame->func);
     } else {
-        pc_to_loc(&frame->loc, PCS_FRAME_LOC(pcs, idx).addr);
+        pc_to_loc(&frame->loc, pcs_frame_loc(pcs, idx, node)->addr);
         if (info != NULL) {
             const char *modname = (info->name == NULL) ?
                 "<name unavailable>" : info->name;
@@ -1538,9 +2617,12 @@ packed_callstack_print(packed_callstack_t *pcs, uint num_frames,
 {
     uint i;
     symbolized_frame_t frame; /* 480 bytes but our stack can handle it */
+    frame_node_t *node;
     ASSERT(pcs != NULL, "invalid args");
-    for (i = 0; i < pcs->num_frames && (num_frames == 0 || i < num_frames); i++) {
-        packed_frame_to_symbolized(pcs, &frame, i);
+    node = pcs->is_trie ? pcs->frames.leaf : NULL;
+    for (i = 0; i < pcs->num_frames && (num_frames == 0 || i < num_frames);
+         i++, node = (node == NULL ? NULL : node->parent)) {
+        packed_frame_to_symbolized(pcs, &frame, i, node);
         print_frame(&frame, buf, bufsz, sofar, false, 0, 0, prefix);
         if (op_truncate_below != NULL &&
             text_matches_any_pattern((const char *)frame.func, op_truncate_below, false))
@@ -1553,13 +2635,16 @@ packed_callstack_to_symbolized(packed_callstack_t *pcs IN,
                                symbolized_callstack_t *scs OUT)
 {
     uint i;
+    frame_node_t *node;
     scs->num_frames = pcs->num_frames;
     scs->num_frames_allocated = pcs->num_frames;
     scs->frames = (symbolized_frame_t *)
         global_alloc(sizeof(*scs->frames) * scs->num_frames, HEAPSTAT_CALLSTACK);
     ASSERT(pcs != NULL, "invalid args");
-    for (i = 0; i < pcs->num_frames; i++) {
-        packed_frame_to_symbolized(pcs, &scs->frames[i], i);
+    node = pcs->is_trie ? pcs->frames.leaf : NULL;
+    for (i = 0; i < pcs->num_frames;
+         i++, node = (node == NULL ? NULL : node->parent)) {
+        packed_frame_to_symbolized(pcs, &scs->frames[i], i, node);
         /* we truncate for real and not just on printing (i#700) */
         if (op_truncate_below != NULL &&
             text_matches_any_pattern((const char *)scs->frames[i].func,
@@ -1601,31 +2686,27 @@ packed_callstack_log(packed_callstack_t *pcs, file_t f)
 #endif
 
 uint
-packed_callstack_free(packed_callstack_t *pcs)
+packed_callstack_release(packed_callstack_t *pcs)
 {
-    uint refcount;
     ASSERT(pcs != NULL, "invalid args");
-    refcount = atomic_add32_return_sum((volatile int *)&pcs->refcount, - 1);
-    if (refcount == 0) {
-        if (pcs->first_is_syscall) {
-            global_free(PCS_FRAME_LOC(pcs, 0).sysloc, sizeof(syscall_loc_t),
-                        HEAPSTAT_CALLSTACK);
-        }
-        if (pcs->is_packed) {
-            if (pcs->frames.packed != NULL) {
-                global_free(pcs->frames.packed,
-                            sizeof(*pcs->frames.packed)*pcs->num_frames,
-                            HEAPSTAT_CALLSTACK);
-            }
-        } else {
-            if (pcs->frames.full != NULL) {
-                global_free(pcs->frames.full,
-                            sizeof(*pcs->frames.full)*pcs->num_frames,
-                            HEAPSTAT_CALLSTACK);
-            }
-        }
-        global_free(pcs, sizeof(*pcs), HEAPSTAT_CALLSTACK);
-    }
+    return atomic_add32_return_sum((volatile int *)&pcs->refcount, - 1);
+}
+
+void
+packed_callstack_destroy(packed_callstack_t *pcs)
+{
+    ASSERT(pcs != NULL && pcs->refcount == 0, "invalid args");
+    if (pcs->is_trie)
+        frame_trie_release(pcs->frames.leaf);
+    global_free(pcs, packed_callstack_size(pcs), HEAPSTAT_CALLSTACK);
+}
+
+uint
+packed_callstack_free(packed_callstack_t *pcs)
+{
+    uint refcount = packed_callstack_release(pcs);
+    if (refcount == 0)
+        packed_callstack_destroy(pcs);
     return refcount;
 }
 
@@ -1636,42 +2717,43 @@ packed_callstack_add_ref(packed_callstack_t *pcs)
     ATOMIC_INC32(pcs->refcount);
 }
 
+bool
+packed_callstack_add_ref_if_live(packed_callstack_t *pcs)
+{
+    int count;
+    ASSERT(pcs != NULL, "invalid args");
+    do {
+        count = *(volatile int *)&pcs->refcount;
+        if (count == 0)
+            return false;
+    } while (!atomic_compare_exchange32((volatile int *)&pcs->refcount,
+                                        count, count + 1));
+    return true;
+}
+
+bool
+packed_callstack_release_last(packed_callstack_t *pcs)
+{
+    ASSERT(pcs != NULL, "invalid args");
+    return atomic_compare_exchange32((volatile int *)&pcs->refcount, 1, 0);
+}
+
+uint
+packed_callstack_refcount(packed_callstack_t *pcs)
+{
+    ASSERT(pcs != NULL, "invalid args");
+    return pcs->refcount;
+}
+
 packed_callstack_t *
 packed_callstack_clone(packed_callstack_t *src)
 {
-    packed_callstack_t *dst = (packed_callstack_t *)
-        global_alloc(sizeof(*dst), HEAPSTAT_CALLSTACK);
+    packed_callstack_t *dst;
     ASSERT(src != NULL, "invalid args");
-    memset(dst, 0, sizeof(*dst));
-    dst->refcount = 1;
-    dst->num_frames = src->num_frames;
-    dst->is_packed = src->is_packed;
-    dst->first_is_retaddr = src->first_is_retaddr;
-    dst->first_is_syscall = src->first_is_syscall;
-    if (dst->is_packed) {
-        dst->frames.packed = (packed_frame_t *)
-            global_alloc(sizeof(*dst->frames.packed) * src->num_frames,
-                         HEAPSTAT_CALLSTACK);
-        memcpy(dst->frames.packed, src->frames.packed,
-               sizeof(*dst->frames.packed) * src->num_frames);
-    } else {
-        dst->frames.full = (full_frame_t *)
-            global_alloc(sizeof(*dst->frames.full) * src->num_frames,
-                         HEAPSTAT_CALLSTACK);
-        memcpy(dst->frames.full, src->frames.full,
-               sizeof(*dst->frames.full) * src->num_frames);
-    }
-    if (dst->first_is_syscall) {
-        if (dst->is_packed) {
-            dst->frames.packed[0].loc.sysloc = (syscall_loc_t *)
-                global_alloc(sizeof(syscall_loc_t), HEAPSTAT_CALLSTACK);
-        } else {
-            dst->frames.full[0].loc.sysloc = (syscall_loc_t *)
-                global_alloc(sizeof(syscall_loc_t), HEAPSTAT_CALLSTACK);
-        }
-        memcpy(PCS_FRAME_LOC(dst, 0).sysloc, PCS_FRAME_LOC(src, 0).sysloc,
-               sizeof(syscall_loc_t));
-    }
+    dst = packed_callstack_copy(src);
+    /* clones outlive the fixups at module unload so we resolve them now */
+    if (dst->is_raw)
+        packed_callstack_resolve_frames(dst);
     return dst;
 }
 
@@ -1680,6 +2762,8 @@ packed_callstack_hash(packed_callstack_t *pcs)
 {
     uint hash = 0;
     uint i;
+    if (pcs->is_trie)
+        return pcs->frames.leaf->cstack_hash;
     for (i = 0; i < pcs->num_frames; i++) {
         if (!pcs->first_is_syscall || i > 0)
             hash ^= (ptr_uint_t) PCS_FRAME_LOC(pcs, i).addr;
@@ -1691,6 +2775,7 @@ bool
 packed_callstack_cmp(packed_callstack_t *pcs1, packed_callstack_t *pcs2)
 {
     uint i;
+    frame_node_t *node1, *node2;
     if (PCS_FRAMES(pcs1) == NULL) {
         if (PCS_FRAMES(pcs2) != NULL)
             return false;
@@ -1700,7 +2785,13 @@ packed_callstack_cmp(packed_callstack_t *pcs1, packed_callstack_t *pcs2)
         return false;
     if (pcs1->num_frames != pcs2->num_frames)
         return false;
-    if (!pcs1->first_is_syscall && !pcs2->first_is_syscall &&
+    if (pcs1->is_raw != pcs2->is_raw || pcs1->resolve_gen != pcs2->resolve_gen)
+        return false;
+    /* trie nodes are interned, so equal frames mean the same leaf */
+    if (pcs1->is_trie && pcs2->is_trie && pcs1->is_packed == pcs2->is_packed)
+        return (pcs1->frames.leaf == pcs2->frames.leaf);
+    if (!pcs1->is_trie && !pcs2->is_trie &&
+        !pcs1->first_is_syscall && !pcs2->first_is_syscall &&
         ((pcs1->is_packed && pcs2->is_packed) ||
          (!pcs1->is_packed && !pcs2->is_packed))) {
         return (memcmp(PCS_FRAMES(pcs1), PCS_FRAMES(pcs2),
@@ -1709,19 +2800,32 @@ packed_callstack_cmp(packed_callstack_t *pcs1, packed_callstack_t *pcs2)
     /* One is packed, the other is not; or, one has a syscall.
      * We have to walk the frames.
      */
+    node1 = pcs1->is_trie ? pcs1->frames.leaf : NULL;
+    node2 = pcs2->is_trie ? pcs2->frames.leaf : NULL;
     for (i = 0; i < pcs1->num_frames; i++) {
         modname_info_t *info1 = NULL, *info2 = NULL;
         size_t offs1 = 0, offs2 = 0;
         bool nonsys1, nonsys2;
-        nonsys1 = packed_callstack_frame_modinfo(pcs1, i, &info1, &offs1);
-        nonsys2 = packed_callstack_frame_modinfo(pcs2, i, &info2, &offs2);
+        frame_loc_t *loc1, *loc2;
+        /* Walk a trie's parents in step with i rather than re-walking from
+         * the leaf for every frame.
+         */
+        if (i > 0) {
+            if (node1 != NULL)
+                node1 = node1->parent;
+            if (node2 != NULL)
+                node2 = node2->parent;
+        }
+        nonsys1 = packed_callstack_frame_modinfo(pcs1, i, node1, &info1, &offs1);
+        nonsys2 = packed_callstack_frame_modinfo(pcs2, i, node2, &info2, &offs2);
         if ((nonsys1 && !nonsys2) || (!nonsys1 && nonsys2))
             return false;
+        loc1 = pcs_frame_loc(pcs1, i, node1);
+        loc2 = pcs_frame_loc(pcs2, i, node2);
         if (!nonsys1) {
-            return (memcmp(PCS_FRAME_LOC(pcs1, i).sysloc, PCS_FRAME_LOC(pcs2, i).sysloc,
-                           sizeof(syscall_loc_t)) == 0);
+            return (memcmp(loc1->sysloc, loc2->sysloc, sizeof(syscall_loc_t)) == 0);
         } else {
-            if (PCS_FRAME_LOC(pcs1, i).addr != PCS_FRAME_LOC(pcs2, i).addr)
+            if (loc1->addr != loc2->addr)
                 return false;
             if (info1 != info2)
                 return false;
@@ -1735,6 +2839,8 @@ packed_callstack_cmp(packed_callstack_t *pcs1, packed_callstack_t *pcs2)
 void
 packed_callstack_md5(packed_callstack_t *pcs, byte digest[MD5_RAW_BYTES])
 {
+    ASSERT(!pcs->is_raw, "raw callstacks are not supported");
+    ASSERT(!pcs->is_trie, "trie callstacks are not supported");
     if (pcs->num_frames == 0) {
         memset(digest, 0, sizeof(digest[0])*MD5_RAW_BYTES);
     } else {
@@ -1746,6 +2852,8 @@ packed_callstack_md5(packed_callstack_t *pcs, byte digest[MD5_RAW_BYTES])
 void
 packed_callstack_crc32(packed_callstack_t *pcs, uint crc[2])
 {
+    ASSERT(!pcs->is_raw, "raw callstacks are not supported");
+    ASSERT(!pcs->is_trie, "trie callstacks are not supported");
     crc32_whole_and_half((const char *)PCS_FRAMES(pcs),
                          PCS_FRAME_SZ(pcs)*pcs->num_frames, crc);
 }
@@ -1979,10 +3087,24 @@ callstack_module_load(void *drcontext, const module_data_t *info, bool loaded)
         callstack_module_add_region(seg_base, info->segments[i - 1].end, name_info);
     }
 #endif
-    /* update cached values */
-    modtree_last_hit = NULL;
-    modtree_last_miss = NULL;
+    module_array_publish();
     dr_mutex_unlock(modtree_lock);
+
+#ifdef LINUX
+    if (op_cfi_unwind) {
+        /* parse outside the lock: walks only need it for the insert */
+        unwind_module_t *mod = unwind_module_create(info);
+        if (mod != NULL) {
+            rb_node_t *node;
+            dr_rwlock_write_lock(unwind_lock);
+            node = rb_insert(unwind_tree, info->start, info->end - info->start, mod);
+            dr_rwlock_write_unlock(unwind_lock);
+            ASSERT(node == NULL, "new module overlaps w/ existing");
+            if (node != NULL)
+                unwind_module_free(mod);
+        }
+    }
+#endif
 }
 
 void
@@ -2035,79 +3157,186 @@ callstack_module_unload(void *drcontext, const module_data_t *info)
         modtree_min_start = node_start;
     } else
         modtree_min_start = NULL;
-    modtree_last_start = NULL;
-    modtree_last_hit = NULL;
-    modtree_last_miss = NULL;
+    module_array_publish();
+    module_unload_count++;
+    memset(retaddr_cache, 0, sizeof(retaddr_cache));
 
     dr_mutex_unlock(modtree_lock);
+
+#ifdef LINUX
+    if (op_cfi_unwind) {
+        dr_rwlock_write_lock(unwind_lock);
+        node = rb_find(unwind_tree, info->start);
+        if (node != NULL)
+            rb_delete(unwind_tree, node);
+        dr_rwlock_write_unlock(unwind_lock);
+    }
+#endif
+}
+
+/***************************************************************************
+ * Lock-free module lookups.
+ *
+ * Readers hold an epoch read section (epoch_read_enter()) while using
+ * module_array, and a publisher hands the array it replaces to
+ * epoch_defer_free().
+ */
+
+static void
+module_array_free(module_array_t *array)
+{
+    global_free(array, MODULE_ARRAY_SIZE(array->num), HEAPSTAT_CALLSTACK);
 }
 
+static void
+module_array_free_retired(void *array, void *data)
+{
+    module_array_free((module_array_t *) array);
+}
+
+typedef struct _module_array_fill_t {
+    module_array_t *array;
+    uint num;
+} module_array_fill_t;
+
 static bool
-module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **name)
+module_array_fill_cb(rb_node_t *node, void *iter_data)
 {
-    rb_node_t *node;
-    bool res = false;
-    dr_mutex_lock(modtree_lock);
-    /* We cache to avoid the rb_in_node cost */
-    if (modtree_last_start != NULL &&
-        pc >= modtree_last_start && pc < modtree_last_start + modtree_last_size) {
-        /* use cached values */
-        res = true;
-        LOG(5, "module_lookup: using cached "PFX"\n", modtree_last_start);
+    module_array_fill_t *fill = (module_array_fill_t *) iter_data;
+    if (fill->array != NULL) {
+        module_range_t *range = &fill->array->range[fill->num];
+        size_t size;
+        rb_node_fields(node, &range->start, &size, (void **) &range->name_info);
+        range->end = range->start + size;
+    }
+    fill->num++;
+    return true;
+}
+
+/* Replaces module_array w/ a copy of module_tree.  Caller must hold modtree_lock. */
+static void
+module_array_publish(void)
+{
+    module_array_t *old = module_array;
+    module_array_fill_t fill = {NULL, 0};
+    uint num;
+    rb_iterate(module_tree, module_array_fill_cb, &fill);
+    num = fill.num;
+    fill.array = (module_array_t *) global_alloc(MODULE_ARRAY_SIZE(num),
+                                                 HEAPSTAT_CALLSTACK);
+    fill.array->gen = ++module_array_gen;
+    fill.array->num = num;
+    fill.num = 0;
+    rb_iterate(module_tree, module_array_fill_cb, &fill);
+    ASSERT(fill.num == num, "module tree changed under lock");
+    /* the contents must be visible before the array */
+    MEMORY_STORE_BARRIER();
+    module_array = fill.array;
+    if (old != NULL)
+        epoch_defer_free((void *)old, module_array_free_retired, NULL);
+}
+
+/* Returns the calling thread's state, or NULL if it has none */
+static tls_callstack_t *
+module_reader(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    if (drcontext == NULL || tls_idx_callstack < 0)
+        return NULL;
+    return (tls_callstack_t *) drmgr_get_tls_field(drcontext, tls_idx_callstack);
+}
+
+static bool
+module_array_search(module_array_t *array, byte *pc, module_range_t *found OUT)
+{
+    uint lo = 0, hi = array->num;
+    /* find the last range starting at or below pc */
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (array->range[mid].start <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || pc >= array->range[lo - 1].end)
+        return false;
+    *found = array->range[lo - 1];
+    return true;
+}
+
+static bool
+module_range_lookup(byte *pc, module_range_t *found OUT)
+{
+    tls_callstack_t *pt = module_reader();
+    void *reader = (pt == NULL) ? NULL : epoch_read_enter();
+    module_array_t *array;
+    module_range_t range;
+    bool outer, res;
+    if (reader == NULL) {
+        dr_mutex_lock(modtree_lock);
+        res = module_array_search(module_array, pc, &range);
+        dr_mutex_unlock(modtree_lock);
     } else {
-        LOG(5, "module_lookup: "PFX" doesn't match cached "PFX"\n",
-            pc, modtree_last_start);
-        node = rb_in_node(module_tree, pc);
-        if (node != NULL) {
+        /* a lookup nested inside another on this thread, from a signal or
+         * a restore-state event, finds this set
+         */
+        outer = pt->module_looking_up;
+        pt->module_looking_up = true;
+        array = module_array;
+        /* Consecutive frames and candidates are often in the same module.
+         * We compare w/ the array's own generation as it is read along
+         * w/ the array.
+         */
+        if (pt->module_last_gen == array->gen &&
+            pc >= pt->module_last.start && pc < pt->module_last.end) {
+            range = pt->module_last;
             res = true;
-            rb_node_fields(node, &modtree_last_start, &modtree_last_size,
-                           (void **) &modtree_last_name_info);
+        } else {
+            res = module_array_search(array, pc, &range);
+            /* a nested lookup leaves the cache alone, as it may have
+             * interrupted the outer one reading it
+             */
+            if (res && !outer) {
+                pt->module_last = range;
+                pt->module_last_gen = array->gen;
+            }
         }
+        pt->module_looking_up = outer;
+        epoch_read_exit(reader);
     }
-    if (res) {
-        if (start != NULL)
-            *start = modtree_last_start;
-        if (size != NULL)
-            *size = modtree_last_size;
-        if (name != NULL)
-            *name = modtree_last_name_info;
-    }
-    dr_mutex_unlock(modtree_lock);
+    if (res && found != NULL)
+        *found = range;
     return res;
 }
 
+static bool
+module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **name)
+{
+    module_range_t range;
+    if (!module_range_lookup(pc, &range)) {
+        LOG(5, "module_lookup: "PFX" is not in a module\n", pc);
+        return false;
+    }
+    if (start != NULL)
+        *start = range.start;
+    if (size != NULL)
+        *size = range.end - range.start;
+    if (name != NULL)
+        *name = range.name_info;
+    return true;
+}
+
 /* this is exported for PR 570839 for is_image() */
 bool
 is_in_module(byte *pc)
 {
-    /* We cache the last page queried for performance */
-    bool res = false;
-    /* This is a perf bottleneck so we use caching.
-     * We read these values w/o a lock, assuming they are written
-     * atomically (since aligned they won't cross cache lines).
+    /* This is a perf bottleneck so we first check the bounds, which we
+     * read w/o a lock, assuming they are written atomically (since aligned
+     * they won't cross cache lines).
      */
     if (pc < modtree_min_start || pc >= modtree_max_end)
-        res = false;
-    else if ((app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE) == modtree_last_miss)
-        res = false;
-    else if ((app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE) == modtree_last_hit)
-        res = true;
-    else {
-        dr_mutex_lock(modtree_lock);
-        LOG(5, "is_in_module: "PFX" missed cached "PFX"-"PFX", miss="PFX", hit="PFX"\n",
-            pc, modtree_min_start, modtree_max_end, modtree_last_miss, modtree_last_hit);
-        res = (rb_in_node(module_tree, pc) != NULL);
-        /* XXX: we could cache the range on a hit, and the range from prev lower
-         * to next higher on a miss: but going to wait for this to show up
-         * in pclookup.
-         */
-        if (res)
-            modtree_last_hit = (app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE);
-        else
-            modtree_last_miss = (app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE);
-        dr_mutex_unlock(modtree_lock);
-    }
-    return res;
+        return false;
+    return module_range_lookup(pc, NULL);
 }
 
 const char *
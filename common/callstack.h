@@ -90,6 +90,11 @@ loc_to_print(app_loc_t *loc);
  * Callstacks
  */
 
+/* priority of the shadow call stack's call and ret instrumentation: after
+ * the main instrumentation so that app registers have been restored
+ */
+#define DRMGR_PRIORITY_INSERT_CALLSTACK 2030
+
 /* Values for the flags parameter to callstack_init.  These control
  * how our callstack walking looks for frame pointers when it
  * encounters a discontinuity in the frame links.  We arrange these
@@ -189,11 +194,20 @@ extern uint symbol_names_truncated;
 extern uint cstack_is_retaddr;
 extern uint cstack_is_retaddr_backdecode;
 extern uint cstack_is_retaddr_unreadable;
+extern uint cstack_is_retaddr_cached;
+extern uint cstack_shadow_stack_hits;
+extern uint cstack_shadow_stack_misses;
+extern uint cstack_cfi_frames;
+extern uint cstack_cfi_fallbacks;
+# ifdef WINDOWS
+extern uint cstack_stack_bounds_queries;
+# endif
 #endif
 
 void
 callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
-               uint fp_flags, size_t fp_scan_sz, uint print_flags,
+               uint fp_flags, size_t fp_scan_sz, bool shadow_call_stack,
+               bool cfi_unwind, bool frame_trie, uint print_flags,
                const char *(*get_syscall_name)(drsys_sysnum_t),
                bool (*is_dword_defined)(byte *),
                bool (*ignore_xbp)(void *, dr_mcontext_t *),
@@ -213,6 +227,12 @@ callstack_thread_init(void *drcontext);
 void
 callstack_thread_exit(void *drcontext);
 
+#ifdef WINDOWS
+/* Tells the walker that the thread has moved to the stack holding new_sp */
+void
+callstack_stack_swap(void *drcontext, app_pc new_sp);
+#endif
+
 size_t
 max_callstack_size(void);
 
@@ -227,6 +247,23 @@ void
 packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
                         app_loc_t *loc);
 
+/* If raw is true, only addresses are recorded, saving a module lookup per
+ * frame.  Module info is looked up whenever it is needed, which only works
+ * while the modules are still loaded: so the caller must call
+ * packed_callstack_resolve() on every raw callstack it still holds from
+ * its module unload event, prior to callstack_module_unload().
+ * Clones are always resolved.
+ */
+void
+packed_callstack_record_ex(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
+                           app_loc_t *loc, bool raw);
+
+/* Fills in the module info of pcs if it is raw and has a frame in [start, end).
+ * Returns whether pcs was changed.  Its hash does not change.
+ */
+bool
+packed_callstack_resolve(packed_callstack_t *pcs, app_pc start, app_pc end);
+
 void
 packed_callstack_first_frame_retaddr(packed_callstack_t *pcs);
 
@@ -245,6 +282,47 @@ packed_callstack_free(packed_callstack_t *pcs);
 void
 packed_callstack_add_ref(packed_callstack_t *pcs);
 
+/* Like packed_callstack_free() but leaves freeing a callstack whose count
+ * reaches 0 to the caller, via packed_callstack_destroy().
+ */
+uint
+packed_callstack_release(packed_callstack_t *pcs);
+
+void
+packed_callstack_destroy(packed_callstack_t *pcs);
+
+/* For a callstack found without the lock its releases are made under:
+ * adds a reference unless the count has already reached 0.
+ */
+bool
+packed_callstack_add_ref_if_live(packed_callstack_t *pcs);
+
+/* Drops the sole remaining reference, leaving the count at 0, unless
+ * packed_callstack_add_ref_if_live() added another first.
+ */
+bool
+packed_callstack_release_last(packed_callstack_t *pcs);
+
+/* Records into a per-thread buffer without allocating any memory.  Returns
+ * NULL if the calling thread has no buffer, in which case the caller should
+ * use packed_callstack_record() instead.  The result is only valid until
+ * the thread's next call here and must not be freed or have references
+ * added: use packed_callstack_from_scratch() to keep it.  It may be passed
+ * to the hash, cmp, and print routines.
+ */
+packed_callstack_t *
+packed_callstack_record_scratch(dr_mcontext_t *mc, app_loc_t *loc, bool raw);
+
+/* Returns a new callstack, with one reference, copied from a scratch one.
+ * Unlike packed_callstack_clone(), a raw callstack stays raw.
+ */
+packed_callstack_t *
+packed_callstack_from_scratch(packed_callstack_t *scratch);
+
+/* Only stable if the caller knows no other thread can add a reference */
+uint
+packed_callstack_refcount(packed_callstack_t *pcs);
+
 packed_callstack_t *
 packed_callstack_clone(packed_callstack_t *src);
 
@@ -577,6 +577,35 @@ heap_iterator(void (*cb_region)(app_pc,app_pc _IF_WINDOWS(HANDLE)),
 static rb_tree_t *heap_tree;
 static void *heap_lock;
 
+/* The tree is kept for bounds queries, but membership queries
+ * (is_in_heap_region(), get_heap_region_flags(), and most
+ * is_entirely_in_heap_region() calls) are answered without the lock from a
+ * flat map holding one byte per page.  A page wholly inside one region
+ * holds HEAP_MAP_FULL plus the region's flags, and HEAP_MAP_START too if
+ * the region begins there; a page only partly covered by regions holds
+ * HEAP_MAP_PARTIAL and is answered from the tree.  The map is updated under
+ * heap_lock after the tree, so a racing reader sees either answer for a
+ * page, as it could with the lock.
+ */
+#define HEAP_MAP_FULL    0x80
+#define HEAP_MAP_PARTIAL 0x40
+#define HEAP_MAP_START   0x20
+#define HEAP_MAP_FLAGS   0x1f
+#define HEAP_MAP_UNIT_SHIFT 12
+#define HEAP_MAP_UNIT_SIZE (1 << HEAP_MAP_UNIT_SHIFT)
+/* each second-level table covers 4GB, and only touched pages are committed */
+#define HEAP_MAP_L2_BITS 20
+#define HEAP_MAP_L2_SIZE (1 << HEAP_MAP_L2_BITS)
+#ifdef X64
+/* user-mode addresses fit in 48 bits */
+# define HEAP_MAP_L1_SIZE (1 << (48 - HEAP_MAP_UNIT_SHIFT - HEAP_MAP_L2_BITS))
+#else
+# define HEAP_MAP_L1_SIZE 1
+#endif
+/* Beyond this many pages is_entirely_in_heap_region() uses the tree */
+#define HEAP_MAP_MAX_SCAN 16
+static byte *volatile *heap_map;
+
 /* Payload stored in each node */
 typedef struct _heap_info_t {
     uint flags;
@@ -600,6 +629,80 @@ uint heap_regions;
 static void (*cb_add)(app_pc start, app_pc end, dr_mcontext_t *mc);
 static void (*cb_remove)(app_pc start, app_pc end, dr_mcontext_t *mc);
 
+static inline byte
+heap_map_lookup(app_pc pc)
+{
+    ptr_uint_t unit = (ptr_uint_t)pc >> HEAP_MAP_UNIT_SHIFT;
+    byte *l2;
+    if (heap_map == NULL || unit >> HEAP_MAP_L2_BITS >= HEAP_MAP_L1_SIZE)
+        return HEAP_MAP_PARTIAL; /* have the caller ask the tree */
+    l2 = heap_map[unit >> HEAP_MAP_L2_BITS];
+    if (l2 == NULL)
+        return 0;
+    return ((volatile byte *)l2)[unit & (HEAP_MAP_L2_SIZE - 1)];
+}
+
+/* Caller must hold heap_lock */
+static void
+heap_map_set(app_pc page, byte val)
+{
+    ptr_uint_t unit = (ptr_uint_t)page >> HEAP_MAP_UNIT_SHIFT;
+    byte *l2;
+    if (unit >> HEAP_MAP_L2_BITS >= HEAP_MAP_L1_SIZE)
+        return;
+    l2 = heap_map[unit >> HEAP_MAP_L2_BITS];
+    if (l2 == NULL) {
+        if (val == 0)
+            return;
+        /* zeroed by the allocator, so ready to publish */
+        l2 = (byte *) nonheap_alloc(HEAP_MAP_L2_SIZE,
+                                    DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+        heap_map[unit >> HEAP_MAP_L2_BITS] = l2;
+    }
+    l2[unit & (HEAP_MAP_L2_SIZE - 1)] = val;
+}
+
+/* Caller must hold heap_lock.  Returns the map value for page per the tree. */
+static byte
+heap_map_compute(app_pc page)
+{
+    rb_node_t *node = rb_overlaps_node(heap_tree, page, page + HEAP_MAP_UNIT_SIZE);
+    heap_info_t *info;
+    app_pc node_start;
+    size_t node_size;
+    if (node == NULL)
+        return 0;
+    rb_node_fields(node, &node_start, &node_size, (void **)&info);
+    if (node_start > page || node_start + node_size < page + HEAP_MAP_UNIT_SIZE)
+        return HEAP_MAP_PARTIAL;
+    ASSERT((info->flags & ~HEAP_MAP_FLAGS) == 0, "heap flags do not fit in map");
+    return (HEAP_MAP_FULL | (byte)info->flags |
+            (node_start == page ? HEAP_MAP_START : 0));
+}
+
+/* Caller must hold heap_lock and have updated the tree for [start, end),
+ * which must now lie within a single region or outside all regions.
+ */
+static void
+heap_map_update(app_pc start, app_pc end)
+{
+    app_pc first = (app_pc) ALIGN_BACKWARD(start, HEAP_MAP_UNIT_SIZE);
+    app_pc last = (app_pc) ALIGN_BACKWARD(end - 1, HEAP_MAP_UNIT_SIZE);
+    app_pc page;
+    if (heap_map == NULL || end <= start)
+        return;
+    heap_map_set(first, heap_map_compute(first));
+    if (last == first)
+        return;
+    if (last > first + HEAP_MAP_UNIT_SIZE) {
+        /* the pages in between share one answer */
+        byte val = heap_map_compute(first + HEAP_MAP_UNIT_SIZE);
+        for (page = first + HEAP_MAP_UNIT_SIZE; page < last; page += HEAP_MAP_UNIT_SIZE)
+            heap_map_set(page, val);
+    }
+    heap_map_set(last, heap_map_compute(last));
+}
+
 static void
 heap_info_delete(void *p)
 {
@@ -615,13 +718,23 @@ heap_region_init(void (*region_add_cb)(app_pc, app_pc, dr_mcontext_t *mc),
     cb_add = region_add_cb;
     cb_remove = region_remove_cb;
     heap_tree = rb_tree_create(heap_info_delete);
+    heap_map = (byte *volatile *)
+        nonheap_alloc(HEAP_MAP_L1_SIZE * sizeof(*heap_map),
+                      DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
 }
 
 void
 heap_region_exit(void)
 {
+    uint i;
     dr_mutex_lock(heap_lock);
     rb_tree_destroy(heap_tree);
+    for (i = 0; i < HEAP_MAP_L1_SIZE; i++) {
+        if (heap_map[i] != NULL)
+            nonheap_free(heap_map[i], HEAP_MAP_L2_SIZE, HEAPSTAT_MISC);
+    }
+    nonheap_free((void *)heap_map, HEAP_MAP_L1_SIZE * sizeof(*heap_map), HEAPSTAT_MISC);
+    heap_map = NULL;
     dr_mutex_unlock(heap_lock);
     dr_mutex_destroy(heap_lock);
 }
@@ -642,6 +755,7 @@ heap_region_add(app_pc start, app_pc end, uint flags, dr_mcontext_t *mc)
     IF_DEBUG(existing =)
         rb_insert(heap_tree, start, (end - start), (void *) info);
     ASSERT(existing == NULL, "new heap region overlaps w/ existing");
+    heap_map_update(start, end);
     dr_mutex_unlock(heap_lock);
 }
 
@@ -694,6 +808,7 @@ heap_region_remove(app_pc start, app_pc end, dr_mcontext_t *mc)
             STATS_INC(heap_regions);
         }
         ASSERT(clone == NULL, "error in earlier clone cond");
+        heap_map_update(start, end);
     }
     dr_mutex_unlock(heap_lock);
     return node != NULL;
@@ -719,6 +834,10 @@ heap_region_adjust(app_pc start, app_pc new_end)
         clone = heap_info_clone(info);
         rb_delete(heap_tree, node); /* deletes info */
         rb_insert(heap_tree, node_start, (new_end - node_start), (void *)clone);
+        if (new_end > node_start + node_size)
+            heap_map_update(node_start + node_size, new_end);
+        else
+            heap_map_update(new_end, node_start + node_size);
     }
     dr_mutex_unlock(heap_lock);
     return node != NULL;
@@ -753,6 +872,9 @@ bool
 is_in_heap_region(app_pc pc)
 {
     bool res = false;
+    byte val = heap_map_lookup(pc);
+    if (val != HEAP_MAP_PARTIAL)
+        return TEST(HEAP_MAP_FULL, val);
     dr_mutex_lock(heap_lock);
     res = (rb_in_node(heap_tree, pc) != NULL);
     dr_mutex_unlock(heap_lock);
@@ -766,6 +888,25 @@ is_entirely_in_heap_region(app_pc start, app_pc end)
     app_pc node_start;
     size_t node_size;
     bool res = false;
+    byte val = heap_map_lookup(start);
+    if (val == 0)
+        return false;
+    if (TEST(HEAP_MAP_FULL, val) && end > start &&
+        (ptr_uint_t)(end - 1 - start) < HEAP_MAP_MAX_SCAN * HEAP_MAP_UNIT_SIZE) {
+        /* every page must be wholly in a region with no new region beginning */
+        app_pc page = (app_pc) ALIGN_BACKWARD(start, HEAP_MAP_UNIT_SIZE);
+        app_pc last = (app_pc) ALIGN_BACKWARD(end - 1, HEAP_MAP_UNIT_SIZE);
+        while (page < last) {
+            page += HEAP_MAP_UNIT_SIZE;
+            val = heap_map_lookup(page);
+            if (!TEST(HEAP_MAP_FULL, val) || TEST(HEAP_MAP_START, val))
+                break;
+        }
+        if (page == last && TEST(HEAP_MAP_FULL, val) &&
+            (page == (app_pc) ALIGN_BACKWARD(start, HEAP_MAP_UNIT_SIZE) ||
+             !TEST(HEAP_MAP_START, val)))
+            return true;
+    }
     dr_mutex_lock(heap_lock);
     node = rb_overlaps_node(heap_tree, start, end);
     if (node != NULL) {
@@ -785,6 +926,9 @@ get_heap_region_flags(app_pc pc)
     rb_node_t *node = NULL;
     uint res = 0;
     heap_info_t *info;
+    byte val = heap_map_lookup(pc);
+    if (val != HEAP_MAP_PARTIAL)
+        return (val & HEAP_MAP_FLAGS);
     dr_mutex_lock(heap_lock);
     node = rb_in_node(heap_tree, pc);
     if (node != NULL) {
@@ -0,0 +1,460 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Open-addressed Robin Hood hashtable: see ohashtable.h.
+ *
+ * Each entry's probe distance is how far it sits from its home slot.  On
+ * insert, an entry that has traveled further than the resident of a slot
+ * takes that slot and the resident moves on, which keeps distances short
+ * and lets a lookup stop as soon as it passes a resident closer to home
+ * than the key would be.  Removal shifts the following run back by one
+ * rather than leaving a tombstone.
+ *
+ * Lock-free lookups use the table's seq as a seqlock: writers make it odd
+ * while they move entries, and a lookup that saw it change retries.  A
+ * resize stores the new slot array before the new size and a lookup reads
+ * the size first, so a lookup never indexes past the array it reads.
+ */
+
+#include "dr_api.h"
+#include "utils.h"
+#include "ohashtable.h"
+
+/* Robin Hood probing keeps distances short up to high loads */
+#define OHASH_LOAD_PERCENT 85
+#define OHASH_FULL_BIT 0x80000000
+
+#define OHASH_SIZE(bits) (1U << (bits))
+#define OHASH_MASK(bits) (OHASH_SIZE(bits) - 1)
+
+static inline uint
+ohash_hash(ohashtable_t *table, void *key)
+{
+    uint hash = (table->hash_key_func == NULL) ? ohash_hash_ptr(key) :
+        table->hash_key_func(key);
+    return (hash | OHASH_FULL_BIT);
+}
+
+static inline bool
+ohash_keys_equal(ohashtable_t *table, void *key1, void *key2)
+{
+    if (table->cmp_key_func == NULL)
+        return (key1 == key2);
+    return table->cmp_key_func(key1, key2);
+}
+
+/* probe distance of an entry with hash sitting at slot idx */
+static inline uint
+ohash_dist(uint hash, uint idx, uint mask)
+{
+    return ((idx - hash) & mask);
+}
+
+/* A slot array outgrown by a resize, kept for lock-free lookups when there
+ * is no defer_free_func
+ */
+typedef struct _ohash_retired_t {
+    ohash_slot_t *slots;
+    uint bits;
+    struct _ohash_retired_t *next;
+} ohash_retired_t;
+
+/* Writers must hold the lock */
+static inline void
+ohash_write_begin(ohashtable_t *table)
+{
+    table->seq++;
+    MEMORY_STORE_BARRIER();
+}
+
+static inline void
+ohash_write_end(ohashtable_t *table)
+{
+    MEMORY_STORE_BARRIER();
+    table->seq++;
+}
+
+/* For defer_free_func: data holds the array's bits */
+static void
+ohash_slots_free(void *slots, void *data)
+{
+    uint bits = (uint)(ptr_uint_t) data;
+    global_free(slots, OHASH_SIZE(bits) * sizeof(ohash_slot_t), HEAPSTAT_HASHTABLE);
+}
+
+static ohash_slot_t *
+ohash_slots_alloc(uint bits)
+{
+    size_t sz = OHASH_SIZE(bits) * sizeof(ohash_slot_t);
+    ohash_slot_t *slots = (ohash_slot_t *) global_alloc(sz, HEAPSTAT_HASHTABLE);
+    memset(slots, 0, sz);
+    return slots;
+}
+
+void
+ohashtable_init(ohashtable_t *table, uint bits,
+                uint (*hash_key_func)(void *),
+                bool (*cmp_key_func)(void *, void *),
+                void (*free_payload_func)(void *),
+                bool synch)
+{
+    ASSERT(table != NULL, "invalid params");
+    ASSERT(bits > 0 && bits < 32, "invalid table size");
+    table->slots = ohash_slots_alloc(bits);
+    table->table_bits = bits;
+    table->entries = 0;
+    table->max_dist = 0;
+    table->hash_key_func = hash_key_func;
+    table->cmp_key_func = cmp_key_func;
+    table->free_payload_func = free_payload_func;
+    table->synch = synch;
+    table->lock = dr_recurlock_create();
+    table->seq = 0;
+    table->lockfree_lookups = false;
+    table->defer_free_func = NULL;
+    table->retired_slots = NULL;
+}
+
+void
+ohashtable_set_lockfree_lookups(ohashtable_t *table,
+                                void (*defer_free_func)
+                                (void *item, void (*free_func)(void *, void *),
+                                 void *data))
+{
+    ASSERT(table->entries == 0, "must be set before use");
+    table->lockfree_lookups = true;
+    table->defer_free_func = defer_free_func;
+}
+
+void
+ohashtable_delete(ohashtable_t *table)
+{
+    uint i;
+    if (table->free_payload_func != NULL) {
+        for (i = 0; i < OHASH_SIZE(table->table_bits); i++) {
+            if (table->slots[i].hash != 0)
+                table->free_payload_func(table->slots[i].payload);
+        }
+    }
+    global_free(table->slots, OHASH_SIZE(table->table_bits) * sizeof(ohash_slot_t),
+                HEAPSTAT_HASHTABLE);
+    while (table->retired_slots != NULL) {
+        ohash_retired_t *r = (ohash_retired_t *) table->retired_slots;
+        table->retired_slots = r->next;
+        global_free(r->slots, OHASH_SIZE(r->bits) * sizeof(ohash_slot_t),
+                    HEAPSTAT_HASHTABLE);
+        global_free(r, sizeof(*r), HEAPSTAT_HASHTABLE);
+    }
+    table->slots = NULL;
+    table->entries = 0;
+    dr_recurlock_destroy(table->lock);
+}
+
+void
+ohashtable_delete_with_stats(ohashtable_t *table, const char *name)
+{
+    DOLOG(1, {
+        uint i;
+        uint total = 0;
+        uint mask = OHASH_MASK(table->table_bits);
+        for (i = 0; i <= mask; i++) {
+            if (table->slots[i].hash != 0)
+                total += ohash_dist(table->slots[i].hash, i, mask);
+        }
+        LOG(1, "%s: %u entries, %u slots, probe distance max %u avg %u.%02u\n",
+            name, table->entries, mask + 1, table->max_dist,
+            table->entries == 0 ? 0 : total / table->entries,
+            table->entries == 0 ? 0 : (total * 100 / table->entries) % 100);
+    });
+    ohashtable_delete(table);
+}
+
+void
+ohashtable_lock(ohashtable_t *table)
+{
+    dr_recurlock_lock(table->lock);
+}
+
+void
+ohashtable_unlock(ohashtable_t *table)
+{
+    dr_recurlock_unlock(table->lock);
+}
+
+bool
+ohashtable_lock_self_owns(ohashtable_t *table)
+{
+    return dr_recurlock_self_owns(table->lock);
+}
+
+/* Returns the slot index holding key, or -1 */
+static int
+ohash_find(ohashtable_t *table, void *key, uint hash)
+{
+    uint mask = OHASH_MASK(table->table_bits);
+    uint i = hash & mask;
+    uint dist = 0;
+    while (true) {
+        ohash_slot_t *slot = &table->slots[i];
+        if (slot->hash == 0 || ohash_dist(slot->hash, i, mask) < dist)
+            return -1;
+        if (slot->hash == hash && ohash_keys_equal(table, slot->key, key))
+            return (int) i;
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
+
+/* Places an entry known not to be present */
+static void
+ohash_insert_new(ohashtable_t *table, void *key, void *payload, uint hash)
+{
+    uint mask = OHASH_MASK(table->table_bits);
+    uint i = hash & mask;
+    uint dist = 0;
+    ohash_slot_t cur, tmp;
+    cur.key = key;
+    cur.payload = payload;
+    cur.hash = hash;
+    while (true) {
+        ohash_slot_t *slot = &table->slots[i];
+        uint slot_dist;
+        if (dist > table->max_dist)
+            table->max_dist = dist;
+        if (slot->hash == 0) {
+            *slot = cur;
+            table->entries++;
+            return;
+        }
+        slot_dist = ohash_dist(slot->hash, i, mask);
+        if (slot_dist < dist) {
+            /* the resident is closer to home: it moves on instead */
+            tmp = *slot;
+            *slot = cur;
+            cur = tmp;
+            dist = slot_dist;
+        }
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
+
+static void
+ohash_resize(ohashtable_t *table)
+{
+    ohash_slot_t *old = table->slots;
+    uint old_bits = table->table_bits;
+    uint i;
+    /* the array before the size: see the top of the file */
+    table->slots = ohash_slots_alloc(old_bits + 1);
+    MEMORY_STORE_BARRIER();
+    table->table_bits++;
+    table->entries = 0;
+    table->max_dist = 0;
+    for (i = 0; i < OHASH_SIZE(old_bits); i++) {
+        if (old[i].hash != 0)
+            ohash_insert_new(table, old[i].key, old[i].payload, old[i].hash);
+    }
+    if (table->defer_free_func != NULL) {
+        table->defer_free_func((void *)old, ohash_slots_free,
+                               (void *)(ptr_uint_t) old_bits);
+    } else if (table->lockfree_lookups) {
+        ohash_retired_t *r = (ohash_retired_t *)
+            global_alloc(sizeof(*r), HEAPSTAT_HASHTABLE);
+        r->slots = old;
+        r->bits = old_bits;
+        r->next = (ohash_retired_t *) table->retired_slots;
+        table->retired_slots = r;
+    } else {
+        global_free(old, OHASH_SIZE(old_bits) * sizeof(ohash_slot_t),
+                    HEAPSTAT_HASHTABLE);
+    }
+    LOG(3, "ohashtable "PFX" resized to %u bits\n", table, table->table_bits);
+}
+
+void *
+ohashtable_lookup(ohashtable_t *table, void *key)
+{
+    void *res = NULL;
+    int idx;
+    ASSERT(key != NULL, "NULL keys are not supported");
+    if (table->synch)
+        dr_recurlock_lock(table->lock);
+    idx = ohash_find(table, key, ohash_hash(table, key));
+    if (idx >= 0)
+        res = table->slots[idx].payload;
+    if (table->synch)
+        dr_recurlock_unlock(table->lock);
+    return res;
+}
+
+bool
+ohashtable_lookup_lockfree(ohashtable_t *table, void *key, OUT void **payload)
+{
+    uint hash, seq, mask, i, dist;
+    volatile ohash_slot_t *slots;
+    void *res = NULL;
+    ASSERT(table->lockfree_lookups, "lock-free lookups not enabled");
+    ASSERT(key != NULL, "NULL keys are not supported");
+    hash = ohash_hash(table, key);
+    seq = table->seq;
+    if (TEST(1, seq))
+        return false;
+    MEMORY_LOAD_BARRIER();
+    mask = OHASH_MASK(table->table_bits);
+    MEMORY_LOAD_BARRIER();
+    slots = table->slots;
+    i = hash & mask;
+    /* a writer can leave any mix of entries in our way, so we bound the walk
+     * by the table size and check every key before using it
+     */
+    for (dist = 0; dist <= mask; dist++) {
+        uint slot_hash = slots[i].hash;
+        void *slot_key;
+        if (slot_hash == 0 || ohash_dist(slot_hash, i, mask) < dist)
+            break;
+        slot_key = slots[i].key;
+        if (slot_hash == hash && slot_key != NULL &&
+            ohash_keys_equal(table, slot_key, key)) {
+            res = slots[i].payload;
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    MEMORY_LOAD_BARRIER();
+    if (table->seq != seq)
+        return false;
+    *payload = res;
+    return true;
+}
+
+void *
+ohashtable_add_replace(ohashtable_t *table, void *key, void *payload)
+{
+    void *old = NULL;
+    uint hash;
+    int idx;
+    ASSERT(key != NULL, "NULL keys are not supported");
+    hash = ohash_hash(table, key);
+    if (table->synch)
+        dr_recurlock_lock(table->lock);
+    idx = ohash_find(table, key, hash);
+    ohash_write_begin(table);
+    if (idx >= 0) {
+        old = table->slots[idx].payload;
+        table->slots[idx].key = key;
+        table->slots[idx].payload = payload;
+    } else {
+        if ((table->entries + 1) * 100 >
+            OHASH_SIZE(table->table_bits) * OHASH_LOAD_PERCENT)
+            ohash_resize(table);
+        ohash_insert_new(table, key, payload, hash);
+    }
+    ohash_write_end(table);
+    if (table->synch)
+        dr_recurlock_unlock(table->lock);
+    return old;
+}
+
+bool
+ohashtable_remove(ohashtable_t *table, void *key)
+{
+    uint mask = OHASH_MASK(table->table_bits);
+    void *payload = NULL;
+    int idx;
+    ASSERT(key != NULL, "NULL keys are not supported");
+    if (table->synch)
+        dr_recurlock_lock(table->lock);
+    idx = ohash_find(table, key, ohash_hash(table, key));
+    if (idx >= 0) {
+        uint i = (uint) idx;
+        uint next = (i + 1) & mask;
+        payload = table->slots[i].payload;
+        ohash_write_begin(table);
+        /* shift the rest of the run back toward home */
+        while (table->slots[next].hash != 0 &&
+               ohash_dist(table->slots[next].hash, next, mask) > 0) {
+            table->slots[i] = table->slots[next];
+            i = next;
+            next = (next + 1) & mask;
+        }
+        table->slots[i].key = NULL;
+        table->slots[i].payload = NULL;
+        table->slots[i].hash = 0;
+        table->entries--;
+        ohash_write_end(table);
+    }
+    if (table->synch)
+        dr_recurlock_unlock(table->lock);
+    if (idx >= 0 && table->free_payload_func != NULL)
+        table->free_payload_func(payload);
+    return (idx >= 0);
+}
+
+void
+ohashtable_iterate(ohashtable_t *table,
+                   bool (*iter_cb)(void *key, void *payload, void *iter_data),
+                   void *iter_data)
+{
+    uint i;
+    ASSERT(iter_cb != NULL, "invalid params");
+    if (table->synch)
+        dr_recurlock_lock(table->lock);
+    for (i = 0; i < OHASH_SIZE(table->table_bits); i++) {
+        if (table->slots[i].hash != 0 &&
+            !iter_cb(table->slots[i].key, table->slots[i].payload, iter_data))
+            break;
+    }
+    if (table->synch)
+        dr_recurlock_unlock(table->lock);
+}
+
+/***************************************************************************/
+#ifdef DEBUG_UNIT_TEST
+
+bool
+ohashtable_check(ohashtable_t *table)
+{
+    uint mask = OHASH_MASK(table->table_bits);
+    uint i, count = 0;
+    for (i = 0; i <= mask; i++) {
+        ohash_slot_t *slot = &table->slots[i];
+        uint prev = (i - 1) & mask;
+        if (slot->hash == 0)
+            continue;
+        count++;
+        if (!TEST(OHASH_FULL_BIT, slot->hash) || slot->key == NULL)
+            return false;
+        /* an entry is never more than one step further from home than its
+         * predecessor, else it would have displaced it
+         */
+        if (ohash_dist(slot->hash, i, mask) > 0 &&
+            (table->slots[prev].hash == 0 ||
+             ohash_dist(slot->hash, i, mask) >
+             ohash_dist(table->slots[prev].hash, prev, mask) + 1))
+            return false;
+        if (ohash_find(table, slot->key, slot->hash) != (int) i)
+            return false;
+    }
+    return (count == table->entries);
+}
+
+#endif /* DEBUG_UNIT_TEST */
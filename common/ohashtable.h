@@ -0,0 +1,168 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OHASHTABLE_H_
+#define _OHASHTABLE_H_
+
+/* Open-addressed hashtable using Robin Hood linear probing with
+ * backward-shift deletion.  The key, payload, and full hash of each entry
+ * live inline in the slot array, so a lookup touches one or two cache
+ * lines rather than chasing a hash_entry_t chain as DR's hashtable_t does.
+ * Keys are pointers (or pointer-sized integers) and may not be NULL.
+ *
+ * Entries move on every add and remove, so a lock must be held from
+ * any call here to the last use of any returned payload that the table
+ * owns: either the table's own lock (see ohashtable_lock()) or a lock
+ * of the caller's.  The exception is ohashtable_lookup_lockfree().
+ */
+
+#include "dr_api.h"
+
+typedef struct _ohash_slot_t {
+    void *key;
+    void *payload;
+    /* 0 for an empty slot: real hashes have the top bit set */
+    uint hash;
+} ohash_slot_t;
+
+typedef struct _ohashtable_t {
+    ohash_slot_t *slots;
+    uint table_bits;
+    uint entries;
+    /* max probe distance ever seen, for stats */
+    uint max_dist;
+    /* NULL means keys are compared and hashed by value */
+    uint (*hash_key_func)(void *key);
+    bool (*cmp_key_func)(void *key1, void *key2);
+    void (*free_payload_func)(void *payload);
+    bool synch;
+    void *lock;
+    /* odd while a writer is changing the slots */
+    volatile uint seq;
+    /* whether lock-free lookups may still be reading slot arrays outgrown
+     * by a resize: see ohashtable_set_lockfree_lookups()
+     */
+    bool lockfree_lookups;
+    void (*defer_free_func)(void *item, void (*free_func)(void *, void *),
+                            void *data);
+    void *retired_slots;
+} ohashtable_t;
+
+/* Initializes table with 2^bits slots.  hash_key_func and cmp_key_func
+ * may be NULL for pointer-valued keys.  free_payload_func, if non-NULL,
+ * is called on a payload when it is removed or the table is deleted.
+ * If synch is true, every routine here takes the table lock itself;
+ * else, ohashtable_lock() is still available to callers.  The lock is
+ * recursive, so a caller may hold it across several synch calls.
+ */
+void
+ohashtable_init(ohashtable_t *table, uint bits,
+                uint (*hash_key_func)(void *),
+                bool (*cmp_key_func)(void *, void *),
+                void (*free_payload_func)(void *),
+                bool synch);
+
+/* Frees all payloads and the table's storage. */
+void
+ohashtable_delete(ohashtable_t *table);
+
+/* Logs table statistics under name, then deletes the table. */
+void
+ohashtable_delete_with_stats(ohashtable_t *table, const char *name);
+
+void
+ohashtable_lock(ohashtable_t *table);
+
+void
+ohashtable_unlock(ohashtable_t *table);
+
+bool
+ohashtable_lock_self_owns(ohashtable_t *table);
+
+/* Returns the payload for key, or NULL. */
+void *
+ohashtable_lookup(ohashtable_t *table, void *key);
+
+/* Allows ohashtable_lookup_lockfree() on table.  Must be called before the
+ * table is used.  Slot arrays outgrown by a resize are passed to
+ * defer_free_func (e.g., epoch_defer_free()), which must call free_func
+ * on them once no lock-free lookup can still be reading them.  If
+ * defer_free_func is NULL they are instead kept until the table is deleted,
+ * which costs at most the size of the current one.
+ */
+void
+ohashtable_set_lockfree_lookups(ohashtable_t *table,
+                                void (*defer_free_func)
+                                (void *item, void (*free_func)(void *, void *),
+                                 void *data));
+
+/* Looks up key without the lock, even while another thread holding it is
+ * changing the table.  Returns false if such a change got in the way, in
+ * which case the caller should retry or fall back to ohashtable_lookup().
+ * Else sets *payload to key's payload or NULL.
+ * The table's key compare routine may be passed keys that have just been
+ * removed, and the caller must keep those keys and any payload returned
+ * from being freed until it is done (e.g., by deferring their frees).
+ */
+bool
+ohashtable_lookup_lockfree(ohashtable_t *table, void *key, OUT void **payload);
+
+/* Adds key if not present and returns NULL.  Otherwise, replaces the
+ * payload and returns the old one, which is NOT freed.
+ */
+void *
+ohashtable_add_replace(ohashtable_t *table, void *key, void *payload);
+
+/* Removes key, freeing its payload.  Returns whether it was present. */
+bool
+ohashtable_remove(ohashtable_t *table, void *key);
+
+/* Calls iter_cb on each entry until it returns false.  iter_cb must not
+ * add or remove entries.
+ */
+void
+ohashtable_iterate(ohashtable_t *table,
+                   bool (*iter_cb)(void *key, void *payload, void *iter_data),
+                   void *iter_data);
+
+/* Mixes a pointer into a 32-bit hash.  The low 3 bits of heap pointers
+ * carry no information and are dropped.
+ */
+static inline uint
+ohash_hash_ptr(void *key)
+{
+    ptr_uint_t p = (ptr_uint_t) key;
+    uint hash;
+#ifdef X64
+    p ^= (p >> 32);
+#endif
+    hash = (uint)(p >> 3) * 0x85ebca6bU;
+    hash ^= (hash >> 15);
+    return hash;
+}
+
+#ifdef DEBUG_UNIT_TEST
+/* Checks the Robin Hood ordering invariant and the entry count */
+bool
+ohashtable_check(ohashtable_t *table);
+#endif
+
+#endif /* _OHASHTABLE_H_ */
@@ -48,6 +48,24 @@ struct _rb_node_t {
     void *client;
 };
 
+/* Nodes come from slabs of about a page, so neighbors in a tree tend to
+ * share cache lines and an insert or delete is not a heap round trip.
+ * Freed nodes go on a free list linked through their parent field.
+ */
+#define RB_SLAB_NODES (4096 / sizeof(rb_node_t))
+
+typedef struct _rb_slab_t {
+    struct _rb_slab_t *next;
+    rb_node_t node[RB_SLAB_NODES];
+} rb_slab_t;
+
+struct _rb_arena_t {
+    rb_slab_t *slabs;
+    /* nodes handed out from the head slab */
+    uint slab_used;
+    rb_node_t *free_list;
+};
+
 /* Data structure to wrap around the root node, to store global info
  * such as callback routines.
  */
@@ -62,6 +80,9 @@ struct _rb_tree_t {
      */
     rb_node_t NIL_node;
     void (*free_payload_func)(void*);
+    /* &own_arena unless created with a shared arena */
+    rb_arena_t *arena;
+    rb_arena_t own_arena;
 };
 
 #define NIL(tree) (&(tree)->NIL_node)
@@ -94,11 +115,65 @@ rb_node_set_client(rb_node_t *node, void *client)
     node->client = client;
 }
 
+static rb_node_t *
+rb_arena_alloc(rb_arena_t *arena)
+{
+    rb_node_t *node = arena->free_list;
+    if (node != NULL) {
+        arena->free_list = node->parent;
+        return node;
+    }
+    if (arena->slabs == NULL || arena->slab_used == RB_SLAB_NODES) {
+        rb_slab_t *slab = (rb_slab_t *) global_alloc(sizeof(*slab), HEAPSTAT_RBTREE);
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        arena->slab_used = 0;
+    }
+    return &arena->slabs->node[arena->slab_used++];
+}
+
+static inline void
+rb_arena_free(rb_arena_t *arena, rb_node_t *node)
+{
+    node->parent = arena->free_list;
+    arena->free_list = node;
+}
+
+/* Frees the slabs themselves */
+static void
+rb_arena_release(rb_arena_t *arena)
+{
+    rb_slab_t *slab, *next;
+    for (slab = arena->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        global_free(slab, sizeof(*slab), HEAPSTAT_RBTREE);
+    }
+    arena->slabs = NULL;
+    arena->slab_used = 0;
+    arena->free_list = NULL;
+}
+
+rb_arena_t *
+rb_arena_create(void)
+{
+    rb_arena_t *arena = (rb_arena_t *) global_alloc(sizeof(*arena), HEAPSTAT_RBTREE);
+    memset(arena, 0, sizeof(*arena));
+    return arena;
+}
+
+void
+rb_arena_destroy(rb_arena_t *arena)
+{
+    ASSERT(arena != NULL, "invalid params");
+    rb_arena_release(arena);
+    global_free(arena, sizeof(*arena), HEAPSTAT_RBTREE);
+}
+
 /* Allocate a new node */
 static rb_node_t *
 rb_new_node(rb_tree_t *tree, byte *base, size_t size, void *client)
 {
-    rb_node_t *node = (rb_node_t *) global_alloc(sizeof(rb_node_t), HEAPSTAT_RBTREE);
+    rb_node_t *node = rb_arena_alloc(tree->arena);
     ASSERT(node != NULL, "alloc failed");
 
     if (node != NULL) {
@@ -120,9 +195,9 @@ rb_new_node(rb_tree_t *tree, byte *base, size_t size, void *client)
 static inline void
 rb_free_node(rb_tree_t *tree, rb_node_t *node, bool free_payload)
 {
-    if (tree != NULL && free_payload && tree->free_payload_func != NULL)
+    if (free_payload && tree->free_payload_func != NULL)
         (tree->free_payload_func)(node->client);
-    global_free(node, sizeof(rb_node_t), HEAPSTAT_RBTREE);
+    rb_arena_free(tree->arena, node);
 }
 
 
@@ -140,7 +215,11 @@ rb_clear_helper(rb_tree_t *tree, rb_node_t *node)
 void
 rb_clear(rb_tree_t *tree)
 {
-    rb_clear_helper(tree, tree->root);
+    if (tree->free_payload_func == NULL && tree->arena == &tree->own_arena) {
+        /* nothing to visit the nodes for: drop them all at once */
+        rb_arena_release(tree->arena);
+    } else
+        rb_clear_helper(tree, tree->root);
     tree->root = NIL(tree);
 }
 
@@ -634,6 +713,12 @@ rb_min_node(rb_tree_t *tree)
 
 rb_tree_t *
 rb_tree_create(void (*free_payload_func)(void*))
+{
+    return rb_tree_create_ex(free_payload_func, NULL);
+}
+
+rb_tree_t *
+rb_tree_create_ex(void (*free_payload_func)(void*), rb_arena_t *arena)
 {
     rb_tree_t *tree = global_alloc(sizeof(*tree), HEAPSTAT_RBTREE);
 
@@ -648,6 +733,8 @@ rb_tree_create(void (*free_payload_func)(void*))
 
     tree->root = NIL(tree);
     tree->free_payload_func = free_payload_func;
+    memset(&tree->own_arena, 0, sizeof(tree->own_arena));
+    tree->arena = (arena == NULL) ? &tree->own_arena : arena;
     return tree;
 }
 
@@ -655,7 +742,10 @@ void
 rb_tree_destroy(rb_tree_t *tree)
 {
     ASSERT(tree != NULL, "invalid params");
-    rb_clear(tree);
+    /* an arena's nodes are reclaimed with the arena */
+    if (tree->arena == &tree->own_arena || tree->free_payload_func != NULL)
+        rb_clear(tree);
+    rb_arena_release(&tree->own_arena);
     global_free(tree, sizeof(*tree), HEAPSTAT_RBTREE);
 }
 
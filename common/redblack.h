@@ -37,6 +37,9 @@ typedef struct _rb_node_t rb_node_t;
 struct _rb_tree_t;
 typedef struct _rb_tree_t rb_tree_t;
 
+struct _rb_arena_t;
+typedef struct _rb_arena_t rb_arena_t;
+
 /* Synchronization is up to the caller.  A lock should be held from
  * the point of a call to any routine here to the last use of any
  * returned rb_node_t*.
@@ -48,6 +51,28 @@ typedef struct _rb_tree_t rb_tree_t;
 rb_tree_t *
 rb_tree_create(void (*free_payload_func)(void*));
 
+/* Nodes are carved out of page-sized slabs rather than allocated one at a
+ * time.  By default each tree has its own slabs.  An arena lets several
+ * short-lived trees share slabs that are all freed at once by
+ * rb_arena_destroy().  An arena is not synchronized: the caller must
+ * serialize all operations on all of its trees.
+ */
+rb_arena_t *
+rb_arena_create(void);
+
+/* Frees every node of every tree created in arena.  Those trees must
+ * already be destroyed.
+ */
+void
+rb_arena_destroy(rb_arena_t *arena);
+
+/* Like rb_tree_create() but allocates nodes from arena, if non-NULL.
+ * Destroying an arena tree without a free_payload_func does not visit its
+ * nodes: their memory is reclaimed by rb_arena_destroy().
+ */
+rb_tree_t *
+rb_tree_create_ex(void (*free_payload_func)(void*), rb_arena_t *arena);
+
 /* Remove and free all nodes in the tree and free the tree itself */
 void
 rb_tree_destroy(rb_tree_t *tree);
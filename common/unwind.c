@@ -0,0 +1,796 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/***************************************************************************
+ * unwind.c: DWARF CFI unwinding from .eh_frame: see unwind.h.
+ *
+ * We read the app's own mapped copies of .eh_frame_hdr and .eh_frame
+ * rather than the files.  All reads are bounded by the file-backed part
+ * of the PT_LOAD segment holding them, as the data is the app's and need
+ * not be well-formed, and a module's [start,end) can have unmapped gaps
+ * between its segments.
+ */
+
+#include "dr_api.h"
+#include "utils.h"
+#include "unwind.h"
+
+#ifdef LINUX
+
+#include <elf.h>
+#include <string.h>
+
+#ifdef X64
+# define ELF_HEADER_TYPE Elf64_Ehdr
+# define ELF_PROGRAM_HEADER_TYPE Elf64_Phdr
+/* DWARF register numbers */
+# define DWARF_REG_FP 6
+# define DWARF_REG_SP 7
+# define DWARF_REG_RA 16
+#else
+# define ELF_HEADER_TYPE Elf32_Ehdr
+# define ELF_PROGRAM_HEADER_TYPE Elf32_Phdr
+# define DWARF_REG_SP 4
+# define DWARF_REG_FP 5
+# define DWARF_REG_RA 8
+#endif
+
+/* pointer encodings */
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+/* call frame instructions */
+enum {
+    DW_CFA_advance_loc                = 0x40,
+    DW_CFA_offset                     = 0x80,
+    DW_CFA_restore                    = 0xc0,
+    DW_CFA_nop                        = 0x00,
+    DW_CFA_set_loc                    = 0x01,
+    DW_CFA_advance_loc1               = 0x02,
+    DW_CFA_advance_loc2               = 0x03,
+    DW_CFA_advance_loc4               = 0x04,
+    DW_CFA_offset_extended            = 0x05,
+    DW_CFA_restore_extended           = 0x06,
+    DW_CFA_undefined                  = 0x07,
+    DW_CFA_same_value                 = 0x08,
+    DW_CFA_register                   = 0x09,
+    DW_CFA_remember_state             = 0x0a,
+    DW_CFA_restore_state              = 0x0b,
+    DW_CFA_def_cfa                    = 0x0c,
+    DW_CFA_def_cfa_register           = 0x0d,
+    DW_CFA_def_cfa_offset             = 0x0e,
+    DW_CFA_def_cfa_expression         = 0x0f,
+    DW_CFA_expression                 = 0x10,
+    DW_CFA_offset_extended_sf         = 0x11,
+    DW_CFA_def_cfa_sf                 = 0x12,
+    DW_CFA_def_cfa_offset_sf          = 0x13,
+    DW_CFA_val_offset                 = 0x14,
+    DW_CFA_val_offset_sf              = 0x15,
+    DW_CFA_val_expression             = 0x16,
+    DW_CFA_GNU_args_size              = 0x2e,
+    DW_CFA_GNU_negative_offset_extended = 0x2f,
+};
+
+struct _unwind_module_t {
+    app_pc start;
+    app_pc end;
+    /* the mapped file contents of the segment with .eh_frame{,_hdr} */
+    byte *data_start;
+    byte *data_end;
+    byte *hdr; /* .eh_frame_hdr */
+    /* Binary search table of (initial pc, FDE) pairs, each an sdata4
+     * offset from hdr, sorted by pc.
+     */
+    int *table;
+    uint fde_count;
+};
+
+/* How to find a register's value in the caller */
+typedef enum {
+    RULE_SAME,      /* unchanged */
+    RULE_UNDEFINED, /* for the return address: there is no caller */
+    RULE_OFFSET,    /* saved at CFA+offset */
+    RULE_VAL_OFFSET,/* is CFA+offset */
+    RULE_UNSUPPORTED,
+} rule_kind_t;
+
+typedef struct _reg_rule_t {
+    rule_kind_t kind;
+    ptr_int_t offset;
+} reg_rule_t;
+
+/* A row of the CFI table, for the only registers we track */
+typedef struct _cfa_row_t {
+    uint cfa_reg;
+    ptr_int_t cfa_offset;
+    bool cfa_is_expr;
+    reg_rule_t fp;
+    reg_rule_t ra;
+} cfa_row_t;
+
+#define CFA_STATE_STACK_DEPTH 8
+
+typedef struct _cie_info_t {
+    ptr_uint_t code_align;
+    ptr_int_t data_align;
+    uint ra_reg;
+    byte fde_enc;
+    bool has_aug_data;
+    byte *insts;
+    byte *insts_end;
+} cie_info_t;
+
+/***************************************************************************
+ * READING
+ */
+
+static bool
+read_bytes(byte **p, byte *end, void *out, size_t size)
+{
+    if (*p + size > end || *p + size < *p)
+        return false;
+    memcpy(out, *p, size);
+    *p += size;
+    return true;
+}
+
+static bool
+read_uleb128(byte **p, byte *end, ptr_uint_t *val)
+{
+    ptr_uint_t res = 0;
+    uint shift = 0;
+    byte b;
+    do {
+        if (*p >= end)
+            return false;
+        b = **p;
+        (*p)++;
+        if (shift < sizeof(res) * 8)
+            res |= ((ptr_uint_t)(b & 0x7f)) << shift;
+        shift += 7;
+    } while (TEST(0x80, b));
+    *val = res;
+    return true;
+}
+
+static bool
+read_sleb128(byte **p, byte *end, ptr_int_t *val)
+{
+    ptr_uint_t res = 0;
+    uint shift = 0;
+    byte b;
+    do {
+        if (*p >= end)
+            return false;
+        b = **p;
+        (*p)++;
+        if (shift < sizeof(res) * 8)
+            res |= ((ptr_uint_t)(b & 0x7f)) << shift;
+        shift += 7;
+    } while (TEST(0x80, b));
+    if (shift < sizeof(res) * 8 && TEST(0x40, b))
+        res |= ~(ptr_uint_t)0 << shift;
+    *val = (ptr_int_t) res;
+    return true;
+}
+
+/* Reads a value in pointer encoding enc.  base is for DW_EH_PE_datarel. */
+static bool
+read_encoded(byte **p, byte *end, byte enc, byte *base, ptr_uint_t *val)
+{
+    byte *start = *p;
+    ptr_uint_t res;
+    if (enc == DW_EH_PE_omit)
+        return false;
+    switch (enc & 0x0f) {
+    case DW_EH_PE_absptr: {
+        void *v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = (ptr_uint_t) v;
+        break;
+    }
+    case DW_EH_PE_uleb128:
+        if (!read_uleb128(p, end, &res))
+            return false;
+        break;
+    case DW_EH_PE_sleb128: {
+        ptr_int_t v;
+        if (!read_sleb128(p, end, &v))
+            return false;
+        res = (ptr_uint_t) v;
+        break;
+    }
+    case DW_EH_PE_udata2: {
+        ushort v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = v;
+        break;
+    }
+    case DW_EH_PE_sdata2: {
+        short v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = (ptr_uint_t)(ptr_int_t) v;
+        break;
+    }
+    case DW_EH_PE_udata4: {
+        uint v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = v;
+        break;
+    }
+    case DW_EH_PE_sdata4: {
+        int v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = (ptr_uint_t)(ptr_int_t) v;
+        break;
+    }
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8: {
+        uint64 v;
+        if (!read_bytes(p, end, &v, sizeof(v)))
+            return false;
+        res = (ptr_uint_t) v;
+        break;
+    }
+    default:
+        return false;
+    }
+    switch (enc & 0x70) {
+    case 0:
+        break;
+    case DW_EH_PE_pcrel:
+        res += (ptr_uint_t) start;
+        break;
+    case DW_EH_PE_datarel:
+        if (base == NULL)
+            return false;
+        res += (ptr_uint_t) base;
+        break;
+    default:
+        return false;
+    }
+    if (TEST(DW_EH_PE_indirect, enc)) {
+        if (!safe_read((void *)res, sizeof(res), &res))
+            return false;
+    }
+    *val = res;
+    return true;
+}
+
+/***************************************************************************
+ * MODULES
+ */
+
+/* Returns whether all of [start, end) is mapped readable */
+static bool
+region_readable(byte *start, byte *end)
+{
+    byte *pc = start;
+    while (pc < end) {
+        byte *base;
+        size_t size;
+        uint prot;
+        if (!dr_query_memory(pc, &base, &size, &prot) || !TEST(DR_MEMPROT_READ, prot))
+            return false;
+        if (base + size <= pc)
+            return false;
+        pc = base + size;
+    }
+    return true;
+}
+
+unwind_module_t *
+unwind_module_create(const module_data_t *info)
+{
+    ELF_HEADER_TYPE *ehdr = (ELF_HEADER_TYPE *) info->start;
+    ELF_PROGRAM_HEADER_TYPE *phdr;
+    ptr_uint_t min_vaddr = POINTER_MAX;
+    ptr_uint_t hdr_vaddr = 0;
+    bool found = false;
+    byte *base, *hdr, *p, *data_start = NULL, *data_end = NULL;
+    ptr_uint_t eh_frame, count;
+    unwind_module_t *mod;
+    uint i;
+    if (info->start + sizeof(*ehdr) > info->end ||
+        memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_phentsize != sizeof(*phdr) ||
+        ehdr->e_phoff > (ptr_uint_t)(info->end - info->start) ||
+        ehdr->e_phnum * sizeof(*phdr) >
+        (ptr_uint_t)(info->end - info->start) - ehdr->e_phoff)
+        return NULL;
+    phdr = (ELF_PROGRAM_HEADER_TYPE *) (info->start + ehdr->e_phoff);
+    if (!region_readable((byte *)phdr, (byte *)(phdr + ehdr->e_phnum)))
+        return NULL;
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_vaddr < min_vaddr)
+            min_vaddr = phdr[i].p_vaddr;
+        else if (phdr[i].p_type == PT_GNU_EH_FRAME) {
+            hdr_vaddr = phdr[i].p_vaddr;
+            found = true;
+        }
+    }
+    if (!found || min_vaddr == POINTER_MAX)
+        return NULL;
+    base = info->start - ALIGN_BACKWARD(min_vaddr, PAGE_SIZE);
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && phdr[i].p_vaddr <= hdr_vaddr &&
+            hdr_vaddr < phdr[i].p_vaddr + phdr[i].p_filesz) {
+            data_start = base + phdr[i].p_vaddr;
+            data_end = data_start + phdr[i].p_filesz;
+            break;
+        }
+    }
+    if (data_start == NULL || data_start < info->start || data_end > info->end ||
+        data_end < data_start || !region_readable(data_start, data_end))
+        return NULL;
+    hdr = base + hdr_vaddr;
+    if (hdr + 4 > data_end || hdr[0] != 1/*version*/)
+        return NULL;
+    p = hdr + 4;
+    if (!read_encoded(&p, data_end, hdr[1], hdr, &eh_frame) ||
+        !read_encoded(&p, data_end, hdr[2], hdr, &count))
+        return NULL;
+    /* the linker always uses this encoding, which makes entries fixed-size */
+    if (hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4) || count == 0 ||
+        count > (ptr_uint_t)(data_end - p) / (2 * sizeof(int))) {
+        LOG(2, "%s: unsupported .eh_frame_hdr table at "PFX"\n", __FUNCTION__, hdr);
+        return NULL;
+    }
+    mod = (unwind_module_t *) global_alloc(sizeof(*mod), HEAPSTAT_CALLSTACK);
+    mod->start = info->start;
+    mod->end = info->end;
+    mod->data_start = data_start;
+    mod->data_end = data_end;
+    mod->hdr = hdr;
+    mod->table = (int *) p;
+    mod->fde_count = (uint) count;
+    LOG(2, "%s: %d FDEs for module at "PFX"\n", __FUNCTION__, mod->fde_count,
+        info->start);
+    return mod;
+}
+
+void
+unwind_module_free(unwind_module_t *mod)
+{
+    global_free(mod, sizeof(*mod), HEAPSTAT_CALLSTACK);
+}
+
+/* Returns the FDE that may cover pc, or NULL */
+static byte *
+find_fde(unwind_module_t *mod, app_pc pc)
+{
+    uint lo = 0, hi = mod->fde_count;
+    if (pc < mod->hdr + mod->table[0])
+        return NULL;
+    /* find the last entry whose initial pc is <= pc */
+    while (hi - lo > 1) {
+        uint mid = lo + (hi - lo) / 2;
+        if (mod->hdr + mod->table[2 * mid] <= pc)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return mod->hdr + mod->table[2 * lo + 1];
+}
+
+/* Reads the length of the CIE or FDE at *p and points *p past it */
+static bool
+read_entry_length(unwind_module_t *mod, byte **p, byte **entry_end)
+{
+    uint len;
+    if (*p < mod->data_start || !read_bytes(p, mod->data_end, &len, sizeof(len)))
+        return false;
+    /* 0 is a terminator; we don't bother w/ the 64-bit DWARF format */
+    if (len == 0 || len == 0xffffffff || len > (ptr_uint_t)(mod->data_end - *p))
+        return false;
+    *entry_end = *p + len;
+    return true;
+}
+
+static bool
+parse_cie(unwind_module_t *mod, byte *cie, cie_info_t *info)
+{
+    byte *p = cie, *end, *aug_end = NULL;
+    const char *aug;
+    uint id;
+    byte version;
+    ptr_uint_t val;
+    if (!read_entry_length(mod, &p, &end) ||
+        !read_bytes(&p, end, &id, sizeof(id)) || id != 0 ||
+        !read_bytes(&p, end, &version, sizeof(version)))
+        return false;
+    aug = (const char *) p;
+    while (p < end && *p != '\0')
+        p++;
+    if (p >= end)
+        return false;
+    p++;
+    if (aug[0] == 'e' && aug[1] == 'h') {
+        /* old gcc: a pointer to exception data */
+        p += sizeof(void *);
+        aug += 2;
+    }
+    if (!read_uleb128(&p, end, &info->code_align) ||
+        !read_sleb128(&p, end, &info->data_align))
+        return false;
+    if (version == 1) {
+        byte ra;
+        if (!read_bytes(&p, end, &ra, sizeof(ra)))
+            return false;
+        info->ra_reg = ra;
+    } else {
+        if (!read_uleb128(&p, end, &val))
+            return false;
+        info->ra_reg = (uint) val;
+    }
+    info->fde_enc = DW_EH_PE_absptr;
+    info->has_aug_data = (aug[0] == 'z');
+    if (info->has_aug_data) {
+        if (!read_uleb128(&p, end, &val) || val > (ptr_uint_t)(end - p))
+            return false;
+        aug_end = p + val;
+        for (aug++; *aug != '\0'; aug++) {
+            byte enc;
+            if (*aug == 'R') {
+                if (!read_bytes(&p, aug_end, &info->fde_enc, sizeof(info->fde_enc)))
+                    return false;
+            } else if (*aug == 'L') {
+                if (!read_bytes(&p, aug_end, &enc, sizeof(enc)))
+                    return false;
+            } else if (*aug == 'P') {
+                /* skip the personality routine, w/o following it */
+                if (!read_bytes(&p, aug_end, &enc, sizeof(enc)) ||
+                    !read_encoded(&p, aug_end, enc & 0x0f, NULL, &val))
+                    return false;
+            } else if (*aug != 'S') {
+                /* the data is still delimited, but we don't know the order */
+                break;
+            }
+        }
+        p = aug_end;
+    } else if (aug[0] != '\0')
+        return false;
+    info->insts = p;
+    info->insts_end = end;
+    return true;
+}
+
+/***************************************************************************
+ * CFA PROGRAMS
+ */
+
+static void
+set_rule(cfa_row_t *row, uint ra_reg, ptr_uint_t reg, rule_kind_t kind,
+         ptr_int_t offset)
+{
+    reg_rule_t *rule;
+    if (reg == ra_reg)
+        rule = &row->ra;
+    else if (reg == DWARF_REG_FP)
+        rule = &row->fp;
+    else
+        return;
+    rule->kind = kind;
+    rule->offset = offset;
+}
+
+static void
+restore_rule(cfa_row_t *row, const cfa_row_t *initial, uint ra_reg, ptr_uint_t reg)
+{
+    if (reg == ra_reg)
+        row->ra = initial->ra;
+    else if (reg == DWARF_REG_FP)
+        row->fp = initial->fp;
+}
+
+/* Runs the instructions in [p, end) until the row for target_pc is reached.
+ * For the CIE's initial instructions, initial is NULL.
+ */
+static bool
+run_cfa_program(byte *p, byte *end, cie_info_t *cie, byte *fde_base,
+                app_pc loc, app_pc target_pc, cfa_row_t *row,
+                const cfa_row_t *initial)
+{
+    cfa_row_t stack[CFA_STATE_STACK_DEPTH];
+    uint depth = 0;
+    ptr_uint_t reg, uval;
+    ptr_int_t sval;
+    while (p < end) {
+        byte op = *p++;
+        byte low = op & 0x3f;
+        switch (op & 0xc0) {
+        case DW_CFA_advance_loc:
+            loc += low * cie->code_align;
+            if (loc > target_pc)
+                return true;
+            continue;
+        case DW_CFA_offset:
+            if (!read_uleb128(&p, end, &uval))
+                return false;
+            set_rule(row, cie->ra_reg, low, RULE_OFFSET,
+                     (ptr_int_t)uval * cie->data_align);
+            continue;
+        case DW_CFA_restore:
+            if (initial == NULL)
+                return false;
+            restore_rule(row, initial, cie->ra_reg, low);
+            continue;
+        }
+        switch (op) {
+        case DW_CFA_nop:
+            break;
+        case DW_CFA_set_loc:
+            if (!read_encoded(&p, end, cie->fde_enc, fde_base, &uval))
+                return false;
+            loc = (app_pc) uval;
+            if (loc > target_pc)
+                return true;
+            break;
+        case DW_CFA_advance_loc1: {
+            byte delta;
+            if (!read_bytes(&p, end, &delta, sizeof(delta)))
+                return false;
+            loc += delta * cie->code_align;
+            if (loc > target_pc)
+                return true;
+            break;
+        }
+        case DW_CFA_advance_loc2: {
+            ushort delta;
+            if (!read_bytes(&p, end, &delta, sizeof(delta)))
+                return false;
+            loc += delta * cie->code_align;
+            if (loc > target_pc)
+                return true;
+            break;
+        }
+        case DW_CFA_advance_loc4: {
+            uint delta;
+            if (!read_bytes(&p, end, &delta, sizeof(delta)))
+                return false;
+            loc += delta * cie->code_align;
+            if (loc > target_pc)
+                return true;
+            break;
+        }
+        case DW_CFA_offset_extended:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_OFFSET,
+                     (ptr_int_t)uval * cie->data_align);
+            break;
+        case DW_CFA_offset_extended_sf:
+            if (!read_uleb128(&p, end, &reg) || !read_sleb128(&p, end, &sval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_OFFSET, sval * cie->data_align);
+            break;
+        case DW_CFA_GNU_negative_offset_extended:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_OFFSET,
+                     -(ptr_int_t)uval * cie->data_align);
+            break;
+        case DW_CFA_val_offset:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_VAL_OFFSET,
+                     (ptr_int_t)uval * cie->data_align);
+            break;
+        case DW_CFA_val_offset_sf:
+            if (!read_uleb128(&p, end, &reg) || !read_sleb128(&p, end, &sval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_VAL_OFFSET, sval * cie->data_align);
+            break;
+        case DW_CFA_restore_extended:
+            if (!read_uleb128(&p, end, &reg) || initial == NULL)
+                return false;
+            restore_rule(row, initial, cie->ra_reg, reg);
+            break;
+        case DW_CFA_undefined:
+            if (!read_uleb128(&p, end, &reg))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_UNDEFINED, 0);
+            break;
+        case DW_CFA_same_value:
+            if (!read_uleb128(&p, end, &reg))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_SAME, 0);
+            break;
+        case DW_CFA_register:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval))
+                return false;
+            set_rule(row, cie->ra_reg, reg, RULE_UNSUPPORTED, 0);
+            break;
+        case DW_CFA_remember_state:
+            if (depth >= CFA_STATE_STACK_DEPTH)
+                return false;
+            stack[depth++] = *row;
+            break;
+        case DW_CFA_restore_state:
+            if (depth == 0)
+                return false;
+            *row = stack[--depth];
+            break;
+        case DW_CFA_def_cfa:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval))
+                return false;
+            row->cfa_reg = (uint) reg;
+            row->cfa_offset = (ptr_int_t) uval;
+            row->cfa_is_expr = false;
+            break;
+        case DW_CFA_def_cfa_sf:
+            if (!read_uleb128(&p, end, &reg) || !read_sleb128(&p, end, &sval))
+                return false;
+            row->cfa_reg = (uint) reg;
+            row->cfa_offset = sval * cie->data_align;
+            row->cfa_is_expr = false;
+            break;
+        case DW_CFA_def_cfa_register:
+            if (!read_uleb128(&p, end, &reg))
+                return false;
+            row->cfa_reg = (uint) reg;
+            row->cfa_is_expr = false;
+            break;
+        case DW_CFA_def_cfa_offset:
+            if (!read_uleb128(&p, end, &uval))
+                return false;
+            row->cfa_offset = (ptr_int_t) uval;
+            break;
+        case DW_CFA_def_cfa_offset_sf:
+            if (!read_sleb128(&p, end, &sval))
+                return false;
+            row->cfa_offset = sval * cie->data_align;
+            break;
+        case DW_CFA_def_cfa_expression:
+            if (!read_uleb128(&p, end, &uval) || uval > (ptr_uint_t)(end - p))
+                return false;
+            p += uval;
+            row->cfa_is_expr = true;
+            break;
+        case DW_CFA_expression:
+        case DW_CFA_val_expression:
+            if (!read_uleb128(&p, end, &reg) || !read_uleb128(&p, end, &uval) ||
+                uval > (ptr_uint_t)(end - p))
+                return false;
+            p += uval;
+            set_rule(row, cie->ra_reg, reg, RULE_UNSUPPORTED, 0);
+            break;
+        case DW_CFA_GNU_args_size:
+            if (!read_uleb128(&p, end, &uval))
+                return false;
+            break;
+        default:
+            LOG(3, "%s: unknown CFA op 0x%x\n", __FUNCTION__, op);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Computes the row for pc from the FDE at fde */
+static bool
+find_row(unwind_module_t *mod, byte *fde, app_pc pc, cfa_row_t *row)
+{
+    byte *p = fde, *end, *cie;
+    cie_info_t cie_info;
+    cfa_row_t initial;
+    uint cie_offs;
+    ptr_uint_t pc_begin, pc_range, aug_len;
+    if (!read_entry_length(mod, &p, &end) ||
+        !read_bytes(&p, end, &cie_offs, sizeof(cie_offs)) || cie_offs == 0)
+        return false;
+    /* the CIE pointer is relative to its own field */
+    cie = p - sizeof(cie_offs) - cie_offs;
+    if (!parse_cie(mod, cie, &cie_info) ||
+        !read_encoded(&p, end, cie_info.fde_enc, mod->hdr, &pc_begin) ||
+        !read_encoded(&p, end, cie_info.fde_enc & 0x0f, NULL, &pc_range))
+        return false;
+    if (pc < (app_pc)pc_begin || pc >= (app_pc)pc_begin + pc_range)
+        return false;
+    if (cie_info.has_aug_data) {
+        if (!read_uleb128(&p, end, &aug_len) || aug_len > (ptr_uint_t)(end - p))
+            return false;
+        p += aug_len;
+    }
+    memset(row, 0, sizeof(*row));
+    row->cfa_reg = (uint) -1;
+    row->fp.kind = RULE_SAME;
+    row->ra.kind = RULE_UNDEFINED;
+    if (!run_cfa_program(cie_info.insts, cie_info.insts_end, &cie_info, mod->hdr,
+                         (app_pc)pc_begin, (app_pc)POINTER_MAX, row, NULL))
+        return false;
+    initial = *row;
+    return run_cfa_program(p, end, &cie_info, mod->hdr, (app_pc)pc_begin, pc,
+                           row, &initial);
+}
+
+/* Computes the caller's value from rule, or returns false */
+static bool
+apply_rule(reg_rule_t *rule, reg_t cfa, reg_t cur, reg_t *val OUT)
+{
+    switch (rule->kind) {
+    case RULE_SAME:
+        *val = cur;
+        return true;
+    case RULE_OFFSET:
+        return safe_read((void *)(cfa + rule->offset), sizeof(*val), val);
+    case RULE_VAL_OFFSET:
+        *val = cfa + rule->offset;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool
+unwind_step(unwind_module_t *mod, unwind_state_t *state, bool pc_is_retaddr)
+{
+    /* a retaddr can be just past the end of a noreturn call's function */
+    app_pc pc = pc_is_retaddr ? state->pc - 1 : state->pc;
+    cfa_row_t row;
+    byte *fde;
+    reg_t cfa, ra, fp;
+    if (pc < mod->start || pc >= mod->end)
+        return false;
+    fde = find_fde(mod, pc);
+    if (fde == NULL || !find_row(mod, fde, pc, &row) || row.cfa_is_expr)
+        return false;
+    if (row.cfa_reg == DWARF_REG_SP)
+        cfa = state->sp + row.cfa_offset;
+    else if (row.cfa_reg == DWARF_REG_FP)
+        cfa = state->fp + row.cfa_offset;
+    else
+        return false;
+    if (!apply_rule(&row.fp, cfa, state->fp, &fp))
+        return false;
+    if (row.ra.kind == RULE_UNDEFINED) {
+        /* outermost frame, such as _start */
+        state->pc = NULL;
+        return true;
+    }
+    if (!apply_rule(&row.ra, cfa, (reg_t)state->pc, &ra))
+        return false;
+    /* the stack only grows down, so a caller can't be below its callee */
+    if (cfa <= state->sp)
+        return false;
+    state->pc = (app_pc) ra;
+    state->sp = cfa;
+    state->fp = fp;
+    return true;
+}
+
+#endif /* LINUX */
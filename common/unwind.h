@@ -0,0 +1,66 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _UNWIND_H_
+#define _UNWIND_H_ 1
+
+/* DWARF call frame information unwinding for Linux modules.
+ *
+ * We use each module's .eh_frame_hdr, which the linker emits for every
+ * module with .eh_frame (even w/o exception support in the app it's
+ * needed for pthread_cancel), and whose binary search table maps pcs to
+ * FDEs.  Only the stack pointer, frame pointer, and return address are
+ * tracked: a frame whose CFA is based on any other register is not
+ * unwound.
+ */
+
+#include "dr_api.h"
+
+#ifdef LINUX
+
+typedef struct _unwind_module_t unwind_module_t;
+
+/* The state of a frame: on a successful step, that of its caller */
+typedef struct _unwind_state_t {
+    app_pc pc;
+    reg_t sp;
+    reg_t fp;
+} unwind_state_t;
+
+/* Returns NULL if the module has no usable .eh_frame_hdr */
+unwind_module_t *
+unwind_module_create(const module_data_t *info);
+
+void
+unwind_module_free(unwind_module_t *mod);
+
+/* Steps state from the frame at state->pc in mod to its caller.  If
+ * pc_is_retaddr, state->pc is a return address rather than the next
+ * instruction to execute.  Returns false, leaving state untouched, if mod
+ * has no usable CFI for the pc.  Sets state->pc to NULL at the outermost
+ * frame.  The caller must prevent mod from being unloaded meanwhile.
+ */
+bool
+unwind_step(unwind_module_t *mod, unwind_state_t *state, bool pc_is_retaddr);
+
+#endif /* LINUX */
+
+#endif /* _UNWIND_H_ */
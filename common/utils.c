@@ -1201,6 +1201,311 @@ hashwrap_assert_fail(const char *msg)
     ASSERT(false, msg);
 }
 
+/***************************************************************************
+ * EPOCH-BASED RECLAMATION
+ *
+ * A reader announces epoch_global in its record and then re-reads it:
+ * either an advancer, which needs every announced reader to be at the
+ * current epoch, sees the announcement, or the reader sees the new epoch
+ * and retries.  An item deferred in epoch N was unlinked before any
+ * section that announces N+1 began, so once the epoch reaches N+2 no
+ * section that could have reached it remains.
+ *
+ * Each record also holds the items its thread deferred, under the record's
+ * own lock so that any thread can free them: a thread that goes idle does
+ * not hold back its items, and a record outlives its thread for reuse.
+ */
+
+typedef struct _epoch_item_t {
+    void *item;
+    void (*free_func)(void *item, void *data);
+    void *data;
+} epoch_item_t;
+
+typedef struct _epoch_limbo_t {
+    uint epoch;
+    uint num;
+    uint capacity;
+    epoch_item_t *items;
+} epoch_limbo_t;
+
+/* An item waits through two advances, so three buckets keyed by epoch */
+#define EPOCH_LIMBO_BUCKETS 3
+#define EPOCH_LIMBO_INIT_CAPACITY 16
+/* Defers on a thread, and outermost exits while items wait, between reclaims */
+#define EPOCH_DEFER_RECLAIM_INTERVAL 64
+#define EPOCH_READ_RECLAIM_INTERVAL 256
+
+typedef struct _epoch_reader_t {
+    /* epoch announced by the current read section, or 0 */
+    volatile uint epoch;
+    /* owned by a live thread: protected by epoch_lock */
+    bool in_use;
+    /* in epoch_reclaim(), whose free_funcs can defer more */
+    bool reclaiming;
+    uint defers;
+    uint exits;
+    void *lock; /* protects limbo */
+    epoch_limbo_t limbo[EPOCH_LIMBO_BUCKETS];
+    /* records are only added, at the head, and live until utils_exit() */
+    struct _epoch_reader_t *next;
+} epoch_reader_t;
+
+static epoch_reader_t *volatile epoch_readers;
+/* Holds items deferred by a thread w/o a record.  Never reads. */
+static epoch_reader_t epoch_orphans;
+/* Never 0, which marks a record outside any section */
+static volatile uint epoch_global = 1;
+/* Protects adding records and advancing epoch_global */
+static void *epoch_lock;
+/* Items waiting in all records, so idle readers can skip reclaiming */
+static volatile int epoch_pending;
+
+/* Returns the calling thread's record, or NULL if it has none */
+static epoch_reader_t *
+epoch_reader_self(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    tls_util_t *pt;
+    epoch_reader_t *r;
+    if (drcontext == NULL || tls_idx_util < 0)
+        return NULL;
+    pt = PT_GET(drcontext);
+    if (pt == NULL)
+        return NULL;
+    if (pt->epoch_reader != NULL)
+        return pt->epoch_reader;
+    dr_mutex_lock(epoch_lock);
+    for (r = epoch_readers; r != NULL; r = r->next) {
+        if (!r->in_use)
+            break;
+    }
+    if (r == NULL) {
+        r = (epoch_reader_t *) global_alloc(sizeof(*r), HEAPSTAT_MISC);
+        memset(r, 0, sizeof(*r));
+        r->lock = dr_mutex_create();
+        r->next = epoch_readers;
+        /* the record must be complete before lock-free walks can see it */
+        MEMORY_STORE_BARRIER();
+        epoch_readers = r;
+    }
+    /* a reused record keeps its dead thread's limbo */
+    r->in_use = true;
+    r->reclaiming = false;
+    r->defers = 0;
+    r->exits = 0;
+    dr_mutex_unlock(epoch_lock);
+    pt->epoch_reader = r;
+    return r;
+}
+
+void *
+epoch_read_enter(void)
+{
+    epoch_reader_t *r = epoch_reader_self();
+    if (r == NULL)
+        return NULL;
+    if (r->epoch != 0) {
+        /* Nested inside another section on this thread: the outer
+         * announcement, even if it is about to be retried, holds back
+         * every advance that could free what we can reach.
+         */
+        return (void *)((ptr_uint_t)r | 1);
+    }
+    while (true) {
+        uint epoch = epoch_global;
+        /* the exchange's full barrier orders the announcement before the
+         * re-read of the epoch
+         */
+        atomic_exchange32((volatile int *)&r->epoch, (int)epoch);
+        if (epoch == epoch_global)
+            break;
+        r->epoch = 0;
+    }
+    return (void *)r;
+}
+
+static void
+epoch_reclaim(epoch_reader_t *self);
+
+void
+epoch_read_exit(void *token)
+{
+    epoch_reader_t *r = (epoch_reader_t *) token;
+    ASSERT(token != NULL, "exiting a read section never entered");
+    if (TEST(1, (ptr_uint_t)token))
+        return;
+    /* the section's reads must complete first */
+    MEMORY_STORE_BARRIER();
+    r->epoch = 0;
+    if (epoch_pending > 0 && ++r->exits % EPOCH_READ_RECLAIM_INTERVAL == 0)
+        epoch_reclaim(r);
+}
+
+/* Advances epoch_global if every reader in a section has seen it */
+static void
+epoch_try_advance(void)
+{
+    epoch_reader_t *r;
+    uint epoch;
+    if (!dr_mutex_trylock(epoch_lock))
+        return; /* someone else is advancing */
+    epoch = epoch_global;
+    for (r = epoch_readers; r != NULL; r = r->next) {
+        uint seen = r->epoch;
+        if (seen != 0 && seen != epoch)
+            break;
+    }
+    if (r == NULL) {
+        if (epoch + 1 == 0)
+            ATOMIC_INC32(epoch_global);
+        ATOMIC_INC32(epoch_global);
+    }
+    dr_mutex_unlock(epoch_lock);
+}
+
+static void
+epoch_limbo_free(epoch_limbo_t *bucket)
+{
+    uint i;
+    for (i = 0; i < bucket->num; i++)
+        bucket->items[i].free_func(bucket->items[i].item, bucket->items[i].data);
+    ATOMIC_ADD32(epoch_pending, -(int)bucket->num);
+    if (bucket->items != NULL) {
+        global_free(bucket->items, bucket->capacity * sizeof(*bucket->items),
+                    HEAPSTAT_MISC);
+    }
+}
+
+/* Frees the items in every record that no section can still reach.  The
+ * free_funcs are called outside the record locks, which we only try for,
+ * so a record being appended to is simply left for next time.
+ */
+static void
+epoch_reclaim(epoch_reader_t *self)
+{
+    epoch_limbo_t done[EPOCH_LIMBO_BUCKETS];
+    epoch_reader_t *r;
+    uint i, num_done, epoch;
+    if (self->reclaiming)
+        return;
+    self->reclaiming = true;
+    epoch_try_advance();
+    epoch = epoch_global;
+    for (r = epoch_readers; r != NULL; r = r->next) {
+        if (!dr_mutex_trylock(r->lock))
+            continue;
+        num_done = 0;
+        for (i = 0; i < EPOCH_LIMBO_BUCKETS; i++) {
+            epoch_limbo_t *bucket = &r->limbo[i];
+            if (bucket->num > 0 && epoch - bucket->epoch >= 2) {
+                done[num_done++] = *bucket;
+                memset(bucket, 0, sizeof(*bucket));
+            }
+        }
+        dr_mutex_unlock(r->lock);
+        for (i = 0; i < num_done; i++)
+            epoch_limbo_free(&done[i]);
+    }
+    self->reclaiming = false;
+}
+
+void
+epoch_defer_free(void *item, void (*free_func)(void *item, void *data), void *data)
+{
+    epoch_reader_t *self = epoch_reader_self();
+    epoch_reader_t *r = (self == NULL) ? &epoch_orphans : self;
+    epoch_limbo_t *bucket;
+    uint epoch;
+    dr_mutex_lock(r->lock);
+    /* read after the caller unlinked item */
+    epoch = epoch_global;
+    bucket = &r->limbo[epoch % EPOCH_LIMBO_BUCKETS];
+    /* anything still here is from an older epoch and now waits on this one */
+    bucket->epoch = epoch;
+    if (bucket->num == bucket->capacity) {
+        uint capacity = (bucket->capacity == 0) ? EPOCH_LIMBO_INIT_CAPACITY :
+            bucket->capacity * 2;
+        epoch_item_t *items = (epoch_item_t *)
+            global_alloc(capacity * sizeof(*items), HEAPSTAT_MISC);
+        if (bucket->items != NULL) {
+            memcpy(items, bucket->items, bucket->num * sizeof(*items));
+            global_free(bucket->items, bucket->capacity * sizeof(*items),
+                        HEAPSTAT_MISC);
+        }
+        bucket->items = items;
+        bucket->capacity = capacity;
+    }
+    bucket->items[bucket->num].item = item;
+    bucket->items[bucket->num].free_func = free_func;
+    bucket->items[bucket->num].data = data;
+    bucket->num++;
+    dr_mutex_unlock(r->lock);
+    ATOMIC_INC32(epoch_pending);
+    if (self != NULL && ++self->defers % EPOCH_DEFER_RECLAIM_INTERVAL == 0)
+        epoch_reclaim(self);
+}
+
+void
+epoch_reclaim_all(void)
+{
+    epoch_limbo_t done;
+    epoch_reader_t *r;
+    uint i;
+    /* free_funcs can defer more */
+    while (epoch_pending > 0) {
+        for (r = epoch_readers; r != NULL; r = r->next) {
+            for (i = 0; i < EPOCH_LIMBO_BUCKETS; i++) {
+                dr_mutex_lock(r->lock);
+                done = r->limbo[i];
+                memset(&r->limbo[i], 0, sizeof(r->limbo[i]));
+                dr_mutex_unlock(r->lock);
+                epoch_limbo_free(&done);
+            }
+        }
+    }
+}
+
+static void
+epoch_init(void)
+{
+    epoch_lock = dr_mutex_create();
+    epoch_orphans.lock = dr_mutex_create();
+    epoch_orphans.in_use = true;
+    epoch_readers = &epoch_orphans;
+}
+
+static void
+epoch_exit(void)
+{
+    epoch_reader_t *r, *next;
+    epoch_reclaim_all();
+    for (r = epoch_readers; r != NULL; r = next) {
+        next = r->next;
+        dr_mutex_destroy(r->lock);
+        if (r != &epoch_orphans)
+            global_free(r, sizeof(*r), HEAPSTAT_MISC);
+    }
+    epoch_readers = NULL;
+    dr_mutex_destroy(epoch_lock);
+}
+
+static void
+epoch_thread_exit(tls_util_t *pt)
+{
+    epoch_reader_t *r = pt->epoch_reader;
+    if (r == NULL)
+        return;
+    ASSERT(r->epoch == 0, "thread exiting inside a read section");
+    /* our own sections may be all that held these back */
+    if (epoch_pending > 0)
+        epoch_reclaim(r);
+    pt->epoch_reader = NULL;
+    dr_mutex_lock(epoch_lock);
+    r->in_use = false;
+    dr_mutex_unlock(epoch_lock);
+}
+
 /***************************************************************************
  * INIT/EXIT
  */
@@ -1230,12 +1535,15 @@ utils_init(void)
 
     hashtable_global_config(hashwrap_alloc, hashwrap_free, hashwrap_assert_fail);
 
+    epoch_init();
+
     primary_thread = dr_get_thread_id(dr_get_current_drcontext());
 }
 
 void
 utils_exit(void)
 {
+    epoch_exit();
 #ifdef USE_DRSYMS
     if (drsym_exit() != DRSYM_SUCCESS) {
         LOG(1, "WARNING: error cleaning up symbol library\n");
@@ -1256,6 +1564,7 @@ void
 utils_thread_exit(void *drcontext)
 {
     tls_util_t *pt = (tls_util_t *) drmgr_get_tls_field(drcontext, tls_idx_util);
+    epoch_thread_exit(pt);
     /* with PR 536058 we do have dcontext in exit event so indicate explicitly
      * that we've cleaned up the per-thread data
      */
@@ -276,6 +276,7 @@ print_prefix_to_console(void);
 /* Per-thread data shared across callbacks and all modules */
 typedef struct _tls_util_t {
     file_t f;  /* logfile */
+    struct _epoch_reader_t *epoch_reader; /* see epoch_read_enter() */
 } tls_util_t;
 
 extern int tls_idx_util;
@@ -486,6 +487,16 @@ extern int tls_idx_util;
 # define ATOMIC_DEC32(x) __asm__ __volatile__("lock decl %0" : "=m" (x) : : "memory")
 # define ATOMIC_ADD32(x, val) \
     __asm__ __volatile__("lock addl %1, %0" : "=m" (x) : "r" (val) : "memory")
+# define ATOMIC_OR32(x, val) \
+    __asm__ __volatile__("lock orl %1, %0" : "=m" (x) : "r" (val) : "memory")
+# define ATOMIC_AND32(x, val) \
+    __asm__ __volatile__("lock andl %1, %0" : "=m" (x) : "r" (val) : "memory")
+/* Keeps prior loads and stores ahead of subsequent stores.  x86 does not
+ * reorder those so only the compiler needs to be stopped.
+ */
+# define MEMORY_STORE_BARRIER() __asm__ __volatile__("" : : : "memory")
+/* Keeps prior loads ahead of subsequent loads: likewise only the compiler */
+# define MEMORY_LOAD_BARRIER() __asm__ __volatile__("" : : : "memory")
 
 static inline int
 atomic_add32_return_sum(volatile int *x, int val)
@@ -495,16 +506,50 @@ atomic_add32_return_sum(volatile int *x, int val)
                          : "1" (val) : "memory");
     return (cur + val);
 }
+
+/* Sets *x to val if it equals expect.  Returns whether it did. */
+static inline bool
+atomic_compare_exchange32(volatile int *x, int expect, int val)
+{
+    int prev;
+    __asm__ __volatile__("lock cmpxchgl %2, %1" : "=a" (prev), "+m" (*x)
+                         : "r" (val), "0" (expect) : "memory");
+    return (prev == expect);
+}
+
+/* Sets *x to val, w/ a full barrier.  Returns the prior value. */
+static inline int
+atomic_exchange32(volatile int *x, int val)
+{
+    __asm__ __volatile__("xchgl %0, %1" : "+r" (val), "+m" (*x) : : "memory");
+    return val;
+}
 #else
 # define ATOMIC_INC32(x) _InterlockedIncrement((volatile LONG *)&(x))
 # define ATOMIC_DEC32(x) _InterlockedDecrement((volatile LONG *)&(x))
 # define ATOMIC_ADD32(x, val) _InterlockedExchangeAdd((volatile LONG *)&(x), val)
+# define ATOMIC_OR32(x, val) _InterlockedOr((volatile LONG *)&(x), val)
+# define ATOMIC_AND32(x, val) _InterlockedAnd((volatile LONG *)&(x), val)
+# define MEMORY_STORE_BARRIER() _ReadWriteBarrier()
+# define MEMORY_LOAD_BARRIER() _ReadWriteBarrier()
 
 static inline int
 atomic_add32_return_sum(volatile int *x, int val)
 {
     return (ATOMIC_ADD32(*x, val) + val);
 }
+
+static inline bool
+atomic_compare_exchange32(volatile int *x, int expect, int val)
+{
+    return (_InterlockedCompareExchange((volatile LONG *)x, val, expect) == expect);
+}
+
+static inline int
+atomic_exchange32(volatile int *x, int val)
+{
+    return _InterlockedExchange((volatile LONG *)x, val);
+}
 #endif
 
 /* racy: should be used only for diagnostics */
@@ -752,6 +797,39 @@ const char *
 text_contains_any_string(const char *text, const char *patterns, bool ignore_case,
                          const char **matched);
 
+/***************************************************************************
+ * EPOCH-BASED RECLAMATION
+ *
+ * For data read w/o a lock: a writer that unlinks an item passes it to
+ * epoch_defer_free(), which frees it once no read section that might
+ * have seen it is still running.
+ */
+
+/* Enters a read section and returns the token to pass to
+ * epoch_read_exit().  Returns NULL if this thread cannot read lock-free
+ * (before utils_thread_init() or after utils_thread_exit()), in which
+ * case the caller must use its lock instead.  Sections nest, including
+ * one from a signal or restore-state event that interrupts another.
+ */
+void *
+epoch_read_enter(void);
+
+void
+epoch_read_exit(void *token);
+
+/* Calls free_func(item, data) once every read section that could have
+ * reached item has exited.  free_func can be called w/ any of the caller's
+ * locks held, and from any thread, so it must only take leaf locks.
+ */
+void
+epoch_defer_free(void *item, void (*free_func)(void *item, void *data), void *data);
+
+/* Calls every pending free_func now, ignoring readers.  Only for exit,
+ * before tearing down state that the free_funcs use.
+ */
+void
+epoch_reclaim_all(void);
+
 /***************************************************************************
  * HASHTABLE
  *
@@ -121,6 +121,7 @@ static void *snapshot_lock;
 static void reset_clock_timer(void);
 static void reset_real_timer(void);
 static void event_thread_exit(void *drcontext);
+static void alloc_events_drain_all(void);
 
 #ifdef STATISTICS
 static void 
@@ -147,12 +148,16 @@ static hashtable_t alloc_md5_table;
  * TLS and CLS
  */
 
+struct _alloc_event_buf_t;
+
 typedef struct _tls_heapstat_t {
     char *errbuf; /* buffer for atomic writes */
     size_t errbufsz;
 # ifdef LINUX
     int64 filepos; /* f_callstack file position */
 # endif
+    /* for -batch_alloc_events */
+    struct _alloc_event_buf_t *events;
 } tls_heapstat_t;
 
 /* XXX: share w/ syscall_os.h */
@@ -564,6 +569,7 @@ take_snapshot(void)
      * needing potentially very large buffers to try and get atomic writes
      */
     dr_mutex_lock(snapshot_lock);
+    alloc_events_drain_all();
     if (options.staleness) {
         /* Unlike the mem usage data which is maintained as the app
          * executes, we have to go collect this at snapshot time from
@@ -608,18 +614,18 @@ take_snapshot(void)
     dr_mutex_unlock(snapshot_lock);
 }
 
-/* Called from pre-alloc-hashtable-change events.
- * Updates the current snapshot and callstack usage.
+/* Updates the current snapshot and callstack usage.
+ * Caller must hold snapshot_lock.
+ * With -batch_alloc_events, records from different threads are applied out
+ * of order, so a free can arrive before its malloc and the counts can
+ * transiently go negative (they are unsigned but wrap back).
  */
 static void
-account_for_bytes_pre(per_callstack_t *per, int asked_for,
-                      int extra_usable, int extra_occupied)
+account_for_bytes_locked(per_callstack_t *per, int asked_for,
+                         int extra_usable, int extra_occupied)
 {
-    /* must be synched w/ take_snapshot().  the malloc lock is always acquired
-     * before the snapshot lock.
-     */
-    dr_mutex_lock(snapshot_lock);
-    if (asked_for+extra_usable > 0) {
+    if (asked_for+extra_usable > 0 ||
+        (options.batch_alloc_events && per->used == NULL)) {
         if (per->used == NULL) {
             per->used = (heap_used_t *)
                 global_alloc(sizeof(*per->used), HEAPSTAT_SNAPSHOT);
@@ -634,13 +640,17 @@ account_for_bytes_pre(per_callstack_t *per, int asked_for,
             ASSERT(per->prev_used == NULL, "prev_used should already be null");
             snaps[snap_idx].used = per->used;
         }
+    }
+    if (asked_for+extra_usable > 0) {
         per->used->instances++;
         snaps[snap_idx].tot_mallocs++;
     } else {
         ASSERT(asked_for+extra_usable < 0, "cannot have 0-sized usable space");
         ASSERT(per->used != NULL, "alloc must exist");
-        ASSERT(per->used->instances > 0, "alloc count must be >= 0");
-        ASSERT(snaps[snap_idx].tot_mallocs > 0, "alloc count must be >= 0");
+        ASSERT(options.batch_alloc_events || per->used->instances > 0,
+               "alloc count must be >= 0");
+        ASSERT(options.batch_alloc_events || snaps[snap_idx].tot_mallocs > 0,
+               "alloc count must be >= 0");
         per->used->instances--;
         snaps[snap_idx].tot_mallocs--;
     }
@@ -650,7 +660,11 @@ account_for_bytes_pre(per_callstack_t *per, int asked_for,
     LOG(2, "callstack id %u => %ux, %uB, +%uB, +%uB\n", per->id,
         per->used->instances, per->used->bytes_asked_for,
         per->used->extra_usable, per->used->extra_occupied);
-    if (per->used->instances == 0) {
+    if (per->used->instances == 0 &&
+        /* a batched malloc and a different one's free can cancel out */
+        (!options.batch_alloc_events ||
+         (per->used->bytes_asked_for == 0 && per->used->extra_usable == 0 &&
+          per->used->extra_occupied == 0))) {
         /* remove the node to save memory since may not re-alloc */
         ASSERT(per->used->bytes_asked_for == 0, "no malloc => no bytes!");
         if (per->used->next != NULL)
@@ -668,6 +682,142 @@ account_for_bytes_pre(per_callstack_t *per, int asked_for,
     snaps[snap_idx].tot_bytes_asked_for += asked_for;
     snaps[snap_idx].tot_bytes_usable += asked_for + extra_usable;
     snaps[snap_idx].tot_bytes_occupied += asked_for + extra_usable + extra_occupied;
+}
+
+/* -batch_alloc_events: each thread appends its usage changes to its own
+ * ring buffer without locking.  Any thread holding snapshot_lock may drain
+ * any buffer: the owner is the single producer and snapshot_lock
+ * serializes consumers.  All buffers are drained before a snapshot is
+ * taken, dumped, or reset, and when any one of them fills.  Partway through
+ * a drain the totals mix different threads' progress, so peaks are only
+ * checked for once every buffer has been drained.
+ */
+typedef struct _alloc_event_t {
+    per_callstack_t *per;
+    int asked_for;
+    int extra_usable;
+    int extra_occupied;
+} alloc_event_t;
+
+#define ALLOC_EVENT_BUF_SIZE 256 /* power of 2 */
+
+typedef struct _alloc_event_buf_t {
+    /* free-running indices: only the owner writes head, only a drainer tail */
+    volatile uint head;
+    volatile uint tail;
+    /* list of all threads' buffers, protected by snapshot_lock */
+    struct _alloc_event_buf_t *next;
+    struct _alloc_event_buf_t *prev;
+    alloc_event_t ev[ALLOC_EVENT_BUF_SIZE];
+} alloc_event_buf_t;
+
+static alloc_event_buf_t *alloc_event_bufs;
+
+/* Caller must hold snapshot_lock */
+static void
+alloc_events_drain(alloc_event_buf_t *buf)
+{
+    uint head = buf->head;
+    uint tail;
+    for (tail = buf->tail; tail != head; tail++) {
+        alloc_event_t *ev = &buf->ev[tail & (ALLOC_EVENT_BUF_SIZE - 1)];
+        account_for_bytes_locked(ev->per, ev->asked_for, ev->extra_usable,
+                                 ev->extra_occupied);
+    }
+    /* the slots must be read before the owner can reuse them */
+    MEMORY_STORE_BARRIER();
+    buf->tail = tail;
+}
+
+/* Caller must hold snapshot_lock */
+static void
+alloc_events_drain_all(void)
+{
+    alloc_event_buf_t *buf;
+    for (buf = alloc_event_bufs; buf != NULL; buf = buf->next)
+        alloc_events_drain(buf);
+}
+
+static void
+alloc_events_append(alloc_event_buf_t *buf, per_callstack_t *per, int asked_for,
+                    int extra_usable, int extra_occupied)
+{
+    uint head = buf->head;
+    alloc_event_t *ev;
+    if (head - buf->tail == ALLOC_EVENT_BUF_SIZE) {
+        dr_mutex_lock(snapshot_lock);
+        alloc_events_drain_all();
+        /* the totals are consistent again: see whether they peaked (PR 476018) */
+        check_for_peak();
+        dr_mutex_unlock(snapshot_lock);
+    }
+    ev = &buf->ev[head & (ALLOC_EVENT_BUF_SIZE - 1)];
+    ev->per = per;
+    ev->asked_for = asked_for;
+    ev->extra_usable = extra_usable;
+    ev->extra_occupied = extra_occupied;
+    /* the record must be complete before a drainer can see it */
+    MEMORY_STORE_BARRIER();
+    buf->head = head + 1;
+}
+
+static void
+alloc_events_thread_init(tls_heapstat_t *pt)
+{
+    alloc_event_buf_t *buf = (alloc_event_buf_t *)
+        global_alloc(sizeof(*buf), HEAPSTAT_SNAPSHOT);
+    memset(buf, 0, sizeof(*buf));
+    dr_mutex_lock(snapshot_lock);
+    buf->next = alloc_event_bufs;
+    if (alloc_event_bufs != NULL)
+        alloc_event_bufs->prev = buf;
+    alloc_event_bufs = buf;
+    dr_mutex_unlock(snapshot_lock);
+    pt->events = buf;
+}
+
+static void
+alloc_events_thread_exit(tls_heapstat_t *pt)
+{
+    alloc_event_buf_t *buf = pt->events;
+    if (buf == NULL)
+        return;
+    dr_mutex_lock(snapshot_lock);
+    alloc_events_drain(buf);
+    if (buf->prev != NULL)
+        buf->prev->next = buf->next;
+    else
+        alloc_event_bufs = buf->next;
+    if (buf->next != NULL)
+        buf->next->prev = buf->prev;
+    dr_mutex_unlock(snapshot_lock);
+    pt->events = NULL;
+    global_free(buf, sizeof(*buf), HEAPSTAT_SNAPSHOT);
+}
+
+/* Called from pre-alloc-hashtable-change events.
+ * Updates the current snapshot and callstack usage, or with
+ * -batch_alloc_events queues the update.
+ */
+static void
+account_for_bytes_pre(per_callstack_t *per, int asked_for,
+                      int extra_usable, int extra_occupied)
+{
+    if (options.batch_alloc_events) {
+        void *drcontext = dr_get_current_drcontext();
+        tls_heapstat_t *pt = (drcontext == NULL) ? NULL : (tls_heapstat_t *)
+            drmgr_get_tls_field(drcontext, tls_idx_heapstat);
+        if (pt != NULL && pt->events != NULL) {
+            alloc_events_append(pt->events, per, asked_for, extra_usable,
+                                extra_occupied);
+            return;
+        }
+    }
+    /* must be synched w/ take_snapshot().  the malloc lock is always acquired
+     * before the snapshot lock.
+     */
+    dr_mutex_lock(snapshot_lock);
+    account_for_bytes_locked(per, asked_for, extra_usable, extra_occupied);
     dr_mutex_unlock(snapshot_lock);
 }
 
@@ -753,11 +903,17 @@ client_add_malloc_pre(app_pc start, app_pc end, app_pc real_end,
         /* Printing to a buffer is slow (quite noticeable: 2x on cfrac) so it's
          * faster to create a packed callstack for computing the checksum to
          * decide uniqueness, limiting printing to new callstacks only.
+         * We never keep it, so we record into the thread's scratch space.
          */
         packed_callstack_t *pcs;
+        bool scratch = true;
         app_loc_t loc;
         pc_to_loc(&loc, post_call);
-        packed_callstack_record(&pcs, mc, &loc);
+        pcs = packed_callstack_record_scratch(mc, &loc, false/*resolve now*/);
+        if (pcs == NULL) {
+            scratch = false;
+            packed_callstack_record(&pcs, mc, &loc);
+        }
 
 #if defined(USE_MD5) || defined(CHECK_WITH_MD5)
         packed_callstack_md5(pcs, md5);
@@ -794,8 +950,10 @@ client_add_malloc_pre(app_pc start, app_pc end, app_pc real_end,
             dump_callstack(pcs, per, buf, bufsz, &sofar);
         }
         hashtable_unlock(&alloc_stack_table);
-        sofar = packed_callstack_free(pcs);
-        ASSERT(sofar == 0, "pcs should have 0 ref count");
+        if (!scratch) {
+            sofar = packed_callstack_free(pcs);
+            ASSERT(sofar == 0, "pcs should have 0 ref count");
+        }
     }
 
 #ifdef X64
@@ -830,8 +988,11 @@ client_remove_malloc_pre(app_pc start, app_pc end, app_pc real_end, void *data)
 #ifdef X64
     /* FIXME: assert not truncating */
 #endif
-    /* To avoid repeatedly redoing the peak snapshot we wait until a drop (PR 476018) */
-    check_for_peak();
+    /* To avoid repeatedly redoing the peak snapshot we wait until a drop (PR 476018).
+     * With -batch_alloc_events this is done each time all records are applied.
+     */
+    if (!options.batch_alloc_events)
+        check_for_peak();
     account_for_bytes_pre(per, -(end - start), -(real_end - end), -(ssize_t)(HEADER_SIZE));
     if (options.staleness)
         staleness_free_per_alloc((stale_per_alloc_t *)data);
@@ -860,6 +1021,7 @@ snapshot_dump_all(void)
 {
     uint i;
     dr_mutex_lock(snapshot_lock);
+    alloc_events_drain_all();
     /* These should be sorted by stamp, but simpler to have the vis tool
      * sort them.
      */
@@ -897,6 +1059,12 @@ snapshot_exit(void)
 
     snapshot_dump_all();
 
+    while (alloc_event_bufs != NULL) {
+        /* threads still alive at exit: already drained above */
+        alloc_event_buf_t *buf = alloc_event_bufs;
+        alloc_event_bufs = buf->next;
+        global_free(buf, sizeof(*buf), HEAPSTAT_SNAPSHOT);
+    }
     for (i = 0; i < options.snapshots; i++)
         free_snapshot(&snaps[i]);
     global_free(snaps, options.snapshots*sizeof(*snaps), HEAPSTAT_SNAPSHOT);
@@ -1590,6 +1758,7 @@ reset_to_time_zero(bool keep_offs)
 {
     int i;
     dr_mutex_lock(snapshot_lock);
+    alloc_events_drain_all();
 
     /* take current data and make it the cur val of to-be-snapshot 0 */
     if (snap_idx != 0)
@@ -2011,6 +2180,8 @@ event_thread_init(void *drcontext)
         shadow_thread_init(drcontext);
     if (options.staleness)
         instrument_thread_init(drcontext);
+    if (options.batch_alloc_events)
+        alloc_events_thread_init(pt);
 }
 
 static void 
@@ -2019,6 +2190,7 @@ event_thread_exit(void *drcontext)
     tls_heapstat_t *pt = (tls_heapstat_t *)
         drmgr_get_tls_field(drcontext, tls_idx_heapstat);
     LOGPT(2, PT_GET(drcontext), "in event_thread_exit()\n");
+    alloc_events_thread_exit(pt);
     if (options.staleness)
         instrument_thread_init(drcontext);
     callstack_thread_exit(drcontext);
@@ -2168,6 +2340,10 @@ dr_init(client_id_t client_id)
                     * can be the bottleneck) and good callstacks
                     */
                    PAGE_SIZE,
+                   options.callstack_shadow_stack,
+                   options.callstack_cfi_unwind,
+                   /* we keep checksums rather than callstacks */
+                   false/*!frame_trie*/,
                    /* XXX i#926: symbolize and suppress leaks online (and then
                     * use options.callstack_style here)
                     */
@@ -123,6 +123,10 @@ OPTION_CLIENT(client, peak_threshold, uint, 5, 0, 99,
               "Accuracy of peak snapshot, in percentage from the true peak.",
               "A new peak snapshot will only be taken if it is more than this percentage different from the existing peak snapshot in any of total size, number of allocations and frees, and timestamp.  Lowering this number can reduce performance but will also increase accuracy.")
 
+OPTION_CLIENT_BOOL(client, batch_alloc_events, false,
+                   "Batch heap usage accounting per thread",
+                   "Rather than updating the current snapshot under a global lock on every allocation and free, each thread appends a compact record to its own buffer, and the records are applied when a snapshot is taken or when the buffer fills.  This reduces contention in heavily multi-threaded applications.  The peak snapshot is then only checked once every thread's records have been applied, rather than at each free, so a short-lived peak between such points can be missed.")
+
 OPTION_CLIENT_BOOL(client, staleness, true,
                    "Record staleness data for each allocation",
                    "Whether to record the time at which each allocation was last accessed.")
@@ -29,6 +29,7 @@
 #include "alloc.h"
 #include "heap.h"
 #include "redblack.h"
+#include "ohashtable.h"
 #include "leak.h"
 #ifdef LINUX
 # include "sysnum_linux.h"
@@ -42,15 +43,122 @@
 #include "pattern.h"
 
 /* PR 465174: share allocation site callstacks.
- * This table should only be accessed while holding the lock for
- * malloc_table (via malloc_lock()), which makes the coordinated
- * operations with malloc_table atomic.
- *
- * FIXME i#949: for -replace_malloc a global lock is not always held
- * so we need our own locks
+ * The malloc table is sharded (-shard_malloc_table) and for -replace_malloc
+ * no global lock is held (i#949), so the coordinated lookup+add and
+ * refcount+remove operations hold this table's own lock.
+ * With -shard_malloc_table the table is likewise split, by callstack hash,
+ * so that threads allocating from different call sites take different locks.
+ * A thread holds at most one shard lock at a time.
+ * Finding an existing callstack, the common case, takes no lock at all:
+ * see alloc_stack_lookup_lockfree().
+ */
+#define ASTACK_TABLE_HASH_BITS 6
+#define ASTACK_TABLE_SHARD_BITS 4
+#define ASTACK_TABLE_SHARDS (1U << ASTACK_TABLE_SHARD_BITS)
+static ohashtable_t alloc_stack_table[ASTACK_TABLE_SHARDS];
+static uint num_alloc_stack_shards;
+
+/* The callstack hash xors frame addresses, so mix before taking the top bits */
+static inline ohashtable_t *
+alloc_stack_shard(packed_callstack_t *pcs)
+{
+    uint hash = packed_callstack_hash(pcs) * 0x9e3779b1U;
+    return &alloc_stack_table[(hash >> (32 - ASTACK_TABLE_SHARD_BITS)) &
+                              (num_alloc_stack_shards - 1)];
+}
+
+/* A lock-free lookup can still be comparing against a callstack after it
+ * leaves its shard, so a callstack that has been in the table is retired
+ * rather than freed when its last reference goes away: see epoch_read_enter().
+ */
+static void
+alloc_stack_free_retired(void *pcs, void *data)
+{
+    packed_callstack_destroy((packed_callstack_t *) pcs);
+}
+
+static inline void
+alloc_stack_retire(packed_callstack_t *pcs)
+{
+    epoch_defer_free((void *)pcs, alloc_stack_free_retired, NULL);
+}
+
+/* Returns the callstack in shard equal to pcs with a reference added, or
+ * NULL if there is none or we raced with a change to the shard, in which
+ * case the caller should take the lock and look again.
+ */
+static packed_callstack_t *
+alloc_stack_lookup_lockfree(ohashtable_t *shard, packed_callstack_t *pcs)
+{
+    packed_callstack_t *res = NULL;
+    void *found = NULL;
+    void *reader = epoch_read_enter();
+    if (reader == NULL)
+        return NULL;
+    if (ohashtable_lookup_lockfree(shard, (void *)pcs, &found) && found != NULL &&
+        packed_callstack_add_ref_if_live((packed_callstack_t *) found))
+        res = (packed_callstack_t *) found;
+    epoch_read_exit(reader);
+    return res;
+}
+
+/* Drops a reference to pcs, which may be in shard, whose lock the caller
+ * must hold.  The table's reference is dropped along with the last other
+ * one, unless a lock-free lookup added one first.
  */
-#define ASTACK_TABLE_HASH_BITS 8
-static hashtable_t alloc_stack_table;
+static void
+alloc_stack_release(ohashtable_t *shard, packed_callstack_t *pcs)
+{
+    uint count = packed_callstack_release(pcs);
+    if (count == 0) {
+        /* in neither the table nor a thread's cache */
+        alloc_stack_retire(pcs);
+    } else if (count == 1 && ohashtable_lookup(shard, (void *)pcs) == pcs &&
+               packed_callstack_release_last(pcs)) {
+        ohashtable_remove(shard, (void *)pcs);
+        alloc_stack_retire(pcs);
+    }
+}
+
+/* i#75: with -lazy_callstack_modules we record raw addresses and fill in
+ * module info only for the callstacks still around when one of their modules
+ * is unloaded.  If such fixups are frequent we go back to resolving at
+ * allocation time.
+ */
+#define LAZY_CALLSTACK_MAX_FIXUPS 32
+static bool lazy_callstacks;
+static uint lazy_callstack_fixups;
+/* Bumped before alloc_drmem_module_unload() walks the callstacks.  A raw
+ * callstack recorded in an older generation may have been missed by the
+ * walk if it was not yet published, so we re-record it eagerly instead.
+ */
+static volatile uint lazy_unload_gen;
+
+/* i#246: each thread keeps its last few new callstacks out of
+ * alloc_stack_table, holding one reference to each.  One whose mallocs
+ * are all freed by the time it is evicted never touches the table; one
+ * still in use is promoted then.  The table is only needed for sharing,
+ * so nothing else has to flush these, except module unload fixups, which
+ * walk every thread's cache via callstack_caches.
+ */
+#define CALLSTACK_CACHE_MAX 32
+typedef struct _callstack_cache_t {
+    /* owner thread vs alloc_drmem_module_unload() and exit */
+    void *lock;
+    uint next_victim;
+    packed_callstack_t *pcs[CALLSTACK_CACHE_MAX];
+    uint hash[CALLSTACK_CACHE_MAX];
+    struct _callstack_cache_t *prev;
+    struct _callstack_cache_t *next;
+} callstack_cache_t;
+
+static int tls_idx_alloc_drmem = -1;
+/* list of all callstack_cache_t, protected by callstack_caches_lock.
+ * Lock order: callstack_caches_lock, then a cache lock, then an
+ * alloc_stack_table shard.
+ */
+static callstack_cache_t *callstack_caches;
+static void *callstack_caches_lock;
 
 #ifdef LINUX
 /* Track all signal handlers registered by app so we can instrument them */
@@ -64,6 +172,8 @@ static void *mmap_tree_lock; /* maybe rbtree should support internal synch */
 
 #ifdef STATISTICS
 uint alloc_stack_count;
+uint alloc_stack_cache_hits;
+uint alloc_stack_cache_promotions;
 #endif
 
 #ifdef WINDOWS
@@ -113,8 +223,7 @@ typedef struct _delay_free_t {
     packed_callstack_t *pcs; /* i#205 for reporting where freed */
 } delay_free_t;
 
-/* We need a separate free queue per malloc routine (PR 476805) */
-typedef struct _delay_free_info_t {
+typedef struct _delay_free_queue_t {
     delay_free_t *delay_free_list;
     /* Head of FIFO array */
     int delay_free_head;
@@ -126,21 +235,37 @@ typedef struct _delay_free_info_t {
      * delaying one or two giant frees
      */
     size_t delay_free_bytes;
-} delay_free_info_t;
+} delay_free_queue_t;
 
-/* We could do per-thread free lists but could strand frees in idle threads;
- * plus, already impacting performance plenty so global synch ok.
- * We could do per-malloc-routine lock as well: but we stick w/ global
- * for simplicity so we can use for delay_free_tree as well.
+/* We need a separate free queue per malloc routine (PR 476805).
+ * Each is split into one queue per shard.
  */
-static void *delay_free_lock;
+typedef struct _delay_free_info_t {
+    delay_free_queue_t *queue; /* num_delay_free_shards entries */
+} delay_free_info_t;
 
-/* Interval tree for looking up whether an address is on the list (PR 535568).
- * Shared across all the queues since should be no overlap.
+/* Per-thread free lists could strand frees in idle threads, but a single
+ * global lock serializes every free with every other once -delay_frees is
+ * large.  We compromise with -delay_frees_shards shards, each with its own
+ * lock and its own interval tree (PR 535568) for looking up whether an
+ * address is on one of its queues.  A thread always frees into the same
+ * shard, and a shard's tree is shared across all the routines' queues
+ * since there should be no overlap.  Lookups by address fan out to every
+ * shard.
+ * -delay_frees and -delay_frees_maxsz apply to each shard's queues, so a
+ * thread sees the same delay as w/ one shard and the total quarantine grows
+ * w/ the number of threads freeing, up to the shard count.
+ * The queue array is allocated on the shard's first free.
  */
-static rb_tree_t *delay_free_tree;
+typedef struct _delay_free_shard_t {
+    void *lock;
+    rb_tree_t *tree;
+} delay_free_shard_t;
 
-#define DELAY_FREE_FULL(info) (info->delay_free_fill == options.delay_frees)
+#define DELAY_FREE_MAX_SHARDS 64
+static delay_free_shard_t delay_free_shards[DELAY_FREE_MAX_SHARDS];
+static uint num_delay_free_shards;
+#define DELAY_FREE_FULL(q) ((q)->delay_free_fill == options.delay_frees)
 
 #ifdef STATISTICS
 uint delayed_free_bytes; /* includes redzones */
@@ -160,10 +285,14 @@ end_of_defined_region(byte *start, byte *end);
 static bool
 is_register_defined(void *drcontext, reg_id_t reg);
 
+static void
+callstack_cache_delete(callstack_cache_t *cache);
+
 void
 alloc_drmem_init(void)
 {
     alloc_options_t alloc_ops;
+    uint i;
     alloc_ops.track_allocs = options.track_allocs;
     alloc_ops.track_heap = options.track_heap;
     alloc_ops.redzone_size = options.redzone_size;
@@ -189,20 +318,37 @@ alloc_drmem_init(void)
     alloc_ops.conservative = options.conservative;
     /* replace vs wrap */
     alloc_ops.replace_malloc = options.replace_malloc;
-    alloc_ops.external_headers = (options.pattern != 0);
+    alloc_ops.external_headers = (options.pattern != 0 || options.external_headers);
     alloc_ops.delay_frees = options.delay_frees;
     alloc_ops.delay_frees_maxsz = options.delay_frees_maxsz;
+    alloc_ops.guard_page_min = options.guard_page_min;
 #ifdef WINDOWS
     alloc_ops.skip_msvc_importers = options.skip_msvc_importers;
 #endif
+    alloc_ops.shard_malloc_table = options.shard_malloc_table;
+    /* Our callbacks only touch alloc_stack_table, which has its own locks,
+     * and they already run in parallel under -replace_malloc.
+     */
+    alloc_ops.malloc_callbacks_synched = true;
+    alloc_ops.lazy_routine_search = options.lazy_alloc_search;
     alloc_init(&alloc_ops, sizeof(alloc_ops));
 
-    hashtable_init_ex(&alloc_stack_table, ASTACK_TABLE_HASH_BITS, HASH_CUSTOM,
-                      false/*!str_dup*/, true/* synch (higher-level synch covered
-                                              * by malloc_table's lock) */,
-                      alloc_callstack_free,
-                      (uint (*)(void*)) packed_callstack_hash,
-                      (bool (*)(void*, void*)) packed_callstack_cmp);
+    num_alloc_stack_shards = options.shard_malloc_table ? ASTACK_TABLE_SHARDS : 1;
+    for (i = 0; i < num_alloc_stack_shards; i++) {
+        /* we drop the table's reference ourselves: see alloc_stack_release() */
+        ohashtable_init(&alloc_stack_table[i], ASTACK_TABLE_HASH_BITS,
+                        (uint (*)(void*)) packed_callstack_hash,
+                        (bool (*)(void*, void*)) packed_callstack_cmp,
+                        NULL, true/*synch*/);
+        ohashtable_set_lockfree_lookups(&alloc_stack_table[i], epoch_defer_free);
+    }
+    /* trie callstacks are resolved, and raw ones never compare equal to them */
+    lazy_callstacks = options.lazy_callstack_modules && !options.callstack_frame_trie;
+    if (options.callstack_thread_cache > 0) {
+        tls_idx_alloc_drmem = drmgr_register_tls_field();
+        ASSERT(tls_idx_alloc_drmem > -1, "unable to reserve TLS slot");
+        callstack_caches_lock = dr_mutex_create();
+    }
 
 #ifdef LINUX
     hashtable_init(&sighand_table, SIGHAND_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
@@ -223,8 +369,13 @@ alloc_drmem_init(void)
               is_register_defined);
 
     if (options.delay_frees > 0) {
-        delay_free_lock = dr_mutex_create();
-        delay_free_tree = rb_tree_create(NULL);
+        num_delay_free_shards = options.delay_frees_shards;
+        ASSERT(num_delay_free_shards > 0 &&
+               num_delay_free_shards <= DELAY_FREE_MAX_SHARDS, "invalid shard count");
+        for (i = 0; i < num_delay_free_shards; i++) {
+            delay_free_shards[i].lock = dr_mutex_create();
+            delay_free_shards[i].tree = rb_tree_create(NULL);
+        }
     }
 
 #ifdef WINDOWS /* for i#689 */
@@ -234,20 +385,42 @@ alloc_drmem_init(void)
 #endif
 }
 
+static bool
+alloc_stack_exit_iter_cb(void *key, void *payload, void *iter_data)
+{
+    alloc_callstack_free(payload);
+    return true;
+}
+
 void
 alloc_drmem_exit(void)
 {
+    uint i;
     leak_exit();
     alloc_exit(); /* must be before deleting alloc_stack_table */
-    hashtable_delete_with_stats(&alloc_stack_table, "alloc stack table");
+    if (options.callstack_thread_cache > 0) {
+        /* threads still alive at exit never ran their exit event */
+        while (callstack_caches != NULL)
+            callstack_cache_delete(callstack_caches);
+        dr_mutex_destroy(callstack_caches_lock);
+        drmgr_unregister_tls_field(tls_idx_alloc_drmem);
+    }
+    for (i = 0; i < num_alloc_stack_shards; i++) {
+        ohashtable_iterate(&alloc_stack_table[i], alloc_stack_exit_iter_cb, NULL);
+        ohashtable_delete_with_stats(&alloc_stack_table[i], "alloc stack table shard");
+    }
+    /* retired callstacks need the frame trie, which callstack_exit() frees */
+    epoch_reclaim_all();
 #ifdef LINUX
     hashtable_delete(&sighand_table);
     rb_tree_destroy(mmap_tree);
     dr_mutex_destroy(mmap_tree_lock);
 #endif
     if (options.delay_frees > 0) {
-        rb_tree_destroy(delay_free_tree);
-        dr_mutex_destroy(delay_free_lock);
+        for (i = 0; i < num_delay_free_shards; i++) {
+            rb_tree_destroy(delay_free_shards[i].tree);
+            dr_mutex_destroy(delay_free_shards[i].lock);
+        }
     }
 }
 
@@ -343,17 +516,172 @@ alloc_callstack_free(void *p)
 void
 shared_callstack_free(packed_callstack_t *pcs)
 {
+    ohashtable_t *shard;
+    if (pcs == NULL)
+        return;
+    shard = alloc_stack_shard(pcs);
+    /* hold the lock so a racing locked get_shared_callstack() can't re-use pcs.
+     * A pcs still in a thread's callstack cache keeps the cache's ref.
+     * One evicted while an equal callstack was already in alloc_stack_table
+     * is in neither, and is retired here when its last malloc goes away.
+     */
+    ohashtable_lock(shard);
+    alloc_stack_release(shard, pcs);
+    ohashtable_unlock(shard);
+}
+
+/* Drops the cache's reference to slot i of cache, whose lock must be held,
+ * promoting the callstack to alloc_stack_table if mallocs still use it.
+ */
+static void
+callstack_cache_evict(callstack_cache_t *cache, uint i)
+{
+    packed_callstack_t *pcs = cache->pcs[i];
+    packed_callstack_t *existing;
+    ohashtable_t *shard;
     uint count;
     if (pcs == NULL)
         return;
-    count = packed_callstack_free(pcs);
-    ASSERT(count != 0, "refcount should not hit 0 in malloc_table");
-    if (count == 1) {
-        /* One ref left, which must be the alloc_stack_table.
-         * packed_callstack_free will be called by hashtable_remove
-         * to dec refcount to 0 and do the actual free.
-         */
-        hashtable_remove(&alloc_stack_table, (void *)pcs);
+    cache->pcs[i] = NULL;
+    /* Only a malloc_table entry can hand out another reference (as
+     * existing_data), so if ours is the only one, it stays that way.
+     */
+    if (packed_callstack_refcount(pcs) == 1) {
+        IF_DEBUG(count =)
+            packed_callstack_free(pcs);
+        ASSERT(count == 0, "refcount should be 0");
+        return;
+    }
+    shard = alloc_stack_shard(pcs);
+    ohashtable_lock(shard);
+    existing = ohashtable_lookup(shard, (void *)pcs);
+    if (existing == NULL) {
+        /* the table takes over the cache's reference */
+        ohashtable_add_replace(shard, (void *)pcs, (void *)pcs);
+        DOLOG(3, {
+            LOG(3, "@@@ unique callstack #%d\n", alloc_stack_count);
+            packed_callstack_log(pcs, INVALID_FILE);
+        });
+        STATS_INC(alloc_stack_count);
+        STATS_INC(alloc_stack_cache_promotions);
+    } else {
+        if (existing != pcs) {
+            /* Another thread promoted an equal callstack first.  Ours lives on
+             * outside the table until its mallocs are freed, out of reach of
+             * alloc_drmem_module_unload(), so resolve it now.
+             */
+            packed_callstack_resolve(pcs, NULL, (app_pc)POINTER_MAX);
+        }
+        alloc_stack_release(shard, pcs);
+    }
+    ohashtable_unlock(shard);
+}
+
+static void
+callstack_cache_delete(callstack_cache_t *cache)
+{
+    uint i;
+    dr_mutex_lock(callstack_caches_lock);
+    if (cache->prev == NULL)
+        callstack_caches = cache->next;
+    else
+        cache->prev->next = cache->next;
+    if (cache->next != NULL)
+        cache->next->prev = cache->prev;
+    dr_mutex_unlock(callstack_caches_lock);
+    dr_mutex_lock(cache->lock);
+    for (i = 0; i < CALLSTACK_CACHE_MAX; i++)
+        callstack_cache_evict(cache, i);
+    dr_mutex_unlock(cache->lock);
+    dr_mutex_destroy(cache->lock);
+    global_free(cache, sizeof(*cache), HEAPSTAT_CALLSTACK);
+}
+
+void
+alloc_drmem_thread_init(void *drcontext)
+{
+    callstack_cache_t *cache;
+    if (options.callstack_thread_cache == 0)
+        return;
+    /* global so that exit can free the caches of threads that never exit */
+    cache = (callstack_cache_t *) global_alloc(sizeof(*cache), HEAPSTAT_CALLSTACK);
+    memset(cache, 0, sizeof(*cache));
+    cache->lock = dr_mutex_create();
+    dr_mutex_lock(callstack_caches_lock);
+    cache->next = callstack_caches;
+    if (callstack_caches != NULL)
+        callstack_caches->prev = cache;
+    callstack_caches = cache;
+    dr_mutex_unlock(callstack_caches_lock);
+    drmgr_set_tls_field(drcontext, tls_idx_alloc_drmem, (void *)cache);
+}
+
+void
+alloc_drmem_thread_exit(void *drcontext)
+{
+    callstack_cache_t *cache;
+    if (options.callstack_thread_cache == 0)
+        return;
+    cache = (callstack_cache_t *) drmgr_get_tls_field(drcontext, tls_idx_alloc_drmem);
+    if (cache == NULL)
+        return;
+    drmgr_set_tls_field(drcontext, tls_idx_alloc_drmem, NULL);
+    callstack_cache_delete(cache);
+}
+
+typedef struct _callstack_fixup_data_t {
+    const module_data_t *info;
+    uint count;
+} callstack_fixup_data_t;
+
+static bool
+callstack_fixup_iter_cb(void *key, void *payload, void *iter_data)
+{
+    callstack_fixup_data_t *data = (callstack_fixup_data_t *) iter_data;
+    if (packed_callstack_resolve((packed_callstack_t *) payload,
+                                 data->info->start, data->info->end))
+        data->count++;
+    return true;
+}
+
+void
+alloc_drmem_module_unload(const module_data_t *info)
+{
+    callstack_fixup_data_t data;
+    uint i;
+    if (!options.lazy_callstack_modules)
+        return;
+    ATOMIC_INC32(lazy_unload_gen);
+    /* Every callstack held by a malloc_table entry is shared through
+     * alloc_stack_table or is in some thread's callstack cache, so walking
+     * those covers them all.  We walk the caches first: an eviction moves a
+     * callstack into its shard while holding the cache's lock, so one we
+     * miss in a cache is in its shard before the shard walk below, and one
+     * evicted after we walked its cache is already fixed up.
+     */
+    data.info = info;
+    data.count = 0;
+    if (options.callstack_thread_cache > 0) {
+        callstack_cache_t *cache;
+        dr_mutex_lock(callstack_caches_lock);
+        for (cache = callstack_caches; cache != NULL; cache = cache->next) {
+            dr_mutex_lock(cache->lock);
+            for (i = 0; i < CALLSTACK_CACHE_MAX; i++) {
+                if (cache->pcs[i] != NULL)
+                    callstack_fixup_iter_cb(NULL, cache->pcs[i], &data);
+            }
+            dr_mutex_unlock(cache->lock);
+        }
+        dr_mutex_unlock(callstack_caches_lock);
+    }
+    for (i = 0; i < num_alloc_stack_shards; i++)
+        ohashtable_iterate(&alloc_stack_table[i], callstack_fixup_iter_cb, &data);
+    LOG(2, "resolved %d raw callstacks for unload of "PFX"-"PFX"\n",
+        data.count, info->start, info->end);
+    if (data.count > 0 && lazy_callstacks &&
+        ++lazy_callstack_fixups >= LAZY_CALLSTACK_MAX_FIXUPS) {
+        LOG(1, "too many module unloads: resolving callstacks at allocation time\n");
+        lazy_callstacks = false;
     }
 }
 
@@ -365,42 +693,182 @@ client_malloc_data_free(void *data)
     shared_callstack_free(pcs);
 }
 
+/* Discards a just-recorded callstack for which an equal one was found */
+static void
+drop_new_callstack(packed_callstack_t *pcs, bool scratch)
+{
+    IF_DEBUG(uint count;)
+    if (scratch)
+        return;
+    IF_DEBUG(count = )
+        packed_callstack_free(pcs);
+    ASSERT(count == 0, "refcount should be 0");
+}
+
+/* Records the callstack for an allocation, into the thread's scratch
+ * space if possible, in which case *scratch is set.
+ */
+static packed_callstack_t *
+record_alloc_callstack(dr_mcontext_t *mc, app_pc post_call, bool lazy,
+                       OUT bool *scratch)
+{
+    packed_callstack_t *pcs;
+    app_loc_t loc;
+    pc_to_loc(&loc, post_call);
+    pcs = packed_callstack_record_scratch(mc, &loc, lazy);
+    *scratch = (pcs != NULL);
+    if (pcs == NULL)
+        packed_callstack_record_ex(&pcs, mc, &loc, lazy);
+    /* our malloc and free callstacks use post-call as the top frame when wrapping */
+    if (!options.replace_malloc)
+        packed_callstack_first_frame_retaddr(pcs);
+    return pcs;
+}
+
+/* Whether a callstack recorded raw in unload generation gen must be
+ * re-recorded before it is published.  Call while holding a lock that
+ * alloc_drmem_module_unload() takes to walk wherever it is being put.
+ */
+static inline bool
+lazy_callstack_stale(bool raw, uint gen)
+{
+    return raw && gen != lazy_unload_gen;
+}
+
+/* i#246: takes the new callstack pcs and returns it or an equal one with a
+ * reference added for the caller's malloc.  If freed right away, a
+ * callstack that only lives in cache never pays for the alloc_stack_table
+ * insert and remove.
+ * Returns NULL, having dropped pcs, if it is stale (see
+ * lazy_callstack_stale()).
+ */
+static packed_callstack_t *
+get_cached_callstack(callstack_cache_t *cache, packed_callstack_t *pcs, bool scratch,
+                     bool raw, uint gen)
+{
+    packed_callstack_t *res;
+    ohashtable_t *shard;
+    uint hash = packed_callstack_hash(pcs);
+    uint i;
+    dr_mutex_lock(cache->lock);
+    for (i = 0; i < options.callstack_thread_cache; i++) {
+        if (cache->pcs[i] != NULL && cache->hash[i] == hash &&
+            packed_callstack_cmp(cache->pcs[i], pcs)) {
+            res = cache->pcs[i];
+            packed_callstack_add_ref(res);
+            dr_mutex_unlock(cache->lock);
+            drop_new_callstack(pcs, scratch);
+            STATS_INC(alloc_stack_cache_hits);
+            return res;
+        }
+    }
+    /* a callstack that has already been promoted keeps being shared through
+     * the table: we only cache new ones
+     */
+    shard = alloc_stack_shard(pcs);
+    res = alloc_stack_lookup_lockfree(shard, pcs);
+    if (res == NULL) {
+        ohashtable_lock(shard);
+        res = ohashtable_lookup(shard, (void *)pcs);
+        if (res != NULL)
+            packed_callstack_add_ref(res);
+        ohashtable_unlock(shard);
+    }
+    if (res != NULL) {
+        dr_mutex_unlock(cache->lock);
+        drop_new_callstack(pcs, scratch);
+        return res;
+    }
+    if (lazy_callstack_stale(raw, gen)) {
+        dr_mutex_unlock(cache->lock);
+        drop_new_callstack(pcs, scratch);
+        return NULL;
+    }
+    if (scratch)
+        pcs = packed_callstack_from_scratch(pcs);
+    /* the oldest entry has survived a full generation of new callstacks */
+    i = cache->next_victim;
+    cache->next_victim = (i + 1) % options.callstack_thread_cache;
+    callstack_cache_evict(cache, i);
+    /* the initial reference is the cache's */
+    cache->pcs[i] = pcs;
+    cache->hash[i] = hash;
+    packed_callstack_add_ref(pcs);
+    dr_mutex_unlock(cache->lock);
+    return pcs;
+}
+
 static packed_callstack_t *
 get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
                      app_pc post_call)
 {
-    /* XXX i#75: when the app has a ton of mallocs that are quickly freed,
+    /* i#75: when the app has a ton of mallocs that are quickly freed,
      * we spend a lot of time building and tearing down callstacks
      * (xref my original setup of not showing leak callstacks by default
      * which was for this reason and to save space: but for usability
      * it's better to have leak callstacks by default).
-     * We could just record addresses and not modules, and only on
-     * module unload or app exit walk the malloc table and fill
-     * in the module info (and if too many unloads, switch to the
-     * every-alloc scheme).
+     * With lazy_callstacks we just record addresses and not modules, and
+     * alloc_drmem_module_unload() fills in the module info.
      */
     packed_callstack_t *pcs;
     packed_callstack_t *existing;
+    ohashtable_t *shard;
+    /* whether pcs is this thread's scratch callstack, which we only copy to
+     * the heap if it is new
+     */
+    bool scratch = false;
+    /* whether pcs is raw, and the unload generation it was recorded in */
+    bool raw = false;
+    uint gen = 0;
     if (existing_data != NULL)
         pcs = (packed_callstack_t *) existing_data;
     else {
-        app_loc_t loc;
-        pc_to_loc(&loc, post_call);
-        packed_callstack_record(&pcs, mc, &loc);
-        /* our malloc and free callstacks use post-call as the top frame when wrapping */
-        if (!options.replace_malloc)
-            packed_callstack_first_frame_retaddr(pcs);
-    }
-    /* XXX i#246: store last malloc callstack outside of hashtable,
-     * and only add to hashtable on next malloc, so that if freed
-     * right away we avoid the hashtable lookup+cmp+insert+remove
-     * costs
-     */ 
-    existing = hashtable_lookup(&alloc_stack_table, (void *)pcs);
+        /* An unload racing with us can walk the callstacks before pcs is
+         * published and leave it raw: we find out via lazy_unload_gen once
+         * we hold the lock for publishing it and then record it again w/
+         * module info (we still have mc on this same thread).
+         */
+        raw = lazy_callstacks;
+        gen = lazy_unload_gen;
+        pcs = record_alloc_callstack(mc, post_call, raw, &scratch);
+    }
+    if (existing_data == NULL && options.callstack_thread_cache > 0) {
+        callstack_cache_t *cache = (callstack_cache_t *)
+            drmgr_get_tls_field(dr_get_current_drcontext(), tls_idx_alloc_drmem);
+        if (cache != NULL) {
+            packed_callstack_t *res = get_cached_callstack(cache, pcs, scratch, raw, gen);
+            if (res != NULL)
+                return res;
+            LOG(2, "module unload raced with callstack: re-recording\n");
+            pcs = record_alloc_callstack(mc, post_call, false, &scratch);
+            return get_cached_callstack(cache, pcs, scratch, false, 0);
+        }
+    }
+ publish:
+    shard = alloc_stack_shard(pcs);
+    if (existing_data == NULL) {
+        existing = alloc_stack_lookup_lockfree(shard, pcs);
+        if (existing != NULL) {
+            drop_new_callstack(pcs, scratch);
+            return existing;
+        }
+    }
+    ohashtable_lock(shard);
+    existing = ohashtable_lookup(shard, (void *)pcs);
+    if (existing == NULL && lazy_callstack_stale(raw, gen)) {
+        ohashtable_unlock(shard);
+        drop_new_callstack(pcs, scratch);
+        LOG(2, "module unload raced with callstack: re-recording\n");
+        raw = false;
+        pcs = record_alloc_callstack(mc, post_call, false, &scratch);
+        goto publish;
+    }
     if (existing == NULL) {
-        /* avoid calling lookup twice by not calling hashtable_add() */
-        IF_DEBUG(void *prior =)
-            hashtable_add_replace(&alloc_stack_table, (void *)pcs, (void *)pcs);
+        IF_DEBUG(void *prior;)
+        if (scratch)
+            pcs = packed_callstack_from_scratch(pcs);
+        IF_DEBUG(prior =)
+            ohashtable_add_replace(shard, (void *)pcs, (void *)pcs);
         ASSERT(prior == NULL, "just did lookup: cannot happen");
         DOLOG(3, {
             LOG(3, "@@@ unique callstack #%d\n", alloc_stack_count);
@@ -408,12 +876,8 @@ get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
         });
         STATS_INC(alloc_stack_count);
     } else {
-        IF_DEBUG(uint count;)
-        if (existing_data == NULL) {    /* PR 533755 */
-            IF_DEBUG(count = )
-                packed_callstack_free(pcs);
-            ASSERT(count == 0, "refcount should be 0");
-        }
+        if (existing_data == NULL)    /* PR 533755 */
+            drop_new_callstack(pcs, scratch);
         else
             ASSERT(pcs == existing, "invalid params");
         pcs = existing;
@@ -423,6 +887,7 @@ get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
      * and the refcount hits 1 we remove from alloc_stack_table.
      */
     packed_callstack_add_ref(pcs);
+    ohashtable_unlock(shard);
     return pcs;
 }
 
@@ -639,14 +1104,18 @@ client_add_malloc_routine(app_pc pc)
 {
     /* We assume no lock is needed on creation */
     if (options.delay_frees > 0) {
+        uint s;
         delay_free_info_t *info = (delay_free_info_t *)
             global_alloc(sizeof(*info), HEAPSTAT_MISC);
-        info->delay_free_list = (delay_free_t *)
-            global_alloc(options.delay_frees * sizeof(*info->delay_free_list),
-                         HEAPSTAT_MISC);
-        info->delay_free_head = 0;
-        info->delay_free_fill = 0;
-        info->delay_free_bytes = 0;
+        info->queue = (delay_free_queue_t *)
+            global_alloc(num_delay_free_shards * sizeof(*info->queue), HEAPSTAT_MISC);
+        for (s = 0; s < num_delay_free_shards; s++) {
+            delay_free_queue_t *q = &info->queue[s];
+            q->delay_free_list = NULL; /* allocated on first use */
+            q->delay_free_head = 0;
+            q->delay_free_fill = 0;
+            q->delay_free_bytes = 0;
+        }
         return (void *) info;
     } else {
         return NULL;
@@ -659,15 +1128,24 @@ client_remove_malloc_routine(void *client_data)
     /* We assume no lock is needed on destroy */
     if (options.delay_frees > 0) {
         delay_free_info_t *info = (delay_free_info_t *) client_data;
+        uint s;
         int i;
         ASSERT(info != NULL, "invalid param");
-        for (i = 0; i < info->delay_free_fill; i++) {
-            if (info->delay_free_list[i].addr != NULL) {
-                shared_callstack_free(info->delay_free_list[i].pcs);
+        for (s = 0; s < num_delay_free_shards; s++) {
+            delay_free_queue_t *q = &info->queue[s];
+            for (i = 0; i < q->delay_free_fill; i++) {
+                if (q->delay_free_list[i].addr != NULL) {
+                    shared_callstack_free(q->delay_free_list[i].pcs);
+                }
+            }
+            if (q->delay_free_list != NULL) {
+                global_free(q->delay_free_list,
+                            options.delay_frees * sizeof(*q->delay_free_list),
+                            HEAPSTAT_MISC);
             }
         }
-        global_free(info->delay_free_list,
-                    options.delay_frees * sizeof(*info->delay_free_list), HEAPSTAT_MISC);
+        global_free(info->queue, num_delay_free_shards * sizeof(*info->queue),
+                    HEAPSTAT_MISC);
         global_free(info, sizeof(*info), HEAPSTAT_MISC);
     }
 }
@@ -684,52 +1162,61 @@ print_free_tree(rb_node_t *node, void *data)
 }
 #endif
 
+/* Each thread always frees into the same shard */
+static inline uint
+delay_free_shard_idx(void)
+{
+    if (num_delay_free_shards == 1)
+        return 0;
+    return (uint)dr_get_thread_id(dr_get_current_drcontext()) % num_delay_free_shards;
+}
+
 /* Retrieves the fields for the free queue entry at idx (base and
  * auxarg), adjusts the delay_free_bytes count, and removes the
- * next-to-free entry from the rbtree.  Does not change the head
- * pointer.  Caller must hold lock.
+ * next-to-free entry from the shard's rbtree.  Does not change the head
+ * pointer.  Caller must hold the shard lock.
  */
 static app_pc
-next_to_free(delay_free_info_t *info, int idx _IF_WINDOWS(ptr_int_t *auxarg OUT),
-             const char *reason)
+next_to_free(delay_free_shard_t *shard, delay_free_queue_t *q, int idx
+             _IF_WINDOWS(ptr_int_t *auxarg OUT), const char *reason)
 {
     app_pc pass_to_free = NULL;
-    pass_to_free = info->delay_free_list[idx].addr;
+    pass_to_free = q->delay_free_list[idx].addr;
 #ifdef WINDOWS
     if (auxarg != NULL)
-        *auxarg = info->delay_free_list[idx].auxarg;
+        *auxarg = q->delay_free_list[idx].auxarg;
 #endif
     if (pass_to_free != NULL) {
-        rb_node_t *node = rb_find(delay_free_tree, pass_to_free);
+        rb_node_t *node = rb_find(shard->tree, pass_to_free);
         if (node != NULL) {
             DOLOG(2, {
                 byte *start;
                 size_t size;
                 rb_node_fields(node, &start, &size, NULL);
-                LOG(2, "deleting from delay_free_tree "PFX": "PFX"-"PFX"\n",
+                LOG(2, "deleting from delay free tree "PFX": "PFX"-"PFX"\n",
                     pass_to_free, start, start + size);
             });
-            rb_delete(delay_free_tree, node);
+            rb_delete(shard->tree, node);
         } else {
-            DOLOG(1, { rb_iterate(delay_free_tree, print_free_tree, NULL); });
-            ASSERT(false, "delay_free_tree inconsistent");
+            DOLOG(1, { rb_iterate(shard->tree, print_free_tree, NULL); });
+            ASSERT(false, "delay free tree inconsistent");
         }
-        info->delay_free_bytes -= info->delay_free_list[idx].real_size;
+        q->delay_free_bytes -= q->delay_free_list[idx].real_size;
         STATS_ADD(delayed_free_bytes,
-                  -(int)info->delay_free_list[idx].real_size);
+                  -(int)q->delay_free_list[idx].real_size);
         LOG(2, "%s: freeing "PFX"-"PFX
             IF_WINDOWS(" auxarg="PFX) "\n", reason, pass_to_free,
-            pass_to_free + info->delay_free_list[idx].real_size
+            pass_to_free + q->delay_free_list[idx].real_size
             _IF_WINDOWS(auxarg == NULL ? 0 : *auxarg));
         if (options.pattern != 0) {
             pattern_handle_real_free(pass_to_free /* real_base */,
-                                     info->delay_free_list[idx].real_size,
-                                     info->delay_free_list[idx].real_size,
+                                     q->delay_free_list[idx].real_size,
+                                     q->delay_free_list[idx].real_size,
                                      true /* delayed */);
         }
     }
-    shared_callstack_free(info->delay_free_list[idx].pcs);
-    info->delay_free_list[idx].pcs = NULL;
+    shared_callstack_free(q->delay_free_list[idx].pcs);
+    q->delay_free_list[idx].pcs = NULL;
     return pass_to_free;
 }
 
@@ -755,6 +1242,9 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
          * simply exclude from our leak report.
          */
         delay_free_info_t *info = (delay_free_info_t *) client_data;
+        uint s = delay_free_shard_idx();
+        delay_free_shard_t *shard = &delay_free_shards[s];
+        delay_free_queue_t *q;
         app_pc pass_to_free = NULL;
 #ifdef WINDOWS
         ptr_int_t pass_auxarg;
@@ -762,23 +1252,29 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
 #endif
         uint idx;
         ASSERT(info != NULL, "invalid param");
-        dr_mutex_lock(delay_free_lock);
+        q = &info->queue[s];
+        dr_mutex_lock(shard->lock);
+        if (q->delay_free_list == NULL) {
+            q->delay_free_list = (delay_free_t *)
+                global_alloc(options.delay_frees * sizeof(*q->delay_free_list),
+                             HEAPSTAT_MISC);
+        }
         if (real_size > options.delay_frees_maxsz) {
             /* we have to free this one, it's too big */
             LOG(2, "malloc size %d is larger than max delay %d so freeing immediately\n",
                 real_size, options.delay_frees_maxsz);
-            dr_mutex_unlock(delay_free_lock);
+            dr_mutex_unlock(shard->lock);
             if (options.pattern != 0)
                 pattern_handle_real_free(base, size, real_size, false);
             return real_base;
         }
         /* Store real base and real size: i.e., including redzones (PR 572716) */
-        info->delay_free_bytes += real_size;
-        if (info->delay_free_bytes > options.delay_frees_maxsz) {
-            int head_start = info->delay_free_head;
-            int idx = info->delay_free_head;
+        q->delay_free_bytes += real_size;
+        if (q->delay_free_bytes > options.delay_frees_maxsz) {
+            int head_start = q->delay_free_head;
+            int idx = q->delay_free_head;
             LOG(2, "total delayed %d larger than max delay %d\n",
-                info->delay_free_bytes, options.delay_frees_maxsz);
+                q->delay_free_bytes, options.delay_frees_maxsz);
             /* we can't invoke the app's free() routine safely
              * so we look for a single free that's bigger than this one:
              * if none, we have to free this one.
@@ -792,21 +1288,21 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
                  * queue gets full of small objects and the app is freeing large
                  * objects.  not ideal!
                  */
-                if (info->delay_free_list[idx].addr != NULL &&
-                    info->delay_free_list[idx].real_size >= real_size) {
+                if (q->delay_free_list[idx].addr != NULL &&
+                    q->delay_free_list[idx].real_size >= real_size) {
                     LOG(2, "freeing delayed idx=%d "PFX" w/ size=%d (head=%d, fill=%d)\n", 
-                        idx, info->delay_free_list[idx].addr,
-                        info->delay_free_list[idx].real_size,
-                        info->delay_free_head, info->delay_free_fill);
-                    pass_to_free = next_to_free(info, idx _IF_WINDOWS(&pass_auxarg),
+                        idx, q->delay_free_list[idx].addr,
+                        q->delay_free_list[idx].real_size,
+                        q->delay_free_head, q->delay_free_fill);
+                    pass_to_free = next_to_free(shard, q, idx _IF_WINDOWS(&pass_auxarg),
                                                 "exceeded delay_frees_maxsz");
-                    ASSERT(info->delay_free_bytes <= options.delay_frees_maxsz,
+                    ASSERT(q->delay_free_bytes <= options.delay_frees_maxsz,
                            "cannot happen");
-                    info->delay_free_list[idx].addr = NULL;
+                    q->delay_free_list[idx].addr = NULL;
                     break;
                 }
                 idx++;
-                if (idx >= info->delay_free_fill)
+                if (idx >= q->delay_free_fill)
                     break;
                 if (idx >= options.delay_frees)
                     idx = 0;
@@ -814,8 +1310,8 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
             if (pass_to_free == NULL) {
                 LOG(2, "malloc size %d larger than any entry + over size limit\n",
                     real_size);
-                info->delay_free_bytes -= real_size;
-                dr_mutex_unlock(delay_free_lock);
+                q->delay_free_bytes -= real_size;
+                dr_mutex_unlock(shard->lock);
                 if (options.pattern != 0) {
                     pattern_handle_real_free(base, size, real_size, false);
                 }
@@ -823,62 +1319,62 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
             }
         }
 
-        LOG(2, "inserting into delay_free_tree (queue idx=%d): "PFX
+        LOG(2, "inserting into delay free tree (queue idx=%d): "PFX
             "-"PFX" %d bytes redzone=%d\n",
-            DELAY_FREE_FULL(info) ? info->delay_free_head : info->delay_free_fill,
+            DELAY_FREE_FULL(q) ? q->delay_free_head : q->delay_free_fill,
             real_base, real_base + real_size, real_size, base != real_base);
 
-        if (DELAY_FREE_FULL(info)) {
+        if (DELAY_FREE_FULL(q)) {
             IF_WINDOWS(full = true;)
             if (pass_to_free == NULL) {
-                pass_to_free = next_to_free(info, info->delay_free_head
+                pass_to_free = next_to_free(shard, q, q->delay_free_head
                                             _IF_WINDOWS(&pass_auxarg),
                                             "delayed free queue full");
             }
-            idx = info->delay_free_head;
-            info->delay_free_head++;
-            if (info->delay_free_head >= options.delay_frees)
-                info->delay_free_head = 0;
+            idx = q->delay_free_head;
+            q->delay_free_head++;
+            if (q->delay_free_head >= options.delay_frees)
+                q->delay_free_head = 0;
         } else {
             LOG(2, "delayed free queue not full: delaying %d-th free of "PFX"-"PFX
                 IF_WINDOWS(" auxarg="PFX) "\n",
-                info->delay_free_fill, real_base, real_base + real_size
+                q->delay_free_fill, real_base, real_base + real_size
                 _IF_WINDOWS((auxarg==NULL) ? 0:*auxarg));
-            ASSERT(info->delay_free_fill <= options.delay_frees - 1, "internal error");
+            ASSERT(q->delay_free_fill <= options.delay_frees - 1, "internal error");
             IF_WINDOWS(full = false;)
-            idx = info->delay_free_fill;
-            info->delay_free_fill++;
+            idx = q->delay_free_fill;
+            q->delay_free_fill++;
             /* Rather than try to engineer a return, we continue on w/
              * pass_to_free as NULL which free() is guaranteed to handle
              */
         }
 
-        rb_insert(delay_free_tree, real_base, real_size,
-                  (void *)&info->delay_free_list[idx]);
+        rb_insert(shard->tree, real_base, real_size,
+                  (void *)&q->delay_free_list[idx]);
 
-        info->delay_free_list[idx].addr = real_base;
+        q->delay_free_list[idx].addr = real_base;
 #ifdef WINDOWS
         /* should we be doing safe_read() and safe_write()? */
         if (auxarg != NULL) {
-            info->delay_free_list[idx].auxarg = *auxarg;
+            q->delay_free_list[idx].auxarg = *auxarg;
             if (full)
                 *auxarg = pass_auxarg;
         } else {
-            info->delay_free_list[idx].auxarg = 0;
+            q->delay_free_list[idx].auxarg = 0;
             if (full)
                 ASSERT(pass_auxarg == 0, "whether using auxarg should be consistent");
         }
 #endif
-        info->delay_free_list[idx].real_size = real_size;
-        info->delay_free_list[idx].has_redzone = (base != real_base);
+        q->delay_free_list[idx].real_size = real_size;
+        q->delay_free_list[idx].has_redzone = (base != real_base);
         if (options.delay_frees_stack)
-            info->delay_free_list[idx].pcs = get_shared_callstack(NULL, mc, free_routine);
+            q->delay_free_list[idx].pcs = get_shared_callstack(NULL, mc, free_routine);
         else
-            info->delay_free_list[idx].pcs = NULL;
+            q->delay_free_list[idx].pcs = NULL;
 
         STATS_ADD(delayed_free_bytes, (uint)real_size);
 
-        dr_mutex_unlock(delay_free_lock);
+        dr_mutex_unlock(shard->lock);
         if (options.pattern != 0)
             pattern_handle_delayed_free(base, size, real_size);
         return pass_to_free;
@@ -910,31 +1406,36 @@ void
 client_handle_heap_destroy(void *drcontext, HANDLE heap, void *client_data)
 {
     delay_free_info_t *info = (delay_free_info_t *) client_data;
+    uint s;
     int i, num_removed = 0;
     if (options.delay_frees == 0)
         return;
     ASSERT(info != NULL, "invalid param");
-    dr_mutex_lock(delay_free_lock);
-    for (i = 0; i < info->delay_free_fill; i++) {
-        if (info->delay_free_list[i].addr != NULL &&
-            info->delay_free_list[i].auxarg == (ptr_int_t)heap) {
-            /* not worth shifting the array around: just invalidate */
-            rb_node_t *node = rb_find(delay_free_tree, info->delay_free_list[i].addr);
-            LOG(3, "removing delayed free "PFX"-"PFX" from destroyed heap "PFX"\n",
-                info->delay_free_list[i].addr,
-                info->delay_free_list[i].addr +
-                info->delay_free_list[i].real_size, heap);
-            if (node != NULL)
-                rb_delete(delay_free_tree, node);
-            else
-                ASSERT(false, "delay_free_tree inconsistent");
-            info->delay_free_list[i].addr = NULL;
-            shared_callstack_free(info->delay_free_list[i].pcs);
-            info->delay_free_list[i].pcs = NULL;
-            num_removed++;
+    for (s = 0; s < num_delay_free_shards; s++) {
+        delay_free_shard_t *shard = &delay_free_shards[s];
+        delay_free_queue_t *q = &info->queue[s];
+        dr_mutex_lock(shard->lock);
+        for (i = 0; i < q->delay_free_fill; i++) {
+            if (q->delay_free_list[i].addr != NULL &&
+                q->delay_free_list[i].auxarg == (ptr_int_t)heap) {
+                /* not worth shifting the array around: just invalidate */
+                rb_node_t *node = rb_find(shard->tree, q->delay_free_list[i].addr);
+                LOG(3, "removing delayed free "PFX"-"PFX" from destroyed heap "PFX"\n",
+                    q->delay_free_list[i].addr,
+                    q->delay_free_list[i].addr +
+                    q->delay_free_list[i].real_size, heap);
+                if (node != NULL)
+                    rb_delete(shard->tree, node);
+                else
+                    ASSERT(false, "delay free tree inconsistent");
+                q->delay_free_list[i].addr = NULL;
+                shared_callstack_free(q->delay_free_list[i].pcs);
+                q->delay_free_list[i].pcs = NULL;
+                num_removed++;
+            }
         }
+        dr_mutex_unlock(shard->lock);
     }
-    dr_mutex_unlock(delay_free_lock);
     LOG(2, "removed %d delayed frees from destroyed heap "PFX"\n",
         num_removed, heap);
 }
@@ -947,7 +1448,9 @@ overlaps_delayed_free(byte *start, byte *end,
                       packed_callstack_t **pcs OUT)
 {
     bool res = false;
-    rb_node_t *node;
+    rb_node_t *node = NULL;
+    delay_free_shard_t *shard = NULL;
+    uint s;
     if (options.delay_frees == 0)
         return false;
     if (options.replace_malloc) {
@@ -955,10 +1458,20 @@ overlaps_delayed_free(byte *start, byte *end,
         return alloc_replace_overlaps_delayed_free(start, end, free_start, free_end,
                                                    (void **)pcs);
     }
-    dr_mutex_lock(delay_free_lock);
     LOG(3, "overlaps_delayed_free "PFX"-"PFX"\n", start, end);
-    DOLOG(3, { rb_iterate(delay_free_tree, print_free_tree, NULL); });
-    node = rb_overlaps_node(delay_free_tree, start, end);
+    /* Delayed frees never overlap each other, so the first shard with a
+     * match has the only one.  We hold that shard's lock while using the
+     * entry.
+     */
+    for (s = 0; s < num_delay_free_shards; s++) {
+        shard = &delay_free_shards[s];
+        dr_mutex_lock(shard->lock);
+        DOLOG(3, { rb_iterate(shard->tree, print_free_tree, NULL); });
+        node = rb_overlaps_node(shard->tree, start, end);
+        if (node != NULL)
+            break;
+        dr_mutex_unlock(shard->lock);
+    }
     if (node != NULL) {
         /* we store real base and real size, so exclude redzone since we only
          * want to report overlap with app-requested base and size
@@ -988,8 +1501,8 @@ overlaps_delayed_free(byte *start, byte *end,
                     *pcs = packed_callstack_clone(info->pcs);
             }
         }
+        dr_mutex_unlock(shard->lock);
     }
-    dr_mutex_unlock(delay_free_lock);
     return res;
 }
 
@@ -2270,7 +2783,9 @@ check_unaddressable_exceptions(bool write, app_loc_t *loc, app_pc addr, uint sz,
                options.define_unknown_regions && !addr_in_heap &&
                (!options.check_stack_bounds || !addr_on_stack)
                /* i#579: leave kernel regions as unaddr */
-               IF_WINDOWS(&& addr < get_highest_user_address())) {
+               IF_WINDOWS(&& addr < get_highest_user_address()) &&
+               /* a freed guard chunk is no longer a heap region */
+               !alloc_replace_in_guard_page(addr)) {
         /* i#352 (and old PR 464106): handle memory allocated by other
          * processes by treating as fully defined, without any UNADDR.
          * This is Windows and there are cases where csrss allocates
@@ -2297,6 +2812,54 @@ check_unaddressable_exceptions(bool write, app_loc_t *loc, app_pc addr, uint sz,
     return false;
 }
 
+bool
+handle_guard_page_fault(void *drcontext, byte *target, dr_mcontext_t *mc)
+{
+    if (!alloc_replace_in_guard_page(target))
+        return false;
+    LOG(2, "fault @"PFX" accessing guard page "PFX"\n", mc->pc, target);
+    if (!options.shadowing) {
+        /* With shadowing, our instrumentation has already reported this
+         * access before the app instruction ran, so we only report here
+         * when nothing else will.
+         */
+        instr_t inst;
+        app_loc_t loc;
+        app_pc addr = target;
+        uint sz = 1;
+        bool write = false;
+        int i;
+        instr_init(drcontext, &inst);
+        if (safe_decode(drcontext, mc->pc, &inst, NULL)) {
+            for (i = 0; i < instr_num_srcs(&inst) + instr_num_dsts(&inst); i++) {
+                bool is_dst = (i >= instr_num_srcs(&inst));
+                opnd_t opnd = is_dst ? instr_get_dst(&inst, i - instr_num_srcs(&inst)) :
+                    instr_get_src(&inst, i);
+                if (opnd_is_memory_reference(opnd)) {
+                    app_pc ref = opnd_compute_address(opnd, mc);
+                    uint ref_sz = opnd_size_in_bytes(opnd_get_size(opnd));
+                    if (target >= ref && target < ref + ref_sz) {
+                        addr = ref;
+                        sz = ref_sz;
+                        write = is_dst;
+                        break;
+                    }
+                }
+            }
+        }
+        instr_free(drcontext, &inst);
+        pc_to_loc(&loc, mc->pc);
+        if (!check_unaddressable_exceptions(write, &loc, addr, sz, false, mc))
+            report_unaddressable_access(&loc, addr, sz, write, addr, addr + sz, mc);
+    }
+    /* Open up the page and re-execute the access, as skipping it would
+     * leave a read's destination stale.  Further accesses to this page
+     * no longer fault: they are only caught by shadowing.  A live chunk's
+     * guard page is protected again on free along with the rest of it.
+     */
+    return alloc_replace_unprotect_guard_page(target);
+}
+
 /***************************************************************************
  * HEAP REGION
  */
@@ -2431,18 +2994,19 @@ malloc_iterate_cb(app_pc start, app_pc end, app_pc real_end,
     return true; /* continue iteration */
 }
 
-/* XXX: this could be used in report_heap_info() in report.c when we don't have
- * shadow info, to find overlapping malloc, and it could be adapted to find
- * the nearest neighbor.
- */
 static bool
 region_overlap_with_malloc_block(malloc_iter_data_t *iter_data)
 {
+    /* The tail redzone includes any padding so we look a page farther back */
+    size_t reach = options.redzone_size + PAGE_SIZE;
+    byte *lookup_start;
     ASSERT(iter_data != NULL, "invalid iteration data");
-    /* expensive hashtable walk */
-    LOG(2, "expensive lookup for region_overlap_with_malloc_block@["
+    lookup_start = (iter_data->addr > (byte *)reach) ? iter_data->addr - reach : NULL;
+    LOG(3, "lookup for region_overlap_with_malloc_block@["
         PFX".."PFX")\n", iter_data->addr, iter_data->addr + iter_data->size);
-    malloc_iterate(malloc_iterate_cb, iter_data);
+    malloc_iterate_range(lookup_start,
+                         iter_data->addr + iter_data->size + options.redzone_size,
+                         malloc_iterate_cb, iter_data);
     return iter_data->found;
 }
 
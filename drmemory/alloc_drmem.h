@@ -36,10 +36,27 @@ alloc_drmem_init(void);
 void
 alloc_drmem_exit(void);
 
+void
+alloc_drmem_thread_init(void *drcontext);
+
+void
+alloc_drmem_thread_exit(void *drcontext);
+
+/* Must be called prior to callstack_module_unload() */
+void
+alloc_drmem_module_unload(const module_data_t *info);
+
 bool
 check_unaddressable_exceptions(bool write, app_loc_t *loc, app_pc addr, uint sz,
                                bool addr_on_stack, dr_mcontext_t *mc);
 
+/* Handles a fault on a -guard_page_min guard page: returns whether the fault
+ * was ours, in which case the page has been made accessible and the caller
+ * should re-execute the faulting instruction.
+ */
+bool
+handle_guard_page_fault(void *drcontext, byte *target, dr_mcontext_t *mc);
+
 #ifdef LINUX
 dr_signal_action_t
 event_signal_alloc(void *drcontext, dr_siginfo_t *info);
@@ -169,6 +169,9 @@ void
 dump_statistics(void)
 {
     int i;
+    /* summed in 64 bits so a long run can't wrap the total */
+    uint64 retaddr_lookups = (uint64)cstack_is_retaddr_cached +
+        (uint64)cstack_is_retaddr_backdecode;
     dr_fprintf(f_global, "Statistics:\n");
     dr_fprintf(f_global, "nudges: %d\n", num_nudges);
     dr_fprintf(f_global, "adjust_esp:%10u slow; %10u fast\n", adjust_esp_executions,
@@ -218,11 +221,27 @@ dump_statistics(void)
                num_slowpath_faults);
     dr_fprintf(f_global, "app mallocs: %8u, frees: %8u, large mallocs: %6u\n",
                num_mallocs, num_frees, num_large_mallocs);
+    dr_fprintf(f_global, "zeroed allocs from fresh memory: %8u\n", num_zeroed_fresh);
+    dr_fprintf(f_global, "reallocs grown in place: %8u\n", num_realloc_grown_in_place);
+    dr_fprintf(f_global, "guard-page allocs: %8u\n", num_guard_chunks);
     dr_fprintf(f_global, "unique malloc stacks: %8u\n", alloc_stack_count);
+    dr_fprintf(f_global, "malloc stack cache hits: %8u, promotions: %8u\n",
+               alloc_stack_cache_hits, alloc_stack_cache_promotions);
     dr_fprintf(f_global, "callstack fp scans: %8u\n", find_next_fp_scans);
-    dr_fprintf(f_global, "callstack is_retaddr: %8u, backdecode: %8u, unreadable: %8u\n",
+    dr_fprintf(f_global, "callstack shadow stack hits: %8u, misses: %8u\n",
+               cstack_shadow_stack_hits, cstack_shadow_stack_misses);
+    dr_fprintf(f_global, "callstack cfi frames: %8u, fallbacks: %8u\n",
+               cstack_cfi_frames, cstack_cfi_fallbacks);
+#ifdef WINDOWS
+    dr_fprintf(f_global, "callstack stack bounds queries: %8u\n",
+               cstack_stack_bounds_queries);
+#endif
+    dr_fprintf(f_global, "callstack is_retaddr: %8u, backdecode: %8u, unreadable: %8u, "
+               "cache hits: %8u (%3u%%)\n",
                cstack_is_retaddr, cstack_is_retaddr_backdecode,
-               cstack_is_retaddr_unreadable);
+               cstack_is_retaddr_unreadable, cstack_is_retaddr_cached,
+               (retaddr_lookups == 0) ? 0 :
+               (uint)(((uint64)cstack_is_retaddr_cached * 100) / retaddr_lookups));
     dr_fprintf(f_global, "symbol names truncated: %8u\n", symbol_names_truncated);
 #ifdef USE_DRSYMS
     dr_fprintf(f_global, "symbol lookups: %6u cached %6u, searches: %6u cached %6u\n",
@@ -539,6 +558,7 @@ event_thread_init(void *drcontext)
         shadow_thread_init(drcontext);
     }
     syscall_thread_init(drcontext);
+    alloc_drmem_thread_init(drcontext);
     if (!options.perturb_only)
         report_thread_init(drcontext);
     if (options.perturb)
@@ -572,6 +592,7 @@ event_thread_exit(void *drcontext)
         set_thread_tls_value(drcontext, SPILL_SLOT_1, (ptr_uint_t)teb);
     }
 #endif
+    alloc_drmem_thread_exit(drcontext);
     syscall_thread_exit(drcontext);
     if (options.shadowing)
         shadow_thread_exit(drcontext);
@@ -1477,8 +1498,11 @@ event_module_unload(void *drcontext, const module_data_t *info)
         dr_module_preferred_name(info) == NULL ? "<null>" :
         dr_module_preferred_name(info), info->start, info->end);
     readwrite_module_unload(drcontext, info);
-    if (!options.perturb_only)
+    if (!options.perturb_only) {
+        /* resolve raw callstacks while we can still look up the module */
+        alloc_drmem_module_unload(info);
         callstack_module_unload(drcontext, info);
+    }
     if (INSTRUMENT_MEMREFS())
         replace_module_unload(drcontext, info);
     alloc_module_unload(drcontext, info);
@@ -38,6 +38,8 @@ extern client_id_t client_id;
 enum {
     /* replace first, then app2app */
 #if 0
+    /* we need to find alloc routines before drwrap looks for them */
+    DRMGR_PRIORITY_APP2APP_ALLOC    = -600, /* from alloc.h */
     DRMGR_PRIORITY_APP2APP_DRWRAP   = -500, /* from drwrap.h */
 #endif
     DRMGR_PRIORITY_APP2APP_ANNOTATE = -100,
@@ -63,6 +65,8 @@ enum {
 #if 0
     /* we need our alloc wrapping to go after CLS tracking */
     DRMGR_PRIORITY_INSERT_ALLOC     = 2020, /* from alloc.h */
+    /* the shadow call stack needs app registers restored */
+    DRMGR_PRIORITY_INSERT_CALLSTACK = 2030, /* from callstack.h */
 #endif
 };
 
@@ -3669,6 +3669,10 @@ event_signal_instrument(void *drcontext, dr_siginfo_t *info)
                    handle_zeroing_fault(drcontext, target, info->raw_mcontext,
                                         info->mcontext)) {
             return DR_SIGNAL_SUPPRESS;
+        } else if (options.guard_page_min > 0 &&
+                   handle_guard_page_fault(drcontext, target, info->mcontext)) {
+            /* re-execute the faulting instr now that its page is accessible */
+            return DR_SIGNAL_SUPPRESS;
         } else if (options.leaks_only) {
             return DR_SIGNAL_DELIVER;
         } else if (is_in_special_shadow_block(target)) {
@@ -3722,6 +3726,10 @@ event_exception_instrument(void *drcontext, dr_exception_t *excpt)
             handle_zeroing_fault(drcontext, target, excpt->raw_mcontext,
                                  excpt->mcontext)) {
             return false;
+        } else if (options.guard_page_min > 0 &&
+                   handle_guard_page_fault(drcontext, target, excpt->mcontext)) {
+            /* re-execute the faulting instr now that its page is accessible */
+            return false;
         } else if (options.leaks_only) {
             return true;
         } else if (excpt->record->ExceptionInformation[0] == 1 /* write */ &&
@@ -86,8 +86,19 @@ typedef struct _reachability_data_t {
      */
     pc_entry_t *midreachq_head;
     pc_entry_t *midreachq_tail;
-    /* Tree for interval lookup to find head given mid-chunk pointer */
+    /* Per-chunk unreach_entry_t, keyed by chunk start and created lazily
+     * as only leaks need one.  We find the head given a mid-chunk pointer
+     * via malloc_iterate_range(), or via alloc_tree when that is not indexed.
+     */
+    hashtable_t unreach_table;
+    /* Tree for interval lookup to find head given mid-chunk pointer, built
+     * on each scan only when !malloc_iterate_range_is_indexed().  A zero-sized
+     * chunk is stored with size 1 and a non-NULL client.
+     */
     rb_tree_t *alloc_tree;
+    /* Bounds of all heap regions, so most non-heap pointers skip the lookup */
+    byte *heap_lo;
+    byte *heap_hi;
     /* Tree for storing beyond-TOS ranges for -leaks_only */
     rb_tree_t *stack_tree;
 } reachability_data_t;
@@ -353,6 +364,8 @@ get_decoded_ptr(byte *encoded)
  * Splitting indirectly leaked bytes from direct (PR 576032) 
  */
 
+#define UNREACH_TABLE_HASH_BITS 8
+
 typedef struct _unreach_entry_t {
     /* If this is an unreachable or maybe-reachable entry, the sum of
      * directly-reachable child leaks and a pointer to the parent for
@@ -370,14 +383,74 @@ unreach_entry_alloc(void)
     return e;
 }
 
+static void
+unreach_entry_free(void *p)
+{
+    unreach_entry_t *e = (unreach_entry_t *) p;
+    global_free(e, sizeof(*e), HEAPSTAT_MISC);
+}
+
+static unreach_entry_t *
+unreach_entry_lookup(reachability_data_t *data, byte *chunk_start)
+{
+    unreach_entry_t *e = (unreach_entry_t *)
+        hashtable_lookup(&data->unreach_table, (void *)chunk_start);
+    if (e == NULL) {
+        e = unreach_entry_alloc();
+        hashtable_add(&data->unreach_table, (void *)chunk_start, (void *)e);
+    }
+    return e;
+}
+
 static bool
-rb_cleanup_entries(rb_node_t *node, void *iter_data)
+heap_bounds_cb(byte *start, byte *end, uint flags
+               _IF_WINDOWS(HANDLE heap), void *iter_data)
 {
-    unreach_entry_t *e;
-    ASSERT(node != NULL, "invalid param");
-    rb_node_fields(node, NULL, NULL, (void*)&e);
-    if (e != NULL)
-        global_free(e, sizeof(*e), HEAPSTAT_MISC);
+    reachability_data_t *data = (reachability_data_t *) iter_data;
+    if (start < data->heap_lo)
+        data->heap_lo = start;
+    if (end > data->heap_hi)
+        data->heap_hi = end;
+    return true;
+}
+
+static bool
+find_chunk_cb(app_pc start, app_pc end, app_pc real_end,
+              bool pre_us, uint client_flags,
+              void *client_data, void *iter_data)
+{
+    app_pc *bounds = (app_pc *) iter_data;
+    bounds[0] = start;
+    bounds[1] = end;
+    return false; /* stop iteration */
+}
+
+/* Finds the chunk containing addr, treating a zero-sized chunk as
+ * containing its start.
+ */
+static bool
+find_chunk(reachability_data_t *data, byte *addr,
+           byte **chunk_start OUT, byte **chunk_end OUT)
+{
+    app_pc bounds[2] = {NULL, NULL};
+    /* every malloc is inside a heap region */
+    if (addr < data->heap_lo || addr >= data->heap_hi)
+        return false;
+    if (data->alloc_tree != NULL) {
+        size_t size;
+        void *zero_sized;
+        rb_node_t *node = rb_in_node(data->alloc_tree, addr);
+        if (node == NULL)
+            return false;
+        rb_node_fields(node, chunk_start, &size, &zero_sized);
+        *chunk_end = *chunk_start + (zero_sized != NULL ? 0 : size);
+        return true;
+    }
+    malloc_iterate_range(addr, addr + 1, find_chunk_cb, (void *)bounds);
+    if (bounds[0] == NULL)
+        return false;
+    *chunk_start = bounds[0];
+    *chunk_end = bounds[1];
     return true;
 }
 
@@ -418,8 +491,7 @@ rb_cleanup_entries(rb_node_t *node, void *iter_data)
  */
 static void
 mark_indirect(reachability_data_t *data, byte *ptr_parent, byte *ptr_child,
-              byte *child_start, byte *child_end, uint flags,
-              rb_node_t *node_child/*OPTIONAL*/)
+              byte *child_start, byte *child_end, uint flags)
 {
     if (TEST(MALLOC_REACHABLE, flags)) {
         /* if reachable through some other parent: leave alone */
@@ -434,26 +506,16 @@ mark_indirect(reachability_data_t *data, byte *ptr_parent, byte *ptr_child,
          * every top-level direct leak, but we're not doing a
          * depth-first walk, so we must later update parents when we
          * process their children.  We also don't have any other good
-         * place to store the size so we use the rbtree.
+         * place to store the size so we use the unreach_table.
          */
         unreach_entry_t *unreach_child, *unreach_parent;
-        rb_node_t *node_parent = rb_in_node(data->alloc_tree, ptr_parent);
-        ASSERT(node_parent != NULL, "unreachable must be in heap");
-        if (node_child == NULL) /* optional */
-            node_child = rb_find(data->alloc_tree, ptr_child);
-        ASSERT(node_child != NULL, "reachable object must be in rbtree");
-        rb_node_fields(node_child, NULL, NULL, (void*)&unreach_child);
-        /* rb client fields allocated lazily */
-        if (unreach_child == NULL) {
-            unreach_child = unreach_entry_alloc();
-            rb_node_set_client(node_child, (void *)unreach_child);
-        }
+        byte *parent_start, *parent_end;
+        IF_DEBUG(bool found =)
+            find_chunk(data, ptr_parent, &parent_start, &parent_end);
+        ASSERT(found, "unreachable must be in heap");
+        unreach_child = unreach_entry_lookup(data, child_start);
         /* acquire after in case child==parent */
-        rb_node_fields(node_parent, NULL, NULL, (void *)&unreach_parent);
-        if (unreach_parent == NULL) {
-            unreach_parent = unreach_entry_alloc();
-            rb_node_set_client(node_parent, (void *)unreach_parent);
-        }
+        unreach_parent = unreach_entry_lookup(data, parent_start);
 
         if (TEST(MALLOC_INDIRECTLY_REACHABLE, flags)) {
             /* node is already claimed: either by another parent,
@@ -837,7 +899,7 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, byte *defined_end,
     bool add_reachable = false, add_maybe_reachable = false;
     uint flags = 0;
     bool reachable = false;
-    rb_node_t *node = NULL;
+    bool in_chunk = false;
 
     if (pointer == NULL)
         return;
@@ -863,11 +925,13 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, byte *defined_end,
     }
 #endif
 
-    /* We look in rbtree first since likely to miss both so why do hash lookup */
-    node = rb_in_node(data->alloc_tree, pointer);
-    if (node != NULL) {
+    /* We do a range lookup rather than a hash lookup on the head since we're
+     * likely to miss both
+     */
+    in_chunk = find_chunk(data, pointer, &chunk_start, &chunk_end);
+    if (in_chunk) {
 #ifndef VMX86_SERVER /* unsafe to read */
-        /* We check for strings after the rbtree lookup to avoid extra work
+        /* We check for strings after the range lookup to avoid extra work
          * on every pointer.
          */
         if (options.strings_vs_pointers &&
@@ -876,13 +940,12 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, byte *defined_end,
             LOG(3, "\t("PFX" is part of a string table so not considering a pointer)\n",
                 ptr_addr);
             STATS_INC(strings_not_pointers);
-            node = NULL;
+            in_chunk = false;
         }
 #endif
     }
-    if (node != NULL) {
-        chunk_end = malloc_end(pointer);
-        if (chunk_end != NULL) {
+    if (in_chunk) {
+        if (pointer == chunk_start) {
             if (ptr_addr >= pointer && ptr_addr < chunk_end) {
                 LOG(3, "\t("PFX" points to start of its own chunk "PFX"-"PFX")\n",
                     ptr_addr, pointer, chunk_end);
@@ -890,13 +953,9 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, byte *defined_end,
                 flags = malloc_get_client_flags(pointer);
                 LOG(3, "\t"PFX" points to chunk "PFX"-"PFX"\n",
                     ptr_addr, pointer, chunk_end);
-                chunk_start = pointer;
                 reachable = true;
             }
         } else {
-            size_t chunk_size;
-            rb_node_fields(node, &chunk_start, &chunk_size, NULL);
-            chunk_end = chunk_start + chunk_size;
             ASSERT(is_in_heap_region(pointer), "heap data struct inconsistency");
             if (ptr_addr >= chunk_start && ptr_addr < chunk_end) {
                 LOG(3, "\t("PFX" points to middle "PFX" of its own chunk "PFX"-"PFX")\n",
@@ -959,7 +1018,7 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, byte *defined_end,
              * the secondary scan
              */
         } else {
-            mark_indirect(data, ptr_addr, pointer, chunk_start, chunk_end, flags, node);
+            mark_indirect(data, ptr_addr, pointer, chunk_start, chunk_end, flags);
         }
     }
     if (add_reachable || add_maybe_reachable) {
@@ -1191,10 +1250,8 @@ malloc_iterate_cb(app_pc start, app_pc end, app_pc real_end,
     if (!TESTANY(MALLOC_IGNORE_LEAK | MALLOC_INDIRECTLY_REACHABLE, client_flags) &&
         /* for 2nd pass only report reachable */
         (!data->last_of_2_iters || TEST(MALLOC_REACHABLE, client_flags))) {
-        rb_node_t *node = rb_find(data->alloc_tree, start);
-        unreach_entry_t *unreach;
-        ASSERT(node != NULL, "must be in rbtree");
-        rb_node_fields(node, NULL, NULL, (void *)&unreach);
+        unreach_entry_t *unreach = (unreach_entry_t *)
+            hashtable_lookup(&data->unreach_table, (void *)start);
         client_found_leak(start, end, 
                           (unreach == NULL) ? 0 : unreach->indirect_bytes, 
                           pre_us,
@@ -1220,12 +1277,10 @@ malloc_iterate_build_tree_cb(app_pc start, app_pc end, app_pc real_end,
     rb_tree_t *alloc_tree = (rb_tree_t *) iter_data;
     IF_DEBUG(rb_node_t *node;)
     ASSERT(alloc_tree != NULL, "invalid iteration data");
-    /* We use NULL for client b/c we only need unreach_entry_t for the
-     * leaks, a small fraction (for most apps!) of the total and thus
-     * best allocated lazily
-     */
+    /* the redzone keeps a zero-sized chunk's 1-byte node from overlapping */
     IF_DEBUG(node = )
-        rb_insert(alloc_tree, start, (end - start), NULL);
+        rb_insert(alloc_tree, start, (end == start) ? 1 : (end - start),
+                  (end == start) ? (void *)alloc_tree : NULL);
     ASSERT(node == NULL, "mallocs should not overlap");
     return true;
 }
@@ -1291,6 +1346,7 @@ leak_scan_for_leaks(bool at_exit)
     uint num_threads = 0, i;
     dr_mcontext_t mc; /* do not init whole thing: memset is expensive */
     reachability_data_t data;
+    rb_arena_t *scan_arena;
     void *my_drcontext = dr_get_current_drcontext();
 #ifdef DEBUG
     static bool called_at_exit;
@@ -1344,16 +1400,24 @@ leak_scan_for_leaks(bool at_exit)
 
     memset(&data, 0, sizeof(data));
     data.primary_scan = true;
-    data.alloc_tree = rb_tree_create(NULL);
-    data.stack_tree = rb_tree_create(NULL);
-
-    /* Build tree for interval lookup for mid-chunk pointers (PR 476482).
-     * Since doing this just once, we could use an array, but tree may be
-     * useful later on.  I have measured the cost of having the malloc
-     * hashtable be an rbtree instead, avoiding this creation, but the extra
-     * overhead shows up on heap-intensive bmarks (PR 535568).
+    hashtable_init_ex(&data.unreach_table, UNREACH_TABLE_HASH_BITS, HASH_INTPTR,
+                      false/*!str_dup*/, false/*!synch*/, unreach_entry_free,
+                      NULL, NULL);
+    /* the scan's temporary nodes are freed in one step at the end */
+    scan_arena = rb_arena_create();
+    data.stack_tree = rb_tree_create_ex(NULL, scan_arena);
+    /* other threads are suspended, so these bounds hold for the scan */
+    data.heap_lo = (byte *) POINTER_MAX;
+    data.heap_hi = NULL;
+    heap_region_iterate(heap_bounds_cb, (void *) &data);
+    /* The malloc table's range index finds heads for mid-chunk pointers
+     * (PR 476482).  Without one, a range query costs a walk of the arena,
+     * so we build an interval tree of all mallocs for this scan instead.
      */
-    malloc_iterate(malloc_iterate_build_tree_cb, (void *) data.alloc_tree);
+    if (!malloc_iterate_range_is_indexed()) {
+        data.alloc_tree = rb_tree_create_ex(NULL, scan_arena);
+        malloc_iterate(malloc_iterate_build_tree_cb, (void *) data.alloc_tree);
+    }
 
     if (!at_exit || !op_have_defined_info) {
         /* Walk the thread's registers.  We rely on mcontext field ordering here. */
@@ -1430,10 +1494,9 @@ leak_scan_for_leaks(bool at_exit)
         ASSERT(ok, "failed to resume after leak scan");
     }
 
-    /* We do not maintain the tree throughout execution: we make a new one for
-     * each reachability scan.
-     */
-    rb_iterate(data.alloc_tree, rb_cleanup_entries, NULL);
-    rb_tree_destroy(data.alloc_tree);
+    hashtable_delete(&data.unreach_table);
+    if (data.alloc_tree != NULL)
+        rb_tree_destroy(data.alloc_tree);
     rb_tree_destroy(data.stack_tree);
+    rb_arena_destroy(scan_arena);
 }
@@ -386,6 +386,10 @@ options_init(const char *opstr)
             usage_error("pattern mode incompatible with replacing malloc", "");
         }
     }
+    if (options.guard_page_min > 0 && !options.replace_malloc)
+        usage_error("-guard_page_min requires -replace_malloc", "");
+    if (options.external_headers && !options.replace_malloc)
+        usage_error("-external_headers requires -replace_malloc", "");
     if (options.replace_malloc) {
         options.replace_realloc = false; /* no need for it */
         /* whole header is in redzone, but supports redzone being smaller than header */
@@ -262,8 +262,17 @@ OPTION_CLIENT_BOOL(client, callstack_use_top_fp_selectively, true,
 OPTION_CLIENT(client, callstack_max_scan, uint, 2048, 0, 16384,
               "How far to scan to locate the first or next stack frame",
               "How far to scan to locate the first stack frame when starting in a frameless function, or to locate the next stack frame when crossing loader or glue stub thunks or a signal or exception frame.  Increasing this can produce better callstacks but may incur noticeable overhead for applications that make many allocation calls.")
+OPTION_CLIENT_BOOL(client, callstack_shadow_stack, false,
+                   "Record allocation callstacks from a shadow call stack",
+                   "Maintains a per-thread shadow call stack by instrumenting every call and return, and records allocation callstacks from it rather than by walking frame pointers and scanning the application stack.  Each shadow frame is checked against its return address slot on the stack, so frames abandoned by longjmp, exception unwinding, or a stack switch are skipped.  When the shadow stack cannot account for a callstack, the regular walk is used.  This makes allocation-heavy applications faster at the cost of slowing down every call and return.")
+OPTION_CLIENT_BOOL(client, callstack_cfi_unwind, false,
+                   "Walk callstacks using DWARF call frame information",
+                   "Linux-only.  Walks callstacks using the call frame information (.eh_frame) that the compiler emits for each function, which locates each caller precisely even in code built without frame pointers, rather than scanning the stack for return addresses.  Each module's .eh_frame_hdr search table is located when the module is loaded.  Where a frame has no usable call frame information, the rest of the callstack is found by the regular frame pointer walk and stack scan.")
 
 #ifdef TOOL_DR_MEMORY
+OPTION_CLIENT_BOOL(client, callstack_frame_trie, false,
+                   "Share common frames among stored callstacks",
+                   "Stores each kept callstack as a pointer into a tree of frames in which every frame points to its caller, so the frames that many callstacks have in common (such as those from main or a thread entry point on down) are stored once.  This greatly reduces the memory used by applications with many unique allocation callstacks, at some cost when a new callstack is first recorded and when callstacks are printed.  Allocation callstacks are then resolved to modules as they are recorded, as though -lazy_callstack_modules were off.")
 OPTION_CLIENT_BOOL(client, check_leaks, true,
                    /* Requires -count_leaks and -track_heap */
                    "List details on memory leaks detected",
@@ -412,6 +421,9 @@ OPTION_CLIENT_SCOPE(drmemscope, delay_frees, uint, 2000, 0, UINT_MAX,
 OPTION_CLIENT_SCOPE(drmemscope, delay_frees_maxsz, uint, 20000000, 0, UINT_MAX,
                     "Maximum size of frees to delay before committing",
                     "Maximum size of frees to delay before committing.  The larger this number, the greater the likelihood that "TOOLNAME" will identify use-after-free errors.  However, the larger this number, the more memory will be used.  This value is separate for each set of allocation routines.")
+OPTION_CLIENT(internal, delay_frees_shards, uint, 8, 1, 64,
+              "Split the delayed free queues into this many separately locked shards",
+              "Does not apply with -replace_malloc.  Splits each delayed free queue into this many shards, each with its own lock, so that threads freeing in parallel do not all contend on a single lock.  Each thread frees into one shard.  -delay_frees and -delay_frees_maxsz apply to each shard, so each thread sees the full delay while the total memory held in delayed frees can grow up to this many times larger when this many threads are freeing.")
 OPTION_CLIENT_BOOL(drmemscope, delay_frees_stack, false,
                    "Record callstacks on free to use when reporting use-after-free",
                    "Record callstacks on free to use when reporting use-after-free or other errors that overlap with freed objects.  There is a slight performance hit incurred by this feature for malloc-intensive applications.")
@@ -644,12 +656,27 @@ OPTION_CLIENT_BOOL(internal, leave_uninit, false,
 OPTION_CLIENT_BOOL(client, leak_scan, true,
                    "Perform leak scan",
                    "Whether to perform the leak scan.  For performance measurement purposes only.")
-OPTION_CLIENT_BOOL(internal, pattern_use_malloc_tree, false,
-                   "Use red-black tree for tracking malloc/free",
-                   "Use red-black tree for tracking malloc/free to reduce the overhead of maintaining the malloc tree on every memory allocation and free, but we have to do expensive hashtable walk to check if an address is in the redzone.")
 OPTION_CLIENT_BOOL(internal, replace_malloc, false,
                    "Replace malloc rather than wrapping existing routines",
                    "Replace malloc with custom routines rather than wrapping existing routines.  Replacing is more efficient but can be less transparent.")
+OPTION_CLIENT(internal, guard_page_min, uint, 0, 0, UINT_MAX,
+              "With -replace_malloc, end allocations of at least this size at a guard page",
+              "Only applies with -replace_malloc.  Each allocation of at least this many bytes is given its own mapping, placed so that its end abuts an inaccessible page, and the whole mapping is made inaccessible when it is freed (subject to -delay_frees and -delay_frees_maxsz, which these mappings have a budget of their own against).  Overflows and accesses to freed memory then fault, however far past the redzone they go, and are reported as unaddressable accesses.  The faulting page is then opened up and the access completed, so later accesses to that same page are only caught by the regular checks.  0 disables this.")
+OPTION_CLIENT_BOOL(internal, external_headers, false,
+                   "With -replace_malloc, keep chunk headers outside of app memory",
+                   "Only applies with -replace_malloc.  Rather than storing each allocation's header inside its redzone, keep it in a table outside of app memory, where app underflows cannot corrupt it and where it does not share cache lines with app data.  This costs some extra memory per allocation.")
+OPTION_CLIENT_BOOL(internal, shard_malloc_table, true,
+                   "Split the malloc table into separately locked shards",
+                   "Does not apply with -replace_malloc.  Splits the table of live allocations into shards by address, each with its own lock, so that threads allocating and freeing in parallel do not all contend on a single lock.  The table of unique allocation callstacks is likewise split by callstack, including under -replace_malloc.")
+OPTION_CLIENT_BOOL(internal, lazy_alloc_search, true,
+                   "Search each library for heap routines at its first execution",
+                   "Rather than searching every library for heap routines when it is loaded, wait until code in the library first executes.  The C library and the executable are still searched at load time.  Libraries that are loaded but never run are never searched, which shortens startup for applications that load many libraries.")
+OPTION_CLIENT_BOOL(internal, lazy_callstack_modules, true,
+                   "Record allocation callstacks as raw addresses",
+                   "Record only the return addresses of each allocation callstack, and fill in the module and offset of each frame only when the callstack is printed or when a module it references is unloaded.  Most allocations are freed long before either happens.  If many unloads require this fixup, allocation callstacks go back to being resolved as they are recorded.")
+OPTION_CLIENT_SCOPE(internal, callstack_thread_cache, uint, 8, 0, 32,
+                    "Number of new allocation callstacks each thread keeps to itself",
+                    "Each thread keeps up to this many of its most recent new allocation callstacks out of the global table of unique callstacks.  A callstack whose allocations are all freed before it is pushed out of the cache never enters the global table, which avoids its locking and hashing costs.  0 disables the cache.")
 OPTION_CLIENT_SCOPE(internal, pattern_max_2byte_faults, int, 0x1000, -1, INT_MAX,
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only",
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only. 0 means do not use 2-byte checks, and negative value means always use 2-byte checks")
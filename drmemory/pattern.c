@@ -31,7 +31,6 @@
 #include "stack.h"
 #include "fastpath.h"
 #include "alloc.h"
-#include "redblack.h"
 #include "report.h"
 #include "alloc_drmem.h"
 
@@ -50,9 +49,6 @@
 #define SWAP_BYTE(x)  ((0x0ff & ((x) >> 8)) | ((0x0ff & (x)) << 8))
 #define PATTERN_REVERSE(x) (SWAP_BYTE(x) | (SWAP_BYTE(x) << 16))
 
-/* we can use a redblack tree to keep malloc info */
-static rb_tree_t *pattern_malloc_tree;
-static void *pattern_malloc_tree_rwlock;
 static uint  pattern_reverse;
 static bool  pattern_4byte_check_only = false;
 static void *flush_lock;
@@ -1137,78 +1133,6 @@ pattern_handle_segv_fault(void *drcontext, dr_mcontext_t *raw_mc
  * Memory allocation bookkeeping Functions
  */
 
-static bool
-pattern_addr_in_malloc_tree(byte *addr, size_t size)
-{
-    rb_node_t *node;
-    bool res = false;
-
-    /* walk the pattern_malloc_tree */
-    dr_rwlock_read_lock(pattern_malloc_tree_rwlock);
-    node = rb_in_node(pattern_malloc_tree, addr);
-    if (node != NULL) {
-        byte *start;
-        void *data;
-        size_t real_size;
-        size_t app_size;
-        rb_node_fields(node, &start, &real_size, &data);
-        app_size = (size_t)data;
-        ASSERT(app_size + options.redzone_size * 2 <= real_size,
-               "wrong node information");
-        if (addr <  start + options.redzone_size || 
-            addr >= start + options.redzone_size + app_size)
-            res = true;
-    }
-    dr_rwlock_read_unlock(pattern_malloc_tree_rwlock);
-    return res;
-}
-
-static void
-pattern_insert_malloc_tree(byte *app_base,  size_t app_size,
-                           byte *real_base, size_t real_size)
-{
-    IF_DEBUG(rb_node_t *node;)
-    dr_rwlock_write_lock(pattern_malloc_tree_rwlock);
-    /* due to padding, the real_size might be larger than 
-     * (app_size + redzone_size*2), which makes the size of 
-     * rear redzone not fixed, so store app_size in rb_tree.
-     */
-    IF_DEBUG(node =) rb_insert(pattern_malloc_tree, real_base,
-                               real_size, (void *)app_size);
-    dr_rwlock_write_unlock(pattern_malloc_tree_rwlock);
-    ASSERT(node == NULL, "error in inserting pattern malloc tree");
-}
-
-static void
-pattern_remove_malloc_tree(app_pc app_base, size_t app_size, size_t real_size)
-{
-    rb_node_t *node;
-    void *data;
-    app_pc real_base;
-    size_t size;
-
-    dr_rwlock_write_lock(pattern_malloc_tree_rwlock);
-    node = rb_find(pattern_malloc_tree, app_base - options.redzone_size);
-    if (node != NULL) {
-        rb_node_fields(node, &real_base, &size, &data);
-        ASSERT(app_size  == (size_t)data,
-               "wrong app size in pattern malloc tree");
-        ASSERT(real_base == app_base - options.redzone_size,
-               "wrong real_base in pattern malloc tree");
-        ASSERT(real_size == size &&
-               real_size >= app_size + options.redzone_size * 2,
-               "Wrong real_size in pattern malloc tree");
-        /* XXX i#786: we simply remove the memory here, which can be 
-         * improved by invalidating/removing malloc rbtree instead,
-         * though we still need do the lookup to change the node status.
-         */
-        rb_delete(pattern_malloc_tree, node);
-    }
-    dr_rwlock_write_unlock(pattern_malloc_tree_rwlock);
-}
-
-
-
 /* If an addr contains pattern value, we check the memory before and after,
  * and return true if there are enough number of contiguous pattern value.
  * XXX: the pattern value in the redzone could be clobbered by earlier error,
@@ -1263,12 +1187,8 @@ pattern_addr_pre_check(byte *addr)
 static bool
 pattern_addr_in_redzone(byte *addr, size_t size)
 {
-    bool res = false;
-    if (options.pattern_use_malloc_tree)
-        res = pattern_addr_in_malloc_tree(addr, size);
-    else
-        res = region_in_redzone(addr, size, NULL, NULL, NULL, NULL, NULL);
-    return res;
+    /* this is a range query on the malloc table's index */
+    return region_in_redzone(addr, size, NULL, NULL, NULL, NULL, NULL);
 }
 
 void
@@ -1281,8 +1201,6 @@ pattern_handle_malloc(byte *app_base,  size_t app_size,
 
     if ((app_base - real_base) == options.redzone_size) {
         uint *redzone;
-        if (options.pattern_use_malloc_tree)
-            pattern_insert_malloc_tree(app_base, app_size, real_base, real_size);
         LOG(2, "set pattern value at "PFX"-"PFX" in redzone\n",
             real_base, app_base);
         for (redzone = (uint *)real_base; redzone < (uint *)app_base; redzone++)
@@ -1325,13 +1243,6 @@ pattern_handle_real_free(app_pc base, size_t size,
             base, base + size, size);
         memset(base, 0, size);
     } else {
-        if (options.pattern_use_malloc_tree) {
-            /* if !delayed, the base is app base, and the size is app size.
-             * we can ignore the size since our rbtree holds the app_size,
-             * now use passed in size for sanity check.
-             */
-            pattern_remove_malloc_tree(base, size, real_size);
-        }
         /* if !delayed, only need remove the pattern in redzone */
         if (real_size >= (size + 2 * options.redzone_size)) {
             IF_DEBUG(uint val;)
@@ -1361,8 +1272,6 @@ pattern_handle_delayed_free(app_pc base, size_t size, size_t real_size)
     ASSERT(options.pattern != 0, "should not be called");
     /* We assume that any invalid free won't come here */
     ASSERT(ALIGNED(base, 4), "unaligned pointer for free");
-    if (options.pattern_use_malloc_tree)
-        pattern_remove_malloc_tree(base, size, real_size);
     /* We assume the actually alloced block length will be 4-byte aligned,
      * e.g. if size is 2, the allocator will alloc 4 bytes instead,
      * so it is ok to fill 4-byte uint pattern.
@@ -1443,10 +1352,6 @@ void
 pattern_init(void)
 {
     ASSERT(options.pattern != 0, "should not be called");
-    if (options.pattern_use_malloc_tree) {
-        pattern_malloc_tree = rb_tree_create(NULL);
-        pattern_malloc_tree_rwlock = dr_rwlock_create();
-    }
     note_base = drmgr_reserve_note_range(NOTE_MAX_VALUE);
     ASSERT(note_base != DRMGR_NOTE_NONE, "failed to get note value");
 
@@ -1466,9 +1371,5 @@ void
 pattern_exit(void)
 {
     ASSERT(options.pattern != 0, "should not be called");
-    if (options.pattern_use_malloc_tree) {
-        dr_rwlock_destroy(pattern_malloc_tree_rwlock);
-        rb_tree_destroy(pattern_malloc_tree);
-    }
     dr_mutex_destroy(flush_lock);
 }
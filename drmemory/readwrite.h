@@ -142,6 +142,8 @@ extern uint xl8_shared_slowpath_count;
 extern uint slowpath_unaligned;
 extern uint slowpath_8_at_border;
 extern uint alloc_stack_count;
+extern uint alloc_stack_cache_hits;
+extern uint alloc_stack_cache_promotions;
 extern uint delayed_free_bytes;
 extern uint app_instrs_fastpath;
 extern uint app_instrs_no_dup;
@@ -1270,6 +1270,9 @@ report_init(void)
                     * want to expose some flags as options */
                    0,
                    options.callstack_max_scan,
+                   options.callstack_shadow_stack,
+                   options.callstack_cfi_unwind,
+                   options.callstack_frame_trie,
                    IF_DRSYMS_ELSE(options.callstack_style, PRINT_FOR_POSTPROCESS),
                    get_syscall_name,
                    options.shadowing ? is_dword_defined : NULL,
@@ -1796,6 +1799,37 @@ record_error(uint type, packed_callstack_t *pcs, app_loc_t *loc, dr_mcontext_t *
  * line, else adjust postprocess.pl.
  * FIXME PR 423750: provide this info on dups not just 1st unique.
  */
+typedef struct _heap_neighbors_t {
+    byte *addr;
+    byte *addr_end;
+    /* nearest malloc at or above addr_end */
+    byte *next_start;
+    byte *next_end;
+    /* nearest malloc ending at or below addr */
+    byte *prev_start;
+    byte *prev_end;
+} heap_neighbors_t;
+
+static bool
+heap_neighbors_cb(app_pc start, app_pc end, app_pc real_end,
+                  bool pre_us, uint client_flags,
+                  void *client_data, void *iter_data)
+{
+    heap_neighbors_t *data = (heap_neighbors_t *) iter_data;
+    if (start >= data->addr_end) {
+        if (data->next_start == NULL || start < data->next_start) {
+            data->next_start = start;
+            data->next_end = end;
+        }
+    } else if (end <= data->addr) {
+        if (data->prev_start == NULL || start > data->prev_start) {
+            data->prev_start = start;
+            data->prev_end = end;
+        }
+    }
+    return true;
+}
+
 static void
 report_heap_info(char *buf, size_t bufsz, size_t *sofar, app_pc addr, size_t sz,
                  bool invalid_heap_arg, bool for_log)
@@ -1806,108 +1840,47 @@ report_heap_info(char *buf, size_t bufsz, size_t *sofar, app_pc addr, size_t sz,
     ssize_t size;
     bool found = false;
     packed_callstack_t *pcs = NULL;
+    heap_neighbors_t neighbors;
     if (!is_in_heap_region(addr))
         return;
-    /* I measured replacing the malloc hashtable with an interval tree
-     * and the cost is noticeable on heap-intensive benchmarks, so we
-     * instead use shadow values to find malloc boundaries
+    /* The malloc table's range index finds the neighboring mallocs.
+     * We don't look more than PAGE_SIZE away: FIXME: make larger?
+     */
+    neighbors.addr = addr;
+    neighbors.addr_end = addr + sz;
+    neighbors.next_start = NULL;
+    neighbors.prev_start = NULL;
+    malloc_iterate_range(addr - PAGE_SIZE, addr + sz + PAGE_SIZE,
+                         heap_neighbors_cb, &neighbors);
+    /* we don't have the malloc lock so races could result in
+     * inaccurate adjacent malloc info: only print if accurate
      */
-    /* We don't walk more than PAGE_SIZE: FIXME: make larger? */
-    for (end = addr+sz; end < addr+sz + PAGE_SIZE; ) {
-        if (MAP_4B_TO_1B) {
-            /* granularity is 4 so don't report tail of dword of bad ref (i#622) */
-            end = (byte *)ALIGN_FORWARD(end, 4);
+    if (neighbors.next_start != NULL) {
+        next_start = neighbors.next_start;
+        if (next_start - addr+sz < 8 && next_start > addr+sz) {
+            BUFPRINT(buf, bufsz, *sofar, len,
+                     "%srefers to %d byte(s) before next malloc"NL,
+                     INFO_PFX, next_start - addr+sz-1);
+        }
+        if (!options.brief) {
+            BUFPRINT(buf, bufsz, *sofar, len,
+                     "%snext higher malloc: "PFX"-"PFX""NL,
+                     INFO_PFX, next_start, neighbors.next_end);
         }
-        if (options.shadowing &&
-            !shadow_check_range(end, PAGE_SIZE, SHADOW_UNADDRESSABLE,
-                                &start, NULL, NULL)) {
-            LOG(3, "report_heap_info: next addressable="PFX"\n", start);
-            size = malloc_size((byte*)ALIGN_FORWARD(start, MALLOC_CHUNK_ALIGNMENT));
-            if (size <= -1) {
-                /* An earlier unaddr adjacent to real malloc could
-                 * have marked as addr so try align-8 forward as our
-                 * loop will miss that if all addr in between
-                 */
-                start = (byte*) ALIGN_FORWARD(start+1, MALLOC_CHUNK_ALIGNMENT);
-                size = malloc_size(start);
-            }
-            if (size > -1) {
-                found = true;
-                next_start = start;
-                /* we don't have the malloc lock so races could result in
-                 * inaccurate adjacent malloc info: only print if accurate
-                 */
-                if (next_start >= addr+sz) {
-                    if (next_start - addr+sz < 8 && next_start > addr+sz) {
-                        BUFPRINT(buf, bufsz, *sofar, len,
-                                 "%srefers to %d byte(s) before next malloc"NL,
-                                 INFO_PFX, next_start - addr+sz-1);
-                    }
-                    if (!options.brief) {
-                        BUFPRINT(buf, bufsz, *sofar, len,
-                                 "%snext higher malloc: "PFX"-"PFX""NL,
-                                 INFO_PFX, start, start+size);
-                    }
-                } else
-                    next_start = NULL;
-                break;
-            } /* else probably an earlier unaddr error, for which we marked
-               * the memory as addressable!
-               */
-            end = shadow_next_dword((byte *)ALIGN_FORWARD(start, 4),
-                                    addr+sz + PAGE_SIZE, SHADOW_UNADDRESSABLE);
-        } else
-            break;
     }
-    /* If we can't find a higher malloc better to not print anything since we're
-     * using heuristics and could be wrong (if we had rbtree I'd print "no higher")
-     */
-    for (start = addr; start > addr - PAGE_SIZE; ) {
-        if (options.shadowing &&
-            !shadow_check_range_backward(start, PAGE_SIZE,
-                                         SHADOW_UNADDRESSABLE, &end)) {
-            LOG(3, "report_heap_info: prev addressable="PFX"\n", end);
-            start = (byte *) ALIGN_BACKWARD(end, 4);
-            start = shadow_prev_dword(start, start - PAGE_SIZE, SHADOW_UNADDRESSABLE);
-            LOG(3, "\tfrom there, prev unaddressable="PFX"\n", start);
-            if (start != NULL) {
-                start += 4; /* move to start of addressable */
-                size = malloc_size(start);
-                if (size <= -1) {
-                    /* An earlier unaddr adjacent to real malloc could
-                     * have marked as addr so try align-8 back as our
-                     * loop will miss that if all addr in between
-                     */
-                    start = (byte*) ALIGN_BACKWARD(start-1, MALLOC_CHUNK_ALIGNMENT);
-                    size = malloc_size(start);
-                }
-                if (size > -1) {
-                    found = true;
-                    prev_end = start + size;
-                    /* we don't have the malloc lock so races could result in
-                     * inaccurate adjacent malloc info: only print if accurate
-                     */
-                    if (prev_end <= addr) {
-                        if (addr - prev_end < 8) {
-                            BUFPRINT(buf, bufsz, *sofar, len,
-                                     "%srefers to %d byte(s) beyond last valid byte in prior malloc"NL,
-                                     /* +1 since beyond last valid (so don't have +0) */
-                                     INFO_PFX, addr + 1 - prev_end);
-                        }
-                        if (!options.brief) {
-                            BUFPRINT(buf, bufsz, *sofar, len,
-                                     "%sprev lower malloc:  "PFX"-"PFX""NL, INFO_PFX,
-                                     start, prev_end);
-                        }
-                    } else
-                        prev_end = NULL;
-                    break;
-                } /* else probably an earlier unaddr error, for which we marked
-                   * the memory as addressable!
-                   */
-            }
-        } else
-            break;
+    if (neighbors.prev_start != NULL) {
+        prev_end = neighbors.prev_end;
+        if (addr - prev_end < 8) {
+            BUFPRINT(buf, bufsz, *sofar, len,
+                     "%srefers to %d byte(s) beyond last valid byte in prior malloc"NL,
+                     /* +1 since beyond last valid (so don't have +0) */
+                     INFO_PFX, addr + 1 - prev_end);
+        }
+        if (!options.brief) {
+            BUFPRINT(buf, bufsz, *sofar, len,
+                     "%sprev lower malloc:  "PFX"-"PFX""NL, INFO_PFX,
+                     neighbors.prev_start, prev_end);
+        }
     }
     /* Look at both delay free list and at malloc entries marked
      * invalid.  The latter will find frees beyond the limit of the
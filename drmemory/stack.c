@@ -152,6 +152,9 @@ check_stack_swap(byte *cur_xsp, byte *new_xsp)
         LOG(1, "WARNING: cannot determine stack bounds for "PFX"\n", cur_xsp);
     LOG(1, "stack swap "PFX" => "PFX"\n", cur_xsp, new_xsp);
     STATS_INC(stack_swaps);
+#ifdef WINDOWS
+    callstack_stack_swap(dr_get_current_drcontext(), new_xsp);
+#endif
     /* If don't know stack bounds: better to treat as swap, smaller chance
      * of false positives and better to have false negs than tons of pos
      */
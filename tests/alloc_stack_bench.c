@@ -0,0 +1,156 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Benchmark for concurrent allocation-site lookups: many threads malloc
+ * and free from the same few call sites, so nearly every malloc finds its
+ * callstack already in the shared table (the lock-free lookup) and the
+ * frees keep dropping callstacks to their last reference and retiring
+ * them.  Not run as a test: compare a native run against runs with and
+ * without -shard_malloc_table, at several thread counts, and check the
+ * log for the callstack table statistics.
+ * Usage: alloc_stack_bench [threads] [iterations per thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WINDOWS
+# include <windows.h>
+# define NOINLINE __declspec(noinline)
+#else
+# include <pthread.h>
+# include <sys/time.h>
+# define NOINLINE __attribute__((noinline))
+#endif
+
+#define MAX_THREADS 64
+#define NUM_SITES 8
+/* allocations each thread keeps live: small, so that callstacks keep
+ * going away and coming back
+ */
+#define NUM_LIVE 4
+
+static int iters;
+
+/* Distinct call sites, shared by all threads */
+#define SITE(n)                       \
+    static NOINLINE void *            \
+    alloc_site_##n(size_t size)       \
+    {                                 \
+        void *p = malloc(size);       \
+        if (p != NULL)                \
+            memset(p, n, size);       \
+        return p;                     \
+    }
+SITE(0) SITE(1) SITE(2) SITE(3) SITE(4) SITE(5) SITE(6) SITE(7)
+
+static void *(*sites[NUM_SITES])(size_t) = {
+    alloc_site_0, alloc_site_1, alloc_site_2, alloc_site_3,
+    alloc_site_4, alloc_site_5, alloc_site_6, alloc_site_7
+};
+
+#ifdef WINDOWS
+DWORD WINAPI
+#else
+void *
+#endif
+thread_func(void *arg)
+{
+    void *live[NUM_LIVE];
+    unsigned int seed = (unsigned int)(size_t) arg;
+    int i;
+    memset(live, 0, sizeof(live));
+    for (i = 0; i < iters; i++) {
+        int slot = i % NUM_LIVE;
+        /* a cheap LCG, as rand() may take a lock */
+        seed = seed * 1103515245 + 12345;
+        free(live[slot]);
+        live[slot] = sites[(seed >> 16) % NUM_SITES](16 + (seed >> 24) % 64);
+        if (live[slot] == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < NUM_LIVE; i++)
+        free(live[i]);
+    return 0;
+}
+
+static double
+wall_seconds(void)
+{
+#ifdef WINDOWS
+    return GetTickCount() / 1000.;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    int num_threads = (argc > 1) ? atoi(argv[1]) : 16;
+    double start;
+    int i;
+#ifdef WINDOWS
+    HANDLE thread[MAX_THREADS];
+#else
+    pthread_t thread[MAX_THREADS];
+#endif
+    iters = (argc > 2) ? atoi(argv[2]) : 100000;
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "thread count must be 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    start = wall_seconds();
+#ifdef WINDOWS
+    for (i = 0; i < num_threads; i++) {
+        thread[i] = CreateThread(NULL, 0, thread_func, (void *)(size_t)(i + 1),
+                                 0, 0);
+        if (thread[i] == NULL) {
+            fprintf(stderr, "CreateThread failed\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+        WaitForSingleObject(thread[i], INFINITE);
+#else
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&thread[i], NULL, thread_func,
+                           (void *)(size_t)(i + 1)) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_join(thread[i], NULL) != 0) {
+            fprintf(stderr, "pthread_join failed\n");
+            return 1;
+        }
+    }
+#endif
+
+    printf("%d threads, %d mallocs each, %.3f seconds\n", num_threads, iters,
+           wall_seconds() - start);
+    return 0;
+}
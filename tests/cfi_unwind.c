@@ -0,0 +1,68 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; 
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Tests -callstack_cfi_unwind: this app is built w/o frame pointers, and
+ * inner()'s frame is too big for the regular walk's stack scan to get past,
+ * so the frames below it can only be found via .eh_frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NOINLINE __attribute__((noinline))
+
+static char *buf;
+
+static NOINLINE int
+inner(int i)
+{
+    /* larger than -callstack_max_scan */
+    volatile char pad[8192];
+    pad[0] = 0;
+    pad[i] = 1;
+    return buf[i] + pad[0]; /* error: unaddressable */
+}
+
+static NOINLINE int
+middle(int i)
+{
+    volatile int pad[8];
+    pad[0] = inner(i);
+    return pad[0];
+}
+
+static NOINLINE int
+outer(int i)
+{
+    volatile long pad[4];
+    pad[0] = middle(i);
+    return (int) pad[0];
+}
+
+int
+main()
+{
+    buf = (char *) malloc(16);
+    outer(16);
+    free(buf);
+    printf("all done\n");
+    return 0;
+}
@@ -0,0 +1,52 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; 
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Tests -guard_page_min: an overflow off the end of a large chunk runs
+ * into its guard page, and a read of a freed large chunk hits its
+ * protected mapping.  Both must be reported, and the app must keep running
+ * with each faulting access re-executed rather than skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GUARD_SIZE 8192
+
+int
+main()
+{
+    volatile char *p = (volatile char *) malloc(GUARD_SIZE);
+    volatile char *q;
+    char c;
+
+    p[GUARD_SIZE] = 1; /* error: unaddressable, in the guard page */
+    if (p[GUARD_SIZE] != 1) /* the access was re-executed, not skipped */
+        printf("overflow was skipped\n");
+    free((void *)p);
+
+    q = (volatile char *) malloc(GUARD_SIZE);
+    q[0] = 1;
+    free((void *)q);
+    c = q[GUARD_SIZE/2]; /* error: unaddressable, freed */
+
+    printf("all done\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; 
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Unit test for common/ohashtable.c, run natively under DR standalone.
+ * Exercises insert with Robin Hood displacement, lookup, replace, remove
+ * with backward shift, and resize, checking the table invariants with
+ * ohashtable_check() after every change.  Lock-free lookups are only
+ * checked against the locked ones here, from a single thread.
+ */
+
+#include "dr_api.h"
+#include "utils.h"
+#include "ohashtable.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_COLLIDE 200
+#define NUM_SPREAD 10000
+
+static uint num_freed;
+
+/* ohashtable.c allocates through our heap accounting wrappers */
+void *
+global_alloc(size_t size, heapstat_t type)
+{
+    return malloc(size);
+}
+
+void
+global_free(void *p, size_t size, heapstat_t type)
+{
+    free(p);
+}
+
+static void
+check(bool cond, const char *msg)
+{
+    if (!cond) {
+        printf("FAILED: %s\n", msg);
+        exit(1);
+    }
+}
+
+/* A poor hash, so that keys share home slots and form long runs */
+static uint
+collide_hash(void *key)
+{
+    return (uint)(((ptr_uint_t)key >> 3) & 0x3);
+}
+
+static void
+count_free(void *payload)
+{
+    num_freed++;
+}
+
+static uint num_deferred;
+
+/* Single-threaded, so nothing can still be reading an outgrown array */
+static void
+defer_free_now(void *item, void (*free_func)(void *, void *), void *data)
+{
+    num_deferred++;
+    free_func(item, data);
+}
+
+static void *
+key_for(uint i)
+{
+    return (void *)(ptr_uint_t)((i + 1) * 8);
+}
+
+static void *
+payload_for(uint i)
+{
+    return (void *)(ptr_uint_t)(i + 1);
+}
+
+static void *
+lookup(ohashtable_t *table, void *key)
+{
+    void *res = ohashtable_lookup(table, key);
+    if (table->lockfree_lookups) {
+        void *lockfree_res;
+        check(ohashtable_lookup_lockfree(table, key, &lockfree_res),
+              "lock-free lookup saw a writer");
+        check(lockfree_res == res, "lock-free lookup disagrees");
+    }
+    return res;
+}
+
+static void
+test_table(ohashtable_t *table, uint num)
+{
+    uint i;
+    uint start_bits = table->table_bits;
+    for (i = 0; i < num; i++) {
+        check(ohashtable_add_replace(table, key_for(i), payload_for(i)) == NULL,
+              "add of new key returned a payload");
+        check(ohashtable_check(table), "invariant broken by add");
+    }
+    check(table->entries == num, "wrong entry count after adds");
+    check(table->table_bits > start_bits, "table never resized");
+    for (i = 0; i < num; i++)
+        check(lookup(table, key_for(i)) == payload_for(i), "lookup failed");
+    check(lookup(table, key_for(num)) == NULL, "found absent key");
+
+    /* replacing keeps the entry count and does not free the old payload */
+    check(ohashtable_add_replace(table, key_for(0), payload_for(num)) == payload_for(0),
+          "replace returned the wrong payload");
+    check(lookup(table, key_for(0)) == payload_for(num), "replace failed");
+    check(table->entries == num && num_freed == 0, "replace changed the table");
+    ohashtable_add_replace(table, key_for(0), payload_for(0));
+
+    /* removing from the middle of runs shifts the rest of each run back */
+    for (i = 0; i < num; i += 2) {
+        check(ohashtable_remove(table, key_for(i)), "remove of present key failed");
+        check(ohashtable_check(table), "invariant broken by remove");
+    }
+    check(!ohashtable_remove(table, key_for(0)), "removed an absent key");
+    check(num_freed == (num + 1) / 2, "remove did not free payloads");
+    for (i = 0; i < num; i++) {
+        check(lookup(table, key_for(i)) == (i % 2 == 0 ? NULL : payload_for(i)),
+              "lookup after removes failed");
+    }
+    check(table->entries == num / 2, "wrong entry count after removes");
+
+    /* deleting frees the remaining payloads */
+    ohashtable_delete(table);
+    check(num_freed == num, "delete did not free the remaining payloads");
+    num_freed = 0;
+}
+
+int
+main(void)
+{
+    ohashtable_t table;
+    dr_standalone_init();
+
+    ohashtable_init(&table, 2, collide_hash, NULL, count_free, true/*synch*/);
+    test_table(&table, NUM_COLLIDE);
+
+    ohashtable_init(&table, 4, NULL, NULL, count_free, false/*!synch*/);
+    test_table(&table, NUM_SPREAD);
+
+    ohashtable_init(&table, 2, collide_hash, NULL, count_free, true/*synch*/);
+    ohashtable_set_lockfree_lookups(&table, NULL);
+    test_table(&table, NUM_COLLIDE);
+
+    ohashtable_init(&table, 2, collide_hash, NULL, count_free, true/*synch*/);
+    ohashtable_set_lockfree_lookups(&table, defer_free_now);
+    test_table(&table, NUM_COLLIDE);
+    check(num_deferred > 0, "outgrown slot arrays not passed to defer_free_func");
+
+    printf("all done\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; 
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Benchmark for realloc growth: grows a set of buffers a little at a time,
+ * the pattern of string builders and vectors, and reports the elapsed time
+ * and how many reallocs had to move.  Not run as a test: compare a native
+ * run against runs under -replace_malloc with and without in-place growth,
+ * and against the "reallocs grown in place" statistic in the log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_BUFS 64
+#define NUM_STEPS 512
+#define STEP_SIZE 24
+
+int main(int argc, char **argv)
+{
+    char *bufs[NUM_BUFS];
+    size_t sizes[NUM_BUFS];
+    int iters = (argc > 1) ? atoi(argv[1]) : 16;
+    int i, j, k;
+    unsigned long moved = 0, total = 0;
+    clock_t start = clock();
+
+    for (k = 0; k < iters; k++) {
+        for (i = 0; i < NUM_BUFS; i++) {
+            sizes[i] = STEP_SIZE;
+            bufs[i] = (char *) malloc(sizes[i]);
+            memset(bufs[i], i, sizes[i]);
+        }
+        /* interleaving the buffers leaves most growth to free neighbors;
+         * the last buffer allocated grows into the arena frontier
+         */
+        for (j = 0; j < NUM_STEPS; j++) {
+            for (i = 0; i < NUM_BUFS; i++) {
+                char *p = (char *) realloc(bufs[i], sizes[i] + STEP_SIZE);
+                if (p == NULL) {
+                    fprintf(stderr, "out of memory\n");
+                    return 1;
+                }
+                if (p != bufs[i])
+                    moved++;
+                total++;
+                memset(p + sizes[i], i, STEP_SIZE);
+                bufs[i] = p;
+                sizes[i] += STEP_SIZE;
+            }
+        }
+        for (i = 0; i < NUM_BUFS; i++)
+            free(bufs[i]);
+    }
+
+    printf("%lu reallocs, %lu moved, %.3f seconds\n", total, moved,
+           (double)(clock() - start) / CLOCKS_PER_SEC);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* **********************************************************
+ * Copyright (c) 2013 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; 
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Tests in-place realloc growth in the replacement allocator: the arena's
+ * final chunk grows into the frontier w/o moving, contents survive every
+ * kind of growth, and a zeroing realloc returns a zeroed tail even though
+ * the old chunk's trailing redzone was part of the growth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WINDOWS
+# include <malloc.h>
+#endif
+
+static int
+all_equal(const char *p, size_t start, size_t end, char val)
+{
+    size_t i;
+    for (i = start; i < end; i++) {
+        if (p[i] != val)
+            return 0;
+    }
+    return 1;
+}
+
+int main()
+{
+    char *p, *q, *next;
+    /* let stdio allocate its buffers first, so p below is the final chunk */
+    printf("start\n");
+
+    p = (char *) malloc(64);
+    memset(p, 'a', 64);
+    q = (char *) realloc(p, 8192);
+    printf("frontier realloc %s\n", q == p ? "grew in place" : "moved");
+    if (!all_equal(q, 0, 64, 'a'))
+        printf("frontier realloc lost contents\n");
+    free(q);
+
+    /* a freed neighbor may or may not be absorbed, depending on how old it
+     * is: either way the contents must survive
+     */
+    p = (char *) malloc(64);
+    next = (char *) malloc(64);
+    memset(p, 'b', 64);
+    free(next);
+    q = (char *) realloc(p, 128);
+    if (q == NULL || !all_equal(q, 0, 64, 'b'))
+        printf("neighbor realloc lost contents\n");
+    free(q);
+
+#ifdef WINDOWS
+    p = (char *) _recalloc(NULL, 1, 64);
+    memset(p, 'c', 64);
+    q = (char *) _recalloc(p, 1, 8192);
+    printf("frontier _recalloc %s\n", q == p ? "grew in place" : "moved");
+    if (!all_equal(q, 0, 64, 'c'))
+        printf("frontier _recalloc lost contents\n");
+    if (!all_equal(q, 64, 8192, 0))
+        printf("frontier _recalloc did not zero the tail\n");
+    free(q);
+#endif
+
+    printf("success\n");
+    return 0;
+}